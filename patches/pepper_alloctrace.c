@@ -0,0 +1,392 @@
+/*
+ * pepper_alloctrace.c - Binary trace of every malloc/calloc/realloc/free
+ *
+ * diagnose_textures.c only logs the first large allocations and never sees
+ * frees, which is not enough to tell how an allocator will behave on the
+ * game. With PEPPER_ALLOC_TRACE set, the malloc hooks in
+ * pepper_optimizer_v2.c record every call, with its size, thread, time and
+ * call site, and tools/alloc_bench.c --trace replays the file against any
+ * allocator.
+ *
+ * Recording is cheap enough to leave on for a whole session:
+ *   - each thread appends fixed-size records to its own buffer, with no
+ *     lock; the buffer is written to the file under a mutex when it fills,
+ *     when the thread exits and at exit;
+ *   - a call site is the return address of the hooked call. Addresses get
+ *     small IDs from a lock-free table, and only at exit are they resolved
+ *     (dladdr) into <path>.sites.
+ *
+ * Records from different threads are not in time order in the file; sort
+ * them by time_ns. Frees are stamped before the memory is released and
+ * allocations after they return, so an address is never given out again
+ * before the free that made it available. A realloc also records how long
+ * before its stamp it was called, for the same reason.
+ *
+ * The library's own allocations are not recorded. Tracing also works with
+ * PEPPER_DISABLE=1, to capture the game's unmodified allocation pattern.
+ *
+ * Other events go into the same file, so they share the time line:
+ *   - PEPPER_ALLOC_TEXTURE, each glTexImage2D call: ptr = pixels,
+ *     old_ptr = width << 32 | height, size = bytes;
+ *   - PEPPER_ALLOC_MEMORY, each sample of pepper_memsample.c: ptr = RSS and
+ *     old_ptr = PSS in bytes, size = swap and before_ns = anonymous RSS in
+ *     KB, thread = 0.
+ * tools/mem_timeline.c prints them against the heap. With
+ * PEPPER_ALLOC_TRACE_CALLS=0 only these events are recorded, which costs
+ * nothing on the malloc path and can stay on in normal play.
+ *
+ * File layout: AllocTraceHeader, then AllocTraceRecord[] to the end.
+ * <path>.sites has one line per call site:
+ *   <id> <address> <module>+0x<offset> [symbol]
+ *
+ * Environment variables:
+ *   PEPPER_ALLOC_TRACE=path       - Write the trace here, %p = process ID
+ *                                   (default off)
+ *   PEPPER_ALLOC_TRACE_CALLS=0    - Record textures and memory samples only
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// File format (read by tools/alloc_bench.c)
+// ============================================================================
+
+#define TRACE_MAGIC "PEPALC\0\1"
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;     // sizeof(AllocTraceRecord)
+    uint32_t reserved;
+    uint64_t start_ns;        // CLOCK_MONOTONIC at time_ns == 0
+} AllocTraceHeader;
+
+typedef struct {
+    uint64_t time_ns;         // since start; frees are stamped before the call
+    uint64_t ptr;             // returned pointer (freed pointer for frees)
+    uint64_t old_ptr;         // realloc's input
+    uint32_t size;            // requested bytes (nmemb * size for calloc)
+    uint32_t site;            // call-site ID, 0 = unknown
+    uint32_t before_ns;       // realloc: time_ns minus the time it was called
+    uint16_t thread;          // 1 = first thread to allocate
+    uint8_t op;               // PEPPER_ALLOC_*, events after PEPPER_ALLOC_FREE
+    uint8_t reserved;
+} AllocTraceRecord;
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+#define THREAD_RECORDS 4096           // per-thread buffer (160 KB)
+#define SITE_SLOTS (1 << 16)
+
+int g_alloc_trace = 0;                // recording allocation calls
+static int g_trace_events = 0;        // recording textures and memory samples
+static int g_trace_fd = -1;
+static char g_trace_path[512];
+static uint64_t g_start_ns = 0;
+
+// Stats
+static size_t g_records_written = 0;  // under g_write_mutex
+static size_t g_write_errors = 0;
+static size_t g_sites_dropped = 0;
+
+// ============================================================================
+// Call sites
+// ============================================================================
+
+// Open-addressed set of return addresses; an address's ID is its slot + 1
+static uintptr_t* g_sites = NULL;
+
+static uint32_t site_id(const void* site) {
+    uintptr_t addr = (uintptr_t)site;
+    if (!addr) return 0;
+    uint32_t slot = (uint32_t)pepper_mix64(addr) & (SITE_SLOTS - 1);
+    for (int probe = 0; probe < 64; probe++) {
+        uintptr_t seen = __atomic_load_n(&g_sites[slot], __ATOMIC_RELAXED);
+        if (seen == addr) return slot + 1;
+        if (!seen) {
+            uintptr_t expected = 0;
+            if (__atomic_compare_exchange_n(&g_sites[slot], &expected, addr, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+                expected == addr) {
+                return slot + 1;
+            }
+        }
+        slot = (slot + 1) & (SITE_SLOTS - 1);
+    }
+    __atomic_add_fetch(&g_sites_dropped, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void write_sites(void) {
+    char path[540];
+    snprintf(path, sizeof(path), "%s.sites", g_trace_path);
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "[PepperOpt2] Alloc trace: cannot write %s\n", path);
+        return;
+    }
+    for (uint32_t slot = 0; slot < SITE_SLOTS; slot++) {
+        uintptr_t addr = g_sites[slot];
+        if (!addr) continue;
+        Dl_info info;
+        if (dladdr((void*)addr, &info) && info.dli_fname) {
+            const char* module = strrchr(info.dli_fname, '/');
+            module = module ? module + 1 : info.dli_fname;
+            fprintf(f, "%u 0x%lx %s+0x%lx %s\n", slot + 1, (unsigned long)addr, module,
+                    (unsigned long)(addr - (uintptr_t)info.dli_fbase),
+                    info.dli_sname ? info.dli_sname : "");
+        } else {
+            fprintf(f, "%u 0x%lx ? \n", slot + 1, (unsigned long)addr);
+        }
+    }
+    fclose(f);
+}
+
+// ============================================================================
+// Thread buffers
+// ============================================================================
+
+typedef struct TraceBuffer {
+    AllocTraceRecord records[THREAD_RECORDS];
+    size_t count;             // written by the owner only
+    size_t flushed;           // records before this are in the file
+    pthread_mutex_t lock;     // held while flushing
+    int owned;                // a live thread records into it
+    struct TraceBuffer* next;
+} TraceBuffer;
+
+static __thread TraceBuffer* t_buffer = NULL;
+static TraceBuffer* g_buffers = NULL;         // every thread's, for the final flush
+static pthread_mutex_t g_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_thread_key;
+static uint32_t g_thread_count = 0;
+static __thread uint16_t t_thread = 0;
+
+static void write_records(const AllocTraceRecord* records, size_t count) {
+    const char* p = (const char*)records;
+    size_t left = count * sizeof(AllocTraceRecord);
+    pthread_mutex_lock(&g_write_mutex);
+    while (left > 0 && g_trace_fd >= 0) {
+        ssize_t n = write(g_trace_fd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            g_write_errors++;
+            break;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    if (left == 0) g_records_written += count;
+    pthread_mutex_unlock(&g_write_mutex);
+}
+
+static void flush_buffer(TraceBuffer* buf, int reset) {
+    pthread_mutex_lock(&buf->lock);
+    size_t count = __atomic_load_n(&buf->count, __ATOMIC_ACQUIRE);
+    if (count > buf->flushed) write_records(&buf->records[buf->flushed], count - buf->flushed);
+    buf->flushed = count;
+    if (reset) {
+        buf->flushed = 0;
+        __atomic_store_n(&buf->count, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&buf->lock);
+}
+
+// The buffer goes to the next new thread; anything this thread still
+// allocates from other destructors gets a buffer of its own
+static void thread_exit(void* arg) {
+    TraceBuffer* buf = arg;
+    flush_buffer(buf, 1);
+    t_buffer = NULL;
+    __atomic_store_n(&buf->owned, 0, __ATOMIC_RELEASE);
+}
+
+static TraceBuffer* thread_buffer(void) {
+    TraceBuffer* buf;
+    for (buf = __atomic_load_n(&g_buffers, __ATOMIC_ACQUIRE); buf; buf = buf->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&buf->owned, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!buf) {
+        buf = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) return NULL;
+        pthread_mutex_init(&buf->lock, NULL);
+        buf->owned = 1;
+        buf->next = __atomic_load_n(&g_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&g_buffers, &buf->next, buf, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    if (!t_thread) {
+        // Ids wrap after 65535 threads; 0 stays the PEPPER_ALLOC_MEMORY records'
+        uint32_t n = __atomic_fetch_add(&g_thread_count, 1, __ATOMIC_RELAXED);
+        t_thread = (uint16_t)(n % 65535 + 1);
+    }
+
+    // pthread_setspecific may allocate; keep that out of the trace
+    int was_in_malloc = in_malloc;
+    in_malloc = 1;
+    pthread_setspecific(g_thread_key, buf);
+    in_malloc = was_in_malloc;
+    return buf;
+}
+
+// A forked child would interleave its records with the parent's
+static void after_fork_child(void) {
+    g_alloc_trace = 0;
+    g_trace_events = 0;
+    g_trace_fd = -1;
+}
+
+// ============================================================================
+// Hooks from pepper_optimizer_v2.c
+// ============================================================================
+
+int pepper_alloctrace_enabled(void) {
+    return __atomic_load_n(&g_trace_events, __ATOMIC_RELAXED);
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t pepper_alloctrace_clock(void) {
+    if (!__atomic_load_n(&g_alloc_trace, __ATOMIC_RELAXED)) return 0;
+    return monotonic_ns();
+}
+
+// Appends one record to the calling thread's buffer
+static void append(int op, uint64_t ptr, uint64_t old_ptr, size_t size, uint32_t site,
+                   uint32_t before_ns, uint64_t now) {
+    TraceBuffer* buf = t_buffer;
+    if (!buf && !(buf = t_buffer = thread_buffer())) return;
+
+    size_t i = buf->count;
+    AllocTraceRecord* r = &buf->records[i];
+    r->time_ns = now - g_start_ns;
+    r->ptr = ptr;
+    r->old_ptr = old_ptr;
+    r->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    r->site = site;
+    r->before_ns = before_ns;
+    r->thread = op == PEPPER_ALLOC_MEMORY ? 0 : t_thread;
+    r->op = (uint8_t)op;
+    r->reserved = 0;
+    __atomic_store_n(&buf->count, i + 1, __ATOMIC_RELEASE);
+    if (i + 1 == THREAD_RECORDS) flush_buffer(buf, 1);
+}
+
+void pepper_alloctrace_record(int op, const void* ptr, const void* old_ptr, size_t size,
+                              uint64_t called, const void* site) {
+    if (!__atomic_load_n(&g_alloc_trace, __ATOMIC_RELAXED) || in_malloc) return;
+    uint64_t now = monotonic_ns();
+    append(op, (uintptr_t)ptr, (uintptr_t)old_ptr, size, site_id(site),
+           called && now - called < UINT32_MAX ? (uint32_t)(now - called) : 0, now);
+}
+
+void pepper_alloctrace_texture(const void* pixels, int width, int height, size_t bytes,
+                               const void* site) {
+    if (!__atomic_load_n(&g_trace_events, __ATOMIC_RELAXED)) return;
+    append(PEPPER_ALLOC_TEXTURE, (uintptr_t)pixels, (uint64_t)(uint32_t)width << 32 | (uint32_t)height,
+           bytes, site_id(site), 0, monotonic_ns());
+}
+
+void pepper_alloctrace_memory(size_t rss, size_t pss, size_t swap, size_t anon) {
+    if (!__atomic_load_n(&g_trace_events, __ATOMIC_RELAXED)) return;
+    uint64_t anon_kb = anon >> 10;
+    append(PEPPER_ALLOC_MEMORY, rss, pss, swap >> 10, 0,
+           anon_kb > UINT32_MAX ? UINT32_MAX : (uint32_t)anon_kb, monotonic_ns());
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+void pepper_alloctrace_init(void) {
+    const char* spec = pepper_env_str("PEPPER_ALLOC_TRACE");
+    if (!spec) return;
+
+    pepper_expand_path(g_trace_path, sizeof(g_trace_path), spec);
+    const char* path = g_trace_path;
+    g_sites = mmap(NULL, SITE_SLOTS * sizeof(uintptr_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    g_trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (g_sites == MAP_FAILED || g_trace_fd < 0) {
+        fprintf(stderr, "[PepperOpt2] Alloc trace: cannot write %s, disabled\n", path);
+        if (g_trace_fd >= 0) close(g_trace_fd);
+        g_trace_fd = -1;
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    g_start_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    AllocTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, 8);
+    header.record_size = sizeof(AllocTraceRecord);
+    header.start_ns = g_start_ns;
+    if (write(g_trace_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        fprintf(stderr, "[PepperOpt2] Alloc trace: cannot write %s, disabled\n", path);
+        close(g_trace_fd);
+        g_trace_fd = -1;
+        return;
+    }
+
+    pthread_key_create(&g_thread_key, thread_exit);
+    pthread_atfork(NULL, NULL, after_fork_child);
+    int calls = pepper_env_int("PEPPER_ALLOC_TRACE_CALLS", 1);
+    __atomic_store_n(&g_trace_events, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_alloc_trace, calls, __ATOMIC_RELEASE);
+    fprintf(stderr, "[PepperOpt2] Alloc trace: ENABLED (%s, %zu-byte records%s)\n",
+            path, sizeof(AllocTraceRecord), calls ? "" : ", no allocation calls");
+}
+
+void pepper_alloctrace_summary(void) {
+    if (!pepper_alloctrace_enabled()) return;
+
+    // Threads still running lose whatever they record from here on
+    __atomic_store_n(&g_alloc_trace, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_trace_events, 0, __ATOMIC_RELEASE);
+    for (TraceBuffer* buf = __atomic_load_n(&g_buffers, __ATOMIC_ACQUIRE); buf; buf = buf->next) {
+        flush_buffer(buf, 0);
+    }
+    in_malloc = 1;
+    write_sites();
+    in_malloc = 0;
+
+    size_t sites = 0;
+    for (uint32_t slot = 0; slot < SITE_SLOTS; slot++) sites += g_sites[slot] != 0;
+    pthread_mutex_lock(&g_write_mutex);
+    fprintf(stderr, "[PepperOpt2]   Alloc trace: %zu records (%.2f MB) from %u threads, "
+            "%zu call sites\n",
+            g_records_written, g_records_written * sizeof(AllocTraceRecord) / 1024.0 / 1024.0,
+            (unsigned)g_thread_count, sites);
+    if (g_write_errors || g_sites_dropped) {
+        fprintf(stderr, "[PepperOpt2]   Alloc trace: %zu failed writes, %zu calls with no site ID\n",
+                g_write_errors, g_sites_dropped);
+    }
+    close(g_trace_fd);
+    g_trace_fd = -1;
+    pthread_mutex_unlock(&g_write_mutex);
+}
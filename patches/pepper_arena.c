@@ -0,0 +1,302 @@
+/*
+ * pepper_arena.c - Separate page-aligned arena for texture-sized allocations
+ *
+ * Decoded images and other texture-sized buffers normally land in glibc's
+ * heap next to everything else, where one small live allocation above
+ * them keeps the whole range from going back to the kernel. With
+ * PEPPER_ARENA=1 the malloc/calloc/realloc/free hooks in
+ * pepper_optimizer_v2.c send allocations of PEPPER_ARENA_MIN_KB or more
+ * to one reserved region:
+ *
+ *   - Blocks are whole pages and page-aligned. Nothing but pixel-sized
+ *     data lives in the region, and its metadata (a page bitmap and a
+ *     block length per page) is kept outside it.
+ *   - Freed pages are kept for reuse until PEPPER_ARENA_RETAIN_MB of them
+ *     pile up. Then all of them are replaced with fresh anonymous pages in
+ *     one pass, which gives the memory back to the kernel. It also undoes
+ *     any file mapping that pepper_rawcache.c, or mremap() from
+ *     pepper_stage.c, put there. calloc() only clears reused pages.
+ *   - Pages are reserved with MAP_NORESERVE and only count once touched.
+ *     The summary reads the real resident size of the arena with mincore().
+ *   - When the arena is full, allocations go to glibc as before.
+ *
+ * Free blocks are found first-fit from the start of the region, so live
+ * data stays packed toward the bottom.
+ *
+ * Environment variables:
+ *   PEPPER_ARENA=1                - Enable (default 0, 1 with PEPPER_SLAB=1)
+ *   PEPPER_ARENA_MB=1024          - Address space to reserve
+ *   PEPPER_ARENA_MIN_KB=16        - Smallest allocation placed in the arena
+ *   PEPPER_ARENA_RETAIN_MB=32     - Freed pages kept for reuse before returning them
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static int g_arena = 0;
+static size_t g_arena_min = 16384;
+static size_t g_retain_limit = 0;        // in pages
+
+// Stats
+static size_t g_arena_live_bytes = 0;    // whole pages of live blocks
+static size_t g_arena_peak_bytes = 0;
+static size_t g_arena_live_blocks = 0;
+
+static pthread_mutex_t g_arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ============================================================================
+// Arena state
+// ============================================================================
+
+static uint8_t* g_base = NULL;           // set once at init, never unmapped
+static size_t g_size = 0;
+static size_t g_page_size = 4096;
+static size_t g_pages = 0;
+static uint64_t* g_bitmap = NULL;        // one bit per page, 1 = in use
+static uint64_t* g_dirty = NULL;         // free pages not yet given back
+static size_t g_retained = 0;            // pages set in g_dirty
+static uint32_t* g_block_pages = NULL;   // block length, at its first page
+static size_t g_high = 0;                // pages below this may be in use
+static size_t g_low = 0;                 // pages below this are all in use
+
+static void* meta_map(size_t size) {
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static int page_used(size_t page) {
+    return (g_bitmap[page >> 6] >> (page & 63)) & 1;
+}
+
+static int page_dirty(size_t page) {
+    return (g_dirty[page >> 6] >> (page & 63)) & 1;
+}
+
+static void mark_pages(size_t first, size_t count, int used) {
+    for (size_t page = first; page < first + count; page++) {
+        if (used) g_bitmap[page >> 6] |= 1ull << (page & 63);
+        else g_bitmap[page >> 6] &= ~(1ull << (page & 63));
+    }
+}
+
+// First run of `count` free pages, or g_pages if there is none
+static size_t find_run(size_t count) {
+    size_t run = 0, start = 0;
+    size_t page = g_low;
+    while (page < g_pages) {
+        uint64_t word = g_bitmap[page >> 6];
+        if ((page & 63) == 0 && word == ~0ull) {
+            run = 0;
+            page += 64;
+            continue;
+        }
+        if ((page & 63) == 0 && word == 0 && page + 64 <= g_pages) {
+            if (run == 0) start = page;
+            run += 64;
+            page += 64;
+        } else if (page_used(page)) {
+            run = 0;
+            page++;
+            continue;
+        } else {
+            if (run == 0) start = page;
+            run++;
+            page++;
+        }
+        if (run >= count) return start;
+    }
+    return g_pages;
+}
+
+// Give every retained page back: fresh anonymous pages over each run
+static void return_retained(void) {
+    size_t page = 0, returned = 0;
+    while (page < g_high) {
+        if (g_dirty[page >> 6] == 0) {
+            page = (page | 63) + 1;
+            continue;
+        }
+        if (!page_dirty(page)) {
+            page++;
+            continue;
+        }
+        size_t first = page;
+        while (page < g_high && page_dirty(page)) page++;
+
+        // The remap can fail with ENOMEM once the process is near its map
+        // count. MADV_DONTNEED still gives the memory back, but pages the
+        // rawcache mapped from a file read back its contents, not zeros, so
+        // they stay dirty and calloc still clears them.
+        uint8_t* start = g_base + first * g_page_size;
+        size_t len = (page - first) * g_page_size;
+        if (mmap(start, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            if (madvise(start, len, MADV_DONTNEED) == 0) returned += len;
+            continue;
+        }
+        for (size_t p = first; p < page; p++) g_dirty[p >> 6] &= ~(1ull << (p & 63));
+        g_retained -= page - first;
+        returned += len;
+    }
+    pepper_stat_add(PEPPER_STAT_ARENA_RETURNS, 1);
+    pepper_stat_add(PEPPER_STAT_ARENA_RETURNED_BYTES, returned);
+}
+
+static int owns(const void* ptr) {
+    return g_base && (const uint8_t*)ptr >= g_base && (const uint8_t*)ptr < g_base + g_size;
+}
+
+// ============================================================================
+// Hooks from pepper_optimizer_v2.c
+// ============================================================================
+
+int pepper_arena_enabled(void) {
+    return g_arena && g_base && !g_disabled;
+}
+
+void* pepper_arena_alloc(size_t size, int zero) {
+    if (size < g_arena_min || !pepper_arena_enabled()) return NULL;
+    size_t count = (size + g_page_size - 1) / g_page_size;
+    if (count == 0 || count > UINT32_MAX) return NULL;
+
+    pthread_mutex_lock(&g_arena_mutex);
+    size_t first = find_run(count);
+    if (first >= g_pages) {
+        pepper_stat_add(PEPPER_STAT_ARENA_FALLBACKS, 1);
+        pthread_mutex_unlock(&g_arena_mutex);
+        return NULL;
+    }
+    mark_pages(first, count, 1);
+    uint8_t* block = g_base + first * g_page_size;
+    for (size_t page = first; page < first + count; page++) {
+        if (page_dirty(page)) {
+            g_dirty[page >> 6] &= ~(1ull << (page & 63));
+            g_retained--;
+            if (zero) memset(g_base + page * g_page_size, 0, g_page_size);
+        }
+    }
+    g_block_pages[first] = (uint32_t)count;
+    if (first == g_low) g_low = first + count;
+    if (first + count > g_high) g_high = first + count;
+    pepper_stat_add(PEPPER_STAT_ARENA_ALLOCS, 1);
+    g_arena_live_blocks++;
+    g_arena_live_bytes += count * g_page_size;
+    pepper_stat_set(PEPPER_STAT_ARENA_LIVE_BYTES, g_arena_live_bytes);
+    if (g_arena_live_bytes > g_arena_peak_bytes) g_arena_peak_bytes = g_arena_live_bytes;
+    pthread_mutex_unlock(&g_arena_mutex);
+    return block;
+}
+
+size_t pepper_arena_size(const void* ptr) {
+    if (!owns(ptr)) return 0;
+    size_t offset = (const uint8_t*)ptr - g_base;
+    if (offset & (g_page_size - 1)) return 0;
+    pthread_mutex_lock(&g_arena_mutex);
+    size_t size = (size_t)g_block_pages[offset / g_page_size] * g_page_size;
+    pthread_mutex_unlock(&g_arena_mutex);
+    return size;
+}
+
+int pepper_arena_free(void* ptr) {
+    if (!owns(ptr)) return -1;
+    size_t offset = (uint8_t*)ptr - g_base;
+    size_t first = offset / g_page_size;
+
+    pthread_mutex_lock(&g_arena_mutex);
+    size_t count = g_block_pages[first];
+    if ((offset & (g_page_size - 1)) || count == 0) {
+        pthread_mutex_unlock(&g_arena_mutex);
+        fprintf(stderr, "[PepperOpt2] Arena: free() of %p, which is not a live block\n", ptr);
+        return 0;
+    }
+    g_block_pages[first] = 0;
+    mark_pages(first, count, 0);
+    for (size_t page = first; page < first + count; page++) {
+        g_dirty[page >> 6] |= 1ull << (page & 63);
+    }
+    g_retained += count;
+    if (first < g_low) g_low = first;
+    if (g_retained > g_retain_limit) return_retained();
+    while (g_high > 0 && !page_used(g_high - 1) && !page_dirty(g_high - 1)) g_high--;
+    g_arena_live_blocks--;
+    g_arena_live_bytes -= count * g_page_size;
+    pepper_stat_set(PEPPER_STAT_ARENA_LIVE_BYTES, g_arena_live_bytes);
+    pthread_mutex_unlock(&g_arena_mutex);
+    return 0;
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+void pepper_arena_init(void) {
+    // The slab allocator hands large sizes to the arena
+    g_arena = pepper_env_int("PEPPER_ARENA", pepper_env_int("PEPPER_SLAB", 0));
+    if (!g_arena || g_disabled) return;
+
+    int size_mb = pepper_env_int("PEPPER_ARENA_MB", 1024);
+    int min_kb = pepper_env_int("PEPPER_ARENA_MIN_KB", 16);
+    int retain_mb = pepper_env_int("PEPPER_ARENA_RETAIN_MB", 32);
+    if (size_mb < 1) size_mb = 1;
+    if (min_kb < 1) min_kb = 1;
+    if (retain_mb < 0) retain_mb = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0) g_page_size = (size_t)page;
+    g_arena_min = (size_t)min_kb << 10;
+    g_size = ((size_t)size_mb << 20) & ~(g_page_size - 1);
+    g_pages = g_size / g_page_size;
+    g_retain_limit = ((size_t)retain_mb << 20) / g_page_size;
+
+    g_bitmap = meta_map((g_pages + 63) / 64 * sizeof(uint64_t));
+    g_dirty = meta_map((g_pages + 63) / 64 * sizeof(uint64_t));
+    g_block_pages = meta_map(g_pages * sizeof(uint32_t));
+    void* base = mmap(NULL, g_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (!g_bitmap || !g_dirty || !g_block_pages || base == MAP_FAILED) {
+        fprintf(stderr, "[PepperOpt2] Arena: could not reserve %d MB, disabled\n", size_mb);
+        g_arena = 0;
+        return;
+    }
+    __atomic_store_n(&g_base, (uint8_t*)base, __ATOMIC_RELEASE);
+    fprintf(stderr, "[PepperOpt2] Arena: ENABLED (%d MB at %p, allocations >= %d KB)\n",
+            size_mb, base, min_kb);
+}
+
+void pepper_arena_summary(void) {
+    if (!pepper_arena_enabled()) return;
+
+    pthread_mutex_lock(&g_arena_mutex);
+    // Resident pages of the part of the arena that has ever been in use
+    size_t resident = 0;
+    unsigned char vec[256];
+    for (size_t page = 0; page < g_high; page += sizeof(vec)) {
+        size_t count = g_high - page < sizeof(vec) ? g_high - page : sizeof(vec);
+        if (mincore(g_base + page * g_page_size, count * g_page_size, vec) != 0) break;
+        for (size_t i = 0; i < count; i++) resident += vec[i] & 1;
+    }
+    fprintf(stderr, "[PepperOpt2]   Arena: %zu allocations, %zu sent to glibc (arena full)\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_ARENA_ALLOCS),
+            (size_t)pepper_stat_get(PEPPER_STAT_ARENA_FALLBACKS));
+    fprintf(stderr, "[PepperOpt2]   Arena: %zu blocks live (%.2f MB), peak %.2f MB, "
+            "%.2f MB resident\n",
+            g_arena_live_blocks, g_arena_live_bytes / 1024.0 / 1024.0,
+            g_arena_peak_bytes / 1024.0 / 1024.0, resident * g_page_size / 1024.0 / 1024.0);
+    fprintf(stderr, "[PepperOpt2]   Arena: %.2f MB of freed pages given back in %zu passes, "
+            "%.2f MB held for reuse\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_ARENA_RETURNED_BYTES) / 1024.0 / 1024.0,
+            (size_t)pepper_stat_get(PEPPER_STAT_ARENA_RETURNS),
+            g_retained * g_page_size / 1024.0 / 1024.0);
+    pthread_mutex_unlock(&g_arena_mutex);
+}
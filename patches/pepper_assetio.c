@@ -0,0 +1,568 @@
+/*
+ * pepper_assetio.c - Serve Chowdren's Assets.dat reads from an mmap
+ *
+ * LoadAssetMetadataTable and the asset loaders read Assets.dat through a
+ * series of fread() calls. Each one goes through a stdio buffer and then
+ * into the heap, and each buffer refill is a read() syscall. With
+ * PEPPER_ASSET_MMAP=1, fopen() of Assets.dat returns an unbuffered
+ * fopencookie stream backed by one read-only MAP_SHARED mapping of the
+ * whole file (MADV_SEQUENTIAL). fread/fseek/ftell on that stream copy
+ * straight out of the mapping, so no syscalls are made after open. Every
+ * other file goes to the real libc functions untouched.
+ *
+ * When only tracing, prefetch (pepper_prefetch.c), staging
+ * (pepper_stage.c) or the sidecar (pepper_sidecar.c) is on, Assets.dat is
+ * opened normally and its reads are just observed.
+ *
+ * Environment variables:
+ *   PEPPER_ASSET_MMAP=1           - Enable (default 0)
+ *   PEPPER_ASSET_FILE=Assets.dat  - File name to match (basename)
+ *   PEPPER_ASSET_TRACE=path       - Log every read as "<offset> <length>"
+ *                                   (input for tools/layout_assets)
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static int g_asset_mmap = 0;
+static int g_asset_track = 0;      // mmap, trace, prefetch, latency or timeline wants Assets.dat
+static const char* g_asset_name = "Assets.dat";
+static FILE* g_trace_file = NULL;
+
+// Stats
+static double g_asset_open_time = 0;
+static double g_asset_last_read = 0;
+
+static pthread_mutex_t g_asset_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ============================================================================
+// Open asset files
+// ============================================================================
+
+#define MAX_ASSET_FILES 8
+
+typedef struct {
+    FILE* stream;
+    const uint8_t* map;    // NULL when the stream is a normal stdio FILE
+    size_t size;
+    size_t pos;
+    int prefetch;          // holds a reference on the prefetch thread
+    int stage;             // holds a reference on the staging workers
+} AssetFile;
+
+static AssetFile* g_asset_files[MAX_ASSET_FILES];
+static int g_asset_file_count = 0;
+
+static AssetFile* find_asset_file(FILE* stream) {
+    // Fast path for every other stream in the game
+    if (__atomic_load_n(&g_asset_file_count, __ATOMIC_ACQUIRE) == 0) return NULL;
+
+    AssetFile* found = NULL;
+    pthread_mutex_lock(&g_asset_mutex);
+    for (int i = 0; i < MAX_ASSET_FILES; i++) {
+        if (g_asset_files[i] && g_asset_files[i]->stream == stream) {
+            found = g_asset_files[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_asset_mutex);
+    return found;
+}
+
+static int register_asset_file(AssetFile* af) {
+    int ok = 0;
+    pthread_mutex_lock(&g_asset_mutex);
+    for (int i = 0; i < MAX_ASSET_FILES; i++) {
+        if (!g_asset_files[i]) {
+            g_asset_files[i] = af;
+            __atomic_add_fetch(&g_asset_file_count, 1, __ATOMIC_RELEASE);
+            ok = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_asset_mutex);
+    return ok;
+}
+
+static void unregister_asset_file(AssetFile* af) {
+    pthread_mutex_lock(&g_asset_mutex);
+    for (int i = 0; i < MAX_ASSET_FILES; i++) {
+        if (g_asset_files[i] == af) {
+            g_asset_files[i] = NULL;
+            __atomic_sub_fetch(&g_asset_file_count, 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_asset_mutex);
+}
+
+// Recent reads, to turn an inflate input pointer back into a file offset
+#define READ_RING_SIZE 64
+
+typedef struct {
+    const uint8_t* dst;
+    size_t offset;
+    size_t len;
+} RecentRead;
+
+static RecentRead g_reads[READ_RING_SIZE];
+static size_t g_read_head = 0;
+
+int pepper_asset_source(const void* ptr, size_t* offset) {
+    if (__atomic_load_n(&g_read_head, __ATOMIC_ACQUIRE) == 0) return -1;
+
+    int found = -1;
+    const uint8_t* p = ptr;
+    pthread_mutex_lock(&g_asset_mutex);
+    size_t ring = g_read_head < READ_RING_SIZE ? g_read_head : READ_RING_SIZE;
+    for (size_t i = 1; i <= ring; i++) {
+        const RecentRead* r = &g_reads[(g_read_head - i) % READ_RING_SIZE];
+        if (p >= r->dst && p < r->dst + r->len) {
+            *offset = r->offset + (size_t)(p - r->dst);
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_asset_mutex);
+    return found;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Account for a read of `len` bytes at `offset` into `dst` and advance the
+// position
+static void record_read(AssetFile* af, const void* dst, size_t offset, size_t len) {
+    pthread_mutex_lock(&g_asset_mutex);
+    pepper_stat_add(PEPPER_STAT_ASSET_READS, 1);
+    pepper_stat_add(PEPPER_STAT_ASSET_BYTES, len);
+    g_asset_last_read = now_seconds();
+    if (g_trace_file) fprintf(g_trace_file, "%zu %zu\n", offset, len);
+    if (len > 0) {
+        g_reads[g_read_head % READ_RING_SIZE] = (RecentRead){dst, offset, len};
+        __atomic_store_n(&g_read_head, g_read_head + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_asset_mutex);
+
+    af->pos = offset + len;
+    pepper_prefetch_position(af->pos);
+    pepper_stage_note_read(offset);
+}
+
+// Copy `len` bytes at the current position; the caller has bounds-checked
+static void serve(AssetFile* af, void* dst, size_t len) {
+    memcpy(dst, af->map + af->pos, len);
+    record_read(af, dst, af->pos, len);
+}
+
+// ============================================================================
+// fopencookie backend (used by any stdio call we do not interpose)
+// ============================================================================
+
+static ssize_t cookie_read(void* cookie, char* buf, size_t size) {
+    AssetFile* af = cookie;
+    size_t avail = af->pos < af->size ? af->size - af->pos : 0;
+    if (size > avail) size = avail;
+    if (size > 0) serve(af, buf, size);
+    return (ssize_t)size;
+}
+
+static int cookie_seek(void* cookie, off64_t* offset, int whence) {
+    AssetFile* af = cookie;
+    off64_t base = whence == SEEK_SET ? 0 :
+                   whence == SEEK_CUR ? (off64_t)af->pos : (off64_t)af->size;
+    off64_t target = base + *offset;
+    if (target < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    af->pos = (size_t)target;
+    *offset = target;
+    return 0;
+}
+
+static int cookie_close(void* cookie) {
+    AssetFile* af = cookie;
+    munmap((void*)af->map, af->size);
+    free(af);
+    return 0;
+}
+
+// ============================================================================
+// Real function pointers
+// ============================================================================
+
+static FILE* (*real_fopen)(const char* path, const char* mode) = NULL;
+static FILE* (*real_fopen64)(const char* path, const char* mode) = NULL;
+static size_t (*real_fread)(void* ptr, size_t size, size_t nmemb, FILE* stream) = NULL;
+static int (*real_fseek)(FILE* stream, long offset, int whence) = NULL;
+static int (*real_fseeko64)(FILE* stream, off64_t offset, int whence) = NULL;
+static long (*real_ftell)(FILE* stream) = NULL;
+static off64_t (*real_ftello64)(FILE* stream) = NULL;
+static int (*real_fclose)(FILE* stream) = NULL;
+
+#define RESOLVE(name) do { if (!real_##name) real_##name = dlsym(RTLD_NEXT, #name); } while (0)
+
+// ============================================================================
+// Open
+// ============================================================================
+
+static int is_asset_path(const char* path, const char* mode) {
+    if (!g_asset_track || g_disabled || !path || !mode) return 0;
+    if (mode[0] != 'r' || strchr(mode, '+')) return 0;
+
+    const char* base = strrchr(path, '/');
+    return strcmp(base ? base + 1 : path, g_asset_name) == 0;
+}
+
+static void asset_opened(const char* path, AssetFile* af) {
+    pthread_mutex_lock(&g_asset_mutex);
+    pepper_stat_add(PEPPER_STAT_ASSET_OPENS, 1);
+    if (g_asset_open_time == 0) g_asset_open_time = now_seconds();
+    if (g_trace_file) fprintf(g_trace_file, "# open %s %zu\n", path, af->size);
+    pthread_mutex_unlock(&g_asset_mutex);
+
+    af->prefetch = pepper_prefetch_open(path, af->size);
+    af->stage = pepper_stage_open(path, af->size);
+    pepper_sidecar_open(path, af->size);
+    pepper_timeline_open(path, af->size);
+
+    if (g_verbose) {
+        fprintf(stderr, "[PepperOpt2] %s %s (%.2f MB)\n", af->map ? "Serving from mmap:" : "Watching",
+                path, af->size / 1024.0 / 1024.0);
+    }
+}
+
+// Normal stdio stream whose reads are only observed (trace/prefetch)
+static FILE* watch_asset(const char* path, FILE* stream) {
+    if (!stream) return NULL;
+
+    struct stat st;
+    AssetFile* af = calloc(1, sizeof(AssetFile));
+    if (!af) return stream;
+    af->stream = stream;
+    if (fstat(fileno(stream), &st) == 0) af->size = (size_t)st.st_size;
+
+    if (!register_asset_file(af)) {
+        free(af);
+        return stream;
+    }
+    asset_opened(path, af);
+    return stream;
+}
+
+static FILE* map_asset(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[PepperOpt2] Asset mmap of %s failed: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    AssetFile* af = calloc(1, sizeof(AssetFile));
+    if (!af) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    af->map = map;
+    af->size = (size_t)st.st_size;
+
+    cookie_io_functions_t io = { cookie_read, NULL, cookie_seek, cookie_close };
+    FILE* stream = fopencookie(af, "rb", io);
+    if (!stream) {
+        cookie_close(af);
+        return NULL;
+    }
+    setvbuf(stream, NULL, _IONBF, 0);
+    af->stream = stream;
+
+    if (!register_asset_file(af)) {
+        RESOLVE(fclose);
+        real_fclose(stream);
+        return NULL;
+    }
+    asset_opened(path, af);
+    return stream;
+}
+
+FILE* fopen(const char* path, const char* mode) {
+    RESOLVE(fopen);
+    if (!is_asset_path(path, mode)) return real_fopen(path, mode);
+
+    FILE* stream = g_asset_mmap ? map_asset(path) : NULL;
+    return stream ? stream : watch_asset(path, real_fopen(path, mode));
+}
+
+FILE* fopen64(const char* path, const char* mode) {
+    RESOLVE(fopen64);
+    if (!is_asset_path(path, mode)) return real_fopen64(path, mode);
+
+    FILE* stream = g_asset_mmap ? map_asset(path) : NULL;
+    return stream ? stream : watch_asset(path, real_fopen64(path, mode));
+}
+
+// ============================================================================
+// Read / seek / close
+// ============================================================================
+
+static size_t read_asset(AssetFile* af, void* ptr, size_t size, size_t nmemb, FILE* stream) {
+    if (!af->map) {
+        size_t offset = af->pos;
+        size_t got = real_fread(ptr, size, nmemb, stream);
+        record_read(af, ptr, offset, got * size);
+        return got;
+    }
+
+    // Whole request in range: copy directly. Short reads at the end of the
+    // file go through stdio so the EOF flag is set the normal way.
+    size_t len = size * nmemb;
+    if (len / size != nmemb || af->pos > af->size || len > af->size - af->pos) {
+        return real_fread(ptr, size, nmemb, stream);
+    }
+    serve(af, ptr, len);
+    return nmemb;
+}
+
+size_t fread(void* ptr, size_t size, size_t nmemb, FILE* stream) {
+    RESOLVE(fread);
+    AssetFile* af = find_asset_file(stream);
+    if (!af || size == 0 || nmemb == 0) return real_fread(ptr, size, nmemb, stream);
+
+    uint64_t lat = pepper_latency_start();
+    uint64_t span = pepper_timeline_start();
+    size_t offset = af->pos;
+    size_t got = read_asset(af, ptr, size, nmemb, stream);
+    pepper_timeline_record(PEPPER_SPAN_FREAD, span, offset, got * size);
+    pepper_latency_record(PEPPER_LAT_FREAD, lat);
+    return got;
+}
+
+static int seek_asset(AssetFile* af, FILE* stream, off64_t offset, int whence) {
+    off64_t target = offset;
+    if (!af->map) {
+        RESOLVE(fseeko64);
+        if (real_fseeko64(stream, offset, whence) != 0) return -1;
+    }
+    if (cookie_seek(af, &target, whence) != 0) return -1;
+    if (af->map) clearerr(stream);
+    pepper_prefetch_position(af->pos);
+
+    pthread_mutex_lock(&g_asset_mutex);
+    pepper_stat_add(PEPPER_STAT_ASSET_SEEKS, 1);
+    pthread_mutex_unlock(&g_asset_mutex);
+    return 0;
+}
+
+int fseek(FILE* stream, long offset, int whence) {
+    RESOLVE(fseek);
+    AssetFile* af = find_asset_file(stream);
+    if (!af) return real_fseek(stream, offset, whence);
+    return seek_asset(af, stream, offset, whence);
+}
+
+int fseeko(FILE* stream, off_t offset, int whence) {
+    return fseeko64(stream, offset, whence);
+}
+
+int fseeko64(FILE* stream, off64_t offset, int whence) {
+    RESOLVE(fseeko64);
+    AssetFile* af = find_asset_file(stream);
+    if (!af) return real_fseeko64(stream, offset, whence);
+    return seek_asset(af, stream, offset, whence);
+}
+
+long ftell(FILE* stream) {
+    RESOLVE(ftell);
+    AssetFile* af = find_asset_file(stream);
+    return af && af->map ? (long)af->pos : real_ftell(stream);
+}
+
+off_t ftello(FILE* stream) {
+    return ftello64(stream);
+}
+
+off64_t ftello64(FILE* stream) {
+    RESOLVE(ftello64);
+    AssetFile* af = find_asset_file(stream);
+    return af && af->map ? (off64_t)af->pos : real_ftello64(stream);
+}
+
+int fclose(FILE* stream) {
+    RESOLVE(fclose);
+    AssetFile* af = find_asset_file(stream);
+    if (!af) return real_fclose(stream);
+
+    unregister_asset_file(af);
+    if (af->prefetch) pepper_prefetch_close();
+    if (af->stage) pepper_stage_close();
+    pepper_sidecar_close();
+    pthread_mutex_lock(&g_asset_mutex);
+    if (g_trace_file) fflush(g_trace_file);
+    pthread_mutex_unlock(&g_asset_mutex);
+
+    // Mapped streams unmap and free the AssetFile through cookie_close()
+    int mapped = af->map != NULL;
+    int ret = real_fclose(stream);
+    if (!mapped) free(af);
+    return ret;
+}
+
+// ============================================================================
+// Table index (shared with prefetch/staging)
+// ============================================================================
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int compare_by_offset(const void* a, const void* b, void* ctx) {
+    const PepperEntry* entries = ctx;
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    if (entries[x].offset != entries[y].offset) return entries[x].offset < entries[y].offset ? -1 : 1;
+    return x < y ? -1 : (x > y);
+}
+
+int pepper_asset_index_load(int fd, size_t file_size, PepperAssetIndex* index) {
+    static const uint32_t counts[] = {
+        PEPPER_IMAGE_COUNT, PEPPER_SOUND_COUNT, PEPPER_FONT_COUNT, PEPPER_SHADER_COUNT
+    };
+
+    memset(index, 0, sizeof(*index));
+    if (file_size < PEPPER_TABLES_SIZE) return -1;
+
+    uint8_t* tables = malloc(PEPPER_TABLES_SIZE);
+    index->entries = malloc(PEPPER_ENTRY_COUNT * sizeof(PepperEntry));
+    index->by_offset = malloc(PEPPER_ENTRY_COUNT * sizeof(uint32_t));
+    if (!tables || !index->entries || !index->by_offset ||
+        pread(fd, tables, PEPPER_TABLES_SIZE, 0) != PEPPER_TABLES_SIZE) {
+        free(tables);
+        pepper_asset_index_free(index);
+        return -1;
+    }
+
+    const uint8_t* p = tables;
+    for (uint16_t kind = 0; kind < 4; kind++) {
+        for (uint32_t i = 0; i < counts[kind]; i++, p += 8) {
+            uint32_t offset = read_le32(p);
+            uint32_t size = read_le32(p + 4);
+            if (size == 0 || (size_t)offset + size > file_size) continue;
+
+            PepperEntry* e = &index->entries[index->count];
+            e->offset = offset;
+            e->size = size;
+            e->kind = kind;
+            e->reserved = 0;
+            e->index = i;
+            index->by_offset[index->count] = (uint32_t)index->count;
+            index->count++;
+        }
+    }
+    free(tables);
+
+    qsort_r(index->by_offset, index->count, sizeof(uint32_t), compare_by_offset, index->entries);
+    return 0;
+}
+
+size_t pepper_asset_index_find(const PepperAssetIndex* index, size_t pos) {
+    size_t lo = 0, hi = index->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const PepperEntry* e = &index->entries[index->by_offset[mid]];
+        if ((size_t)e->offset + e->size <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < index->count ? index->by_offset[lo] : index->count;
+}
+
+void pepper_asset_index_free(PepperAssetIndex* index) {
+    free(index->entries);
+    free(index->by_offset);
+    memset(index, 0, sizeof(*index));
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+void pepper_assetio_init(void) {
+    g_asset_mmap = pepper_env_int("PEPPER_ASSET_MMAP", 0);
+    if (pepper_env_str("PEPPER_ASSET_FILE")) g_asset_name = pepper_env_str("PEPPER_ASSET_FILE");
+
+    const char* trace_path = pepper_env_str("PEPPER_ASSET_TRACE");
+    if (trace_path) {
+        RESOLVE(fopen);
+        g_trace_file = real_fopen(trace_path, "w");
+        if (g_trace_file) {
+            fprintf(g_trace_file, "# Assets.dat read trace: <offset> <length>\n");
+        } else {
+            fprintf(stderr, "[PepperOpt2] Cannot open trace file %s: %s\n",
+                    trace_path, strerror(errno));
+        }
+    }
+
+    g_asset_track = g_asset_mmap || g_trace_file || pepper_prefetch_enabled() ||
+                    pepper_stage_enabled() || pepper_sidecar_enabled() || g_latency ||
+                    g_timeline;
+
+    if (g_asset_mmap) {
+        fprintf(stderr, "[PepperOpt2] Asset mmap: ENABLED (%s)\n", g_asset_name);
+    }
+    if (g_trace_file) {
+        fprintf(stderr, "[PepperOpt2] Asset trace: %s\n", trace_path);
+    }
+}
+
+void pepper_assetio_summary(void) {
+    if (!g_asset_track) return;
+
+    pthread_mutex_lock(&g_asset_mutex);
+    fprintf(stderr, "[PepperOpt2]   Asset files opened: %zu (%s)\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_ASSET_OPENS), g_asset_mmap ? "mmap" : "stdio");
+    fprintf(stderr, "[PepperOpt2]   Asset reads: %zu (%.2f MB, %zu seeks)\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_ASSET_READS),
+            (size_t)pepper_stat_get(PEPPER_STAT_ASSET_BYTES) / 1024.0 / 1024.0,
+            (size_t)pepper_stat_get(PEPPER_STAT_ASSET_SEEKS));
+    if (pepper_stat_get(PEPPER_STAT_ASSET_READS) > 0) {
+        fprintf(stderr, "[PepperOpt2]   Asset load time (open to last read): %.1f ms, "
+                "prefetch %s, staging %s\n",
+                (g_asset_last_read - g_asset_open_time) * 1000.0,
+                pepper_prefetch_enabled() ? "on" : "off", pepper_stage_enabled() ? "on" : "off");
+    }
+    FILE* trace = g_trace_file;
+    g_trace_file = NULL;
+    pthread_mutex_unlock(&g_asset_mutex);
+
+    if (trace) fclose(trace);
+}
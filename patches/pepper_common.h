@@ -0,0 +1,532 @@
+/*
+ * pepper_common.h - Shared state for the libpepperopt2 modules
+ *
+ * pepper_optimizer_v2.c owns the constructor/destructor and the malloc and
+ * glTexImage2D hooks. Every other module exposes an init function (reads
+ * its PEPPER_* variables) and a summary function (prints its part of the
+ * session summary), and both are called from there. Every module is off
+ * unless its variable enables it.
+ */
+
+#ifndef PEPPER_COMMON_H
+#define PEPPER_COMMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Keep our globals out of the game's symbol namespace
+#pragma GCC visibility push(hidden)
+
+// ============================================================================
+// Shared configuration (pepper_optimizer_v2.c)
+// ============================================================================
+
+extern int g_verbose;
+extern int g_disabled;
+
+// Set while the library itself allocates, so the malloc hooks skip tracking
+extern __thread int in_malloc;
+
+// Only ever LD_PRELOADed, so the cheaper static TLS model is always available
+#define PEPPER_TLS __thread __attribute__((tls_model("initial-exec")))
+
+static inline int pepper_env_int(const char* name, int fallback) {
+    const char* value = getenv(name);
+    return value && *value ? atoi(value) : fallback;
+}
+
+static inline const char* pepper_env_str(const char* name) {
+    const char* value = getenv(name);
+    return value && *value ? value : NULL;
+}
+
+// Copy a file path from a variable, with %p replaced by the process ID, so
+// processes started by the game do not overwrite each other's files
+void pepper_expand_path(char* out, size_t cap, const char* spec);
+
+// Buffer swaps so far (SDL_GL_SwapWindow, glXSwapBuffers, eglSwapBuffers)
+unsigned long pepper_frame_count(void);
+
+// Buffers the aggressive free is holding for their upload: copies up to
+// `cap` of their addresses into `out` and returns how many it copied
+#define PEPPER_TRACKED_BUFFERS 20000
+size_t pepper_buffer_list(uintptr_t* out, size_t cap);
+
+// Run `callback` on a helper thread (with in_malloc set) each time the
+// process gets PEPPER_DUMP_SIGNAL (SIGUSR2 by default), so diagnostics can
+// be written at chosen moments. Returns the signal, or 0 if dumps on signal
+// are off or could not be set up. Call from an init function.
+int pepper_on_dump_signal(void (*callback)(void));
+
+// Content hash, same as chowdren_hash64() in tools/chowdren_assets.c so
+// files written by the tools can be checked at runtime
+static inline uint64_t pepper_mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t pepper_hash64(const void* data, size_t size) {
+    const uint8_t* p = data;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ (size * 0x100000001b3ull);
+    while (size >= 8) {
+        uint64_t v;
+        __builtin_memcpy(&v, p, 8);
+        h = (h ^ pepper_mix64(v)) * 0x100000001b3ull;
+        p += 8;
+        size -= 8;
+    }
+    uint64_t tail = 0;
+    __builtin_memcpy(&tail, p, size);
+    return pepper_mix64(h ^ pepper_mix64(tail ^ size));
+}
+
+// ============================================================================
+// Live stats (pepper_stats.c) - counters a viewer can read while the game runs
+// ============================================================================
+
+// One slot per counter; names and kinds are in pepper_stats.c
+enum {
+    PEPPER_STAT_TEXTURES, PEPPER_STAT_SCALED, PEPPER_STAT_ORIGINAL_BYTES,
+    PEPPER_STAT_OPTIMIZED_BYTES, PEPPER_STAT_FREED, PEPPER_STAT_FREED_BYTES, PEPPER_STAT_FRAMES,
+    PEPPER_STAT_TEXCACHE_HITS, PEPPER_STAT_TEXCACHE_HIT_BYTES, PEPPER_STAT_TEXCACHE_STORED,
+    PEPPER_STAT_TEXCACHE_STORED_BYTES,
+    PEPPER_STAT_ASSET_OPENS, PEPPER_STAT_ASSET_READS, PEPPER_STAT_ASSET_BYTES,
+    PEPPER_STAT_ASSET_SEEKS,
+    PEPPER_STAT_PREFETCH_ENTRIES, PEPPER_STAT_PREFETCH_BYTES, PEPPER_STAT_PREFETCH_CALLS,
+    PEPPER_STAT_PREFETCH_WAKEUPS,
+    PEPPER_STAT_ZLIB_FAST_CALLS, PEPPER_STAT_ZLIB_FAST_BYTES, PEPPER_STAT_ZLIB_FALLBACK_CALLS,
+    PEPPER_STAT_ZLIB_POOL_HITS, PEPPER_STAT_ZLIB_POOL_MISSES,
+    PEPPER_STAT_STAGE_DECODED, PEPPER_STAT_STAGE_DECODED_BYTES, PEPPER_STAT_STAGE_FAILED,
+    PEPPER_STAT_STAGE_HITS, PEPPER_STAT_STAGE_REMAPS, PEPPER_STAT_STAGE_WAITS,
+    PEPPER_STAT_STAGE_MISSES, PEPPER_STAT_STAGE_EVICTED,
+    PEPPER_STAT_SIDECAR_HITS, PEPPER_STAT_SIDECAR_BYTES, PEPPER_STAT_SIDECAR_MISSES,
+    PEPPER_STAT_RAWCACHE_HITS, PEPPER_STAT_RAWCACHE_STORED, PEPPER_STAT_RAWCACHE_STORED_BYTES,
+    PEPPER_STAT_RAWCACHE_MAPPED_BYTES, PEPPER_STAT_RAWCACHE_COPIED_BYTES,
+    PEPPER_STAT_ARENA_ALLOCS, PEPPER_STAT_ARENA_FALLBACKS, PEPPER_STAT_ARENA_LIVE_BYTES,
+    PEPPER_STAT_ARENA_RETURNS, PEPPER_STAT_ARENA_RETURNED_BYTES,
+    PEPPER_STAT_SLAB_REFILLS, PEPPER_STAT_SLAB_FLUSHES, PEPPER_STAT_SLAB_SPANS_LIVE,
+    PEPPER_STAT_SLAB_SPANS_RETURNED,
+    PEPPER_STAT_MALLOC_FREE_BYTES, PEPPER_STAT_MALLOC_TRIMS,
+    PEPPER_STAT_RSS, PEPPER_STAT_PSS,
+    PEPPER_STAT_COUNT
+};
+
+// Never NULL: private memory until pepper_stats_init() moves it to the
+// shared segment (PEPPER_STATS=1)
+extern uint64_t* g_stats;
+
+// Returns the new value
+static inline uint64_t pepper_stat_add(int stat, uint64_t n) {
+    return __atomic_add_fetch(&g_stats[stat], n, __ATOMIC_RELAXED);
+}
+
+static inline void pepper_stat_set(int stat, uint64_t value) {
+    __atomic_store_n(&g_stats[stat], value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t pepper_stat_get(int stat) {
+    return __atomic_load_n(&g_stats[stat], __ATOMIC_RELAXED);
+}
+
+void pepper_stats_init(void);
+void pepper_stats_summary(void);
+
+// ============================================================================
+// Hook latency histograms (pepper_latency.c)
+// ============================================================================
+
+enum {
+    PEPPER_LAT_TEXIMAGE,              // the whole glTexImage2D hook
+    PEPPER_LAT_UPLOAD,                // the driver's glTexImage2D inside it
+    PEPPER_LAT_DOWNSCALE,
+    PEPPER_LAT_MALLOC, PEPPER_LAT_CALLOC, PEPPER_LAT_REALLOC, PEPPER_LAT_FREE,
+    PEPPER_LAT_INFLATE,
+    PEPPER_LAT_FREAD,                 // Assets.dat reads
+    PEPPER_LAT_FRAME,                 // buffer swap to buffer swap
+    PEPPER_LAT_COUNT
+};
+
+extern int g_latency;
+
+// The cheapest counter there is: rdtsc on x86 (box64 turns it into a read of
+// the host's counter), the generic timer on arm64. Not nanoseconds; the
+// module converts when it prints.
+static inline uint64_t pepper_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// 0 when latency recording is off, which pepper_latency_record() skips:
+//   uint64_t lat = pepper_latency_start();
+//   ...
+//   pepper_latency_record(PEPPER_LAT_MALLOC, lat);
+static inline uint64_t pepper_latency_start(void) {
+    return __builtin_expect(g_latency, 0) ? pepper_ticks() : 0;
+}
+
+void pepper_latency_add(int probe, uint64_t ticks);
+
+static inline void pepper_latency_record(int probe, uint64_t start) {
+    if (start) pepper_latency_add(probe, pepper_ticks() - start);
+}
+
+// Bytes the histograms need in the stats segment (0 when off), and the
+// move there; called by pepper_stats_init()
+size_t pepper_latency_size(void);
+void pepper_latency_attach(void* area);
+
+void pepper_latency_init(void);
+void pepper_latency_summary(void);
+
+// ============================================================================
+// CPU counters per texture hook phase (pepper_perf.c)
+// ============================================================================
+
+enum {
+    PEPPER_PHASE_LOOKUP,              // find_buffer() over the tracked allocations
+    PEPPER_PHASE_HASH,                // pepper_texcache_find(): hash and lookup
+    PEPPER_PHASE_DOWNSCALE,
+    PEPPER_PHASE_UPLOAD,              // the driver's glTexImage2D, user space part
+    PEPPER_PHASE_STORE,               // pepper_texcache_store()
+    PEPPER_PHASE_FREE,                // the aggressive free of the source buffer
+    PEPPER_PHASE_COUNT
+};
+
+#define PEPPER_PERF_EVENTS 6
+
+typedef struct {
+    int ok;                           // 0: nothing read, pepper_perf_end() skips
+    uint64_t value[PEPPER_PERF_EVENTS];
+} PepperPerfSample;
+
+extern int g_perf;
+
+void pepper_perf_read(PepperPerfSample* sample);
+void pepper_perf_add(int phase, const PepperPerfSample* start, size_t bytes);
+
+// Reads the calling thread's counters, one read() of the event group:
+//   PepperPerfSample perf;
+//   pepper_perf_begin(&perf);
+//   ...
+//   pepper_perf_end(PEPPER_PHASE_DOWNSCALE, &perf, bytes);
+static inline void pepper_perf_begin(PepperPerfSample* sample) {
+    sample->ok = 0;
+    if (__builtin_expect(g_perf, 0)) pepper_perf_read(sample);
+}
+
+static inline void pepper_perf_end(int phase, const PepperPerfSample* start, size_t bytes) {
+    if (start->ok) pepper_perf_add(phase, start, bytes);
+}
+
+void pepper_perf_init(void);
+void pepper_perf_summary(void);
+
+// ============================================================================
+// Startup timeline in trace-event JSON (pepper_timeline.c)
+// ============================================================================
+
+enum {
+    PEPPER_SPAN_FREAD,                // Assets.dat read; args: offset, bytes
+    PEPPER_SPAN_INFLATE,              // args: bytes in, bytes out
+    PEPPER_SPAN_TEXIMAGE,             // the whole hook; args: width, height
+    PEPPER_SPAN_DOWNSCALE,            // args: width, height of the result
+    PEPPER_SPAN_UPLOAD,               // the driver's glTexImage2D; same
+    PEPPER_SPAN_FRAME,                // buffer swap to buffer swap; args: frame
+    PEPPER_SPAN_COUNT
+};
+
+extern int g_timeline;
+
+// Same pattern as the latency probes; 0 when off, which the record skips:
+//   uint64_t span = pepper_timeline_start();
+//   ...
+//   pepper_timeline_record(PEPPER_SPAN_INFLATE, span, in, out);
+static inline uint64_t pepper_timeline_start(void) {
+    return __builtin_expect(g_timeline, 0) ? pepper_ticks() : 0;
+}
+
+void pepper_timeline_add(int span, uint64_t start, uint64_t arg0, uint64_t arg1);
+
+static inline void pepper_timeline_record(int span, uint64_t start, uint64_t arg0,
+                                          uint64_t arg1) {
+    if (start) pepper_timeline_add(span, start, arg0, arg1);
+}
+
+// Called by pepper_assetio.c when Assets.dat is opened, to name each read
+// after the entry it falls in
+void pepper_timeline_open(const char* path, size_t size);
+
+// Called on every buffer swap; writes the file once the frame limit is hit
+void pepper_timeline_frame(unsigned long frame);
+
+void pepper_timeline_init(void);
+void pepper_timeline_summary(void);
+
+// ============================================================================
+// Assets.dat table index (pepper_assetio.c)
+// ============================================================================
+
+// Same tables as tools/chowdren_assets.h
+#define PEPPER_IMAGE_COUNT  10256
+#define PEPPER_SOUND_COUNT  267
+#define PEPPER_FONT_COUNT   19
+#define PEPPER_SHADER_COUNT 3
+#define PEPPER_ENTRY_COUNT  (PEPPER_IMAGE_COUNT + PEPPER_SOUND_COUNT + \
+                             PEPPER_FONT_COUNT + PEPPER_SHADER_COUNT)
+#define PEPPER_TABLES_SIZE  (PEPPER_ENTRY_COUNT * 8)
+
+typedef enum {
+    PEPPER_KIND_IMAGE = 0,
+    PEPPER_KIND_SOUND,
+    PEPPER_KIND_FONT,
+    PEPPER_KIND_SHADER,
+} PepperKind;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    uint16_t kind;          // PepperKind
+    uint16_t reserved;
+    uint32_t index;         // index within its table
+} PepperEntry;
+
+typedef struct {
+    PepperEntry* entries;   // non-empty entries in table (= load) order
+    size_t count;
+    uint32_t* by_offset;    // positions in `entries`, sorted by file offset
+} PepperAssetIndex;
+
+// Read the tables from `fd`. Entries that are empty or run past the end of
+// the file are left out. Returns 0 on success.
+int pepper_asset_index_load(int fd, size_t file_size, PepperAssetIndex* index);
+
+// Load-order position of the entry containing file offset `pos`, or of the
+// first entry stored after it (index->count if none). Entries sharing
+// storage resolve to the earliest in load order.
+size_t pepper_asset_index_find(const PepperAssetIndex* index, size_t pos);
+
+void pepper_asset_index_free(PepperAssetIndex* index);
+
+// File offset that `ptr` corresponds to, if it points into the buffer of
+// one of the last 64 freads of Assets.dat. Returns 0 on success.
+int pepper_asset_source(const void* ptr, size_t* offset);
+
+// ============================================================================
+// Sampled-block map (pepper_heapprof.c)
+// ============================================================================
+
+// The profilers' live sampled blocks, pointer -> 64-bit value. put and take
+// need the caller's lock. pepper_ptrmap_maybe() does not, and is false for
+// nearly every pointer that is not in the map, so every free can check it.
+typedef struct {
+    uintptr_t* keys;          // 0 = empty
+    uint64_t* values;
+    uint16_t* filter;         // entries per hash bucket
+    size_t slots;
+    size_t count;
+} PepperPtrMap;
+
+#define PEPPER_PTRMAP_FILTER (1 << 16)
+
+// Room for slots / 2 entries; `slots` is a power of two. Returns 0 on success.
+int pepper_ptrmap_init(PepperPtrMap* map, size_t slots);
+// Adds or replaces `ptr`. Returns -1 if the map is full.
+int pepper_ptrmap_put(PepperPtrMap* map, uintptr_t ptr, uint64_t value);
+// Removes `ptr`, storing its value in *value. Returns -1 if it is not there.
+int pepper_ptrmap_take(PepperPtrMap* map, uintptr_t ptr, uint64_t* value);
+
+static inline int pepper_ptrmap_maybe(const PepperPtrMap* map, uintptr_t ptr) {
+    size_t bucket = (pepper_mix64(ptr) >> 32) & (PEPPER_PTRMAP_FILTER - 1);
+    return __atomic_load_n(&map->filter[bucket], __ATOMIC_ACQUIRE) != 0;
+}
+
+// ============================================================================
+// Modules
+// ============================================================================
+
+// pepper_assetio.c - Assets.dat served from an mmap
+void pepper_assetio_init(void);
+void pepper_assetio_summary(void);
+
+// pepper_prefetch.c - read-ahead thread driven by pepper_assetio's hooks
+void pepper_prefetch_init(void);
+void pepper_prefetch_summary(void);
+int pepper_prefetch_enabled(void);
+// Returns 1 if the stream now holds a reference on the prefetch thread, to
+// be dropped with pepper_prefetch_close() when it is closed
+int pepper_prefetch_open(const char* path, size_t size);
+void pepper_prefetch_position(size_t pos);
+void pepper_prefetch_close(void);
+
+// pepper_zlib.c - one-shot libdeflate inflate behind the zlib API
+void pepper_zlib_init(void);
+void pepper_zlib_summary(void);
+
+// Inflate a complete zlib stream without going through the hooks (libdeflate
+// when built with it, real zlib otherwise). Returns 0 on success.
+int pepper_zlib_decode(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap,
+                       size_t* in_used, size_t* out_len);
+
+// pepper_stage.c - images inflated ahead of the engine by worker threads
+void pepper_stage_init(void);
+void pepper_stage_summary(void);
+int pepper_stage_enabled(void);
+// Returns 1 if the stream holds a reference, dropped by pepper_stage_close()
+int pepper_stage_open(const char* path, size_t size);
+void pepper_stage_note_read(size_t offset);
+void pepper_stage_close(void);
+
+// Answer an inflate of the zlib stream at `in` from the staging cache.
+// Same contract as pepper_zlib_decode; -1 means not staged.
+int pepper_stage_take(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap,
+                      size_t* in_used, size_t* out_len);
+
+// pepper_sidecar.c - image pixels decoded from an LZ4 sidecar file
+void pepper_sidecar_init(void);
+void pepper_sidecar_summary(void);
+int pepper_sidecar_enabled(void);
+void pepper_sidecar_open(const char* path, size_t size);
+void pepper_sidecar_close(void);
+
+// Same contract as pepper_stage_take; -1 means not in the sidecar.
+int pepper_sidecar_take(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap,
+                        size_t* in_used, size_t* out_len);
+
+// pepper_texcache.c - downscaled textures kept on disk across launches.
+// `policy` describes everything that affects the processed pixels.
+void pepper_texcache_init(const char* policy);
+void pepper_texcache_summary(void);
+int pepper_texcache_enabled(void);
+
+// Cached result for `src` (width x height RGBA) if it is `out_size` bytes,
+// or NULL. *key is filled either way for pepper_texcache_store().
+const void* pepper_texcache_find(const void* src, int width, int height, size_t out_size,
+                                 uint64_t* key);
+void pepper_texcache_store(uint64_t key, const void* data, size_t size);
+
+// pepper_rawcache.c - decoded images kept in a file and mapped back in
+void pepper_rawcache_init(void);
+void pepper_rawcache_summary(void);
+int pepper_rawcache_enabled(void);
+
+// Same contract as pepper_stage_take; -1 means not cached.
+int pepper_rawcache_take(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap,
+                         size_t* in_used, size_t* out_len);
+// `out` holds the complete decode of in[0, in_used). Its pages may be
+// replaced by a mapping of the cache file.
+void pepper_rawcache_store(const uint8_t* in, size_t in_used, uint8_t* out, size_t out_len);
+
+// pepper_arena.c - page-aligned arena for texture-sized allocations
+void pepper_arena_init(void);
+void pepper_arena_summary(void);
+int pepper_arena_enabled(void);
+
+// NULL if `size` is below the arena's band, or the arena is off or full.
+// With `zero`, the block reads as zeros.
+void* pepper_arena_alloc(size_t size, int zero);
+// Usable size of an arena block, 0 if `ptr` is not one.
+size_t pepper_arena_size(const void* ptr);
+// 0 if `ptr` belonged to the arena (and is now freed), -1 otherwise.
+int pepper_arena_free(void* ptr);
+
+// pepper_slab.c - size-class slabs with per-thread caches for small objects
+void pepper_slab_init(void);
+void pepper_slab_summary(void);
+int pepper_slab_enabled(void);
+
+// Same contracts as the pepper_arena_* functions above, for sizes up to 16 KB
+void* pepper_slab_alloc(size_t size);
+size_t pepper_slab_size(const void* ptr);
+int pepper_slab_free(void* ptr);
+
+// pepper_alloctrace.c - binary trace of every allocation call
+void pepper_alloctrace_init(void);
+void pepper_alloctrace_summary(void);
+int pepper_alloctrace_enabled(void);
+
+// Tested by the malloc hooks before calling in, so tracing costs nothing when off
+extern int g_alloc_trace;
+
+enum { PEPPER_ALLOC_MALLOC, PEPPER_ALLOC_CALLOC, PEPPER_ALLOC_REALLOC, PEPPER_ALLOC_FREE,
+       PEPPER_ALLOC_TEXTURE, PEPPER_ALLOC_MEMORY };
+
+// Trace clock in ns, 0 when tracing is off; pass it as `called` for reallocs
+uint64_t pepper_alloctrace_clock(void);
+// Record one call: after an allocation returns, before a free releases.
+// `site` is the caller's return address. No-op while in_malloc is set.
+void pepper_alloctrace_record(int op, const void* ptr, const void* old_ptr, size_t size,
+                              uint64_t called, const void* site);
+// Events on the same time line, recorded even with PEPPER_ALLOC_TRACE_CALLS=0:
+// a glTexImage2D call, and a memory sample (sizes in bytes)
+void pepper_alloctrace_texture(const void* pixels, int width, int height, size_t bytes,
+                               const void* site);
+void pepper_alloctrace_memory(size_t rss, size_t pss, size_t swap, size_t anon);
+
+// pepper_heapprof.c - sampled heap profile per call stack (pprof format)
+void pepper_heapprof_init(void);
+void pepper_heapprof_summary(void);
+int pepper_heapprof_enabled(void);
+
+// Tested by the malloc hooks before calling in, like g_alloc_trace
+extern int g_heap_prof;
+
+// After an allocation returns, and before a block is released
+void pepper_heapprof_alloc(void* ptr, size_t size);
+void pepper_heapprof_free(void* ptr);
+
+// pepper_sizehist.c - allocation histograms by power-of-two size class
+void pepper_sizehist_init(void);
+void pepper_sizehist_summary(void);
+int pepper_sizehist_enabled(void);
+
+// Tested by the malloc hooks before calling in, like g_alloc_trace
+extern int g_size_hist;
+
+// After an allocation returns, and before a block is released; `usable`
+// is its malloc_usable_size()
+void pepper_sizehist_alloc(void* ptr, size_t usable);
+void pepper_sizehist_free(void* ptr, size_t usable);
+
+// pepper_heapsnap.c - snapshots of every live allocation (tools/heap_diff.c)
+void pepper_heapsnap_init(void);
+void pepper_heapsnap_summary(void);
+int pepper_heapsnap_enabled(void);
+
+// Tested by the malloc hooks before calling in, like g_alloc_trace
+extern int g_heap_snap;
+
+// After an allocation returns (`site` is the caller's return address), and
+// before a block is released
+void pepper_heapsnap_alloc(void* ptr, size_t size, const void* site);
+void pepper_heapsnap_free(void* ptr);
+// After each buffer swap
+void pepper_heapsnap_frame(unsigned long frame);
+
+// pepper_mallocmon.c - glibc arena and fragmentation monitor, malloc_trim
+void pepper_mallocmon_init(void);
+void pepper_mallocmon_summary(void);
+int pepper_mallocmon_enabled(void);
+
+// pepper_memsample.c - RSS/PSS timeline, recorded into the allocation trace
+void pepper_memsample_init(void);
+void pepper_memsample_summary(void);
+int pepper_memsample_enabled(void);
+
+#pragma GCC visibility pop
+
+#endif
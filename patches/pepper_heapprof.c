@@ -0,0 +1,403 @@
+/*
+ * pepper_heapprof.c - Sampled heap profile per call stack, in pprof format
+ *
+ * Shows which engine paths own the memory: allocations are sampled, the
+ * stack of each sample is captured, and live and peak bytes are kept per
+ * stack. Sending the process PEPPER_DUMP_SIGNAL (SIGUSR2 by default)
+ * writes a profile, so one can be taken after the title screen, another
+ * after a level has loaded, and so on. A last one is written at exit.
+ *
+ * Sampling is by bytes, with exponentially distributed gaps (mean
+ * PEPPER_HEAPPROF_RATE_KB), the way tcmalloc does it. A 1 MB texture
+ * buffer is nearly always sampled while a 32-byte object is sampled once
+ * in ~16000, and the cost on the malloc path stays a subtraction unless a
+ * sample is due. Stacks come from the unwind tables (backtrace(3)), so
+ * frame pointers are not needed, and are only taken for samples.
+ *
+ * Every dump writes two files in the legacy gperftools heap format, which
+ * pprof reads (and scales by the sampling rate itself):
+ *   <path>.<n>.heap       - live bytes per stack at the time of the dump,
+ *                           plus everything allocated so far
+ *   <path>.<n>.peak.heap  - the most bytes each stack had live at once
+ * e.g. pprof -top Chowdren /tmp/heap.0001.heap
+ *
+ * Environment variables:
+ *   PEPPER_HEAPPROF=path          - Profile file prefix, %p = process ID
+ *                                   (default off)
+ *   PEPPER_HEAPPROF_RATE_KB=512   - Mean bytes between samples
+ *   PEPPER_DUMP_SIGNAL=12         - Signal that writes a profile (SIGUSR2;
+ *                                   0 = only at exit)
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <link.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+#define MAX_FRAMES 32
+#define STACK_SLOTS 16384             // distinct stacks kept
+#define SAMPLE_SLOTS (1 << 17)        // live sampled blocks, at most half used
+
+int g_heap_prof = 0;
+static char g_prof_path[512];
+static size_t g_prof_rate = 512 * 1024;
+
+// Stats (under g_prof_mutex)
+static size_t g_samples = 0;
+static size_t g_samples_dropped = 0;  // stack or sample table full
+static size_t g_stack_count = 0;
+static int g_dumps = 0;
+
+static pthread_mutex_t g_prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// This library's code, so its frames can be cut from the stacks
+static uintptr_t g_self_lo = 0, g_self_hi = 0;
+
+// ============================================================================
+// Stacks
+// ============================================================================
+
+typedef struct {
+    uint64_t hash;            // 0 = empty slot
+    uint32_t depth;
+    size_t live_count, live_bytes;
+    size_t alloc_count, alloc_bytes;
+    size_t peak_count, peak_bytes;
+    void* frames[MAX_FRAMES];
+} ProfStack;
+
+static ProfStack* g_stacks = NULL;
+
+static uint64_t hash_frames(void* const* frames, int depth) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ (uint64_t)depth;
+    for (int i = 0; i < depth; i++) h = pepper_mix64(h ^ (uintptr_t)frames[i]);
+    return h ? h : 1;
+}
+
+// Index of the stack, added if new; -1 if the table is full. Needs g_prof_mutex.
+static int find_stack(void* const* frames, int depth) {
+    uint64_t hash = hash_frames(frames, depth);
+    uint32_t slot = (uint32_t)hash & (STACK_SLOTS - 1);
+    for (int probe = 0; probe < STACK_SLOTS; probe++) {
+        ProfStack* s = &g_stacks[slot];
+        if (s->hash == hash && s->depth == (uint32_t)depth &&
+            memcmp(s->frames, frames, depth * sizeof(void*)) == 0) {
+            return (int)slot;
+        }
+        if (!s->hash) {
+            if (g_stack_count >= STACK_SLOTS * 3 / 4) return -1;
+            s->hash = hash;
+            s->depth = (uint32_t)depth;
+            memcpy(s->frames, frames, depth * sizeof(void*));
+            g_stack_count++;
+            return (int)slot;
+        }
+        slot = (slot + 1) & (STACK_SLOTS - 1);
+    }
+    return -1;
+}
+
+// ============================================================================
+// Sampled-block map (also used by pepper_sizehist.c)
+// ============================================================================
+
+int pepper_ptrmap_init(PepperPtrMap* map, size_t slots) {
+    memset(map, 0, sizeof(*map));
+    map->keys = mmap(NULL, slots * sizeof(uintptr_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    map->values = mmap(NULL, slots * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    map->filter = mmap(NULL, PEPPER_PTRMAP_FILTER * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map->keys == MAP_FAILED || map->values == MAP_FAILED || map->filter == MAP_FAILED) {
+        return -1;
+    }
+    map->slots = slots;
+    return 0;
+}
+
+int pepper_ptrmap_put(PepperPtrMap* map, uintptr_t ptr, uint64_t value) {
+    uint64_t h = pepper_mix64(ptr);
+    size_t mask = map->slots - 1;
+    size_t slot = h & mask;
+    while (map->keys[slot] && map->keys[slot] != ptr) slot = (slot + 1) & mask;
+    if (!map->keys[slot]) {
+        if (map->count >= map->slots / 2) return -1;
+        map->count++;
+        map->keys[slot] = ptr;
+        __atomic_add_fetch(&map->filter[(h >> 32) & (PEPPER_PTRMAP_FILTER - 1)], 1,
+                           __ATOMIC_RELEASE);
+    }
+    map->values[slot] = value;
+    return 0;
+}
+
+int pepper_ptrmap_take(PepperPtrMap* map, uintptr_t ptr, uint64_t* value) {
+    uint64_t h = pepper_mix64(ptr);
+    size_t mask = map->slots - 1;
+    size_t slot = h & mask;
+    while (map->keys[slot] != ptr) {
+        if (!map->keys[slot]) return -1;
+        slot = (slot + 1) & mask;
+    }
+    *value = map->values[slot];
+    // Backward-shift deletion, so later lookups never stop early
+    size_t hole = slot;
+    for (size_t j = (slot + 1) & mask; map->keys[j]; j = (j + 1) & mask) {
+        size_t home = pepper_mix64(map->keys[j]) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            map->keys[hole] = map->keys[j];
+            map->values[hole] = map->values[j];
+            hole = j;
+        }
+    }
+    map->keys[hole] = 0;
+    map->count--;
+    __atomic_sub_fetch(&map->filter[(h >> 32) & (PEPPER_PTRMAP_FILTER - 1)], 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Live samples: stack index << 32 | size
+static PepperPtrMap g_live;
+
+// ============================================================================
+// Sampling
+// ============================================================================
+
+static __thread int64_t t_until_sample = 0;   // bytes left before the next sample
+static __thread uint64_t t_rng = 0;
+
+// Exponential gap with mean g_prof_rate
+static int64_t next_gap(void) {
+    if (!t_rng) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        t_rng = pepper_mix64((uintptr_t)&t_rng ^ (uint64_t)ts.tv_nsec) | 1;
+    }
+    t_rng ^= t_rng << 13;
+    t_rng ^= t_rng >> 7;
+    t_rng ^= t_rng << 17;
+    double u = ((t_rng >> 11) + 1) * (1.0 / 9007199254740993.0);   // (0, 1]
+    return (int64_t)(-log(u) * (double)g_prof_rate) + 1;
+}
+
+static void take_stack_sample(void* ptr, size_t size) {
+    void* raw[MAX_FRAMES + 8];
+    in_malloc = 1;
+    int n = backtrace(raw, MAX_FRAMES + 8);
+    in_malloc = 0;
+
+    // Drop the frames inside this library (the hooks and this module)
+    int first = 0;
+    while (first < n && (uintptr_t)raw[first] >= g_self_lo && (uintptr_t)raw[first] < g_self_hi) {
+        first++;
+    }
+    int depth = n - first < MAX_FRAMES ? n - first : MAX_FRAMES;
+    uint32_t bytes = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+
+    pthread_mutex_lock(&g_prof_mutex);
+    g_samples++;
+    int stack = find_stack(&raw[first], depth);
+    if (stack < 0 || pepper_ptrmap_put(&g_live, (uintptr_t)ptr, (uint64_t)stack << 32 | bytes) != 0) {
+        g_samples_dropped++;
+    } else {
+        ProfStack* s = &g_stacks[stack];
+        s->alloc_count++;
+        s->alloc_bytes += bytes;
+        s->live_count++;
+        s->live_bytes += bytes;
+        if (s->live_bytes > s->peak_bytes) {
+            s->peak_bytes = s->live_bytes;
+            s->peak_count = s->live_count;
+        }
+    }
+    pthread_mutex_unlock(&g_prof_mutex);
+}
+
+// ============================================================================
+// Hooks from pepper_optimizer_v2.c
+// ============================================================================
+
+int pepper_heapprof_enabled(void) {
+    return g_heap_prof;
+}
+
+void pepper_heapprof_alloc(void* ptr, size_t size) {
+    if (in_malloc) return;
+    if (!t_rng) t_until_sample = next_gap();
+    t_until_sample -= (int64_t)size;
+    if (t_until_sample >= 0) return;
+    t_until_sample = next_gap();
+    take_stack_sample(ptr, size);
+}
+
+void pepper_heapprof_free(void* ptr) {
+    if (!pepper_ptrmap_maybe(&g_live, (uintptr_t)ptr)) return;
+
+    uint64_t sample;
+    pthread_mutex_lock(&g_prof_mutex);
+    if (pepper_ptrmap_take(&g_live, (uintptr_t)ptr, &sample) == 0) {
+        ProfStack* s = &g_stacks[sample >> 32];
+        s->live_count--;
+        s->live_bytes -= (uint32_t)sample;
+    }
+    pthread_mutex_unlock(&g_prof_mutex);
+}
+
+// ============================================================================
+// Profile files
+// ============================================================================
+
+typedef struct {
+    int index;
+    size_t live_count, live_bytes;
+    size_t alloc_count, alloc_bytes;
+    size_t peak_count, peak_bytes;
+} StackStats;
+
+static void write_profile(const char* path, const StackStats* stats, size_t count, int peak) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "[PepperOpt2] Heap profile: cannot write %s\n", path);
+        return;
+    }
+    size_t total_count = 0, total_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        total_count += peak ? stats[i].peak_count : stats[i].live_count;
+        total_bytes += peak ? stats[i].peak_bytes : stats[i].live_bytes;
+        alloc_count += stats[i].alloc_count;
+        alloc_bytes += stats[i].alloc_bytes;
+    }
+    fprintf(f, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", total_count, total_bytes,
+            alloc_count, alloc_bytes, g_prof_rate);
+    for (size_t i = 0; i < count; i++) {
+        const StackStats* s = &stats[i];
+        const ProfStack* stack = &g_stacks[s->index];
+        fprintf(f, "%zu: %zu [%zu: %zu] @", peak ? s->peak_count : s->live_count,
+                peak ? s->peak_bytes : s->live_bytes, s->alloc_count, s->alloc_bytes);
+        for (uint32_t d = 0; d < stack->depth; d++) fprintf(f, " %p", stack->frames[d]);
+        fputc('\n', f);
+    }
+
+    // Lets pprof symbolize the addresses
+    fprintf(f, "\nMAPPED_LIBRARIES:\n");
+    FILE* maps = fopen("/proc/self/maps", "r");
+    char line[1024];
+    while (maps && fgets(line, sizeof(line), maps)) fputs(line, f);
+    if (maps) fclose(maps);
+    fclose(f);
+}
+
+// Writes <path>.<n>.heap and <path>.<n>.peak.heap. Library allocations only.
+static void dump_profiles(void) {
+    StackStats* stats = malloc(STACK_SLOTS * sizeof(StackStats));
+    if (!stats) return;
+    size_t count = 0;
+    pthread_mutex_lock(&g_prof_mutex);
+    int dump = ++g_dumps;
+    for (int i = 0; i < STACK_SLOTS; i++) {
+        const ProfStack* s = &g_stacks[i];
+        if (!s->hash || !s->alloc_count) continue;
+        stats[count++] = (StackStats){ i, s->live_count, s->live_bytes, s->alloc_count,
+                                       s->alloc_bytes, s->peak_count, s->peak_bytes };
+    }
+    pthread_mutex_unlock(&g_prof_mutex);
+
+    // Frames never change once a stack is in the table
+    char path[560];
+    snprintf(path, sizeof(path), "%s.%04d.heap", g_prof_path, dump);
+    write_profile(path, stats, count, 0);
+    snprintf(path, sizeof(path), "%s.%04d.peak.heap", g_prof_path, dump);
+    write_profile(path, stats, count, 1);
+    free(stats);
+
+    if (g_verbose || dump == 1) {
+        fprintf(stderr, "[PepperOpt2] Heap profile: wrote %s.%04d.heap (%zu stacks)\n",
+                g_prof_path, dump, count);
+    }
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+static int find_self(struct dl_phdr_info* info, size_t size, void* arg) {
+    (void)size;
+    if (info->dlpi_addr != (uintptr_t)arg) return 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X)) continue;
+        g_self_lo = info->dlpi_addr + ph->p_vaddr;
+        g_self_hi = g_self_lo + ph->p_memsz;
+    }
+    return 1;
+}
+
+void pepper_heapprof_init(void) {
+    const char* spec = pepper_env_str("PEPPER_HEAPPROF");
+    if (!spec) return;
+    pepper_expand_path(g_prof_path, sizeof(g_prof_path), spec);
+    int rate_kb = pepper_env_int("PEPPER_HEAPPROF_RATE_KB", 512);
+    g_prof_rate = (size_t)(rate_kb < 1 ? 1 : rate_kb) * 1024;
+
+    g_stacks = mmap(NULL, STACK_SLOTS * sizeof(ProfStack), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (g_stacks == MAP_FAILED || pepper_ptrmap_init(&g_live, SAMPLE_SLOTS) != 0) {
+        fprintf(stderr, "[PepperOpt2] Heap profile: out of memory, disabled\n");
+        return;
+    }
+
+    Dl_info self;
+    in_malloc = 1;
+    if (dladdr((void*)pepper_heapprof_init, &self)) dl_iterate_phdr(find_self, self.dli_fbase);
+    // The first backtrace() loads libgcc_s; get that over with here
+    void* warm[4];
+    backtrace(warm, 4);
+    in_malloc = 0;
+
+    int dump_signal = pepper_on_dump_signal(dump_profiles);
+
+    __atomic_store_n(&g_heap_prof, 1, __ATOMIC_RELEASE);
+    if (dump_signal > 0) {
+        fprintf(stderr, "[PepperOpt2] Heap profile: ENABLED (%s.*.heap, 1 sample per %zu KB, "
+                "dump with kill -%d %d)\n", g_prof_path, g_prof_rate / 1024, dump_signal, (int)getpid());
+    } else {
+        fprintf(stderr, "[PepperOpt2] Heap profile: ENABLED (%s.*.heap, 1 sample per %zu KB, "
+                "at exit)\n", g_prof_path, g_prof_rate / 1024);
+    }
+}
+
+void pepper_heapprof_summary(void) {
+    if (!pepper_heapprof_enabled()) return;
+
+    in_malloc = 1;
+    dump_profiles();
+    in_malloc = 0;
+
+    pthread_mutex_lock(&g_prof_mutex);
+    size_t live_bytes = 0;
+    for (int i = 0; i < STACK_SLOTS; i++) live_bytes += g_stacks[i].live_bytes;
+    fprintf(stderr, "[PepperOpt2]   Heap profile: %zu samples from %zu stacks, %zu live "
+            "(%.2f MB sampled), %d profiles written\n",
+            g_samples, g_stack_count, g_live.count, live_bytes / 1024.0 / 1024.0, g_dumps);
+    if (g_samples_dropped) {
+        fprintf(stderr, "[PepperOpt2]   Heap profile: %zu samples dropped (tables full)\n",
+                g_samples_dropped);
+    }
+    pthread_mutex_unlock(&g_prof_mutex);
+}
@@ -0,0 +1,439 @@
+/*
+ * pepper_heapsnap.c - Snapshots of every live allocation, for diffing
+ *
+ * A level that leaves a few MB behind each time it loads only shows up as
+ * an OOM an hour into the game. With PEPPER_HEAPSNAP set, the malloc hooks
+ * in pepper_optimizer_v2.c keep a table of every live block (address,
+ * requested size, call site), and a snapshot writes the table to a file:
+ *   - on PEPPER_DUMP_SIGNAL (SIGUSR2 by default), e.g. before and after a
+ *     level transition;
+ *   - after each buffer swap listed in PEPPER_HEAPSNAP_FRAMES;
+ *   - at exit.
+ * tools/heap_diff.c compares two or more snapshots: what each transition
+ * allocated and freed by call site and size class, and which call sites
+ * grew in every one.
+ *
+ * The table costs 24 bytes per live block (at most twice that with the
+ * table's free slots), not a copy of the heap. A snapshot is streamed to
+ * the file one shard at a time through a fixed 256 KB buffer, so taking
+ * one needs no memory in proportion to the heap. Each shard is locked
+ * while it is written, so the snapshot is consistent per shard, not
+ * across shards.
+ *
+ * Every allocation and free takes one of 64 shard locks: this is for
+ * diagnosing, not for leaving on. The library's own allocations are not
+ * recorded. A realloc counts as freeing the old block and allocating a
+ * new one.
+ *
+ * File layout: HeapSnapHeader, HeapSnapRecord[block_count], then one line
+ * per call site seen in the records:
+ *   0x<address> <module>+0x<offset> [symbol]
+ *
+ * Environment variables:
+ *   PEPPER_HEAPSNAP=path          - Write path.NNNN.snap, %p = process ID
+ *                                   (default off)
+ *   PEPPER_HEAPSNAP_FRAMES=600,1800
+ *                                 - Also take one after these frames
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// File format (read by tools/heap_diff.c)
+// ============================================================================
+
+#define SNAP_MAGIC "PEPSNP\0\1"
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;     // sizeof(HeapSnapRecord)
+    uint32_t sequence;        // 1 = first snapshot of the process
+    uint64_t frame;           // buffer swaps so far
+    uint64_t time_ns;         // since the library was loaded
+    uint64_t block_count;
+    uint64_t live_bytes;      // requested bytes of those blocks
+} HeapSnapHeader;
+
+typedef struct {
+    uint64_t ptr;
+    uint64_t site;            // return address of the hooked call
+    uint32_t size;            // requested bytes (nmemb * size for calloc)
+    uint32_t serial;          // with ptr, tells a block from a later one at
+                              // the same address
+    uint32_t flags;           // HEAPSNAP_*
+    uint32_t reserved;
+} HeapSnapRecord;
+
+// Still held by the aggressive free: a pixel buffer waiting for its upload
+#define HEAPSNAP_TRACKED 1
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+#define SHARDS 64
+#define SHARD_MIN_SLOTS 1024
+#define WRITE_RECORDS 8192            // 256 KB write buffer
+#define SITE_SLOTS (1 << 16)
+#define MAX_FRAMES 16
+
+int g_heap_snap = 0;
+static char g_snap_path[512];
+static uint64_t g_start_ns = 0;
+static unsigned long g_frames[MAX_FRAMES];
+static int g_frame_count = 0;
+static int g_next_frame = 0;
+
+// Stats
+static pthread_mutex_t g_snap_mutex = PTHREAD_MUTEX_INITIALIZER;  // one snapshot at a time
+static uint32_t g_snapshots = 0;
+static uint64_t g_last_blocks = 0;
+static uint64_t g_last_bytes = 0;
+static size_t g_dropped = 0;          // blocks not recorded (table could not grow)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// ============================================================================
+// Live block table - SHARDS open-addressed tables with backward-shift
+// deletion, each under its own lock
+// ============================================================================
+
+typedef struct {
+    uintptr_t ptr;            // 0 = empty
+    uintptr_t site;
+    uint32_t size;
+    uint32_t serial;
+} LiveBlock;
+
+typedef struct {
+    pthread_mutex_t lock;
+    LiveBlock* slots;         // mmap'd, so growing never calls malloc
+    size_t mask;
+    size_t count;
+    uint32_t serial;
+} Shard;
+
+static Shard g_shards[SHARDS];
+
+static inline uint64_t block_hash(uintptr_t ptr) {
+    return pepper_mix64(ptr);
+}
+
+static inline Shard* shard_of(uint64_t hash) {
+    return &g_shards[hash >> 58];
+}
+
+static void put_slot(LiveBlock* slots, size_t mask, const LiveBlock* block) {
+    size_t i = block_hash(block->ptr) & mask;
+    while (slots[i].ptr) i = (i + 1) & mask;
+    slots[i] = *block;
+}
+
+static int grow(Shard* shard) {
+    size_t slots = shard->slots ? (shard->mask + 1) * 2 : SHARD_MIN_SLOTS;
+    LiveBlock* table = mmap(NULL, slots * sizeof(LiveBlock), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) return -1;
+    if (shard->slots) {
+        for (size_t i = 0; i <= shard->mask; i++) {
+            if (shard->slots[i].ptr) put_slot(table, slots - 1, &shard->slots[i]);
+        }
+        munmap(shard->slots, (shard->mask + 1) * sizeof(LiveBlock));
+    }
+    shard->slots = table;
+    shard->mask = slots - 1;
+    return 0;
+}
+
+static void remove_slot(Shard* shard, size_t i) {
+    size_t mask = shard->mask;
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; shard->slots[j].ptr; j = (j + 1) & mask) {
+        size_t home = block_hash(shard->slots[j].ptr) & mask;
+        // Move j into the hole unless its home lies cyclically in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            shard->slots[hole] = shard->slots[j];
+            hole = j;
+        }
+    }
+    shard->slots[hole].ptr = 0;
+    shard->count--;
+}
+
+// ============================================================================
+// Hooks from pepper_optimizer_v2.c
+// ============================================================================
+
+int pepper_heapsnap_enabled(void) {
+    return g_heap_snap;
+}
+
+void pepper_heapsnap_alloc(void* ptr, size_t size, const void* site) {
+    if (in_malloc) return;
+    uint64_t hash = block_hash((uintptr_t)ptr);
+    Shard* shard = shard_of(hash);
+    LiveBlock block = { (uintptr_t)ptr, (uintptr_t)site,
+                        size > UINT32_MAX ? UINT32_MAX : (uint32_t)size, 0 };
+    pthread_mutex_lock(&shard->lock);
+    if ((shard->count + 1) * 4 > (shard->slots ? shard->mask + 1 : 0) * 3 && grow(shard) != 0) {
+        g_dropped++;
+    } else {
+        block.serial = ++shard->serial;
+        put_slot(shard->slots, shard->mask, &block);
+        shard->count++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void pepper_heapsnap_free(void* ptr) {
+    uint64_t hash = block_hash((uintptr_t)ptr);
+    Shard* shard = shard_of(hash);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->slots) {
+        for (size_t i = hash & shard->mask; shard->slots[i].ptr; i = (i + 1) & shard->mask) {
+            if (shard->slots[i].ptr == (uintptr_t)ptr) {
+                remove_slot(shard, i);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// ============================================================================
+// Snapshot writer
+// ============================================================================
+
+typedef struct {
+    int fd;
+    int failed;
+    HeapSnapRecord* records;  // WRITE_RECORDS
+    size_t count;
+    uintptr_t* sites;         // SITE_SLOTS, every site written so far
+} SnapWriter;
+
+static void write_all(SnapWriter* w, const void* data, size_t size) {
+    const char* p = data;
+    while (size > 0 && !w->failed) {
+        ssize_t n = write(w->fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            w->failed = 1;
+            break;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+}
+
+static void flush_records(SnapWriter* w) {
+    write_all(w, w->records, w->count * sizeof(HeapSnapRecord));
+    w->count = 0;
+}
+
+static void note_site(SnapWriter* w, uintptr_t site) {
+    if (!site) return;
+    uint32_t slot = (uint32_t)pepper_mix64(site) & (SITE_SLOTS - 1);
+    for (int probe = 0; probe < 64; probe++) {
+        if (w->sites[slot] == site) return;
+        if (!w->sites[slot]) {
+            w->sites[slot] = site;
+            return;
+        }
+        slot = (slot + 1) & (SITE_SLOTS - 1);
+    }
+}
+
+static void write_sites(SnapWriter* w) {
+    FILE* f = fdopen(w->fd, "w");
+    if (!f) {
+        w->failed = 1;
+        return;
+    }
+    for (uint32_t slot = 0; slot < SITE_SLOTS; slot++) {
+        uintptr_t addr = w->sites[slot];
+        if (!addr) continue;
+        Dl_info info;
+        if (dladdr((void*)addr, &info) && info.dli_fname) {
+            const char* module = strrchr(info.dli_fname, '/');
+            module = module ? module + 1 : info.dli_fname;
+            fprintf(f, "0x%lx %s+0x%lx %s\n", (unsigned long)addr, module,
+                    (unsigned long)(addr - (uintptr_t)info.dli_fbase),
+                    info.dli_sname ? info.dli_sname : "");
+        } else {
+            fprintf(f, "0x%lx ? \n", (unsigned long)addr);
+        }
+    }
+    if (fclose(f) != 0) w->failed = 1;
+    w->fd = -1;
+}
+
+static int compare_addresses(const void* a, const void* b) {
+    uintptr_t x = *(const uintptr_t*)a, y = *(const uintptr_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void take_snapshot(const char* reason) {
+    int saved_in_malloc = in_malloc;
+    in_malloc = 1;
+    pthread_mutex_lock(&g_snap_mutex);
+
+    uint32_t sequence = g_snapshots + 1;
+    char path[540];
+    snprintf(path, sizeof(path), "%s.%04u.snap", g_snap_path, sequence);
+
+    SnapWriter w = { -1, 0, NULL, 0, NULL };
+    size_t buffers = WRITE_RECORDS * sizeof(HeapSnapRecord) +
+                     (SITE_SLOTS + PEPPER_TRACKED_BUFFERS) * sizeof(uintptr_t);
+    void* memory = mmap(NULL, buffers, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        w.records = memory;
+        w.sites = (uintptr_t*)(w.records + WRITE_RECORDS);
+        w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (w.fd < 0) {
+        fprintf(stderr, "[PepperOpt2] Heap snapshot: cannot write %s\n", path);
+        if (memory != MAP_FAILED) munmap(memory, buffers);
+        pthread_mutex_unlock(&g_snap_mutex);
+        in_malloc = saved_in_malloc;
+        return;
+    }
+
+    HeapSnapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAP_MAGIC, 8);
+    header.record_size = sizeof(HeapSnapRecord);
+    header.sequence = sequence;
+    header.frame = pepper_frame_count();
+    header.time_ns = now_ns() - g_start_ns;
+    write_all(&w, &header, sizeof(header));
+
+    // One sorted copy of the tracked buffers, so the shard locks are not
+    // held across a scan of the tracking table for every block
+    uintptr_t* tracked = w.sites + SITE_SLOTS;
+    size_t tracked_count = pepper_buffer_list(tracked, PEPPER_TRACKED_BUFFERS);
+    qsort(tracked, tracked_count, sizeof(uintptr_t), compare_addresses);
+
+    for (int s = 0; s < SHARDS; s++) {
+        Shard* shard = &g_shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for (size_t i = 0; shard->slots && i <= shard->mask; i++) {
+            const LiveBlock* block = &shard->slots[i];
+            if (!block->ptr) continue;
+            HeapSnapRecord* r = &w.records[w.count++];
+            r->ptr = block->ptr;
+            r->site = block->site;
+            r->size = block->size;
+            r->serial = block->serial;
+            r->flags = block->size >= 16384 &&
+                       bsearch(&block->ptr, tracked, tracked_count, sizeof(uintptr_t),
+                               compare_addresses) ? HEAPSNAP_TRACKED : 0;
+            r->reserved = 0;
+            note_site(&w, block->site);
+            header.block_count++;
+            header.live_bytes += block->size;
+            if (w.count == WRITE_RECORDS) flush_records(&w);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    flush_records(&w);
+    if (!w.failed && pwrite(w.fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        w.failed = 1;
+    }
+    write_sites(&w);
+    munmap(memory, buffers);
+
+    if (w.failed) {
+        fprintf(stderr, "[PepperOpt2] Heap snapshot: write failed for %s\n", path);
+    } else {
+        g_snapshots = sequence;
+        g_last_blocks = header.block_count;
+        g_last_bytes = header.live_bytes;
+        fprintf(stderr, "[PepperOpt2] Heap snapshot: wrote %s (%s, frame %llu, %llu blocks, "
+                "%.2f MB)\n", path, reason, (unsigned long long)header.frame,
+                (unsigned long long)header.block_count, header.live_bytes / 1048576.0);
+    }
+    pthread_mutex_unlock(&g_snap_mutex);
+    in_malloc = saved_in_malloc;
+}
+
+static void snapshot_on_signal(void) {
+    take_snapshot("signal");
+}
+
+// Called by the buffer-swap hooks in pepper_optimizer_v2.c
+void pepper_heapsnap_frame(unsigned long frame) {
+    if (g_next_frame >= g_frame_count || frame < g_frames[g_next_frame]) return;
+    while (g_next_frame < g_frame_count && g_frames[g_next_frame] <= frame) g_next_frame++;
+    take_snapshot("frame");
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+static int compare_frames(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*)a;
+    unsigned long y = *(const unsigned long*)b;
+    return x < y ? -1 : x > y;
+}
+
+void pepper_heapsnap_init(void) {
+    const char* spec = pepper_env_str("PEPPER_HEAPSNAP");
+    if (!spec) return;
+    pepper_expand_path(g_snap_path, sizeof(g_snap_path), spec);
+    for (int s = 0; s < SHARDS; s++) pthread_mutex_init(&g_shards[s].lock, NULL);
+
+    const char* frames = pepper_env_str("PEPPER_HEAPSNAP_FRAMES");
+    while (frames && *frames && g_frame_count < MAX_FRAMES) {
+        char* end;
+        unsigned long frame = strtoul(frames, &end, 10);
+        if (end == frames) break;
+        if (frame > 0) g_frames[g_frame_count++] = frame;
+        frames = *end == ',' ? end + 1 : end;
+    }
+    qsort(g_frames, g_frame_count, sizeof(g_frames[0]), compare_frames);
+
+    g_start_ns = now_ns();
+    int dump_signal = pepper_on_dump_signal(snapshot_on_signal);
+    __atomic_store_n(&g_heap_snap, 1, __ATOMIC_RELEASE);
+
+    fprintf(stderr, "[PepperOpt2] Heap snapshots: ENABLED (%s.NNNN.snap", g_snap_path);
+    if (dump_signal > 0) fprintf(stderr, ", take with kill -%d %d", dump_signal, (int)getpid());
+    if (g_frame_count) fprintf(stderr, ", %d frame%s", g_frame_count, g_frame_count > 1 ? "s" : "");
+    fprintf(stderr, ")\n");
+}
+
+void pepper_heapsnap_summary(void) {
+    if (!pepper_heapsnap_enabled()) return;
+    take_snapshot("exit");
+    size_t table_bytes = 0;
+    for (int s = 0; s < SHARDS; s++) {
+        if (g_shards[s].slots) table_bytes += (g_shards[s].mask + 1) * sizeof(LiveBlock);
+    }
+    fprintf(stderr, "[PepperOpt2]   Heap snapshots: %u written, last %llu blocks (%.2f MB), "
+            "table %.2f MB\n", g_snapshots, (unsigned long long)g_last_blocks,
+            g_last_bytes / 1048576.0, table_bytes / 1048576.0);
+    if (g_dropped) {
+        fprintf(stderr, "[PepperOpt2]   Heap snapshots: %zu blocks not recorded (out of memory)\n",
+                g_dropped);
+    }
+}
@@ -0,0 +1,327 @@
+/*
+ * pepper_latency.c - Latency histograms for the interposed functions
+ *
+ * Every hook adds its own work to the call it wraps. This module measures
+ * how much: with PEPPER_LATENCY=1, each call through the glTexImage2D,
+ * malloc/calloc/realloc/free, inflate and Assets.dat fread hooks is timed
+ * from entry to return, as are the downscaler, the driver's upload inside
+ * the texture hook, and the time from one buffer swap to the next. Compare
+ * a run with PEPPER_DISABLE=1 (the hooks pass straight through) to see what
+ * the optimizer costs, and the hook against the upload to see what it adds
+ * to an upload. Under box64 the library's code is translated x86_64 like
+ * the game's, so a hook that is slow here is work moved into emulated code.
+ *
+ * Calls are timed with the CPU's counter (rdtsc, or cntvct on arm64: no
+ * syscall, no vDSO) and counted into log-linear buckets, four per power of
+ * two, so any percentile is within 19% of the true value. Each thread
+ * counts into its own slot with plain stores; no atomics or locks. A slot
+ * is kept after its thread exits and reused by the next new thread. Once
+ * all slots are taken, the remaining threads share the last one, with
+ * atomic adds.
+ *
+ * The table (calls, mean, p50, p90, p99, p99.9, max, total) is printed at
+ * exit and on PEPPER_DUMP_SIGNAL (SIGUSR2 by default). With PEPPER_STATS,
+ * the slots live in the stats segment, and tools/pepper_top shows the
+ * same table while the game runs.
+ *
+ * Environment variables:
+ *   PEPPER_LATENCY=1              - Enable (default 0)
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Histogram layout (read by tools/pepper_top.c through the stats segment)
+// ============================================================================
+
+#define LATENCY_MAGIC "PEPLAT\0\1"
+#define SUB_BUCKETS 4                 // per power of two
+#define BUCKETS 128                   // up to 2^33 ticks, seconds at any clock
+#define THREAD_SLOTS 32               // the last is shared
+#define MAX_PROBES 16
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;                   // ticks
+    uint64_t max;
+    uint64_t buckets[BUCKETS];
+} LatencyHist;
+
+typedef struct {
+    uint64_t thread;                  // TID of the owner, 0 = free
+    uint64_t reserved[7];
+    LatencyHist probes[PEPPER_LAT_COUNT];
+} LatencySlot;
+
+typedef struct {
+    char magic[8];
+    uint32_t probe_count;
+    uint32_t bucket_count;
+    uint32_t sub_buckets;
+    uint32_t slot_count;
+    uint64_t ticks_per_sec;
+    uint64_t slots_offset;            // from the start of this block
+    char timer[16];
+    char names[MAX_PROBES][24];
+} LatencyHeader;
+
+typedef struct {
+    LatencyHeader header;
+    LatencySlot slots[THREAD_SLOTS];
+} LatencyBlock;
+
+static const char* g_probe_names[PEPPER_LAT_COUNT] = {
+    [PEPPER_LAT_TEXIMAGE] = "glTexImage2D",
+    [PEPPER_LAT_UPLOAD] = "  driver upload",
+    [PEPPER_LAT_DOWNSCALE] = "  downscale",
+    [PEPPER_LAT_MALLOC] = "malloc",
+    [PEPPER_LAT_CALLOC] = "calloc",
+    [PEPPER_LAT_REALLOC] = "realloc",
+    [PEPPER_LAT_FREE] = "free",
+    [PEPPER_LAT_INFLATE] = "inflate",
+    [PEPPER_LAT_FREAD] = "fread (Assets.dat)",
+    [PEPPER_LAT_FRAME] = "frame",
+};
+
+static inline int bucket_of(uint64_t ticks) {
+    if (ticks < SUB_BUCKETS) return (int)ticks;
+    int msb = 63 - __builtin_clzll(ticks);
+    int bucket = (msb - 1) * SUB_BUCKETS + (int)((ticks >> (msb - 2)) & (SUB_BUCKETS - 1));
+    return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+// Smallest tick count that lands in `bucket`
+static uint64_t bucket_low(int bucket) {
+    if (bucket < SUB_BUCKETS) return (uint64_t)bucket;
+    int msb = bucket / SUB_BUCKETS + 1;
+    return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (msb - 2);
+}
+
+// ============================================================================
+// Recording
+// ============================================================================
+
+int g_latency = 0;
+
+// Private until pepper_latency_attach() moves it into the stats segment
+static LatencyBlock g_private;
+static LatencyBlock* g_block = &g_private;
+
+static PEPPER_TLS int t_slot = -1;
+static pthread_key_t g_thread_key;
+static uint64_t g_start_ticks = 0, g_start_ns = 0;
+
+static void thread_exit(void* arg) {
+    LatencySlot* slot = &__atomic_load_n(&g_block, __ATOMIC_ACQUIRE)->slots[(intptr_t)arg - 1];
+    t_slot = -1;
+    __atomic_store_n(&slot->thread, 0, __ATOMIC_RELEASE);
+}
+
+static int claim_slot(void) {
+    LatencyBlock* block = __atomic_load_n(&g_block, __ATOMIC_ACQUIRE);
+    uint64_t tid = (uint64_t)syscall(SYS_gettid);
+    int slot = THREAD_SLOTS - 1;
+    for (int i = 0; i < THREAD_SLOTS - 1; i++) {
+        uint64_t expected = 0;
+        if (__atomic_compare_exchange_n(&block->slots[i].thread, &expected, tid, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            slot = i;
+            break;
+        }
+    }
+    t_slot = slot;
+    if (slot < THREAD_SLOTS - 1) {
+        // pthread_setspecific may allocate; that is the library's own call, not
+        // one of the game's to time
+        int saved = in_malloc;
+        in_malloc = 1;
+        pthread_setspecific(g_thread_key, (void*)(intptr_t)(slot + 1));
+        in_malloc = saved;
+    }
+    return slot;
+}
+
+// Only the owner writes its slot; pepper_top and the summary read it
+static inline void bump(uint64_t* counter, uint64_t by) {
+    __atomic_store_n(counter, *counter + by, __ATOMIC_RELAXED);
+}
+
+void pepper_latency_add(int probe, uint64_t ticks) {
+    int slot = t_slot >= 0 ? t_slot : claim_slot();
+    LatencyHist* h = &__atomic_load_n(&g_block, __ATOMIC_ACQUIRE)->slots[slot].probes[probe];
+    int bucket = bucket_of(ticks);
+    if (slot < THREAD_SLOTS - 1) {
+        bump(&h->count, 1);
+        bump(&h->total, ticks);
+        bump(&h->buckets[bucket], 1);
+        if (ticks > h->max) __atomic_store_n(&h->max, ticks, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total, ticks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ticks > max && !__atomic_compare_exchange_n(&h->max, &max, ticks, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// ============================================================================
+// Clock
+// ============================================================================
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Ticks per second, measured against CLOCK_MONOTONIC since init (a short
+// spin at init, the whole session by exit). arm64 states its frequency.
+static uint64_t ticks_per_sec(void) {
+#if defined(__aarch64__)
+    uint64_t freq;
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+    if (freq) return freq;
+#elif !defined(__x86_64__) && !defined(__i386__)
+    return 1000000000ull;
+#endif
+    uint64_t ns = monotonic_ns() - g_start_ns;
+    uint64_t ticks = pepper_ticks() - g_start_ticks;
+    return ns ? (uint64_t)((double)ticks * 1e9 / ns) : 1000000000ull;
+}
+
+static const char* timer_name(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return "rdtsc";
+#elif defined(__aarch64__)
+    return "cntvct";
+#else
+    return "clock_gettime";
+#endif
+}
+
+// ============================================================================
+// Report
+// ============================================================================
+
+static void merge(int probe, LatencyHist* out) {
+    LatencyBlock* block = __atomic_load_n(&g_block, __ATOMIC_ACQUIRE);
+    memset(out, 0, sizeof(*out));
+    for (int s = 0; s < THREAD_SLOTS; s++) {
+        const LatencyHist* h = &block->slots[s].probes[probe];
+        out->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        out->total += __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+        if (max > out->max) out->max = max;
+        for (int b = 0; b < BUCKETS; b++) {
+            out->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Upper edge of the bucket holding the q-th quantile, capped at the max
+static uint64_t quantile(const LatencyHist* h, double q) {
+    uint64_t rank = (uint64_t)(q * h->count + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t edge = b + 1 < BUCKETS ? bucket_low(b + 1) - 1 : h->max;
+            return edge < h->max ? edge : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void print_table(const char* prefix) {
+    uint64_t tps = ticks_per_sec();
+    g_block->header.ticks_per_sec = tps;
+    double us = 1e6 / tps;
+    fprintf(stderr, "%s%-20s %9s %9s %9s %9s %9s %9s %10s %10s\n", prefix, "us", "calls", "mean",
+            "p50", "p90", "p99", "p99.9", "max", "total ms");
+    LatencyHist h;
+    for (int p = 0; p < PEPPER_LAT_COUNT; p++) {
+        merge(p, &h);
+        if (!h.count) continue;
+        fprintf(stderr, "%s%-20s %9lu %9.1f %9.1f %9.1f %9.1f %9.1f %10.1f %10.1f\n", prefix,
+                g_probe_names[p], (unsigned long)h.count, (double)h.total / h.count * us,
+                quantile(&h, 0.5) * us, quantile(&h, 0.9) * us, quantile(&h, 0.99) * us,
+                quantile(&h, 0.999) * us, h.max * us, h.total * us / 1000.0);
+    }
+}
+
+static void dump_table(void) {
+    fprintf(stderr, "[PepperOpt2] Hook latency:\n");
+    print_table("[PepperOpt2]   ");
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+size_t pepper_latency_size(void) {
+    return g_latency ? sizeof(LatencyBlock) : 0;
+}
+
+// A forked child counts on its own, in private memory again
+static void after_fork_child(void) {
+    memcpy(&g_private, g_block, sizeof(LatencyBlock));
+    g_block = &g_private;
+}
+
+void pepper_latency_attach(void* area) {
+    memcpy(area, &g_private, sizeof(LatencyBlock));
+    __atomic_store_n(&g_block, (LatencyBlock*)area, __ATOMIC_RELEASE);
+    pthread_atfork(NULL, NULL, after_fork_child);
+}
+
+void pepper_latency_init(void) {
+    if (!pepper_env_int("PEPPER_LATENCY", 0)) return;
+    if (pthread_key_create(&g_thread_key, thread_exit) != 0) {
+        fprintf(stderr, "[PepperOpt2] Latency: no thread key, disabled\n");
+        return;
+    }
+    g_start_ns = monotonic_ns();
+    g_start_ticks = pepper_ticks();
+    // Enough for a first estimate of the rdtsc rate; exit measures the session
+    while (monotonic_ns() - g_start_ns < 2000000) {
+    }
+
+    LatencyHeader* header = &g_private.header;
+    header->probe_count = PEPPER_LAT_COUNT;
+    header->bucket_count = BUCKETS;
+    header->sub_buckets = SUB_BUCKETS;
+    header->slot_count = THREAD_SLOTS;
+    header->ticks_per_sec = ticks_per_sec();
+    header->slots_offset = offsetof(LatencyBlock, slots);
+    snprintf(header->timer, sizeof(header->timer), "%s", timer_name());
+    for (int p = 0; p < PEPPER_LAT_COUNT; p++) {
+        snprintf(header->names[p], sizeof(header->names[p]), "%s", g_probe_names[p]);
+    }
+    memcpy(header->magic, LATENCY_MAGIC, 8);
+
+    int dump_signal = pepper_on_dump_signal(dump_table);
+    __atomic_store_n(&g_latency, 1, __ATOMIC_RELEASE);
+    fprintf(stderr, "[PepperOpt2] Latency: ENABLED (%s at %.1f MHz", header->timer,
+            header->ticks_per_sec / 1e6);
+    if (dump_signal > 0) fprintf(stderr, ", dump with kill -%d %d", dump_signal, (int)getpid());
+    fprintf(stderr, ")\n");
+}
+
+void pepper_latency_summary(void) {
+    if (!g_latency) return;
+    fprintf(stderr, "[PepperOpt2]   Hook latency (%s at %.1f MHz):\n", timer_name(),
+            ticks_per_sec() / 1e6);
+    print_table("[PepperOpt2]     ");
+}
@@ -0,0 +1,356 @@
+/*
+ * pepper_mallocmon.c - glibc malloc arena and fragmentation monitor
+ *
+ * glibc gives threads their own arenas (up to 8 per core), and an arena
+ * only returns memory to the system from its top. Chowdren, SDL, audio
+ * and gl4es threads can each be left holding an arena full of freed
+ * blocks that still count as RSS. With PEPPER_MALLOC_MONITOR set, a
+ * helper thread samples the allocator:
+ *   - mallinfo2() for the totals: bytes in use and free inside the heap;
+ *   - malloc_info() for each arena: its size, how much of it is free, and
+ *     its top (what a trim could return at once), which is the free bytes
+ *     not listed in any bin;
+ *   - with PEPPER_MALLOC_SMAPS=1, /proc/self/smaps for the RSS of the heap
+ *     and anonymous mappings, which is what the free bytes really cost.
+ *
+ * When the free bytes pass PEPPER_MALLOC_TRIM_PCT of the heap (and
+ * PEPPER_MALLOC_TRIM_MIN_MB), it calls malloc_trim(0), which also gives
+ * back whole free pages inside every arena, and logs the RSS it recovered.
+ * Trimmed pages still count as free, so the next trim waits until RSS has
+ * grown by PEPPER_MALLOC_TRIM_MIN_MB again.
+ * PEPPER_MALLOC_ARENA_MAX caps the number of arenas instead (M_ARENA_MAX),
+ * for when many threads are the problem.
+ *
+ * The arena table is printed at exit and on PEPPER_DUMP_SIGNAL; with
+ * PEPPER_VERBOSE=1 every sample is logged as well.
+ *
+ * Environment variables:
+ *   PEPPER_MALLOC_MONITOR=1000    - Sample every N ms (default 0 = off)
+ *   PEPPER_MALLOC_SMAPS=1         - Also sum the heap's RSS from
+ *                                   /proc/self/smaps (default 0)
+ *   PEPPER_MALLOC_TRIM_PCT=30     - malloc_trim when this share of the heap
+ *                                   is free (default 0 = never)
+ *   PEPPER_MALLOC_TRIM_MIN_MB=8   - ...and at least this much is free
+ *   PEPPER_MALLOC_ARENA_MAX=2     - Cap glibc's arenas (default: glibc's)
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+#define MAX_ARENAS 64
+#define INFO_BUFFER (256 * 1024)      // malloc_info() output, one sample
+
+static int g_monitor_ms = 0;
+static int g_read_smaps = 0;
+static int g_trim_pct = 0;
+static size_t g_trim_min_bytes = 0;
+
+// ============================================================================
+// Sampling
+// ============================================================================
+
+typedef struct {
+    int nr;
+    size_t size;              // bytes the arena holds from the system
+    size_t free;              // free chunks, the arena's top included
+    size_t top;               // returned by a trim at once
+} ArenaInfo;
+
+typedef struct {
+    size_t heap;              // sbrk'd and arena bytes (no mmapped blocks)
+    size_t mmapped;           // blocks too big for an arena
+    size_t in_use;
+    size_t free;              // free inside the heap
+    size_t top;               // every arena's top: returned by a trim at once
+    size_t rss;
+    size_t heap_rss;          // PEPPER_MALLOC_SMAPS only
+    int arena_count;
+    ArenaInfo arenas[MAX_ARENAS];
+} MallocSample;
+
+// mallinfo2() is glibc 2.33+; older glibc only has the int fields
+struct pepper_mallinfo2 {
+    size_t arena, ordblks, smblks, hblks, hblkhd, usmblks, fsmblks, uordblks, fordblks,
+           keepcost;
+};
+static struct pepper_mallinfo2 (*g_mallinfo2)(void) = NULL;
+
+static char* g_info_buffer = NULL;
+static pthread_mutex_t g_info_mutex = PTHREAD_MUTEX_INITIALIZER;  // guards g_info_buffer
+
+// Stats
+static pthread_mutex_t g_sample_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_samples = 0;
+static size_t g_peak_free = 0;
+static size_t g_peak_heap = 0;
+static int g_peak_arenas = 0;
+static size_t g_trims = 0;
+static int64_t g_trim_recovered = 0;
+static size_t g_rss_after_trim = 0;
+
+static size_t rss_bytes(void) {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long size = 0, resident = 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Rss of [heap] and of anonymous mappings (where the other arenas live)
+static size_t heap_rss_bytes(void) {
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f) return 0;
+    char line[512];
+    int counted = 0;
+    size_t total = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long kb;
+        if ((line[0] >= '0' && line[0] <= '9') || (line[0] >= 'a' && line[0] <= 'f')) {
+            // Mapping header (fields are capitalized): address perms offset dev inode [path]
+            char path[256] = "";
+            sscanf(line, "%*s %*s %*s %*s %*s %255s", path);
+            counted = !path[0] || strcmp(path, "[heap]") == 0;
+        } else if (counted && sscanf(line, "Rss: %lu kB", &kb) == 1) {
+            total += (size_t)kb * 1024;
+        }
+    }
+    fclose(f);
+    return total;
+}
+
+static void read_mallinfo(MallocSample* s) {
+    if (g_mallinfo2) {
+        struct pepper_mallinfo2 mi = g_mallinfo2();
+        s->heap = mi.arena;
+        s->mmapped = mi.hblkhd;
+        s->in_use = mi.uordblks;
+        s->free = mi.fordblks;
+        s->top = mi.keepcost;
+    } else {
+        // Wraps at 4 GB, which a handheld does not reach
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+        struct mallinfo mi = mallinfo();
+#pragma GCC diagnostic pop
+        s->heap = (unsigned)mi.arena;
+        s->mmapped = (unsigned)mi.hblkhd;
+        s->in_use = (unsigned)mi.uordblks;
+        s->free = (unsigned)mi.fordblks;
+        s->top = (unsigned)mi.keepcost;
+    }
+}
+
+// Per-arena sizes from malloc_info()'s XML: <heap nr="N"> <sizes> <size
+// total=/>... <unsorted total=/> </sizes> <total type="fast|rest" size=/>
+// ... <system type="current" size=/> ... </heap>. The fast and rest totals
+// count the top chunk, the bins do not.
+static void read_arenas(MallocSample* s) {
+    s->arena_count = 0;
+    pthread_mutex_lock(&g_info_mutex);
+    FILE* f = fmemopen(g_info_buffer, INFO_BUFFER - 1, "w");
+    long length = 0;
+    if (f) {
+        malloc_info(0, f);
+        length = ftell(f);
+        fclose(f);
+    }
+    if (length < 0) length = 0;
+    g_info_buffer[length < INFO_BUFFER - 1 ? length : INFO_BUFFER - 1] = '\0';
+
+    ArenaInfo* arena = NULL;
+    size_t binned = 0, tops = 0;
+    for (char* line = g_info_buffer; line && *line; ) {
+        char* next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        int nr;
+        size_t size;
+        if (sscanf(line, "<heap nr=\"%d\">", &nr) == 1) {
+            arena = s->arena_count < MAX_ARENAS ? &s->arenas[s->arena_count++] : NULL;
+            if (arena) {
+                memset(arena, 0, sizeof(*arena));
+                arena->nr = nr;
+            }
+            binned = 0;
+        } else if (strncmp(line, "</heap>", 7) == 0) {
+            if (arena) {
+                arena->top = arena->free > binned ? arena->free - binned : 0;
+                tops += arena->top;
+            }
+            arena = NULL;
+        } else if (arena && (sscanf(line, " <size from=\"%*u\" to=\"%*u\" total=\"%zu\"", &size) == 1 ||
+                             sscanf(line, " <unsorted from=\"%*u\" to=\"%*u\" total=\"%zu\"", &size) == 1)) {
+            binned += size;
+        } else if (arena && (sscanf(line, "<total type=\"fast\" count=\"%*u\" size=\"%zu\"", &size) == 1 ||
+                             sscanf(line, "<total type=\"rest\" count=\"%*u\" size=\"%zu\"", &size) == 1)) {
+            arena->free += size;
+        } else if (arena && sscanf(line, "<system type=\"current\" size=\"%zu\"", &size) == 1) {
+            arena->size = size;
+        }
+        line = next;
+    }
+    // mallinfo's keepcost only covers the main arena
+    if (s->arena_count > 0) s->top = tops;
+    pthread_mutex_unlock(&g_info_mutex);
+}
+
+static void take_sample(MallocSample* s) {
+    memset(s, 0, sizeof(*s));
+    read_mallinfo(s);
+    read_arenas(s);
+    s->rss = rss_bytes();
+    if (g_read_smaps) s->heap_rss = heap_rss_bytes();
+}
+
+static double mb(size_t bytes) {
+    return bytes / 1048576.0;
+}
+
+static void maybe_trim(const MallocSample* s) {
+    if (!g_trim_pct || s->free < g_trim_min_bytes) return;
+    if (s->free * 100 < (s->heap ? s->heap : 1) * (size_t)g_trim_pct) return;
+    // Trimmed pages still count as free, so wait for RSS to grow again
+    if (s->rss < g_rss_after_trim + g_trim_min_bytes) return;
+    size_t before = rss_bytes();
+    malloc_trim(0);
+    size_t after = rss_bytes();
+    g_rss_after_trim = after;
+    int64_t recovered = (int64_t)before - (int64_t)after;
+    pthread_mutex_lock(&g_sample_mutex);
+    g_trims++;
+    g_trim_recovered += recovered;
+    pthread_mutex_unlock(&g_sample_mutex);
+    pepper_stat_add(PEPPER_STAT_MALLOC_TRIMS, 1);
+    fprintf(stderr, "[PepperOpt2] malloc_trim: %.1f MB of %.1f MB heap free, RSS %.1f -> %.1f MB "
+            "(%+.1f MB)\n", mb(s->free), mb(s->heap), mb(before), mb(after), -recovered / 1048576.0);
+}
+
+static void* monitor_main(void* arg) {
+    (void)arg;
+    in_malloc = 1;  // malloc_info's FILE and our /proc reads
+    static MallocSample sample;
+    for (;;) {
+        take_sample(&sample);
+        pthread_mutex_lock(&g_sample_mutex);
+        g_samples++;
+        if (sample.free > g_peak_free) g_peak_free = sample.free;
+        if (sample.heap > g_peak_heap) g_peak_heap = sample.heap;
+        if (sample.arena_count > g_peak_arenas) g_peak_arenas = sample.arena_count;
+        pthread_mutex_unlock(&g_sample_mutex);
+        pepper_stat_set(PEPPER_STAT_MALLOC_FREE_BYTES, sample.free);
+
+        if (g_verbose) {
+            fprintf(stderr, "[PepperOpt2] malloc: %d arenas, heap %.1f MB (%.1f in use, %.1f free, "
+                    "top %.1f), mmapped %.1f MB, RSS %.1f MB", sample.arena_count, mb(sample.heap),
+                    mb(sample.in_use), mb(sample.free), mb(sample.top), mb(sample.mmapped),
+                    mb(sample.rss));
+            if (g_read_smaps) fprintf(stderr, ", heap RSS %.1f MB", mb(sample.heap_rss));
+            fprintf(stderr, "\n");
+        }
+        maybe_trim(&sample);
+
+        struct timespec delay = { g_monitor_ms / 1000, (g_monitor_ms % 1000) * 1000000L };
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+// ============================================================================
+// Report
+// ============================================================================
+
+static void print_arenas(const char* prefix, const MallocSample* s) {
+    fprintf(stderr, "%s%6s %10s %10s %10s %6s %10s\n", prefix, "arena", "size MB", "in use MB",
+            "free MB", "free", "top MB");
+    for (int i = 0; i < s->arena_count; i++) {
+        const ArenaInfo* a = &s->arenas[i];
+        size_t free = a->free < a->size ? a->free : a->size;
+        fprintf(stderr, "%s%6d %10.2f %10.2f %10.2f %5.0f%% %10.2f\n", prefix, a->nr, mb(a->size),
+                mb(a->size - free), mb(free), a->size ? 100.0 * free / a->size : 0.0, mb(a->top));
+    }
+    fprintf(stderr, "%sheap %.2f MB: %.2f in use, %.2f free (%.2f at arena tops); "
+            "mmapped %.2f MB; RSS %.2f MB", prefix, mb(s->heap), mb(s->in_use), mb(s->free),
+            mb(s->top), mb(s->mmapped), mb(s->rss));
+    if (g_read_smaps) fprintf(stderr, " (heap %.2f MB)", mb(s->heap_rss));
+    fprintf(stderr, "\n");
+}
+
+static void dump_arenas(void) {
+    MallocSample sample;
+    take_sample(&sample);
+    fprintf(stderr, "[PepperOpt2] malloc arenas:\n");
+    print_arenas("[PepperOpt2]   ", &sample);
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+int pepper_mallocmon_enabled(void) {
+    return g_monitor_ms > 0;
+}
+
+void pepper_mallocmon_init(void) {
+    int arena_max = pepper_env_int("PEPPER_MALLOC_ARENA_MAX", 0);
+    if (arena_max > 0) {
+        mallopt(M_ARENA_MAX, arena_max);
+        fprintf(stderr, "[PepperOpt2] malloc: at most %d arenas\n", arena_max);
+    }
+
+    int ms = pepper_env_int("PEPPER_MALLOC_MONITOR", 0);
+    if (ms <= 0) return;
+    g_read_smaps = pepper_env_int("PEPPER_MALLOC_SMAPS", 0);
+    g_trim_pct = pepper_env_int("PEPPER_MALLOC_TRIM_PCT", 0);
+    g_trim_min_bytes = (size_t)pepper_env_int("PEPPER_MALLOC_TRIM_MIN_MB", 8) << 20;
+    g_mallinfo2 = (struct pepper_mallinfo2 (*)(void))dlsym(RTLD_DEFAULT, "mallinfo2");
+
+    in_malloc = 1;
+    g_info_buffer = malloc(INFO_BUFFER);
+    in_malloc = 0;
+    if (!g_info_buffer) return;
+    g_monitor_ms = ms;
+    int dump_signal = pepper_on_dump_signal(dump_arenas);
+
+    fprintf(stderr, "[PepperOpt2] malloc monitor: ENABLED (every %d ms", ms);
+    if (g_trim_pct) fprintf(stderr, ", trim at %d%% free", g_trim_pct);
+    if (dump_signal > 0) fprintf(stderr, ", arenas with kill -%d %d", dump_signal, (int)getpid());
+    fprintf(stderr, ")\n");
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, monitor_main, NULL) != 0) {
+        fprintf(stderr, "[PepperOpt2] malloc monitor: no thread, reporting at exit only\n");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+void pepper_mallocmon_summary(void) {
+    if (!pepper_mallocmon_enabled()) return;
+    MallocSample sample;
+    in_malloc = 1;
+    take_sample(&sample);
+    in_malloc = 0;
+    pthread_mutex_lock(&g_sample_mutex);
+    fprintf(stderr, "[PepperOpt2]   malloc: %zu samples, peak %d arenas, peak heap %.2f MB, "
+            "peak free %.2f MB\n", g_samples, g_peak_arenas, mb(g_peak_heap), mb(g_peak_free));
+    if (g_trim_pct) {
+        fprintf(stderr, "[PepperOpt2]   malloc_trim: %zu calls, %.2f MB of RSS recovered\n",
+                g_trims, g_trim_recovered / 1048576.0);
+    }
+    pthread_mutex_unlock(&g_sample_mutex);
+    print_arenas("[PepperOpt2]     ", &sample);
+}
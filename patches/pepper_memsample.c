@@ -0,0 +1,199 @@
+/*
+ * pepper_memsample.c - RSS/PSS timeline, on the allocation trace's clock
+ *
+ * An htop screenshot or the final OOM line says how much memory the game
+ * used, not which load phase pushed it over the device's limit. With
+ * PEPPER_MEM_SAMPLE set, a helper thread reads the process's memory at a
+ * fixed rate:
+ *   - /proc/self/status: RSS, its anonymous share, swap, and the peak RSS;
+ *   - /proc/self/smaps_rollup: PSS, which splits shared pages (libraries,
+ *     the box64 and gl4es mappings) between the processes using them.
+ * With PEPPER_ALLOC_TRACE set, every sample is also written into the trace,
+ * next to the allocations and the glTexImage2D calls, and
+ * tools/mem_timeline.c shows them together. PEPPER_ALLOC_TRACE_CALLS=0
+ * keeps only the textures and the samples there, for normal play.
+ *
+ * The game's threads are not touched: nothing is added to the malloc or
+ * texture path. smaps_rollup walks every mapping, which costs more the
+ * more the process maps; the summary shows the mean time a sample took.
+ *
+ * Environment variables:
+ *   PEPPER_MEM_SAMPLE=100         - Sample every N ms (default 0 = off)
+ *   PEPPER_MEM_SAMPLE_PSS=0       - Skip smaps_rollup, RSS only (default 1)
+ *   PEPPER_MEM_LIMIT_MB=900       - Log when RSS first passes this, with the
+ *                                   time and frame (default 0 = off)
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static int g_sample_ms = 0;
+static int g_read_pss = 1;
+static size_t g_limit_bytes = 0;
+static uint64_t g_start_ns = 0;
+
+// Stats, written by the sampler thread only
+static size_t g_samples = 0;
+static uint64_t g_sample_ns = 0;      // time spent reading /proc
+static size_t g_peak_rss = 0, g_peak_pss = 0, g_peak_swap = 0;
+static uint64_t g_peak_rss_ns = 0, g_peak_pss_ns = 0;
+static uint64_t g_limit_ns = 0;       // when RSS passed the limit, 0 = not yet
+static size_t g_hwm = 0;              // VmHWM at the last sample
+
+typedef struct {
+    size_t rss, anon, swap, hwm;
+    size_t pss;
+} MemSample;
+
+// ============================================================================
+// Sampling
+// ============================================================================
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Reads a small /proc file into `buf` without stdio (and its malloc)
+static int read_proc(const char* path, char* buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    size_t used = 0;
+    ssize_t n;
+    while (used < size - 1 && (n = read(fd, buf + used, size - 1 - used)) > 0) used += (size_t)n;
+    close(fd);
+    buf[used] = '\0';
+    return used > 0;
+}
+
+// Value of a "Key:   1234 kB" line, in bytes
+static size_t field_kb(const char* buf, const char* key) {
+    size_t len = strlen(key);
+    for (const char* line = buf; line; line = strchr(line, '\n')) {
+        if (*line == '\n') line++;
+        if (strncmp(line, key, len) == 0 && line[len] == ':') {
+            return (size_t)strtoull(line + len + 1, NULL, 10) * 1024;
+        }
+    }
+    return 0;
+}
+
+static void take_sample(MemSample* s) {
+    char buf[4096];
+    memset(s, 0, sizeof(*s));
+    if (read_proc("/proc/self/status", buf, sizeof(buf))) {
+        s->rss = field_kb(buf, "VmRSS");
+        s->anon = field_kb(buf, "RssAnon");
+        s->swap = field_kb(buf, "VmSwap");
+        s->hwm = field_kb(buf, "VmHWM");
+    }
+    if (g_read_pss && read_proc("/proc/self/smaps_rollup", buf, sizeof(buf))) {
+        s->pss = field_kb(buf, "Pss");
+    }
+}
+
+static double mb(size_t bytes) {
+    return bytes / 1048576.0;
+}
+
+static void* sampler_main(void* arg) {
+    (void)arg;
+    in_malloc = 1;
+    MemSample s;
+    for (;;) {
+        uint64_t start = monotonic_ns();
+        take_sample(&s);
+        uint64_t now = monotonic_ns();
+        g_sample_ns += now - start;
+        g_samples++;
+        pepper_alloctrace_memory(s.rss, s.pss, s.swap, s.anon);
+        pepper_stat_set(PEPPER_STAT_RSS, s.rss);
+        if (g_read_pss) pepper_stat_set(PEPPER_STAT_PSS, s.pss);
+
+        uint64_t at = start - g_start_ns;
+        g_hwm = s.hwm;
+        if (s.rss > g_peak_rss) {
+            g_peak_rss = s.rss;
+            g_peak_rss_ns = at;
+        }
+        if (s.pss > g_peak_pss) {
+            g_peak_pss = s.pss;
+            g_peak_pss_ns = at;
+        }
+        if (s.swap > g_peak_swap) g_peak_swap = s.swap;
+        if (g_limit_bytes && !g_limit_ns && s.rss >= g_limit_bytes) {
+            g_limit_ns = at ? at : 1;
+            fprintf(stderr, "[PepperOpt2] Memory: RSS %.1f MB passed %.0f MB at %.2f s, frame %lu\n",
+                    mb(s.rss), mb(g_limit_bytes), at / 1e9, pepper_frame_count());
+        }
+        if (g_verbose) {
+            fprintf(stderr, "[PepperOpt2] Memory: %.2f s RSS %.1f MB (anon %.1f) PSS %.1f MB "
+                    "swap %.1f MB\n", at / 1e9, mb(s.rss), mb(s.anon), mb(s.pss), mb(s.swap));
+        }
+
+        struct timespec delay = { g_sample_ms / 1000, (g_sample_ms % 1000) * 1000000L };
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+int pepper_memsample_enabled(void) {
+    return g_sample_ms > 0;
+}
+
+void pepper_memsample_init(void) {
+    int ms = pepper_env_int("PEPPER_MEM_SAMPLE", 0);
+    if (ms <= 0) return;
+    g_read_pss = pepper_env_int("PEPPER_MEM_SAMPLE_PSS", 1);
+    g_limit_bytes = (size_t)pepper_env_int("PEPPER_MEM_LIMIT_MB", 0) << 20;
+    g_start_ns = monotonic_ns();
+    g_sample_ms = ms;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sampler_main, NULL) != 0) {
+        fprintf(stderr, "[PepperOpt2] Memory sampler: no thread, disabled\n");
+        g_sample_ms = 0;
+        return;
+    }
+    pthread_detach(thread);
+    fprintf(stderr, "[PepperOpt2] Memory sampler: ENABLED (every %d ms%s%s)\n", ms,
+            g_read_pss ? ", with PSS" : "",
+            pepper_alloctrace_enabled() ? ", into the alloc trace" : "");
+}
+
+void pepper_memsample_summary(void) {
+    if (!pepper_memsample_enabled() || !g_samples) return;
+    fprintf(stderr, "[PepperOpt2]   Memory: %zu samples (%.0f us each), peak RSS %.1f MB "
+            "at %.2f s (high-water %.1f MB)\n", g_samples, g_sample_ns / 1e3 / g_samples,
+            mb(g_peak_rss), g_peak_rss_ns / 1e9, mb(g_hwm));
+    if (g_read_pss || g_peak_swap) {
+        fprintf(stderr, "[PepperOpt2]   Memory: peak PSS %.1f MB at %.2f s, peak swap %.1f MB\n",
+                mb(g_peak_pss), g_peak_pss_ns / 1e9, mb(g_peak_swap));
+    }
+    if (g_limit_bytes) {
+        if (g_limit_ns) {
+            fprintf(stderr, "[PepperOpt2]   Memory: passed %.0f MB at %.2f s\n",
+                    mb(g_limit_bytes), g_limit_ns / 1e9);
+        } else {
+            fprintf(stderr, "[PepperOpt2]   Memory: stayed under %.0f MB\n", mb(g_limit_bytes));
+        }
+    }
+}
@@ -6,8 +6,44 @@
  * 2. Hook glTexImage2D to downscale textures
  * 3. After uploading to GPU, FREE the original buffer to reclaim RAM
  * 
+ * Optional modules (see each file's header for its variables, all off
+ * by default):
+ *   pepper_assetio.c  - Assets.dat reads served from an mmap (PEPPER_ASSET_MMAP)
+ *   pepper_prefetch.c - Read-ahead thread for Assets.dat (PEPPER_PREFETCH)
+ *   pepper_zlib.c     - libdeflate one-shot inflate (PEPPER_FAST_INFLATE)
+ *   pepper_stage.c    - Images inflated ahead of the loader (PEPPER_STAGE)
+ *   pepper_sidecar.c  - Images decoded from an LZ4 sidecar (PEPPER_SIDECAR)
+ *   pepper_texcache.c - Downscaled textures kept on disk (PEPPER_TEXCACHE)
+ *   pepper_rawcache.c - Decoded images backed by a cache file (PEPPER_RAWCACHE)
+ *   pepper_arena.c    - Texture-sized allocations in their own arena (PEPPER_ARENA)
+ *   pepper_slab.c     - Slab allocator for everything smaller (PEPPER_SLAB)
+ *   pepper_alloctrace.c - Binary trace of every allocation (PEPPER_ALLOC_TRACE)
+ *   pepper_heapprof.c - Sampled heap profile per call stack (PEPPER_HEAPPROF)
+ *   pepper_sizehist.c - Histograms by allocation size class (PEPPER_SIZEHIST)
+ *   pepper_heapsnap.c - Snapshots of every live allocation (PEPPER_HEAPSNAP)
+ *   pepper_mallocmon.c - glibc arena monitor and malloc_trim (PEPPER_MALLOC_MONITOR)
+ *   pepper_memsample.c - RSS/PSS timeline (PEPPER_MEM_SAMPLE)
+ *   pepper_stats.c    - Counters in shared memory for pepper_top (PEPPER_STATS)
+ *   pepper_latency.c  - Latency histograms for every hook (PEPPER_LATENCY)
+ *   pepper_perf.c     - CPU counters per texture hook phase (PEPPER_PERF)
+ *   pepper_timeline.c - Startup timeline as trace-event JSON (PEPPER_TIMELINE)
+ * 
  * Build:
- *   gcc -shared -fPIC -O3 -o libpepperopt2.so pepper_optimizer_v2.c -ldl -lpthread -lm
+ *   gcc -shared -fPIC -O3 -o libpepperopt2.so pepper_optimizer_v2.c pepper_assetio.c \
+ *       pepper_prefetch.c pepper_zlib.c pepper_stage.c pepper_sidecar.c \
+ *       pepper_texcache.c pepper_rawcache.c pepper_arena.c pepper_slab.c \
+ *       pepper_alloctrace.c pepper_heapprof.c pepper_sizehist.c pepper_heapsnap.c \
+ *       pepper_mallocmon.c pepper_memsample.c pepper_stats.c \
+ *       pepper_latency.c pepper_perf.c pepper_timeline.c -ldl -lpthread -lm
+ * 
+ * Build (with libdeflate for the fast inflate path, LZ4 for the sidecar):
+ *   gcc -shared -fPIC -O3 -DUSE_LIBDEFLATE -DUSE_LZ4 -o libpepperopt2.so \
+ *       pepper_optimizer_v2.c pepper_assetio.c pepper_prefetch.c pepper_zlib.c \
+ *       pepper_stage.c pepper_sidecar.c pepper_texcache.c pepper_rawcache.c \
+ *       pepper_arena.c pepper_slab.c pepper_alloctrace.c pepper_heapprof.c \
+ *       pepper_sizehist.c pepper_heapsnap.c pepper_mallocmon.c pepper_memsample.c \
+ *       pepper_stats.c pepper_latency.c pepper_perf.c pepper_timeline.c -ldeflate \
+ *       -llz4 -ldl -lpthread -lm
  * 
  * Usage:
  *   LD_PRELOAD=/path/to/libpepperopt2.so ./Chowdren
@@ -15,12 +51,19 @@
 
 #define _GNU_SOURCE
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <math.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
 
 // ============================================================================
 // Configuration
@@ -28,25 +71,89 @@
 
 static float g_scale_factor = 0.5f;
 static int g_min_size = 64;
-static int g_verbose = 0;
-static int g_disabled = 0;
+int g_verbose = 0;
+int g_disabled = 0;
 static int g_aggressive_free = 1;  // NEW: Free buffers after GPU upload
 
-// Stats
-static size_t g_original_bytes = 0;
-static size_t g_optimized_bytes = 0;
-static size_t g_freed_bytes = 0;
-static int g_texture_count = 0;
-static int g_scaled_count = 0;
-static int g_freed_count = 0;
-
 static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+void pepper_expand_path(char* out, size_t cap, const char* spec) {
+    const char* pid_at = strstr(spec, "%p");
+    if (pid_at) {
+        snprintf(out, cap, "%.*s%d%s", (int)(pid_at - spec), spec, (int)getpid(), pid_at + 2);
+    } else {
+        snprintf(out, cap, "%s", spec);
+    }
+}
+
+// ============================================================================
+// Dump signal - diagnostics modules write their reports on PEPPER_DUMP_SIGNAL
+// ============================================================================
+
+#define MAX_DUMP_CALLBACKS 8
+
+static void (*g_dump_callbacks[MAX_DUMP_CALLBACKS])(void);
+static int g_dump_callback_count = 0;
+static int g_dump_signal = -1;      // -1 = not set up yet
+static int g_dump_pipe[2] = { -1, -1 };
+
+// Only a write here; the helper thread does the work
+static void on_dump_signal(int sig) {
+    (void)sig;
+    int saved = errno;
+    char byte = 1;
+    if (write(g_dump_pipe[1], &byte, 1) < 0) {
+        // Pipe full: a dump is already pending
+    }
+    errno = saved;
+}
+
+static void* dump_main(void* arg) {
+    (void)arg;
+    in_malloc = 1;  // this thread's allocations are the library's own
+    for (;;) {
+        char bytes[16];
+        ssize_t n = read(g_dump_pipe[0], bytes, sizeof(bytes));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return NULL;
+        for (int i = 0; i < __atomic_load_n(&g_dump_callback_count, __ATOMIC_ACQUIRE); i++) {
+            g_dump_callbacks[i]();
+        }
+    }
+}
+
+int pepper_on_dump_signal(void (*callback)(void)) {
+    if (g_dump_signal < 0) {
+        g_dump_signal = pepper_env_int("PEPPER_DUMP_SIGNAL", SIGUSR2);
+        pthread_t thread;
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_dump_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (g_dump_signal > 0 &&
+            (pipe2(g_dump_pipe, O_CLOEXEC | O_NONBLOCK) != 0 ||
+             fcntl(g_dump_pipe[0], F_SETFL, 0) != 0 ||
+             pthread_create(&thread, NULL, dump_main, NULL) != 0 ||
+             sigaction(g_dump_signal, &sa, NULL) != 0)) {
+            fprintf(stderr, "[PepperOpt2] Cannot watch signal %d, diagnostics at exit only\n",
+                    g_dump_signal);
+            g_dump_signal = 0;
+        } else if (g_dump_signal > 0) {
+            pthread_detach(thread);
+        }
+    }
+    if (g_dump_signal == 0 || g_dump_callback_count == MAX_DUMP_CALLBACKS) return 0;
+    g_dump_callbacks[g_dump_callback_count] = callback;
+    __atomic_store_n(&g_dump_callback_count, g_dump_callback_count + 1, __ATOMIC_RELEASE);
+    return g_dump_signal;
+}
+
 // ============================================================================
 // Buffer tracking for aggressive freeing
 // ============================================================================
 
-#define MAX_TRACKED_BUFFERS 20000
+#define MAX_TRACKED_BUFFERS PEPPER_TRACKED_BUFFERS
 
 typedef struct {
     void* ptr;
@@ -98,6 +205,16 @@ static void mark_freed(const void* ptr) {
     pthread_mutex_unlock(&g_buffer_mutex);
 }
 
+size_t pepper_buffer_list(uintptr_t* out, size_t cap) {
+    size_t count = 0;
+    pthread_mutex_lock(&g_buffer_mutex);
+    for (int i = 0; i < g_buffer_count && count < cap; i++) {
+        if (!g_buffers[i].freed) out[count++] = (uintptr_t)g_buffers[i].ptr;
+    }
+    pthread_mutex_unlock(&g_buffer_mutex);
+    return count;
+}
+
 // ============================================================================
 // OpenGL types
 // ============================================================================
@@ -119,13 +236,14 @@ static void* (*real_malloc)(size_t size) = NULL;
 static void (*real_free)(void* ptr) = NULL;
 static void* (*real_realloc)(void* ptr, size_t size) = NULL;
 static void* (*real_calloc)(size_t nmemb, size_t size) = NULL;
+static size_t (*real_malloc_usable_size)(void* ptr) = NULL;
 
 static void (*real_glTexImage2D)(GLenum target, GLint level, GLint internalformat,
                                   GLsizei width, GLsizei height, GLint border,
                                   GLenum format, GLenum type, const void *data) = NULL;
 
 // Flag to prevent recursion in malloc hook
-static __thread int in_malloc = 0;
+__thread int in_malloc = 0;
 
 // ============================================================================
 // Downscaler
@@ -191,6 +309,7 @@ static void init_optimizer() {
     real_free = dlsym(RTLD_NEXT, "free");
     real_realloc = dlsym(RTLD_NEXT, "realloc");
     real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
     
     fprintf(stderr, "[PepperOpt2] ========================================\n");
     fprintf(stderr, "[PepperOpt2] Aggressive Memory Optimizer Loaded\n");
@@ -201,6 +320,29 @@ static void init_optimizer() {
     if (g_disabled) {
         fprintf(stderr, "[PepperOpt2] DISABLED (passthrough mode)\n");
     }
+    pepper_latency_init();
+    pepper_perf_init();
+    pepper_timeline_init();
+    pepper_stats_init();
+    pepper_alloctrace_init();
+    pepper_heapprof_init();
+    pepper_sizehist_init();
+    pepper_heapsnap_init();
+    pepper_mallocmon_init();
+    pepper_memsample_init();
+    pepper_arena_init();
+    pepper_slab_init();
+    pepper_prefetch_init();
+    pepper_stage_init();
+    pepper_sidecar_init();
+    pepper_rawcache_init();
+    pepper_assetio_init();
+    pepper_zlib_init();
+
+    // Everything that changes the downscaled pixels goes into the policy
+    char policy[96];
+    snprintf(policy, sizeof(policy), "bilinear-rgba8 scale=%.6f min=%d", g_scale_factor, g_min_size);
+    pepper_texcache_init(policy);
     fprintf(stderr, "[PepperOpt2] ========================================\n");
 }
 
@@ -208,24 +350,73 @@ __attribute__((destructor))
 static void cleanup_optimizer() {
     pthread_mutex_lock(&g_mutex);
     
-    float saved_mb = (g_original_bytes - g_optimized_bytes) / 1024.0f / 1024.0f;
-    float freed_mb = g_freed_bytes / 1024.0f / 1024.0f;
+    uint64_t original_bytes = pepper_stat_get(PEPPER_STAT_ORIGINAL_BYTES);
+    uint64_t optimized_bytes = pepper_stat_get(PEPPER_STAT_OPTIMIZED_BYTES);
+    float saved_mb = (original_bytes - optimized_bytes) / 1024.0f / 1024.0f;
+    float freed_mb = pepper_stat_get(PEPPER_STAT_FREED_BYTES) / 1024.0f / 1024.0f;
     
     fprintf(stderr, "[PepperOpt2] ========================================\n");
     fprintf(stderr, "[PepperOpt2] Session Summary:\n");
-    fprintf(stderr, "[PepperOpt2]   Total textures: %d\n", g_texture_count);
-    fprintf(stderr, "[PepperOpt2]   Scaled textures: %d\n", g_scaled_count);
+    fprintf(stderr, "[PepperOpt2]   Total textures: %d\n",
+            (int)pepper_stat_get(PEPPER_STAT_TEXTURES));
+    fprintf(stderr, "[PepperOpt2]   Scaled textures: %d\n",
+            (int)pepper_stat_get(PEPPER_STAT_SCALED));
     fprintf(stderr, "[PepperOpt2]   Original size: %.2f MB\n", 
-            g_original_bytes / 1024.0f / 1024.0f);
+            original_bytes / 1024.0f / 1024.0f);
     fprintf(stderr, "[PepperOpt2]   Optimized size: %.2f MB\n", 
-            g_optimized_bytes / 1024.0f / 1024.0f);
+            optimized_bytes / 1024.0f / 1024.0f);
     fprintf(stderr, "[PepperOpt2]   GPU memory saved: %.2f MB\n", saved_mb);
-    fprintf(stderr, "[PepperOpt2]   Buffers freed: %d (%.2f MB)\n", g_freed_count, freed_mb);
+    fprintf(stderr, "[PepperOpt2]   Buffers freed: %d (%.2f MB)\n",
+            (int)pepper_stat_get(PEPPER_STAT_FREED), freed_mb);
+    pepper_prefetch_summary();
+    pepper_assetio_summary();
+    pepper_zlib_summary();
+    pepper_stage_summary();
+    pepper_sidecar_summary();
+    pepper_texcache_summary();
+    pepper_rawcache_summary();
+    pepper_arena_summary();
+    pepper_slab_summary();
+    pepper_alloctrace_summary();
+    pepper_heapprof_summary();
+    pepper_sizehist_summary();
+    pepper_heapsnap_summary();
+    pepper_mallocmon_summary();
+    pepper_memsample_summary();
+    pepper_latency_summary();
+    pepper_perf_summary();
+    pepper_timeline_summary();
+    pepper_stats_summary();
     fprintf(stderr, "[PepperOpt2] ========================================\n");
     
     pthread_mutex_unlock(&g_mutex);
 }
 
+// ============================================================================
+// Own allocators (pepper_arena.c, pepper_slab.c) - NULL/0/-1 when not theirs
+// ============================================================================
+
+static void* own_alloc(size_t size) {
+    if (in_malloc) return NULL;  // the library's own allocations stay in glibc
+    void* ptr = pepper_arena_alloc(size, 0);
+    return ptr ? ptr : pepper_slab_alloc(size);
+}
+
+static size_t own_size(const void* ptr) {
+    size_t size = pepper_arena_size(ptr);
+    return size ? size : pepper_slab_size(ptr);
+}
+
+// malloc_usable_size() without the trip through the exported hook
+static inline size_t block_size(void* ptr) {
+    size_t size = own_size(ptr);
+    return size ? size : real_malloc_usable_size(ptr);
+}
+
+static int own_free(void* ptr) {
+    return (pepper_arena_free(ptr) == 0 || pepper_slab_free(ptr) == 0) ? 0 : -1;
+}
+
 // ============================================================================
 // malloc hook - track large allocations
 // ============================================================================
@@ -234,8 +425,17 @@ void* malloc(size_t size) {
     if (!real_malloc) {
         real_malloc = dlsym(RTLD_NEXT, "malloc");
     }
+    uint64_t lat = pepper_latency_start();
     
-    void* ptr = real_malloc(size);
+    // Texture-sized blocks go to the arena, small ones to the slabs, when
+    // those are on and have room
+    void* ptr = own_alloc(size);
+    if (!ptr) ptr = real_malloc(size);
+    if (g_alloc_trace && ptr) pepper_alloctrace_record(PEPPER_ALLOC_MALLOC, ptr, NULL, size, 0,
+                                      __builtin_return_address(0));
+    if (g_heap_prof && ptr) pepper_heapprof_alloc(ptr, size);
+    if (g_size_hist && ptr && !in_malloc) pepper_sizehist_alloc(ptr, block_size(ptr));
+    if (g_heap_snap && ptr) pepper_heapsnap_alloc(ptr, size, __builtin_return_address(0));
     
     // Track large allocations (likely texture buffers)
     // Texture buffers are typically width*height*4 bytes
@@ -246,6 +446,7 @@ void* malloc(size_t size) {
         in_malloc = 0;
     }
     
+    pepper_latency_record(PEPPER_LAT_MALLOC, lat);
     return ptr;
 }
 
@@ -253,16 +454,30 @@ void* calloc(size_t nmemb, size_t size) {
     if (!real_calloc) {
         real_calloc = dlsym(RTLD_NEXT, "calloc");
     }
+    uint64_t lat = pepper_latency_start();
     
-    void* ptr = real_calloc(nmemb, size);
+    // The arena clears only reused pages; slab objects are always cleared
+    size_t total;
+    void* ptr = NULL;
+    if (!in_malloc && !__builtin_mul_overflow(nmemb, size, &total)) {
+        ptr = pepper_arena_alloc(total, 1);
+        if (!ptr && (ptr = pepper_slab_alloc(total))) memset(ptr, 0, total);
+    }
+    if (!ptr) ptr = real_calloc(nmemb, size);
     
-    size_t total = nmemb * size;
+    total = nmemb * size;
+    if (g_alloc_trace && ptr) pepper_alloctrace_record(PEPPER_ALLOC_CALLOC, ptr, NULL, total, 0,
+                                      __builtin_return_address(0));
+    if (g_heap_prof && ptr) pepper_heapprof_alloc(ptr, total);
+    if (g_size_hist && ptr && !in_malloc) pepper_sizehist_alloc(ptr, block_size(ptr));
+    if (g_heap_snap && ptr) pepper_heapsnap_alloc(ptr, total, __builtin_return_address(0));
     if (!in_malloc && ptr && total >= 16384 && g_aggressive_free && !g_disabled) {
         in_malloc = 1;
         track_buffer(ptr, total);
         in_malloc = 0;
     }
     
+    pepper_latency_record(PEPPER_LAT_CALLOC, lat);
     return ptr;
 }
 
@@ -270,8 +485,47 @@ void* realloc(void* old_ptr, size_t size) {
     if (!real_realloc) {
         real_realloc = dlsym(RTLD_NEXT, "realloc");
     }
+    uint64_t lat = pepper_latency_start();
     
-    void* ptr = real_realloc(old_ptr, size);
+    // Arena and slab blocks are resized here; glibc blocks stay with glibc
+    uint64_t called = g_alloc_trace ? pepper_alloctrace_clock() : 0;
+    size_t old_usable = g_size_hist && old_ptr && !in_malloc ? block_size(old_ptr) : 0;
+    void* ptr;
+    size_t old_size = own_size(old_ptr);
+    if (!old_size) {
+        ptr = old_ptr ? NULL : own_alloc(size);
+        if (!ptr) ptr = real_realloc(old_ptr, size);
+    } else if (size == 0) {
+        if (old_size >= 16384 && !in_malloc) {
+            in_malloc = 1;
+            mark_freed(old_ptr);
+            in_malloc = 0;
+        }
+        own_free(old_ptr);
+        ptr = NULL;
+    } else if (size <= old_size) {
+        ptr = old_ptr;
+    } else {
+        ptr = own_alloc(size);
+        if (!ptr) ptr = real_malloc(size);
+        if (ptr) {
+            memcpy(ptr, old_ptr, old_size);
+            own_free(old_ptr);
+        }
+    }
+    // realloc(ptr, 0) frees and returns NULL; a failed realloc changes nothing
+    if (old_ptr && (ptr || size == 0)) {
+        if (g_heap_prof) pepper_heapprof_free(old_ptr);
+        if (g_heap_snap) pepper_heapsnap_free(old_ptr);
+        if (old_usable) pepper_sizehist_free(old_ptr, old_usable);
+    }
+    if (g_alloc_trace && (ptr || size == 0)) {
+        pepper_alloctrace_record(PEPPER_ALLOC_REALLOC, ptr, old_ptr, size, called,
+                                 __builtin_return_address(0));
+    }
+    if (g_heap_prof && ptr) pepper_heapprof_alloc(ptr, size);
+    if (g_size_hist && ptr && !in_malloc) pepper_sizehist_alloc(ptr, block_size(ptr));
+    if (g_heap_snap && ptr) pepper_heapsnap_alloc(ptr, size, __builtin_return_address(0));
     
     if (!in_malloc && ptr && size >= 16384 && g_aggressive_free && !g_disabled) {
         in_malloc = 1;
@@ -280,6 +534,7 @@ void* realloc(void* old_ptr, size_t size) {
         in_malloc = 0;
     }
     
+    pepper_latency_record(PEPPER_LAT_REALLOC, lat);
     return ptr;
 }
 
@@ -287,23 +542,54 @@ void free(void* ptr) {
     if (!real_free) {
         real_free = dlsym(RTLD_NEXT, "free");
     }
+    uint64_t lat = pepper_latency_start();
     
-    if (ptr && !in_malloc) {
+    // Only blocks of 16 KB or more are ever tracked; skip the search otherwise
+    size_t usable = ptr && !in_malloc ? malloc_usable_size(ptr) : 0;
+    if (usable >= 16384) {
         in_malloc = 1;
         mark_freed(ptr);
         in_malloc = 0;
     }
+    if (g_alloc_trace && ptr) pepper_alloctrace_record(PEPPER_ALLOC_FREE, ptr, NULL, 0, 0, __builtin_return_address(0));
+    if (g_heap_prof && ptr) pepper_heapprof_free(ptr);
+    if (g_size_hist && usable) pepper_sizehist_free(ptr, usable);
+    if (g_heap_snap && ptr) pepper_heapsnap_free(ptr);
+    
+    if (own_free(ptr) != 0) real_free(ptr);
+    pepper_latency_record(PEPPER_LAT_FREE, lat);
+}
+
+size_t malloc_usable_size(void* ptr) {
+    if (!real_malloc_usable_size) {
+        real_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    }
     
-    real_free(ptr);
+    size_t size = own_size(ptr);
+    if (size) return size;
+    return real_malloc_usable_size ? real_malloc_usable_size(ptr) : 0;
 }
 
 // ============================================================================
 // glTexImage2D hook
 // ============================================================================
 
-void glTexImage2D(GLenum target, GLint level, GLint internalformat,
-                  GLsizei width, GLsizei height, GLint border,
-                  GLenum format, GLenum type, const void *data) {
+static void upload(GLenum target, GLint level, GLint internalformat, GLsizei width,
+                   GLsizei height, GLint border, GLenum format, GLenum type, const void* data) {
+    uint64_t lat = pepper_latency_start();
+    uint64_t span = pepper_timeline_start();
+    PepperPerfSample perf;
+    pepper_perf_begin(&perf);
+    real_glTexImage2D(target, level, internalformat, width, height, border, format, type, data);
+    pepper_perf_end(PEPPER_PHASE_UPLOAD, &perf, (size_t)width * height * 4);
+    pepper_timeline_record(PEPPER_SPAN_UPLOAD, span, width, height);
+    pepper_latency_record(PEPPER_LAT_UPLOAD, lat);
+}
+
+// `site` is the game's call, for the allocation trace
+static void texture_hook(GLenum target, GLint level, GLint internalformat,
+                         GLsizei width, GLsizei height, GLint border,
+                         GLenum format, GLenum type, const void *data, void* site) {
     
     if (!real_glTexImage2D) {
         real_glTexImage2D = dlsym(RTLD_NEXT, "glTexImage2D");
@@ -313,9 +599,11 @@ void glTexImage2D(GLenum target, GLint level, GLint internalformat,
         }
     }
     
+    pepper_alloctrace_texture(data, width, height, (size_t)width * height * 4, site);
+    
     if (g_disabled || !data) {
-        real_glTexImage2D(target, level, internalformat, width, height, 
-                          border, format, type, data);
+        upload(target, level, internalformat, width, height, 
+               border, format, type, data);
         return;
     }
     
@@ -329,13 +617,14 @@ void glTexImage2D(GLenum target, GLint level, GLint internalformat,
                         width >= g_min_size &&
                         height >= g_min_size);
     
-    pthread_mutex_lock(&g_mutex);
-    g_texture_count++;
-    g_original_bytes += original_size;
-    pthread_mutex_unlock(&g_mutex);
+    pepper_stat_add(PEPPER_STAT_TEXTURES, 1);
+    pepper_stat_add(PEPPER_STAT_ORIGINAL_BYTES, original_size);
     
     // Find the source buffer for potential freeing
+    PepperPerfSample perf;
+    pepper_perf_begin(&perf);
     size_t buffer_size = find_buffer(data);
+    pepper_perf_end(PEPPER_PHASE_LOOKUP, &perf, 0);
     
     if (should_scale) {
         int new_width = (int)(width * g_scale_factor);
@@ -347,44 +636,76 @@ void glTexImage2D(GLenum target, GLint level, GLint internalformat,
         if (new_width < width && new_height < height) {
             size_t new_size = new_width * new_height * 4;
             
-            in_malloc = 1;  // Prevent tracking our own allocation
-            uint8_t* scaled_data = real_malloc(new_size);
-            in_malloc = 0;
+            // A previous launch may already have produced this result
+            uint64_t cache_key = 0;
+            pepper_perf_begin(&perf);
+            const void* cached = pepper_texcache_find(data, width, height, new_size, &cache_key);
+            if (pepper_texcache_enabled()) {
+                pepper_perf_end(PEPPER_PHASE_HASH, &perf, original_size);
+            }
+            uint8_t* scaled_data = NULL;
             
-            if (scaled_data) {
-                downscale_rgba_bilinear((const uint8_t*)data, width, height,
-                                        scaled_data, new_width, new_height);
+            if (!cached) {
+                in_malloc = 1;  // Prevent tracking our own allocation
+                scaled_data = real_malloc(new_size);
+                in_malloc = 0;
+            }
+            
+            if (cached || scaled_data) {
+                if (scaled_data) {
+                    uint64_t lat = pepper_latency_start();
+                    uint64_t span = pepper_timeline_start();
+                    pepper_perf_begin(&perf);
+                    downscale_rgba_bilinear((const uint8_t*)data, width, height,
+                                            scaled_data, new_width, new_height);
+                    pepper_perf_end(PEPPER_PHASE_DOWNSCALE, &perf, original_size);
+                    pepper_timeline_record(PEPPER_SPAN_DOWNSCALE, span, new_width, new_height);
+                    pepper_latency_record(PEPPER_LAT_DOWNSCALE, lat);
+                }
                 
-                real_glTexImage2D(target, level, internalformat, new_width, new_height,
-                                  border, format, type, scaled_data);
+                upload(target, level, internalformat, new_width, new_height,
+                       border, format, type, cached ? cached : scaled_data);
                 
-                real_free(scaled_data);
+                if (scaled_data) {
+                    pepper_perf_begin(&perf);
+                    pepper_texcache_store(cache_key, scaled_data, new_size);
+                    if (pepper_texcache_enabled()) {
+                        pepper_perf_end(PEPPER_PHASE_STORE, &perf, new_size);
+                    }
+                    real_free(scaled_data);
+                }
                 
-                pthread_mutex_lock(&g_mutex);
-                g_scaled_count++;
-                g_optimized_bytes += new_size;
+                int scaled_count = (int)pepper_stat_add(PEPPER_STAT_SCALED, 1);
+                pepper_stat_add(PEPPER_STAT_OPTIMIZED_BYTES, new_size);
                 
-                if (g_verbose || g_scaled_count <= 5) {
+                if (g_verbose || scaled_count <= 5) {
                     fprintf(stderr, "[PepperOpt2] Scaled %dx%d -> %dx%d (saved %.1f KB)\n",
                             width, height, new_width, new_height,
                             (original_size - new_size) / 1024.0f);
-                } else if (g_scaled_count % 500 == 0) {
-                    fprintf(stderr, "[PepperOpt2] Progress: %d textures scaled...\n", g_scaled_count);
+                } else if (scaled_count % 500 == 0) {
+                    fprintf(stderr, "[PepperOpt2] Progress: %d textures scaled...\n", scaled_count);
                 }
-                pthread_mutex_unlock(&g_mutex);
                 
                 // AGGRESSIVE FREE: Now free the original buffer!
                 if (g_aggressive_free && buffer_size > 0) {
+                    pepper_perf_begin(&perf);
                     // Mark as freed in our tracking
                     mark_freed(data);
                     
                     // Actually free the buffer
-                    real_free((void*)data);
+                    if (g_alloc_trace) {
+                        pepper_alloctrace_record(PEPPER_ALLOC_FREE, data, NULL, 0, 0, site);
+                    }
+                    if (g_heap_prof) pepper_heapprof_free((void*)data);
+                    if (g_size_hist) {
+                        pepper_sizehist_free((void*)data, block_size((void*)data));
+                    }
+                    if (g_heap_snap) pepper_heapsnap_free((void*)data);
+                    if (own_free((void*)data) != 0) real_free((void*)data);
+                    pepper_perf_end(PEPPER_PHASE_FREE, &perf, buffer_size);
                     
-                    pthread_mutex_lock(&g_mutex);
-                    g_freed_count++;
-                    g_freed_bytes += buffer_size;
-                    pthread_mutex_unlock(&g_mutex);
+                    pepper_stat_add(PEPPER_STAT_FREED, 1);
+                    pepper_stat_add(PEPPER_STAT_FREED_BYTES, buffer_size);
                     
                     if (g_verbose) {
                         fprintf(stderr, "[PepperOpt2] Freed source buffer: %.1f KB\n",
@@ -398,21 +719,83 @@ void glTexImage2D(GLenum target, GLint level, GLint internalformat,
     }
     
     // Passthrough
-    pthread_mutex_lock(&g_mutex);
-    g_optimized_bytes += original_size;
-    pthread_mutex_unlock(&g_mutex);
+    pepper_stat_add(PEPPER_STAT_OPTIMIZED_BYTES, original_size);
     
-    real_glTexImage2D(target, level, internalformat, width, height,
-                      border, format, type, data);
+    upload(target, level, internalformat, width, height,
+           border, format, type, data);
     
     // Even for non-scaled textures, try to free the buffer
     if (g_aggressive_free && buffer_size > 0) {
+        pepper_perf_begin(&perf);
         mark_freed(data);
-        real_free((void*)data);
+        if (g_alloc_trace) {
+            pepper_alloctrace_record(PEPPER_ALLOC_FREE, data, NULL, 0, 0, site);
+        }
+        if (g_heap_prof) pepper_heapprof_free((void*)data);
+        if (g_size_hist) pepper_sizehist_free((void*)data, block_size((void*)data));
+        if (g_heap_snap) pepper_heapsnap_free((void*)data);
+        if (own_free((void*)data) != 0) real_free((void*)data);
+        pepper_perf_end(PEPPER_PHASE_FREE, &perf, buffer_size);
         
-        pthread_mutex_lock(&g_mutex);
-        g_freed_count++;
-        g_freed_bytes += buffer_size;
-        pthread_mutex_unlock(&g_mutex);
+        pepper_stat_add(PEPPER_STAT_FREED, 1);
+        pepper_stat_add(PEPPER_STAT_FREED_BYTES, buffer_size);
     }
-}
\ No newline at end of file
+}
+
+void glTexImage2D(GLenum target, GLint level, GLint internalformat,
+                  GLsizei width, GLsizei height, GLint border,
+                  GLenum format, GLenum type, const void *data) {
+    uint64_t lat = pepper_latency_start();
+    uint64_t span = pepper_timeline_start();
+    texture_hook(target, level, internalformat, width, height, border, format, type, data,
+                 __builtin_return_address(0));
+    pepper_timeline_record(PEPPER_SPAN_TEXIMAGE, span, width, height);
+    pepper_latency_record(PEPPER_LAT_TEXIMAGE, lat);
+}
+
+// ============================================================================
+// Buffer swap hooks - count frames, for diagnostics taken at a given frame
+// ============================================================================
+
+static void (*real_SDL_GL_SwapWindow)(void* window) = NULL;
+static void (*real_glXSwapBuffers)(void* dpy, unsigned long drawable) = NULL;
+static unsigned int (*real_eglSwapBuffers)(void* dpy, void* surface) = NULL;
+
+static __thread int t_in_swap = 0;  // SDL may swap through the GLX/EGL hooks
+
+unsigned long pepper_frame_count(void) {
+    return (unsigned long)pepper_stat_get(PEPPER_STAT_FRAMES);
+}
+
+static uint64_t g_last_swap = 0;     // ticks, with PEPPER_LATENCY
+
+static void frame_done(void) {
+    unsigned long frame = (unsigned long)pepper_stat_add(PEPPER_STAT_FRAMES, 1);
+    uint64_t now = pepper_latency_start();
+    if (now && g_last_swap) pepper_latency_add(PEPPER_LAT_FRAME, now - g_last_swap);
+    g_last_swap = now;
+    pepper_timeline_frame(frame);
+    if (g_heap_snap) pepper_heapsnap_frame(frame);
+}
+
+void SDL_GL_SwapWindow(void* window) {
+    if (!real_SDL_GL_SwapWindow) real_SDL_GL_SwapWindow = dlsym(RTLD_NEXT, "SDL_GL_SwapWindow");
+    t_in_swap++;
+    if (real_SDL_GL_SwapWindow) real_SDL_GL_SwapWindow(window);
+    if (--t_in_swap == 0) frame_done();
+}
+
+void glXSwapBuffers(void* dpy, unsigned long drawable) {
+    if (!real_glXSwapBuffers) real_glXSwapBuffers = dlsym(RTLD_NEXT, "glXSwapBuffers");
+    t_in_swap++;
+    if (real_glXSwapBuffers) real_glXSwapBuffers(dpy, drawable);
+    if (--t_in_swap == 0) frame_done();
+}
+
+unsigned int eglSwapBuffers(void* dpy, void* surface) {
+    if (!real_eglSwapBuffers) real_eglSwapBuffers = dlsym(RTLD_NEXT, "eglSwapBuffers");
+    t_in_swap++;
+    unsigned int ok = real_eglSwapBuffers ? real_eglSwapBuffers(dpy, surface) : 0;
+    if (--t_in_swap == 0) frame_done();
+    return ok;
+}
@@ -0,0 +1,291 @@
+/*
+ * pepper_perf.c - CPU counters for each phase of the texture hook
+ *
+ * The latency histograms say how long the downscaler or the upload takes,
+ * not why. On the in-order A53-class cores of the handhelds the answer is
+ * usually one of two: the kernel waits on memory (few instructions per
+ * cycle, many cache misses per KB it touches) or it simply executes too
+ * many instructions (IPC near the core's peak, few misses). The fixes
+ * differ: fewer passes over the data and smaller working sets for the
+ * first, fewer or wider instructions for the second.
+ *
+ * With PEPPER_PERF=1, each thread that enters the texture hook opens a
+ * perf_event group on itself: cycles, instructions, cache-misses and
+ * branch-misses, plus task-clock and page-faults, which the kernel
+ * provides even without a hardware PMU (VMs, some vendor kernels).
+ * Events the kernel refuses are left out. All events count user space
+ * only, which perf_event_paranoid=2 (the usual default) allows without
+ * root; driver work inside the upload's ioctls is not seen. The group is
+ * read with one read() before and after each phase (find_buffer, the
+ * texture cache hash, the downscale, the driver upload, the cache store
+ * and the aggressive free), so each phase costs two syscalls while on.
+ *
+ * The table is printed at exit and on PEPPER_DUMP_SIGNAL (SIGUSR2 by
+ * default): per phase, the calls and bytes, cycles, IPC, cycles per byte,
+ * cache misses per KB and per 1000 instructions, branch misses per 1000
+ * instructions, CPU time and page faults.
+ *
+ * Environment variables:
+ *   PEPPER_PERF=1                 - Enable (default 0)
+ */
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Events
+// ============================================================================
+
+enum {
+    EV_CYCLES,
+    EV_INSTRUCTIONS,
+    EV_CACHE_MISSES,
+    EV_BRANCH_MISSES,
+    EV_TASK_CLOCK,                    // ns on the CPU
+    EV_PAGE_FAULTS,
+    EV_COUNT
+};
+
+_Static_assert(EV_COUNT == PEPPER_PERF_EVENTS, "PEPPER_PERF_EVENTS is out of date");
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char* name;
+} g_events[EV_COUNT] = {
+    [EV_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    [EV_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    [EV_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+    [EV_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+    [EV_TASK_CLOCK] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock"},
+    [EV_PAGE_FAULTS] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults"},
+};
+
+static const char* g_phase_names[PEPPER_PHASE_COUNT] = {
+    [PEPPER_PHASE_LOOKUP] = "lookup",
+    [PEPPER_PHASE_HASH] = "hash",
+    [PEPPER_PHASE_DOWNSCALE] = "downscale",
+    [PEPPER_PHASE_UPLOAD] = "upload",
+    [PEPPER_PHASE_STORE] = "store",
+    [PEPPER_PHASE_FREE] = "free",
+};
+
+int g_perf = 0;
+
+// Events that opened on the first thread; later threads only try these
+static unsigned g_event_mask = 0;
+
+static int has(int event) {
+    return (g_event_mask >> event) & 1;
+}
+
+// ============================================================================
+// Per-thread event groups
+// ============================================================================
+
+static PEPPER_TLS int t_state = 0;    // 0 = not opened yet, 1 = open, -1 = failed
+static PEPPER_TLS int t_count = 0;
+static PEPPER_TLS int t_fds[EV_COUNT];
+static PEPPER_TLS uint8_t t_ids[EV_COUNT];    // event of each value in the group
+static pthread_key_t g_thread_key;
+
+static int open_event(int event, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = g_events[event].type;
+    attr.config = g_events[event].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.pinned = group_fd < 0;       // never multiplexed: a phase is too short
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void close_group(void) {
+    for (int i = 0; i < t_count; i++) close(t_fds[i]);
+    t_count = 0;
+}
+
+static void thread_exit(void* arg) {
+    (void)arg;
+    close_group();
+    t_state = -1;
+}
+
+static int open_group(unsigned mask) {
+    t_count = 0;
+    for (int e = 0; e < EV_COUNT; e++) {
+        if (!((mask >> e) & 1)) continue;
+        int fd = open_event(e, t_count ? t_fds[0] : -1);
+        if (fd < 0) continue;
+        t_fds[t_count] = fd;
+        t_ids[t_count] = (uint8_t)e;
+        t_count++;
+    }
+    t_state = t_count ? 1 : -1;
+    if (t_count) {
+        // pthread_setspecific may allocate; keep the library's own allocation
+        // out of the malloc profilers
+        int saved = in_malloc;
+        in_malloc = 1;
+        pthread_setspecific(g_thread_key, (void*)1);
+        in_malloc = saved;
+    }
+    return t_count;
+}
+
+void pepper_perf_read(PepperPerfSample* sample) {
+    if (t_state == 0) open_group(g_event_mask);
+    if (t_state < 0) return;
+
+    uint64_t values[1 + EV_COUNT];
+    ssize_t n = read(t_fds[0], values, sizeof(values));
+    // A pinned group that lost its counters reads as 0 bytes
+    if (n < (ssize_t)((1 + t_count) * sizeof(uint64_t))) return;
+    for (int i = 0; i < t_count; i++) sample->value[t_ids[i]] = values[1 + i];
+    sample->ok = 1;
+}
+
+// ============================================================================
+// Totals per phase
+// ============================================================================
+
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t value[EV_COUNT];
+} PhaseTotals;
+
+static PhaseTotals g_phases[PEPPER_PHASE_COUNT];
+
+void pepper_perf_add(int phase, const PepperPerfSample* start, size_t bytes) {
+    PepperPerfSample end;
+    end.ok = 0;
+    pepper_perf_read(&end);
+    if (!end.ok) return;
+
+    PhaseTotals* t = &g_phases[phase];
+    __atomic_add_fetch(&t->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->bytes, bytes, __ATOMIC_RELAXED);
+    for (int i = 0; i < t_count; i++) {
+        int e = t_ids[i];
+        __atomic_add_fetch(&t->value[e], end.value[e] - start->value[e], __ATOMIC_RELAXED);
+    }
+}
+
+// ============================================================================
+// Report
+// ============================================================================
+
+static const char* cell(char* buf, size_t cap, int ok, const char* fmt, double v) {
+    if (!ok) return "-";
+    snprintf(buf, cap, fmt, v);
+    return buf;
+}
+
+static void print_table(const char* prefix) {
+    fprintf(stderr, "%s%-10s %8s %9s %9s %6s %7s %8s %8s %8s %9s %8s\n", prefix, "phase",
+            "calls", "MB", "Mcycles", "IPC", "cyc/B", "miss/KB", "miss/Ki", "br/Ki",
+            "cpu ms", "faults");
+    char c[9][24];
+    for (int p = 0; p < PEPPER_PHASE_COUNT; p++) {
+        PhaseTotals t;
+        t.calls = __atomic_load_n(&g_phases[p].calls, __ATOMIC_RELAXED);
+        t.bytes = __atomic_load_n(&g_phases[p].bytes, __ATOMIC_RELAXED);
+        for (int e = 0; e < EV_COUNT; e++) {
+            t.value[e] = __atomic_load_n(&g_phases[p].value[e], __ATOMIC_RELAXED);
+        }
+        if (!t.calls) continue;
+
+        double cycles = (double)t.value[EV_CYCLES];
+        double instructions = (double)t.value[EV_INSTRUCTIONS];
+        double misses = (double)t.value[EV_CACHE_MISSES];
+        int counted = has(EV_INSTRUCTIONS) && instructions > 0;
+        fprintf(stderr, "%s%-10s %8lu %9.1f %9s %6s %7s %8s %8s %8s %9s %8s\n", prefix,
+                g_phase_names[p], (unsigned long)t.calls, t.bytes / 1024.0 / 1024.0,
+                cell(c[0], 24, has(EV_CYCLES), "%.1f", cycles / 1e6),
+                cell(c[1], 24, has(EV_CYCLES) && counted, "%.2f",
+                     instructions / (cycles > 0 ? cycles : 1)),
+                cell(c[2], 24, has(EV_CYCLES) && t.bytes, "%.2f", cycles / (t.bytes ? t.bytes : 1)),
+                cell(c[3], 24, has(EV_CACHE_MISSES) && t.bytes, "%.1f",
+                     misses * 1024.0 / (t.bytes ? t.bytes : 1)),
+                cell(c[4], 24, has(EV_CACHE_MISSES) && counted, "%.2f",
+                     misses * 1000.0 / (instructions > 0 ? instructions : 1)),
+                cell(c[5], 24, has(EV_BRANCH_MISSES) && counted, "%.2f",
+                     t.value[EV_BRANCH_MISSES] * 1000.0 / (instructions > 0 ? instructions : 1)),
+                cell(c[6], 24, has(EV_TASK_CLOCK), "%.1f", t.value[EV_TASK_CLOCK] / 1e6),
+                cell(c[7], 24, has(EV_PAGE_FAULTS), "%.0f", (double)t.value[EV_PAGE_FAULTS]));
+    }
+}
+
+static void dump_table(void) {
+    fprintf(stderr, "[PepperOpt2] Texture hook counters:\n");
+    print_table("[PepperOpt2]   ");
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+static int paranoid_level(void) {
+    FILE* f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+    int level = -100;
+    if (f) {
+        if (fscanf(f, "%d", &level) != 1) level = -100;
+        fclose(f);
+    }
+    return level;
+}
+
+// A forked child opens its own groups; the inherited ones count the parent
+static void after_fork_child(void) {
+    close_group();
+    t_state = 0;
+}
+
+void pepper_perf_init(void) {
+    if (!pepper_env_int("PEPPER_PERF", 0)) return;
+    if (pthread_key_create(&g_thread_key, thread_exit) != 0) {
+        fprintf(stderr, "[PepperOpt2] Perf: no thread key, disabled\n");
+        return;
+    }
+
+    // The loading thread is usually this one; its group decides the events
+    if (!open_group((1u << EV_COUNT) - 1)) {
+        int level = paranoid_level();
+        fprintf(stderr, "[PepperOpt2] Perf: no counters (perf_event_paranoid=%d), disabled\n",
+                level);
+        return;
+    }
+    for (int i = 0; i < t_count; i++) g_event_mask |= 1u << t_ids[i];
+    pthread_atfork(NULL, NULL, after_fork_child);
+
+    char opened[128] = "", missing[128] = "";
+    for (int e = 0; e < EV_COUNT; e++) {
+        char* list = has(e) ? opened : missing;
+        size_t len = strlen(list);
+        snprintf(list + len, sizeof(opened) - len, "%s%s", len ? " " : "", g_events[e].name);
+    }
+    int dump_signal = pepper_on_dump_signal(dump_table);
+    __atomic_store_n(&g_perf, 1, __ATOMIC_RELEASE);
+    fprintf(stderr, "[PepperOpt2] Perf: ENABLED (%s", opened);
+    if (missing[0]) fprintf(stderr, "; not available: %s", missing);
+    if (dump_signal > 0) fprintf(stderr, "; dump with kill -%d %d", dump_signal, (int)getpid());
+    fprintf(stderr, ")\n");
+}
+
+void pepper_perf_summary(void) {
+    if (!g_perf) return;
+    fprintf(stderr, "[PepperOpt2]   Texture hook counters (user space):\n");
+    print_table("[PepperOpt2]     ");
+}
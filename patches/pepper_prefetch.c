@@ -0,0 +1,225 @@
+/*
+ * pepper_prefetch.c - Background read-ahead for Assets.dat during startup
+ *
+ * The loading thread reads Assets.dat in small sequential pieces and stalls
+ * on each one. Under box64 that thread is also slow at everything else. As
+ * soon as the asset file is opened (see pepper_assetio.c), this thread
+ * reads the four entry tables itself. It then keeps issuing readahead() for
+ * the entries that follow the engine's current read position, in table
+ * (load) order, up to a configurable window ahead. The engine then finds
+ * the pages already in the page cache. It works for both the mmap and the
+ * stdio path, since both share the page cache.
+ *
+ * Environment variables:
+ *   PEPPER_PREFETCH=1             - Enable (default 0)
+ *   PEPPER_PREFETCH_WINDOW_MB=8   - How far ahead of the reader to stay
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static int g_prefetch = 0;
+static size_t g_prefetch_window = 8u << 20;
+
+// ============================================================================
+// Prefetch thread state
+// ============================================================================
+
+static pthread_mutex_t g_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_prefetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_prefetch_thread;
+static int g_prefetch_running = 0;
+static int g_prefetch_refs = 0;         // open Assets.dat streams it serves
+static int g_prefetch_stop = 0;
+static char* g_prefetch_path = NULL;
+static size_t g_prefetch_file_size = 0;
+
+// Latest reader position; written by the loading thread on every read
+static size_t g_reader_pos = 0;
+static size_t g_reader_seq = 0;
+
+// Only wake the thread once the reader has moved this far. Written under
+// g_prefetch_mutex, read without it by every fread.
+#define WAKE_STRIDE (256u << 10)
+static size_t g_last_wake_pos = 0;
+
+static void issue(int fd, size_t offset, size_t len) {
+    if (readahead(fd, (off64_t)offset, len) != 0) {
+        posix_fadvise(fd, (off_t)offset, (off_t)len, POSIX_FADV_WILLNEED);
+    }
+    pepper_stat_add(PEPPER_STAT_PREFETCH_CALLS, 1);
+    pepper_stat_add(PEPPER_STAT_PREFETCH_BYTES, len);
+}
+
+static void* prefetch_main(void* arg) {
+    (void)arg;
+    int fd = open(g_prefetch_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    PepperAssetIndex index;
+    if (pepper_asset_index_load(fd, g_prefetch_file_size, &index) != 0) {
+        close(fd);
+        return NULL;
+    }
+    const PepperEntry* order = index.entries;
+    size_t count = index.count;
+
+    size_t issued_to = 0;    // load-order index of the next entry to prefetch
+    for (;;) {
+        pthread_mutex_lock(&g_prefetch_mutex);
+        size_t seen = g_reader_seq;
+        size_t pos = g_reader_pos;
+        pthread_mutex_unlock(&g_prefetch_mutex);
+
+        // Stay `window` bytes of entries ahead of the reader's entry
+        size_t cursor = pepper_asset_index_find(&index, pos);
+        if (cursor > issued_to) issued_to = cursor;
+
+        size_t ahead = 0;
+        for (size_t i = cursor; i < issued_to; i++) ahead += order[i].size;
+
+        while (issued_to < count && ahead < g_prefetch_window) {
+            // Coalesce physically contiguous entries into one call
+            size_t start = order[issued_to].offset;
+            size_t end = start + order[issued_to].size;
+            ahead += order[issued_to].size;
+            issued_to++;
+            pepper_stat_add(PEPPER_STAT_PREFETCH_ENTRIES, 1);
+            while (issued_to < count && order[issued_to].offset == end &&
+                   ahead < g_prefetch_window) {
+                end += order[issued_to].size;
+                ahead += order[issued_to].size;
+                issued_to++;
+                pepper_stat_add(PEPPER_STAT_PREFETCH_ENTRIES, 1);
+            }
+            issue(fd, start, end - start);
+        }
+
+        pthread_mutex_lock(&g_prefetch_mutex);
+        while (!g_prefetch_stop && g_reader_seq == seen && issued_to < count) {
+            pthread_cond_wait(&g_prefetch_cond, &g_prefetch_mutex);
+        }
+        int stop = g_prefetch_stop || issued_to >= count;
+        pepper_stat_add(PEPPER_STAT_PREFETCH_WAKEUPS, 1);
+        pthread_mutex_unlock(&g_prefetch_mutex);
+        if (stop) break;
+    }
+
+    pepper_asset_index_free(&index);
+    close(fd);
+    return NULL;
+}
+
+// ============================================================================
+// Hooks from pepper_assetio.c
+// ============================================================================
+
+int pepper_prefetch_enabled(void) {
+    return g_prefetch && !g_disabled;
+}
+
+int pepper_prefetch_open(const char* path, size_t size) {
+    if (!pepper_prefetch_enabled() || size < PEPPER_TABLES_SIZE) return 0;
+
+    pthread_mutex_lock(&g_prefetch_mutex);
+    if (g_prefetch_refs > 0) {
+        // Already prefetching an open copy of the file
+        g_prefetch_refs++;
+        pthread_mutex_unlock(&g_prefetch_mutex);
+        return 1;
+    }
+    free(g_prefetch_path);
+    g_prefetch_path = strdup(path);
+    g_prefetch_file_size = size;
+    g_prefetch_stop = 0;
+    g_reader_pos = 0;
+    __atomic_store_n(&g_last_wake_pos, 0, __ATOMIC_RELAXED);
+    int started = g_prefetch_path &&
+                  pthread_create(&g_prefetch_thread, NULL, prefetch_main, NULL) == 0;
+    g_prefetch_running = started;
+    g_prefetch_refs = started;
+    pthread_mutex_unlock(&g_prefetch_mutex);
+
+    if (g_verbose && started) {
+        fprintf(stderr, "[PepperOpt2] Prefetch thread started for %s\n", path);
+    }
+    return started;
+}
+
+void pepper_prefetch_position(size_t pos) {
+    if (!__atomic_load_n(&g_prefetch_running, __ATOMIC_RELAXED)) return;
+
+    // Cheap for the common case: only signal after a real jump forward or
+    // a seek backwards
+    size_t last = __atomic_load_n(&g_last_wake_pos, __ATOMIC_RELAXED);
+    size_t moved = pos > last ? pos - last : last - pos;
+    if (moved < WAKE_STRIDE) return;
+
+    pthread_mutex_lock(&g_prefetch_mutex);
+    g_reader_pos = pos;
+    g_reader_seq++;
+    __atomic_store_n(&g_last_wake_pos, pos, __ATOMIC_RELAXED);
+    pthread_cond_signal(&g_prefetch_cond);
+    pthread_mutex_unlock(&g_prefetch_mutex);
+}
+
+static void stop_prefetch(void) {
+    pthread_mutex_lock(&g_prefetch_mutex);
+    int running = g_prefetch_running;
+    g_prefetch_stop = 1;
+    pthread_cond_signal(&g_prefetch_cond);
+    pthread_mutex_unlock(&g_prefetch_mutex);
+
+    if (running) {
+        pthread_join(g_prefetch_thread, NULL);
+        pthread_mutex_lock(&g_prefetch_mutex);
+        g_prefetch_running = 0;
+        pthread_mutex_unlock(&g_prefetch_mutex);
+    }
+}
+
+// The thread keeps going until the last stream that uses it is closed
+void pepper_prefetch_close(void) {
+    pthread_mutex_lock(&g_prefetch_mutex);
+    int last = g_prefetch_refs > 0 && --g_prefetch_refs == 0;
+    pthread_mutex_unlock(&g_prefetch_mutex);
+    if (last) stop_prefetch();
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+void pepper_prefetch_init(void) {
+    g_prefetch = pepper_env_int("PEPPER_PREFETCH", 0);
+    int window_mb = pepper_env_int("PEPPER_PREFETCH_WINDOW_MB", 8);
+    if (window_mb < 1) window_mb = 1;
+    g_prefetch_window = (size_t)window_mb << 20;
+
+    if (pepper_prefetch_enabled()) {
+        fprintf(stderr, "[PepperOpt2] Prefetch: ENABLED (%d MB window)\n", window_mb);
+    }
+}
+
+void pepper_prefetch_summary(void) {
+    if (!pepper_prefetch_enabled()) return;
+
+    stop_prefetch();
+    fprintf(stderr, "[PepperOpt2]   Prefetched: %zu entries, %.2f MB in %zu calls (%zu wakeups)\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_PREFETCH_ENTRIES),
+            (size_t)pepper_stat_get(PEPPER_STAT_PREFETCH_BYTES) / 1024.0 / 1024.0,
+            (size_t)pepper_stat_get(PEPPER_STAT_PREFETCH_CALLS),
+            (size_t)pepper_stat_get(PEPPER_STAT_PREFETCH_WAKEUPS));
+}
@@ -0,0 +1,443 @@
+/*
+ * pepper_rawcache.c - Back decoded image buffers with clean file pages
+ *
+ * Chowdren keeps every decoded image in RAM. Those buffers are anonymous
+ * memory, so under pressure the only place they can go is zram, and zram
+ * is already full when the OOM killer takes the game (see log.txt). With
+ * PEPPER_RAWCACHE=path, every image the zlib hooks see decoded in one
+ * call is also written to a raw cache file. The whole pages of the
+ * engine's buffer are then replaced with a MAP_PRIVATE mapping of that
+ * file (MAP_FIXED). The bytes are identical. The difference is that the
+ * pages are now clean page cache: the kernel can drop them and read them
+ * back later, with no swap. A write by the engine just copies that one
+ * page, as with any private mapping.
+ *
+ * On later launches an inflate whose stream is already in the cache is
+ * not decoded at all. The file pages are mapped in directly, and only the
+ * partial first and last pages are copied.
+ *
+ * Only buffers that glibc allocated with their own mmap(), or blocks of
+ * pepper_arena.c, are remapped. Both are page-granular, and our mapping
+ * goes away with the block's pages once it is freed. Other buffers are
+ * still served from the cache by copying. An entry is only mapped when the
+ * buffer's offset within its page matches the offset the entry was
+ * written with.
+ *
+ * Images that repeat share one copy. Files: <path> holds page-aligned
+ * image data; <path>.idx holds the index and is replaced atomically at a
+ * clean exit. Data appended by a session that did not exit cleanly is cut
+ * off at the next start.
+ *
+ * Environment variables:
+ *   PEPPER_RAWCACHE=path          - Cache data file (default: off)
+ *   PEPPER_RAWCACHE_MB=1024       - Stop adding entries past this size
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Index format
+// ============================================================================
+
+#define RAWCACHE_MAGIC "PEPRAW\0\1"
+#define PROBE_BYTES 64      // stream prefix hashed for the lookup key
+
+typedef struct {
+    char magic[8];
+    uint32_t page_size;
+    uint32_t count;
+    uint64_t data_end;      // bytes of the data file in use
+} RawCacheHeader;
+
+typedef struct {
+    uint64_t probe;         // hash of the first PROBE_BYTES of the stream
+    uint64_t stream_hash;   // hash of the whole stream
+    uint64_t offset;        // page-aligned start in the data file
+    uint32_t raw_size;
+    uint32_t stream_len;
+    uint32_t phase;         // buffer offset within its page when written
+    uint32_t reserved;
+} RawCacheEntry;
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static const char* g_rawcache_path = NULL;
+static char* g_index_path = NULL;
+static size_t g_rawcache_limit = 1024u << 20;
+static size_t g_page_size = 4096;
+
+// Stats
+static long g_rss_anon_start = -1;
+static long g_rss_file_start = -1;
+
+static pthread_mutex_t g_rawcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ============================================================================
+// Cache state
+// ============================================================================
+
+static int g_data_fd = -1;
+static uint64_t g_data_end = 0;
+static RawCacheEntry* g_entries = NULL;
+static size_t g_count = 0;
+static size_t g_cap = 0;
+static int g_dirty = 0;
+
+// Open-addressing table on probe; slots hold entry index + 1, 0 is empty
+static uint32_t* g_slots = NULL;
+static size_t g_slot_mask = 0;
+
+static void* cache_alloc(size_t size) {
+    in_malloc = 1;
+    void* p = malloc(size);
+    in_malloc = 0;
+    return p;
+}
+
+static void cache_free(void* p) {
+    in_malloc = 1;
+    free(p);
+    in_malloc = 0;
+}
+
+static uint64_t probe_key(const uint8_t* in, size_t len) {
+    return pepper_hash64(in, len < PROBE_BYTES ? len : PROBE_BYTES);
+}
+
+static void insert_slot(size_t index) {
+    size_t slot = g_entries[index].probe & g_slot_mask;
+    while (g_slots[slot]) slot = (slot + 1) & g_slot_mask;
+    g_slots[slot] = (uint32_t)index + 1;
+}
+
+// Make room for entry g_count; called with g_rawcache_mutex held
+static int reserve_entry(void) {
+    if (g_count == g_cap) {
+        size_t cap = g_cap ? g_cap * 2 : 1024;
+        RawCacheEntry* grown = cache_alloc(cap * sizeof(RawCacheEntry));
+        if (!grown) return -1;
+        if (g_count) memcpy(grown, g_entries, g_count * sizeof(RawCacheEntry));
+        cache_free(g_entries);
+        g_entries = grown;
+        g_cap = cap;
+    }
+    if (!g_slots || (g_count + 1) * 2 > g_slot_mask + 1) {
+        size_t size = 2048;
+        while (size < (g_count + 1) * 2) size *= 2;
+        in_malloc = 1;
+        uint32_t* slots = calloc(size, sizeof(uint32_t));
+        in_malloc = 0;
+        if (!slots) return -1;
+        cache_free(g_slots);
+        g_slots = slots;
+        g_slot_mask = size - 1;
+        for (size_t i = 0; i < g_count; i++) insert_slot(i);
+    }
+    return 0;
+}
+
+// Entry whose stream is a prefix of `in` and fits in `out_cap`, or NULL.
+// Candidates share the stream's first bytes; the full hash decides.
+// Called with g_rawcache_mutex held.
+static const RawCacheEntry* find_entry(const uint8_t* in, size_t in_len, size_t out_cap) {
+    if (!g_slots) return NULL;
+    uint64_t probe = probe_key(in, in_len);
+    for (size_t slot = probe & g_slot_mask; g_slots[slot]; slot = (slot + 1) & g_slot_mask) {
+        const RawCacheEntry* e = &g_entries[g_slots[slot] - 1];
+        if (e->probe == probe && e->stream_len <= in_len && e->raw_size <= out_cap &&
+            pepper_hash64(in, e->stream_len) == e->stream_hash) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void load_index(void) {
+    int fd = open(g_index_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    RawCacheHeader header;
+    int ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+             memcmp(header.magic, RAWCACHE_MAGIC, sizeof(header.magic)) == 0 &&
+             header.page_size == g_page_size;
+    for (uint32_t i = 0; ok && i < header.count; i++) {
+        ok = reserve_entry() == 0 &&
+             read(fd, &g_entries[i], sizeof(RawCacheEntry)) == sizeof(RawCacheEntry);
+        if (ok) insert_slot(g_count++);
+    }
+    close(fd);
+    if (!ok) {
+        g_count = 0;
+        if (g_slots) memset(g_slots, 0, (g_slot_mask + 1) * sizeof(uint32_t));
+        return;
+    }
+    g_data_end = header.data_end;
+}
+
+// Resident anonymous and file-backed memory in kB, from /proc/self/status
+static void read_rss(long* anon, long* file) {
+    *anon = *file = -1;
+    int fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return;
+    buf[n] = '\0';
+    const char* p = strstr(buf, "RssAnon:");
+    if (p) *anon = strtol(p + 8, NULL, 10);
+    p = strstr(buf, "RssFile:");
+    if (p) *file = strtol(p + 8, NULL, 10);
+}
+
+// ============================================================================
+// Mapping buffers onto the cache
+// ============================================================================
+
+// True if `buf` is the start of a glibc chunk that has its own mmap(). Such
+// buffers sit 16 bytes into their first page, so the chunk header read here
+// is always on the same page as the buffer.
+static int is_mmapped_chunk(const uint8_t* buf, size_t len) {
+    if (((uintptr_t)buf & (g_page_size - 1)) != 2 * sizeof(size_t)) return 0;
+    size_t prev = ((const size_t*)buf)[-2];
+    size_t size = ((const size_t*)buf)[-1];
+    return (size & 2) && (prev & (g_page_size - 1)) == 0 &&
+           (size & ~(size_t)7) >= len + 2 * sizeof(size_t);
+}
+
+// Replace the whole pages of `out` with a private mapping of entry `e`.
+// Returns the number of bytes mapped, 0 if the buffer does not allow it.
+static size_t map_pages(const RawCacheEntry* e, uint8_t* out) {
+    size_t phase = (uintptr_t)out & (g_page_size - 1);
+    size_t head = phase ? g_page_size - phase : 0;
+    size_t len = e->raw_size;
+    size_t pages = len > head ? (len - head) & ~(g_page_size - 1) : 0;
+    if (pages == 0 || phase != e->phase ||
+        (!is_mmapped_chunk(out, len) && pepper_arena_size(out) < len)) {
+        return 0;
+    }
+
+    void* at = mmap(out + head, pages, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                    g_data_fd, (off_t)(e->offset + (phase ? g_page_size : 0)));
+    return at == MAP_FAILED ? 0 : pages;
+}
+
+// Fill `out` with entry `e`: mapped pages where possible, pread for the rest
+static int deliver(const RawCacheEntry* e, uint8_t* out, size_t* mapped) {
+    size_t len = e->raw_size;
+    off_t base = (off_t)(e->offset + e->phase);
+    *mapped = map_pages(e, out);
+    if (*mapped == 0) {
+        return pread(g_data_fd, out, len, base) == (ssize_t)len ? 0 : -1;
+    }
+    size_t head = e->phase ? g_page_size - e->phase : 0;
+    size_t tail = len - head - *mapped;
+    if (head && pread(g_data_fd, out, head, base) != (ssize_t)head) return -1;
+    if (tail && pread(g_data_fd, out + head + *mapped, tail,
+                      base + (off_t)(head + *mapped)) != (ssize_t)tail) {
+        return -1;
+    }
+    return 0;
+}
+
+// ============================================================================
+// Hooks from pepper_zlib.c
+// ============================================================================
+
+int pepper_rawcache_enabled(void) {
+    return g_rawcache_path && !g_disabled;
+}
+
+int pepper_rawcache_take(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap,
+                         size_t* in_used, size_t* out_len) {
+    if (!pepper_rawcache_enabled() || g_data_fd < 0) return -1;
+
+    RawCacheEntry found;
+    pthread_mutex_lock(&g_rawcache_mutex);
+    const RawCacheEntry* e = find_entry(in, in_len, out_cap);
+    if (e) found = *e;
+    pthread_mutex_unlock(&g_rawcache_mutex);
+    if (!e) return -1;
+
+    size_t mapped;
+    if (deliver(&found, out, &mapped) != 0) return -1;
+
+    pthread_mutex_lock(&g_rawcache_mutex);
+    pepper_stat_add(PEPPER_STAT_RAWCACHE_HITS, 1);
+    pepper_stat_add(PEPPER_STAT_RAWCACHE_MAPPED_BYTES, mapped);
+    pepper_stat_add(PEPPER_STAT_RAWCACHE_COPIED_BYTES, found.raw_size - mapped);
+    pthread_mutex_unlock(&g_rawcache_mutex);
+
+    *in_used = found.stream_len;
+    *out_len = found.raw_size;
+    return 0;
+}
+
+void pepper_rawcache_store(const uint8_t* in, size_t in_used, uint8_t* out, size_t out_len) {
+    if (!pepper_rawcache_enabled() || g_data_fd < 0 || out_len < g_page_size ||
+        out_len > UINT32_MAX || in_used > UINT32_MAX) {
+        return;
+    }
+
+    // Repeats of an image already in the cache (this session or an earlier
+    // one) share its file pages instead of adding a copy
+    RawCacheEntry e;
+    pthread_mutex_lock(&g_rawcache_mutex);
+    const RawCacheEntry* known = find_entry(in, in_used, out_len);
+    if (known) e = *known;
+    pthread_mutex_unlock(&g_rawcache_mutex);
+    if (known) {
+        size_t mapped = e.raw_size == out_len ? map_pages(&e, out) : 0;
+        pthread_mutex_lock(&g_rawcache_mutex);
+        pepper_stat_add(PEPPER_STAT_RAWCACHE_MAPPED_BYTES, mapped);
+        pthread_mutex_unlock(&g_rawcache_mutex);
+        return;
+    }
+
+    memset(&e, 0, sizeof(e));
+    e.probe = probe_key(in, in_used);
+    e.stream_hash = pepper_hash64(in, in_used);
+    e.raw_size = (uint32_t)out_len;
+    e.stream_len = (uint32_t)in_used;
+    e.phase = (uint32_t)((uintptr_t)out & (g_page_size - 1));
+
+    // Reserve room at the end of the data file, keeping the buffer's
+    // in-page offset so its whole pages line up with file pages
+    pthread_mutex_lock(&g_rawcache_mutex);
+    size_t span = (e.phase + out_len + g_page_size - 1) & ~(g_page_size - 1);
+    if (g_data_end + span > g_rawcache_limit) {
+        pthread_mutex_unlock(&g_rawcache_mutex);
+        return;
+    }
+    e.offset = g_data_end;
+    g_data_end += span;
+    pthread_mutex_unlock(&g_rawcache_mutex);
+
+    if (pwrite(g_data_fd, out, out_len, (off_t)(e.offset + e.phase)) != (ssize_t)out_len) {
+        return;
+    }
+
+    // The data is in the page cache now; swap the anonymous pages for it
+    size_t mapped = map_pages(&e, out);
+
+    pthread_mutex_lock(&g_rawcache_mutex);
+    if (reserve_entry() != 0) {
+        pthread_mutex_unlock(&g_rawcache_mutex);
+        return;
+    }
+    g_entries[g_count] = e;
+    insert_slot(g_count++);
+    g_dirty = 1;
+    pepper_stat_add(PEPPER_STAT_RAWCACHE_STORED, 1);
+    pepper_stat_add(PEPPER_STAT_RAWCACHE_STORED_BYTES, out_len);
+    pepper_stat_add(PEPPER_STAT_RAWCACHE_MAPPED_BYTES, mapped);
+    pthread_mutex_unlock(&g_rawcache_mutex);
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+static int write_index(void) {
+    size_t len = strlen(g_index_path);
+    char* tmp = cache_alloc(len + 5);
+    if (!tmp) return -1;
+    memcpy(tmp, g_index_path, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    RawCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RAWCACHE_MAGIC, sizeof(header.magic));
+    header.page_size = (uint32_t)g_page_size;
+    header.count = (uint32_t)g_count;
+    header.data_end = g_data_end;
+
+    size_t bytes = g_count * sizeof(RawCacheEntry);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd >= 0 && fdatasync(g_data_fd) == 0 &&
+             write(fd, &header, sizeof(header)) == sizeof(header) &&
+             write(fd, g_entries, bytes) == (ssize_t)bytes && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!ok || rename(tmp, g_index_path) != 0) {
+        fprintf(stderr, "[PepperOpt2] Raw cache index not updated: %s\n", strerror(errno));
+        unlink(tmp);
+        ok = 0;
+    }
+    cache_free(tmp);
+    return ok ? 0 : -1;
+}
+
+void pepper_rawcache_init(void) {
+    g_rawcache_path = pepper_env_str("PEPPER_RAWCACHE");
+    if (!pepper_rawcache_enabled()) return;
+
+    int limit_mb = pepper_env_int("PEPPER_RAWCACHE_MB", 1024);
+    if (limit_mb < 1) limit_mb = 1;
+    g_rawcache_limit = (size_t)limit_mb << 20;
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0) g_page_size = (size_t)page;
+
+    size_t len = strlen(g_rawcache_path);
+    g_index_path = cache_alloc(len + 5);
+    if (!g_index_path) {
+        g_rawcache_path = NULL;
+        return;
+    }
+    memcpy(g_index_path, g_rawcache_path, len);
+    memcpy(g_index_path + len, ".idx", 5);
+
+    load_index();
+    g_data_fd = open(g_rawcache_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (g_data_fd < 0) {
+        fprintf(stderr, "[PepperOpt2] Raw cache: cannot open %s: %s\n", g_rawcache_path,
+                strerror(errno));
+        return;
+    }
+    // Drop whatever a session that never wrote its index appended
+    if (ftruncate(g_data_fd, (off_t)g_data_end) != 0) {
+        close(g_data_fd);
+        g_data_fd = -1;
+        return;
+    }
+
+    read_rss(&g_rss_anon_start, &g_rss_file_start);
+    fprintf(stderr, "[PepperOpt2] Raw cache: ENABLED (%s, %zu images, %.1f MB)\n",
+            g_rawcache_path, g_count, g_data_end / 1024.0 / 1024.0);
+}
+
+void pepper_rawcache_summary(void) {
+    if (!pepper_rawcache_enabled() || g_data_fd < 0) return;
+
+    long anon, file;
+    read_rss(&anon, &file);
+
+    pthread_mutex_lock(&g_rawcache_mutex);
+    if (g_dirty) write_index();
+    fprintf(stderr, "[PepperOpt2]   Raw cache: %zu served from cache, %zu added (%.2f MB)\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_RAWCACHE_HITS),
+            (size_t)pepper_stat_get(PEPPER_STAT_RAWCACHE_STORED),
+            (size_t)pepper_stat_get(PEPPER_STAT_RAWCACHE_STORED_BYTES) / 1024.0 / 1024.0);
+    fprintf(stderr, "[PepperOpt2]   Raw cache: %.2f MB of pixel buffers moved from anonymous "
+            "to file pages, %.2f MB copied\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_RAWCACHE_MAPPED_BYTES) / 1024.0 / 1024.0,
+            (size_t)pepper_stat_get(PEPPER_STAT_RAWCACHE_COPIED_BYTES) / 1024.0 / 1024.0);
+    if (anon >= 0 && g_rss_anon_start >= 0) {
+        fprintf(stderr, "[PepperOpt2]   RssAnon %.1f -> %.1f MB, RssFile %.1f -> %.1f MB "
+                "(start -> exit)\n",
+                g_rss_anon_start / 1024.0, anon / 1024.0,
+                g_rss_file_start / 1024.0, file / 1024.0);
+    }
+    pthread_mutex_unlock(&g_rawcache_mutex);
+}
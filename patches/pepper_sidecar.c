@@ -0,0 +1,241 @@
+/*
+ * pepper_sidecar.c - Answer image inflates from an LZ4 sidecar file
+ *
+ * tools/build_sidecar writes an LZ4 copy of every Assets.dat image, keyed
+ * by image table index and by a hash of the original zlib stream. With
+ * PEPPER_SIDECAR=path, the sidecar is mapped once Assets.dat is opened,
+ * provided it was built from this exact Assets.dat (same size and table
+ * hash). When the engine then inflates a stream (pepper_zlib.c hooks):
+ *   - the input pointer is traced back to a file offset through the
+ *     recent freads of Assets.dat (pepper_asset_source),
+ *   - the offset gives the image index (pepper_asset_index_find),
+ *   - the engine's compressed bytes are hashed and compared with the
+ *     sidecar's source hash,
+ *   - and on a match the pixels are decoded with LZ4 instead.
+ * Everything else goes to the normal inflate path. Assets.dat itself is
+ * never modified.
+ *
+ * Needs -DUSE_LZ4 and -llz4; without them the variable is ignored.
+ *
+ * Environment variables:
+ *   PEPPER_SIDECAR=path           - Sidecar written by tools/build_sidecar
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Sidecar format (same layout as tools/build_sidecar.c)
+// ============================================================================
+
+#define SIDECAR_MAGIC "PEPLZ4\0\1"
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t source_size;
+    uint64_t tables_hash;
+} SidecarHeader;
+
+typedef struct {
+    uint64_t source_hash;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t raw_size;
+    uint32_t stream_len;
+    uint32_t stream_start;
+    uint32_t reserved;
+} SidecarEntry;
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static const char* g_sidecar_path = NULL;
+
+// ============================================================================
+// Sidecar state
+// ============================================================================
+
+// Readers (inflate hooks) hold it shared; open/close take it exclusively
+static pthread_rwlock_t g_sidecar_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int g_sidecar_refs = 0;
+static int g_sidecar_active = 0;
+
+static const uint8_t* g_map = NULL;
+static size_t g_map_size = 0;
+static const SidecarEntry* g_entries = NULL;
+static uint32_t g_entry_count = 0;
+static PepperAssetIndex g_index;
+
+// Map the sidecar and check it matches the Assets.dat open on `fd`
+static int load_sidecar(int fd, size_t size) {
+    int side = open(g_sidecar_path, O_RDONLY | O_CLOEXEC);
+    if (side < 0) {
+        fprintf(stderr, "[PepperOpt2] Cannot open sidecar %s\n", g_sidecar_path);
+        return -1;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(side, &st) == 0 && (size_t)st.st_size >= sizeof(SidecarHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, side, 0);
+    }
+    close(side);
+    if (map == MAP_FAILED) return -1;
+
+    const SidecarHeader* header = map;
+    in_malloc = 1;
+    uint8_t* tables = malloc(PEPPER_TABLES_SIZE);
+    in_malloc = 0;
+    int ok = tables && memcmp(header->magic, SIDECAR_MAGIC, sizeof(header->magic)) == 0 &&
+             sizeof(SidecarHeader) + (size_t)header->count * sizeof(SidecarEntry) <= (size_t)st.st_size &&
+             header->source_size == size &&
+             pread(fd, tables, PEPPER_TABLES_SIZE, 0) == PEPPER_TABLES_SIZE &&
+             header->tables_hash == pepper_hash64(tables, PEPPER_TABLES_SIZE);
+    in_malloc = 1;
+    free(tables);
+    in_malloc = 0;
+    if (!ok) {
+        fprintf(stderr, "[PepperOpt2] Sidecar %s does not match this Assets.dat, ignoring it\n",
+                g_sidecar_path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    if (pepper_asset_index_load(fd, size, &g_index) != 0) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    g_map = map;
+    g_map_size = st.st_size;
+    g_entries = (const SidecarEntry*)(g_map + sizeof(SidecarHeader));
+    g_entry_count = header->count;
+    return 0;
+}
+
+static void unload_sidecar(void) {
+    if (g_map) munmap((void*)g_map, g_map_size);
+    pepper_asset_index_free(&g_index);
+    g_map = NULL;
+    g_entries = NULL;
+    g_entry_count = 0;
+}
+
+// ============================================================================
+// Hooks from pepper_assetio.c
+// ============================================================================
+
+int pepper_sidecar_enabled(void) {
+    return g_sidecar_path && !g_disabled;
+}
+
+void pepper_sidecar_open(const char* path, size_t size) {
+    if (!pepper_sidecar_enabled() || size < PEPPER_TABLES_SIZE) return;
+
+    pthread_rwlock_wrlock(&g_sidecar_lock);
+    if (g_sidecar_refs++ == 0) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            g_sidecar_active = load_sidecar(fd, size) == 0;
+            close(fd);
+        }
+        if (g_verbose && g_sidecar_active) {
+            fprintf(stderr, "[PepperOpt2] Sidecar %s: %u images\n", g_sidecar_path, g_entry_count);
+        }
+    }
+    pthread_rwlock_unlock(&g_sidecar_lock);
+}
+
+void pepper_sidecar_close(void) {
+    pthread_rwlock_wrlock(&g_sidecar_lock);
+    if (g_sidecar_refs > 0 && --g_sidecar_refs == 0) {
+        g_sidecar_active = 0;
+        unload_sidecar();
+    }
+    pthread_rwlock_unlock(&g_sidecar_lock);
+}
+
+// ============================================================================
+// Hook from pepper_zlib.c
+// ============================================================================
+
+int pepper_sidecar_take(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap,
+                        size_t* in_used, size_t* out_len) {
+#ifdef USE_LZ4
+    if (!__atomic_load_n(&g_sidecar_active, __ATOMIC_RELAXED)) return -1;
+
+    size_t offset;
+    if (pepper_asset_source(in, &offset) != 0) return -1;
+
+    int ret = -1;
+    pthread_rwlock_rdlock(&g_sidecar_lock);
+    size_t pos = g_sidecar_active ? pepper_asset_index_find(&g_index, offset) : g_index.count;
+    if (pos < g_index.count && g_index.entries[pos].kind == PEPPER_KIND_IMAGE &&
+        g_index.entries[pos].index < g_entry_count) {
+        const PepperEntry* entry = &g_index.entries[pos];
+        const SidecarEntry* s = &g_entries[entry->index];
+        if (s->offset && (size_t)s->offset + s->size <= g_map_size &&
+            offset == (size_t)entry->offset + s->stream_start &&
+            in_len >= s->stream_len && out_cap >= s->raw_size &&
+            pepper_hash64(in, s->stream_len) == s->source_hash &&
+            LZ4_decompress_safe((const char*)g_map + s->offset, (char*)out, (int)s->size,
+                                (int)(out_cap < INT32_MAX ? out_cap : INT32_MAX)) == (int)s->raw_size) {
+            *in_used = s->stream_len;
+            *out_len = s->raw_size;
+            ret = 0;
+        }
+    }
+    pthread_rwlock_unlock(&g_sidecar_lock);
+
+    if (ret == 0) {
+        pepper_stat_add(PEPPER_STAT_SIDECAR_HITS, 1);
+        pepper_stat_add(PEPPER_STAT_SIDECAR_BYTES, *out_len);
+    } else {
+        pepper_stat_add(PEPPER_STAT_SIDECAR_MISSES, 1);
+    }
+    return ret;
+#else
+    (void)in; (void)in_len; (void)out; (void)out_cap; (void)in_used; (void)out_len;
+    return -1;
+#endif
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+void pepper_sidecar_init(void) {
+    g_sidecar_path = pepper_env_str("PEPPER_SIDECAR");
+    if (!pepper_sidecar_enabled()) return;
+
+#ifdef USE_LZ4
+    fprintf(stderr, "[PepperOpt2] Sidecar: ENABLED (%s)\n", g_sidecar_path);
+#else
+    fprintf(stderr, "[PepperOpt2] Sidecar: ignored (built without USE_LZ4)\n");
+    g_sidecar_path = NULL;
+#endif
+}
+
+void pepper_sidecar_summary(void) {
+    if (!pepper_sidecar_enabled()) return;
+
+    fprintf(stderr, "[PepperOpt2]   Sidecar decodes: %zu (%.2f MB out), %zu passed to inflate\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_SIDECAR_HITS),
+            (size_t)pepper_stat_get(PEPPER_STAT_SIDECAR_BYTES) / 1024.0 / 1024.0,
+            (size_t)pepper_stat_get(PEPPER_STAT_SIDECAR_MISSES));
+}
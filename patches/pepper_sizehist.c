@@ -0,0 +1,356 @@
+/*
+ * pepper_sizehist.c - Allocation histograms by power-of-two size class
+ *
+ * Shows which size bands hold the memory and which of them are never
+ * freed, e.g. whether the 16 KB - 64 KB pixel buffers stay live for the
+ * whole session, which is what PEPPER_ARENA_MIN_KB and the slab classes
+ * should be tuned against. For each class (by malloc_usable_size, so what the
+ * allocator really handed out):
+ *   - allocations, and bytes allocated in total;
+ *   - live bytes, and the most that were live at once;
+ *   - how long blocks lived, for one in PEPPER_SIZEHIST_SAMPLE
+ *     allocations, and how many of those are still live.
+ *
+ * Counting adds no atomics or locks to the malloc path: each thread adds
+ * to its own counters. A helper thread sums them every
+ * 10 ms to keep the peaks (so a peak shorter than that can be missed).
+ * Only the timed allocations take a lock, and only their frees do more
+ * than a table lookup that nearly always misses.
+ *
+ * The table is printed at exit, and on PEPPER_DUMP_SIGNAL (SIGUSR2 by
+ * default).
+ *
+ * Environment variables:
+ *   PEPPER_SIZEHIST=1             - Enable (default 0)
+ *   PEPPER_SIZEHIST_SAMPLE=256    - Time one in N allocations (0 = no
+ *                                   lifetimes)
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+#define SIZE_CLASSES 24               // < 32 bytes, then one per power of two
+#define LIFETIME_BUCKETS 8
+#define POLL_MS 10
+#define SAMPLE_SLOTS (1 << 17)
+
+int g_size_hist = 0;
+static uint32_t g_sample_every = 256;
+
+// Upper edges of the lifetime buckets, in microseconds; the last is open
+static const uint64_t g_lifetime_edges[LIFETIME_BUCKETS - 1] = {
+    1000, 10000, 100000, 1000000, 10000000, 60000000, 600000000,
+};
+static const char* g_lifetime_names[LIFETIME_BUCKETS] = {
+    "<1ms", "<10ms", "<0.1s", "<1s", "<10s", "<1m", "<10m", "more",
+};
+
+static inline int size_class(size_t size) {
+    if (size < 32) return 0;
+    int cls = 63 - __builtin_clzll(size) - 4;
+    return cls < SIZE_CLASSES ? cls : SIZE_CLASSES - 1;
+}
+
+// ============================================================================
+// Per-thread counters
+// ============================================================================
+
+typedef struct HistBlock {
+    uint64_t allocs[SIZE_CLASSES];
+    uint64_t bytes_in[SIZE_CLASSES];
+    uint64_t bytes_out[SIZE_CLASSES];
+    int owned;                        // a live thread counts into it
+    struct HistBlock* next;
+} HistBlock;
+
+static PEPPER_TLS HistBlock* t_block = NULL;
+static PEPPER_TLS uint32_t t_sample_countdown = 0;
+static HistBlock* g_blocks = NULL;
+static HistBlock g_retired;           // counts of exited threads
+static pthread_mutex_t g_hist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_thread_key;
+
+// Merged view, and the peaks seen by the poller (under g_hist_mutex)
+typedef struct {
+    uint64_t allocs[SIZE_CLASSES];
+    uint64_t bytes_in[SIZE_CLASSES];
+    int64_t live[SIZE_CLASSES];
+} HistTotals;
+
+static int64_t g_peak_live[SIZE_CLASSES];
+static int64_t g_peak_total = 0;
+
+// Only the owner writes; other threads read with relaxed loads
+static inline void bump(uint64_t* counter, uint64_t by) {
+    __atomic_store_n(counter, *counter + by, __ATOMIC_RELAXED);
+}
+
+static void add_block(HistTotals* totals, const HistBlock* block) {
+    for (int c = 0; c < SIZE_CLASSES; c++) {
+        totals->allocs[c] += __atomic_load_n(&block->allocs[c], __ATOMIC_RELAXED);
+        totals->bytes_in[c] += __atomic_load_n(&block->bytes_in[c], __ATOMIC_RELAXED);
+        totals->live[c] += (int64_t)(__atomic_load_n(&block->bytes_in[c], __ATOMIC_RELAXED) -
+                                     __atomic_load_n(&block->bytes_out[c], __ATOMIC_RELAXED));
+    }
+}
+
+// Sum every thread's counters and update the peaks. Needs g_hist_mutex.
+static void merge(HistTotals* totals) {
+    memset(totals, 0, sizeof(*totals));
+    add_block(totals, &g_retired);
+    for (HistBlock* b = __atomic_load_n(&g_blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+        add_block(totals, b);
+    }
+    int64_t total = 0;
+    for (int c = 0; c < SIZE_CLASSES; c++) {
+        // A block allocated by the library itself but freed by the game
+        // (or the other way round) can leave a class slightly negative
+        if (totals->live[c] < 0) totals->live[c] = 0;
+        if (totals->live[c] > g_peak_live[c]) g_peak_live[c] = totals->live[c];
+        total += totals->live[c];
+    }
+    if (total > g_peak_total) g_peak_total = total;
+}
+
+// Fold an exiting thread's counts into g_retired and hand the block on
+static void thread_exit(void* arg) {
+    HistBlock* block = arg;
+    pthread_mutex_lock(&g_hist_mutex);
+    for (int c = 0; c < SIZE_CLASSES; c++) {
+        g_retired.allocs[c] += block->allocs[c];
+        g_retired.bytes_in[c] += block->bytes_in[c];
+        g_retired.bytes_out[c] += block->bytes_out[c];
+    }
+    memset(block, 0, offsetof(HistBlock, owned));
+    t_block = NULL;
+    __atomic_store_n(&block->owned, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_hist_mutex);
+}
+
+static HistBlock* thread_block(void) {
+    HistBlock* block;
+    for (block = __atomic_load_n(&g_blocks, __ATOMIC_ACQUIRE); block; block = block->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&block->owned, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!block) {
+        block = mmap(NULL, sizeof(HistBlock), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) return NULL;
+        block->owned = 1;
+        block->next = __atomic_load_n(&g_blocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&g_blocks, &block->next, block, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    t_block = block;
+
+    // pthread_setspecific may allocate; keep that out of the counts
+    in_malloc = 1;
+    pthread_setspecific(g_thread_key, block);
+    in_malloc = 0;
+    return block;
+}
+
+// ============================================================================
+// Lifetimes
+// ============================================================================
+
+static PepperPtrMap g_timed;          // allocation time in us << 8 | class
+static uint64_t g_lifetimes[SIZE_CLASSES][LIFETIME_BUCKETS];
+static uint64_t g_timed_live[SIZE_CLASSES];
+static size_t g_timed_dropped = 0;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void time_block(void* ptr, int cls) {
+    uint64_t value = now_us() << 8 | (uint64_t)cls;
+    pthread_mutex_lock(&g_hist_mutex);
+    if (pepper_ptrmap_put(&g_timed, (uintptr_t)ptr, value) == 0) {
+        g_timed_live[cls]++;
+    } else {
+        g_timed_dropped++;
+    }
+    pthread_mutex_unlock(&g_hist_mutex);
+}
+
+static void end_lifetime(void* ptr) {
+    uint64_t value;
+    pthread_mutex_lock(&g_hist_mutex);
+    if (pepper_ptrmap_take(&g_timed, (uintptr_t)ptr, &value) == 0) {
+        int cls = (int)(value & 0xff);
+        uint64_t lived = now_us() - (value >> 8);
+        int bucket = 0;
+        while (bucket < LIFETIME_BUCKETS - 1 && lived >= g_lifetime_edges[bucket]) bucket++;
+        g_lifetimes[cls][bucket]++;
+        g_timed_live[cls]--;
+    }
+    pthread_mutex_unlock(&g_hist_mutex);
+}
+
+// ============================================================================
+// Hooks from pepper_optimizer_v2.c
+// ============================================================================
+
+int pepper_sizehist_enabled(void) {
+    return g_size_hist;
+}
+
+void pepper_sizehist_alloc(void* ptr, size_t usable) {
+    HistBlock* block = t_block;
+    if (!block && !(block = thread_block())) return;
+    int cls = size_class(usable);
+    bump(&block->allocs[cls], 1);
+    bump(&block->bytes_in[cls], usable);
+    if (g_sample_every && --t_sample_countdown >= g_sample_every) {
+        // Wrapped past 0 (or first call)
+        t_sample_countdown = g_sample_every - 1;
+        time_block(ptr, cls);
+    }
+}
+
+void pepper_sizehist_free(void* ptr, size_t usable) {
+    HistBlock* block = t_block;
+    if (!block && !(block = thread_block())) return;
+    int cls = size_class(usable);
+    bump(&block->bytes_out[cls], usable);
+    if (g_sample_every && pepper_ptrmap_maybe(&g_timed, (uintptr_t)ptr)) end_lifetime(ptr);
+}
+
+// ============================================================================
+// Report
+// ============================================================================
+
+static const char* size_label(char* buf, size_t cap, uint64_t bytes) {
+    if (bytes >= (1ull << 20)) snprintf(buf, cap, "%lluM", (unsigned long long)(bytes >> 20));
+    else if (bytes >= 1024) snprintf(buf, cap, "%lluK", (unsigned long long)(bytes >> 10));
+    else snprintf(buf, cap, "%llu", (unsigned long long)bytes);
+    return buf;
+}
+
+static void print_table(const char* prefix) {
+    HistTotals totals;
+    uint64_t lifetimes[SIZE_CLASSES][LIFETIME_BUCKETS];
+    uint64_t timed_live[SIZE_CLASSES];
+    pthread_mutex_lock(&g_hist_mutex);
+    merge(&totals);
+    memcpy(lifetimes, g_lifetimes, sizeof(lifetimes));
+    memcpy(timed_live, g_timed_live, sizeof(timed_live));
+    int64_t peak_live[SIZE_CLASSES];
+    memcpy(peak_live, g_peak_live, sizeof(peak_live));
+    int64_t peak_total = g_peak_total;
+    pthread_mutex_unlock(&g_hist_mutex);
+
+    fprintf(stderr, "%s%-9s %10s %9s %9s %10s", prefix, "size", "allocs", "live MB", "peak MB",
+            "total MB");
+    if (g_sample_every) {
+        for (int b = 0; b < LIFETIME_BUCKETS; b++) fprintf(stderr, " %5s", g_lifetime_names[b]);
+        fprintf(stderr, " %5s", "live");
+    }
+    fputc('\n', stderr);
+
+    int64_t live_total = 0;
+    for (int c = 0; c < SIZE_CLASSES; c++) {
+        live_total += totals.live[c];
+        if (!totals.allocs[c]) continue;
+        char lo[16], hi[16], range[40];
+        if (c == 0) snprintf(range, sizeof(range), "<32");
+        else if (c == SIZE_CLASSES - 1) snprintf(range, sizeof(range), ">=%s",
+                                                 size_label(lo, sizeof(lo), 16ull << c));
+        else snprintf(range, sizeof(range), "%s-%s", size_label(lo, sizeof(lo), 16ull << c),
+                      size_label(hi, sizeof(hi), 32ull << c));
+        fprintf(stderr, "%s%-9s %10llu %9.2f %9.2f %10.1f", prefix, range,
+                (unsigned long long)totals.allocs[c], totals.live[c] / 1048576.0,
+                peak_live[c] / 1048576.0, totals.bytes_in[c] / 1048576.0);
+        if (g_sample_every) {
+            // Share of this class's timed blocks, by how long they lived
+            uint64_t timed = timed_live[c];
+            for (int b = 0; b < LIFETIME_BUCKETS; b++) timed += lifetimes[c][b];
+            for (int b = 0; b <= LIFETIME_BUCKETS; b++) {
+                uint64_t n = b < LIFETIME_BUCKETS ? lifetimes[c][b] : timed_live[c];
+                if (timed) fprintf(stderr, " %4.0f%%", 100.0 * n / timed);
+                else fprintf(stderr, " %5s", "-");
+            }
+        }
+        fputc('\n', stderr);
+    }
+    fprintf(stderr, "%s%-9s %10s %9.2f %9.2f\n", prefix, "all", "", live_total / 1048576.0,
+            peak_total / 1048576.0);
+}
+
+static void dump_table(void) {
+    fprintf(stderr, "[PepperOpt2] Size classes:\n");
+    print_table("[PepperOpt2]   ");
+}
+
+// Keeps the peaks; runs for the whole session
+static void* poll_main(void* arg) {
+    (void)arg;
+    in_malloc = 1;
+    struct timespec delay = { 0, POLL_MS * 1000000L };
+    for (;;) {
+        nanosleep(&delay, NULL);
+        HistTotals totals;
+        pthread_mutex_lock(&g_hist_mutex);
+        merge(&totals);
+        pthread_mutex_unlock(&g_hist_mutex);
+    }
+    return NULL;
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+void pepper_sizehist_init(void) {
+    if (!pepper_env_int("PEPPER_SIZEHIST", 0)) return;
+    int every = pepper_env_int("PEPPER_SIZEHIST_SAMPLE", 256);
+    g_sample_every = every > 0 ? (uint32_t)every : 0;
+    if (g_sample_every && pepper_ptrmap_init(&g_timed, SAMPLE_SLOTS) != 0) {
+        fprintf(stderr, "[PepperOpt2] Size classes: out of memory, disabled\n");
+        return;
+    }
+    pthread_key_create(&g_thread_key, thread_exit);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, poll_main, NULL) == 0) pthread_detach(thread);
+    int dump_signal = pepper_on_dump_signal(dump_table);
+
+    __atomic_store_n(&g_size_hist, 1, __ATOMIC_RELEASE);
+    fprintf(stderr, "[PepperOpt2] Size classes: ENABLED (lifetimes of 1 in %u allocations",
+            g_sample_every);
+    if (dump_signal > 0) fprintf(stderr, ", dump with kill -%d %d", dump_signal, (int)getpid());
+    fprintf(stderr, ")\n");
+}
+
+void pepper_sizehist_summary(void) {
+    if (!pepper_sizehist_enabled()) return;
+    fprintf(stderr, "[PepperOpt2]   Size classes (usable bytes; peaks every %d ms; lifetimes of "
+            "1 in %u allocations):\n", POLL_MS, g_sample_every);
+    print_table("[PepperOpt2]     ");
+    if (g_timed_dropped) {
+        fprintf(stderr, "[PepperOpt2]   Size classes: %zu allocations not timed (table full)\n",
+                g_timed_dropped);
+    }
+}
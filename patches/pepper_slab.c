@@ -0,0 +1,376 @@
+/*
+ * pepper_slab.c - Size-class slab allocator for small objects
+ *
+ * Chowdren keeps thousands of 16 KB - 1 MB buffers for the whole session,
+ * with short-lived small objects allocated in between. In glibc's heap the
+ * small objects end up wedged between the big ones, so their memory can
+ * never be given back. With PEPPER_SLAB=1 the malloc hooks in
+ * pepper_optimizer_v2.c become a complete allocator:
+ *
+ *   - Allocations of PEPPER_ARENA_MIN_KB or more go to pepper_arena.c as
+ *     page runs. PEPPER_SLAB turns the arena on.
+ *   - Smaller ones come from 64 KB spans in a reserved region. Each span
+ *     holds objects of one size class (16 bytes to 16 KB, four classes per
+ *     power of two). The span is found from the pointer, so no per-object
+ *     header is needed.
+ *   - Each thread keeps a short free list per class. Most malloc/free pairs
+ *     never take a lock. Lists that get too long go back to their spans in
+ *     batches.
+ *   - A span whose objects are all free is given back to the kernel with
+ *     MADV_DONTNEED straight away, unless it is its class's last one.
+ *
+ * Sizes above 16 KB but below the arena's minimum still go to glibc, and
+ * so does anything allocated before the library's constructor ran.
+ *
+ * Environment variables:
+ *   PEPPER_SLAB=1                 - Enable (default 0)
+ *   PEPPER_SLAB_MB=512            - Address space to reserve for spans
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Size classes
+// ============================================================================
+
+#define SPAN_SIZE (64 * 1024)
+#define SLAB_MAX_SIZE 16384
+#define SLAB_CLASSES 36            // 8 classes to 128 bytes, then 4 per doubling
+#define TCACHE_BYTES (32 * 1024)   // most a thread keeps per class
+
+static uint32_t g_class_size[SLAB_CLASSES];
+static uint32_t g_class_objects[SLAB_CLASSES];  // objects per span
+static uint32_t g_class_cache[SLAB_CLASSES];    // thread cache length limit
+static uint8_t g_size_class[SLAB_MAX_SIZE / 16 + 1];
+
+static void build_classes(void) {
+    int c = 0;
+    for (uint32_t size = 16; size <= 128; size += 16) g_class_size[c++] = size;
+    for (uint32_t base = 128; base < SLAB_MAX_SIZE; base *= 2) {
+        for (int step = 1; step <= 4; step++) g_class_size[c++] = base + step * base / 4;
+    }
+    for (c = 0; c < SLAB_CLASSES; c++) {
+        uint32_t size = g_class_size[c];
+        g_class_objects[c] = SPAN_SIZE / size;
+        uint32_t cache = TCACHE_BYTES / size;
+        g_class_cache[c] = cache < 4 ? 4 : cache > 64 ? 64 : cache;
+    }
+    c = 0;
+    for (uint32_t i = 0; i <= SLAB_MAX_SIZE / 16; i++) {
+        while (g_class_size[c] < i * 16) c++;
+        g_size_class[i] = (uint8_t)c;
+    }
+}
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static int g_slab = 0;
+
+// Stats (span counts under g_span_mutex)
+static size_t g_spans_live = 0;
+static size_t g_spans_peak = 0;
+
+// ============================================================================
+// Spans
+// ============================================================================
+
+typedef struct SlabSpan {
+    void* free_list;          // freed objects, linked through their first word
+    struct SlabSpan* next;    // class partial list, or the free span list
+    uint32_t bump;            // objects from here on were never handed out
+    uint32_t used;            // objects out, thread caches included
+    uint8_t cls;
+    uint8_t listed;           // on its class's partial list
+} SlabSpan;
+
+typedef struct {
+    pthread_mutex_t lock;
+    SlabSpan* partial;        // spans with at least one object available
+    size_t spans;
+} SlabClass;
+
+static uint8_t* g_base = NULL;
+static size_t g_size = 0;
+static SlabSpan* g_spans = NULL;
+static size_t g_span_count = 0;
+static size_t g_span_high = 0;          // spans below this have been used
+static SlabSpan* g_free_spans = NULL;
+static pthread_mutex_t g_span_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SlabClass g_classes[SLAB_CLASSES];
+
+static inline SlabSpan* span_of(const void* ptr) {
+    return &g_spans[((const uint8_t*)ptr - g_base) / SPAN_SIZE];
+}
+
+static inline uint8_t* span_start(const SlabSpan* span) {
+    return g_base + (size_t)(span - g_spans) * SPAN_SIZE;
+}
+
+static SlabSpan* new_span(int cls) {
+    pthread_mutex_lock(&g_span_mutex);
+    SlabSpan* span = g_free_spans;
+    if (span) {
+        g_free_spans = span->next;
+    } else if (g_span_high < g_span_count) {
+        span = &g_spans[g_span_high++];
+    }
+    if (span && ++g_spans_live > g_spans_peak) g_spans_peak = g_spans_live;
+    pepper_stat_set(PEPPER_STAT_SLAB_SPANS_LIVE, g_spans_live);
+    pthread_mutex_unlock(&g_span_mutex);
+    if (!span) return NULL;
+
+    memset(span, 0, sizeof(*span));
+    span->cls = (uint8_t)cls;
+    return span;
+}
+
+static void release_span(SlabSpan* span) {
+    madvise(span_start(span), SPAN_SIZE, MADV_DONTNEED);
+    pthread_mutex_lock(&g_span_mutex);
+    span->next = g_free_spans;
+    g_free_spans = span;
+    g_spans_live--;
+    pepper_stat_set(PEPPER_STAT_SLAB_SPANS_LIVE, g_spans_live);
+    pepper_stat_add(PEPPER_STAT_SLAB_SPANS_RETURNED, 1);
+    pthread_mutex_unlock(&g_span_mutex);
+}
+
+static void unlink_partial(SlabClass* sc, SlabSpan* span) {
+    for (SlabSpan** p = &sc->partial; *p; p = &(*p)->next) {
+        if (*p == span) {
+            *p = span->next;
+            break;
+        }
+    }
+    span->listed = 0;
+}
+
+// ============================================================================
+// Thread caches
+// ============================================================================
+
+typedef struct {
+    void* head;
+    uint32_t count;
+} CacheBin;
+
+static __thread CacheBin t_bins[SLAB_CLASSES];
+static __thread int t_registered = 0;
+static pthread_key_t g_thread_key;
+
+// Move up to `want` objects of class `cls` into `bin`. Returns how many.
+static uint32_t refill(int cls, CacheBin* bin, uint32_t want) {
+    SlabClass* sc = &g_classes[cls];
+    uint32_t got = 0;
+    pthread_mutex_lock(&sc->lock);
+    while (got < want) {
+        SlabSpan* span = sc->partial;
+        if (!span) {
+            span = new_span(cls);
+            if (!span) break;
+            span->listed = 1;
+            span->next = sc->partial;
+            sc->partial = span;
+            sc->spans++;
+        }
+        while (got < want && span->free_list) {
+            void* obj = span->free_list;
+            span->free_list = *(void**)obj;
+            *(void**)obj = bin->head;
+            bin->head = obj;
+            span->used++;
+            got++;
+        }
+        while (got < want && span->bump < g_class_objects[cls]) {
+            void* obj = span_start(span) + (size_t)span->bump++ * g_class_size[cls];
+            *(void**)obj = bin->head;
+            bin->head = obj;
+            span->used++;
+            got++;
+        }
+        if (!span->free_list && span->bump == g_class_objects[cls]) {
+            sc->partial = span->next;
+            span->listed = 0;
+        }
+    }
+    pthread_mutex_unlock(&sc->lock);
+    pepper_stat_add(PEPPER_STAT_SLAB_REFILLS, 1);
+    bin->count += got;
+    return got;
+}
+
+// Return `count` objects from the front of `bin` to their spans
+static void flush(int cls, CacheBin* bin, uint32_t count) {
+    SlabClass* sc = &g_classes[cls];
+    pthread_mutex_lock(&sc->lock);
+    for (uint32_t i = 0; i < count && bin->head; i++) {
+        void* obj = bin->head;
+        bin->head = *(void**)obj;
+        bin->count--;
+
+        SlabSpan* span = span_of(obj);
+        *(void**)obj = span->free_list;
+        span->free_list = obj;
+        span->used--;
+        if (span->used == 0 && sc->spans > 1) {
+            // Empty: the pages go back now, unless this is the last span
+            if (span->listed) unlink_partial(sc, span);
+            sc->spans--;
+            release_span(span);
+        } else if (!span->listed) {
+            span->listed = 1;
+            span->next = sc->partial;
+            sc->partial = span;
+        }
+    }
+    pthread_mutex_unlock(&sc->lock);
+    pepper_stat_add(PEPPER_STAT_SLAB_FLUSHES, 1);
+}
+
+static void thread_exit(void* unused) {
+    (void)unused;
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        if (t_bins[cls].count) flush(cls, &t_bins[cls], t_bins[cls].count);
+    }
+}
+
+// Arm thread_exit the first time this thread touches its bins, from a free
+// as well: a thread that only frees still fills them
+static void register_thread(void) {
+    // pthread_setspecific may allocate; keep that inside glibc
+    int saved = in_malloc;
+    t_registered = 1;
+    in_malloc = 1;
+    pthread_setspecific(g_thread_key, (void*)1);
+    in_malloc = saved;
+}
+
+// ============================================================================
+// Hooks from pepper_optimizer_v2.c
+// ============================================================================
+
+int pepper_slab_enabled(void) {
+    return g_slab && g_base && !g_disabled;
+}
+
+void* pepper_slab_alloc(size_t size) {
+    if (!g_base || size > SLAB_MAX_SIZE) return NULL;
+    int cls = g_size_class[(size + 15) / 16];
+    CacheBin* bin = &t_bins[cls];
+
+    if (!bin->head) {
+        if (!t_registered) register_thread();
+        uint32_t want = g_class_cache[cls] / 2;
+        if (refill(cls, bin, want ? want : 1) == 0) return NULL;
+    }
+    void* obj = bin->head;
+    bin->head = *(void**)obj;
+    bin->count--;
+    return obj;
+}
+
+size_t pepper_slab_size(const void* ptr) {
+    if (!g_base || (const uint8_t*)ptr < g_base || (const uint8_t*)ptr >= g_base + g_size) return 0;
+    return g_class_size[span_of(ptr)->cls];
+}
+
+int pepper_slab_free(void* ptr) {
+    if (!g_base || (uint8_t*)ptr < g_base || (uint8_t*)ptr >= g_base + g_size) return -1;
+    int cls = span_of(ptr)->cls;
+    CacheBin* bin = &t_bins[cls];
+    if (!t_registered) register_thread();
+    *(void**)ptr = bin->head;
+    bin->head = ptr;
+    if (++bin->count > g_class_cache[cls]) flush(cls, bin, bin->count / 2);
+    return 0;
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+// Like glibc's arenas: hold every lock across fork() so the child never
+// inherits one taken by a thread that does not exist there. Class locks
+// come first, as refill() takes g_span_mutex inside one.
+static void before_fork(void) {
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) pthread_mutex_lock(&g_classes[cls].lock);
+    pthread_mutex_lock(&g_span_mutex);
+}
+
+static void after_fork(void) {
+    pthread_mutex_unlock(&g_span_mutex);
+    for (int cls = SLAB_CLASSES - 1; cls >= 0; cls--) pthread_mutex_unlock(&g_classes[cls].lock);
+}
+
+void pepper_slab_init(void) {
+    g_slab = pepper_env_int("PEPPER_SLAB", 0);
+    if (!g_slab || g_disabled) return;
+
+    int size_mb = pepper_env_int("PEPPER_SLAB_MB", 512);
+    if (size_mb < 1) size_mb = 1;
+    build_classes();
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        pthread_mutex_init(&g_classes[cls].lock, NULL);
+    }
+    pthread_key_create(&g_thread_key, thread_exit);
+
+    // Spans are SPAN_SIZE-aligned so an object's span is a shift away
+    g_span_count = ((size_t)size_mb << 20) / SPAN_SIZE;
+    g_size = g_span_count * SPAN_SIZE;
+    g_spans = mmap(NULL, g_span_count * sizeof(SlabSpan), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint8_t* raw = mmap(NULL, g_size + SPAN_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (g_spans == MAP_FAILED || raw == MAP_FAILED) {
+        fprintf(stderr, "[PepperOpt2] Slab: could not reserve %d MB, disabled\n", size_mb);
+        g_slab = 0;
+        return;
+    }
+    uint8_t* base = (uint8_t*)(((uintptr_t)raw + SPAN_SIZE - 1) & ~(uintptr_t)(SPAN_SIZE - 1));
+    if (base > raw) munmap(raw, base - raw);
+    munmap(base + g_size, raw + SPAN_SIZE - base);
+    __atomic_store_n(&g_base, base, __ATOMIC_RELEASE);
+    pthread_atfork(before_fork, after_fork, after_fork);
+
+    fprintf(stderr, "[PepperOpt2] Slab: ENABLED (%d MB of 64 KB spans, %d classes up to %d KB)\n",
+            size_mb, SLAB_CLASSES, SLAB_MAX_SIZE / 1024);
+}
+
+void pepper_slab_summary(void) {
+    if (!pepper_slab_enabled()) return;
+
+    // Objects in thread caches count as out
+    size_t objects = 0, object_bytes = 0;
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        pthread_mutex_lock(&g_classes[cls].lock);
+        for (size_t i = 0; i < g_span_high; i++) {
+            if (g_spans[i].cls == cls) {
+                objects += g_spans[i].used;
+                object_bytes += (size_t)g_spans[i].used * g_class_size[cls];
+            }
+        }
+        pthread_mutex_unlock(&g_classes[cls].lock);
+    }
+    size_t refills = (size_t)pepper_stat_get(PEPPER_STAT_SLAB_REFILLS);
+    size_t flushes = (size_t)pepper_stat_get(PEPPER_STAT_SLAB_FLUSHES);
+    pthread_mutex_lock(&g_span_mutex);
+    fprintf(stderr, "[PepperOpt2]   Slab: %zu objects out (%.2f MB) in %zu spans (%.2f MB), "
+            "peak %zu spans\n",
+            objects, object_bytes / 1024.0 / 1024.0, g_spans_live,
+            g_spans_live * (double)SPAN_SIZE / 1024.0 / 1024.0, g_spans_peak);
+    fprintf(stderr, "[PepperOpt2]   Slab: %zu thread cache refills, %zu flushes, "
+            "%zu empty spans returned to the kernel\n",
+            refills, flushes, (size_t)pepper_stat_get(PEPPER_STAT_SLAB_SPANS_RETURNED));
+    pthread_mutex_unlock(&g_span_mutex);
+}
@@ -0,0 +1,514 @@
+/*
+ * pepper_stage.c - Inflate images ahead of the engine's loader
+ *
+ * The engine loads its ~10k images one after another on a single thread:
+ * fread the entry, inflate it, upload it, then the next one. The H700 has
+ * four cores. With PEPPER_STAGE=1, opening Assets.dat (see
+ * pepper_assetio.c) maps the file read-only, reads the image table and
+ * starts worker threads. The workers inflate the next PEPPER_STAGE_AHEAD
+ * images after the engine's current read position (in table order) into
+ * a staging cache. The cache never holds more than PEPPER_STAGE_BUDGET_MB
+ * of decoded pixels.
+ *
+ * When the engine inflates a stream (pepper_zlib.c hooks), the input
+ * pointer is matched against its recent freads of Assets.dat
+ * (pepper_asset_source) to find the file offset. If that image is staged
+ * and the engine's compressed bytes are identical to the file's, the
+ * decoded pixels are delivered. Large page-aligned outputs get the staged
+ * pages moved in with mremap(); everything else is a memcpy. A miss, a
+ * mismatch or an image the workers have not reached yet goes to the
+ * normal inflate path. Staged images the engine has moved past without
+ * inflating are dropped.
+ *
+ * Entries that share storage with an earlier entry (tools/dedup_repack)
+ * are only staged once, for the first one in load order.
+ *
+ * Environment variables:
+ *   PEPPER_STAGE=1                - Enable (default 0)
+ *   PEPPER_STAGE_THREADS=N        - Worker threads (default: cores - 1, max 3)
+ *   PEPPER_STAGE_AHEAD=32         - Images to stay ahead of the reader
+ *   PEPPER_STAGE_BUDGET_MB=32     - Cap on decoded pixels held at once
+ *   PEPPER_STAGE_REMAP=0          - Always memcpy, never mremap() pages
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+#define MAX_STAGE_THREADS 3
+#define IMAGE_HEADER_SIZE 50
+#define MMAP_THRESHOLD (64u << 10)    // staged buffers this big are mmap'd
+
+static int g_stage = 0;
+static int g_stage_threads = 1;
+static size_t g_stage_ahead = 32;
+static size_t g_stage_budget = 32u << 20;
+static int g_stage_remap = 1;
+static size_t g_page_size = 4096;
+
+// Stats
+static size_t g_stage_peak = 0;
+
+// ============================================================================
+// Staging state
+// ============================================================================
+
+typedef enum {
+    SLOT_EMPTY = 0,   // not decoded yet
+    SLOT_BUSY,        // a worker is decoding it
+    SLOT_READY,       // decoded, waiting for the engine
+    SLOT_FAILED,      // not an image we can stage
+    SLOT_TAKEN,       // delivered, dropped, or the engine got there first
+} SlotState;
+
+typedef struct {
+    uint8_t* data;
+    size_t len;             // decoded bytes
+    size_t reserved;        // bytes counted against the budget
+    uint32_t stream_offset; // file offset of the zlib stream
+    uint32_t in_used;       // compressed bytes consumed
+    uint8_t state;          // SlotState
+    uint8_t mapped;         // data came from mmap()
+} StageSlot;
+
+static pthread_mutex_t g_stage_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work_cond = PTHREAD_COND_INITIALIZER;   // workers wait here
+static pthread_cond_t g_ready_cond = PTHREAD_COND_INITIALIZER;  // the engine waits here
+static pthread_t g_workers[MAX_STAGE_THREADS];
+static int g_worker_count = 0;
+static int g_stage_refs = 0;           // open Assets.dat streams
+static int g_stage_running = 0;
+static int g_stage_stop = 0;
+
+static const uint8_t* g_map = NULL;
+static size_t g_map_size = 0;
+static PepperAssetIndex g_index;
+static StageSlot* g_slots = NULL;      // one per g_index entry
+
+static size_t g_cursor = 0;            // load-order position of the reader
+static size_t g_next = 0;              // next position for a worker to claim
+static size_t g_evicted_to = 0;        // positions below this have been swept
+static size_t g_staged = 0;            // bytes reserved right now
+
+// ============================================================================
+// Buffers
+// ============================================================================
+
+// Bytes a decoded image of `need` bytes costs against the budget
+static size_t buffer_cost(size_t need) {
+    return need >= MMAP_THRESHOLD ? (need + g_page_size - 1) & ~(g_page_size - 1) : need;
+}
+
+static uint8_t* alloc_buffer(size_t need, uint8_t* mapped) {
+    if (need >= MMAP_THRESHOLD) {
+        void* p = mmap(NULL, buffer_cost(need), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        *mapped = 1;
+        return p == MAP_FAILED ? NULL : p;
+    }
+    in_malloc = 1;
+    uint8_t* p = malloc(need);
+    in_malloc = 0;
+    *mapped = 0;
+    return p;
+}
+
+static void free_buffer(uint8_t* data, size_t reserved, uint8_t mapped) {
+    if (!data) return;
+    if (mapped) {
+        munmap(data, reserved);
+    } else {
+        in_malloc = 1;
+        free(data);
+        in_malloc = 0;
+    }
+}
+
+// Drop the slot's buffer and return its budget; caller holds g_stage_mutex
+static void release_slot(StageSlot* slot) {
+    free_buffer(slot->data, slot->reserved, slot->mapped);
+    g_staged -= slot->reserved;
+    slot->data = NULL;
+    slot->reserved = 0;
+    slot->state = SLOT_TAKEN;
+}
+
+// ============================================================================
+// Workers
+// ============================================================================
+
+static int is_zlib_header(const uint8_t* p) {
+    return (p[0] & 0x0F) == 8 && (p[0] >> 4) <= 7 && ((p[0] << 8) | p[1]) % 31 == 0;
+}
+
+// Locate the zlib stream of an image entry and its decoded size. Returns 0
+// on success.
+static int parse_image(const PepperEntry* entry, size_t* stream_offset, size_t* pixel_size) {
+    if (entry->size <= IMAGE_HEADER_SIZE + 2) return -1;
+    const uint8_t* data = g_map + entry->offset;
+    size_t width = data[0] | (data[1] << 8);
+    size_t height = data[2] | (data[3] << 8);
+    *pixel_size = width * height * 4;
+    if (*pixel_size == 0) return -1;
+
+    // The stream starts right after the header, but some re-encoded images
+    // put it elsewhere (see scripts/decode_images.py)
+    size_t start = IMAGE_HEADER_SIZE;
+    if (!is_zlib_header(data + start)) {
+        size_t limit = entry->size - 2 < 128 ? entry->size - 2 : 128;
+        for (start = 4; start < limit && !is_zlib_header(data + start); start++) {}
+        if (start >= limit) return -1;
+    }
+    *stream_offset = entry->offset + start;
+    return 0;
+}
+
+// Decode one claimed slot without holding the lock. Its budget was
+// reserved when it was claimed.
+static void decode_slot(size_t pos, size_t stream_offset, size_t need) {
+    const PepperEntry* entry = &g_index.entries[pos];
+    size_t reserved = buffer_cost(need), in_used = 0, len = 0;
+    uint8_t mapped = 0;
+    uint8_t* data = alloc_buffer(need, &mapped);
+    int ok = data && pepper_zlib_decode(g_map + stream_offset,
+                                        entry->offset + entry->size - stream_offset,
+                                        data, need, &in_used, &len) == 0;
+
+    pthread_mutex_lock(&g_stage_mutex);
+    StageSlot* slot = &g_slots[pos];
+    int kept = ok && !g_stage_stop;
+    if (kept) {
+        slot->data = data;
+        slot->len = len;
+        slot->reserved = reserved;
+        slot->mapped = mapped;
+        slot->stream_offset = (uint32_t)stream_offset;
+        slot->in_used = (uint32_t)in_used;
+        slot->state = SLOT_READY;
+        pepper_stat_add(PEPPER_STAT_STAGE_DECODED, 1);
+        pepper_stat_add(PEPPER_STAT_STAGE_DECODED_BYTES, len);
+        if (pos < g_evicted_to) {
+            // The sweep passed it while it was BUSY; nothing will take it now
+            release_slot(slot);
+            pepper_stat_add(PEPPER_STAT_STAGE_EVICTED, 1);
+            pthread_cond_broadcast(&g_work_cond);
+        }
+    } else {
+        g_staged -= reserved;
+        slot->state = SLOT_FAILED;
+        if (!ok) pepper_stat_add(PEPPER_STAT_STAGE_FAILED, 1);
+        pthread_cond_broadcast(&g_work_cond);
+    }
+    pthread_cond_broadcast(&g_ready_cond);
+    pthread_mutex_unlock(&g_stage_mutex);
+
+    if (!kept && data) free_buffer(data, reserved, mapped);
+}
+
+static void* stage_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_stage_mutex);
+    while (!g_stage_stop) {
+        // Drop images the engine has moved past without inflating. BUSY
+        // slots are released by decode_slot once they finish.
+        for (; g_evicted_to < g_cursor && g_evicted_to < g_index.count; g_evicted_to++) {
+            StageSlot* slot = &g_slots[g_evicted_to];
+            if (slot->state == SLOT_READY) {
+                release_slot(slot);
+                pepper_stat_add(PEPPER_STAT_STAGE_EVICTED, 1);
+            } else if (slot->state == SLOT_EMPTY) {
+                slot->state = SLOT_TAKEN;
+            }
+        }
+        if (g_next < g_cursor) g_next = g_cursor;
+
+        // Claim the next image within the window
+        int claimed = 0;
+        while (g_next < g_index.count && g_next < g_cursor + g_stage_ahead) {
+            size_t pos = g_next;
+            const PepperEntry* entry = &g_index.entries[pos];
+            StageSlot* slot = &g_slots[pos];
+            size_t stream_offset, need;
+
+            if (slot->state != SLOT_EMPTY || entry->kind != PEPPER_KIND_IMAGE ||
+                pepper_asset_index_find(&g_index, entry->offset) != pos ||
+                parse_image(entry, &stream_offset, &need) != 0 ||
+                buffer_cost(need) > g_stage_budget) {
+                if (slot->state == SLOT_EMPTY) slot->state = SLOT_FAILED;
+                g_next++;
+                continue;
+            }
+            if (g_staged + buffer_cost(need) > g_stage_budget) break;   // wait for the engine
+
+            slot->state = SLOT_BUSY;
+            g_staged += buffer_cost(need);
+            if (g_staged > g_stage_peak) g_stage_peak = g_staged;
+            g_next++;
+            pthread_mutex_unlock(&g_stage_mutex);
+            decode_slot(pos, stream_offset, need);
+            pthread_mutex_lock(&g_stage_mutex);
+            claimed = 1;
+            break;
+        }
+        if (!claimed && !g_stage_stop) pthread_cond_wait(&g_work_cond, &g_stage_mutex);
+    }
+    pthread_mutex_unlock(&g_stage_mutex);
+    return NULL;
+}
+
+// ============================================================================
+// Hooks from pepper_assetio.c
+// ============================================================================
+
+int pepper_stage_enabled(void) {
+    return g_stage && !g_disabled;
+}
+
+static void stop_workers(void) {
+    pthread_mutex_lock(&g_stage_mutex);
+    g_stage_stop = 1;
+    __atomic_store_n(&g_stage_running, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&g_work_cond);
+    pthread_cond_broadcast(&g_ready_cond);
+    pthread_mutex_unlock(&g_stage_mutex);
+
+    for (int i = 0; i < g_worker_count; i++) pthread_join(g_workers[i], NULL);
+    g_worker_count = 0;
+
+    pthread_mutex_lock(&g_stage_mutex);
+    for (size_t i = 0; g_slots && i < g_index.count; i++) {
+        if (g_slots[i].state == SLOT_READY) release_slot(&g_slots[i]);
+    }
+    in_malloc = 1;
+    free(g_slots);
+    in_malloc = 0;
+    g_slots = NULL;
+    pepper_asset_index_free(&g_index);
+    if (g_map) munmap((void*)g_map, g_map_size);
+    g_map = NULL;
+    pthread_mutex_unlock(&g_stage_mutex);
+}
+
+// A failed open gives its reference back so the next one tries again
+static int drop_failed_open(void) {
+    pthread_mutex_lock(&g_stage_mutex);
+    if (g_stage_refs > 0) g_stage_refs--;
+    pthread_mutex_unlock(&g_stage_mutex);
+    return 0;
+}
+
+int pepper_stage_open(const char* path, size_t size) {
+    if (!pepper_stage_enabled() || size < PEPPER_TABLES_SIZE) return 0;
+
+    pthread_mutex_lock(&g_stage_mutex);
+    if (g_stage_refs++ > 0) {
+        // Already staging from an open copy of the file
+        pthread_mutex_unlock(&g_stage_mutex);
+        return 1;
+    }
+    pthread_mutex_unlock(&g_stage_mutex);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return drop_failed_open();
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    int loaded = map != MAP_FAILED && pepper_asset_index_load(fd, size, &g_index) == 0;
+    close(fd);
+    if (!loaded) {
+        if (map != MAP_FAILED) munmap(map, size);
+        return drop_failed_open();
+    }
+
+    pthread_mutex_lock(&g_stage_mutex);
+    g_map = map;
+    g_map_size = size;
+    in_malloc = 1;
+    g_slots = calloc(g_index.count, sizeof(StageSlot));
+    in_malloc = 0;
+    g_cursor = g_next = g_evicted_to = 0;
+    g_staged = 0;
+    g_stage_stop = 0;
+    pthread_mutex_unlock(&g_stage_mutex);
+
+    if (!g_slots) {
+        stop_workers();
+        return drop_failed_open();
+    }
+    while (g_worker_count < g_stage_threads &&
+           pthread_create(&g_workers[g_worker_count], NULL, stage_main, NULL) == 0) {
+        g_worker_count++;
+    }
+    if (g_worker_count == 0) {
+        stop_workers();
+        return drop_failed_open();
+    }
+    __atomic_store_n(&g_stage_running, 1, __ATOMIC_RELEASE);
+
+    if (g_verbose) {
+        fprintf(stderr, "[PepperOpt2] Staging %zu entries of %s on %d threads\n",
+                g_index.count, path, g_worker_count);
+    }
+    return 1;
+}
+
+void pepper_stage_note_read(size_t offset) {
+    if (!__atomic_load_n(&g_stage_running, __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(&g_stage_mutex);
+    if (g_slots) {
+        // The cursor only moves forward; re-reads of shared entries land on
+        // earlier positions
+        size_t pos = pepper_asset_index_find(&g_index, offset);
+        if (pos < g_index.count && pos > g_cursor) {
+            g_cursor = pos;
+            pthread_cond_broadcast(&g_work_cond);
+        }
+    }
+    pthread_mutex_unlock(&g_stage_mutex);
+}
+
+void pepper_stage_close(void) {
+    pthread_mutex_lock(&g_stage_mutex);
+    int last = g_stage_refs > 0 && --g_stage_refs == 0;
+    pthread_mutex_unlock(&g_stage_mutex);
+    if (last) stop_workers();
+}
+
+// ============================================================================
+// Hook from pepper_zlib.c
+// ============================================================================
+
+// Move whole pages of a staged mmap buffer over the output when possible
+static int remap_pages(StageSlot* slot, uint8_t* out) {
+    size_t pages = slot->len & ~(g_page_size - 1);
+    if (!g_stage_remap || !slot->mapped || ((uintptr_t)out & (g_page_size - 1)) || pages == 0) {
+        return 0;
+    }
+    if (mremap(slot->data, pages, pages, MREMAP_MAYMOVE | MREMAP_FIXED, out) == MAP_FAILED) {
+        return 0;
+    }
+    memcpy(out + pages, slot->data + pages, slot->len - pages);
+    // The moved pages are no longer ours; only the tail is left to unmap
+    if (slot->reserved > pages) munmap(slot->data + pages, slot->reserved - pages);
+    return 1;
+}
+
+int pepper_stage_take(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap,
+                      size_t* in_used, size_t* out_len) {
+    if (!__atomic_load_n(&g_stage_running, __ATOMIC_ACQUIRE)) return -1;
+
+    size_t offset;
+    if (pepper_asset_source(in, &offset) != 0) return -1;
+
+    pthread_mutex_lock(&g_stage_mutex);
+    size_t pos = g_slots ? pepper_asset_index_find(&g_index, offset) : g_index.count;
+    if (pos >= g_index.count || g_index.entries[pos].offset > offset) {
+        pthread_mutex_unlock(&g_stage_mutex);
+        return -1;
+    }
+
+    StageSlot* slot = &g_slots[pos];
+    if (slot->state == SLOT_BUSY) pepper_stat_add(PEPPER_STAT_STAGE_WAITS, 1);
+    while (slot->state == SLOT_BUSY && !g_stage_stop) {
+        pthread_cond_wait(&g_ready_cond, &g_stage_mutex);
+    }
+
+    if (slot->state != SLOT_READY) {
+        // Too late to be useful now; keep the workers off it
+        if (slot->state == SLOT_EMPTY) slot->state = SLOT_TAKEN;
+        pepper_stat_add(PEPPER_STAT_STAGE_MISSES, 1);
+        pthread_mutex_unlock(&g_stage_mutex);
+        return -1;
+    }
+
+    // The engine's bytes must be exactly the stream that was decoded
+    int match = slot->stream_offset == offset && in_len >= slot->in_used &&
+                out_cap >= slot->len &&
+                memcmp(in, g_map + slot->stream_offset, slot->in_used) == 0;
+    if (!match) {
+        release_slot(slot);
+        pepper_stat_add(PEPPER_STAT_STAGE_MISSES, 1);
+        pthread_cond_broadcast(&g_work_cond);
+        pthread_mutex_unlock(&g_stage_mutex);
+        return -1;
+    }
+
+    // Take the buffer out of the cache, then deliver without the lock
+    StageSlot staged = *slot;
+    slot->data = NULL;
+    slot->reserved = 0;
+    slot->state = SLOT_TAKEN;
+    g_staged -= staged.reserved;
+    pepper_stat_add(PEPPER_STAT_STAGE_HITS, 1);
+    pthread_cond_broadcast(&g_work_cond);
+    pthread_mutex_unlock(&g_stage_mutex);
+
+    if (remap_pages(&staged, out)) {
+        pepper_stat_add(PEPPER_STAT_STAGE_REMAPS, 1);
+    } else {
+        memcpy(out, staged.data, staged.len);
+        free_buffer(staged.data, staged.reserved, staged.mapped);
+    }
+    *in_used = staged.in_used;
+    *out_len = staged.len;
+    return 0;
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+void pepper_stage_init(void) {
+    g_stage = pepper_env_int("PEPPER_STAGE", 0);
+    if (!pepper_stage_enabled()) return;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = pepper_env_int("PEPPER_STAGE_THREADS", cores > 1 ? (int)cores - 1 : 1);
+    if (threads < 1) threads = 1;
+    if (threads > MAX_STAGE_THREADS) threads = MAX_STAGE_THREADS;
+    g_stage_threads = threads;
+
+    int ahead = pepper_env_int("PEPPER_STAGE_AHEAD", 32);
+    g_stage_ahead = ahead < 1 ? 1 : (size_t)ahead;
+    int budget_mb = pepper_env_int("PEPPER_STAGE_BUDGET_MB", 32);
+    if (budget_mb < 1) budget_mb = 1;
+    g_stage_budget = (size_t)budget_mb << 20;
+    g_stage_remap = pepper_env_int("PEPPER_STAGE_REMAP", 1);
+
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0) g_page_size = (size_t)page;
+
+    fprintf(stderr, "[PepperOpt2] Staging: ENABLED (%d threads, %zu images ahead, %d MB budget)\n",
+            g_stage_threads, g_stage_ahead, budget_mb);
+}
+
+void pepper_stage_summary(void) {
+    if (!pepper_stage_enabled()) return;
+
+    pthread_mutex_lock(&g_stage_mutex);
+    fprintf(stderr, "[PepperOpt2]   Staged images: %zu decoded (%.2f MB), %zu failed, "
+            "peak %.2f of %.0f MB\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_STAGE_DECODED),
+            (size_t)pepper_stat_get(PEPPER_STAT_STAGE_DECODED_BYTES) / 1024.0 / 1024.0,
+            (size_t)pepper_stat_get(PEPPER_STAT_STAGE_FAILED),
+            g_stage_peak / 1024.0 / 1024.0, g_stage_budget / 1024.0 / 1024.0);
+    fprintf(stderr, "[PepperOpt2]   Staging hits: %zu (%zu page remaps), %zu waits, "
+            "%zu misses, %zu dropped unused\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_STAGE_HITS),
+            (size_t)pepper_stat_get(PEPPER_STAT_STAGE_REMAPS),
+            (size_t)pepper_stat_get(PEPPER_STAT_STAGE_WAITS),
+            (size_t)pepper_stat_get(PEPPER_STAT_STAGE_MISSES),
+            (size_t)pepper_stat_get(PEPPER_STAT_STAGE_EVICTED));
+    pthread_mutex_unlock(&g_stage_mutex);
+}
@@ -0,0 +1,210 @@
+/*
+ * pepper_stats.c - Live counters in shared memory, for tools/pepper_top.c
+ *
+ * The session summary is printed by the destructor, which a game killed
+ * by the OOM killer (or SIGKILL from the launcher) never reaches. With
+ * PEPPER_STATS set, every module's counters live in a file in /dev/shm
+ * instead of private memory: pepper_top reads them over SSH while the game
+ * runs, and the file is still there, with the last values, after a kill.
+ *
+ * Counters are updated with relaxed atomic adds and stores (pepper_stat_add
+ * and friends in pepper_common.h), whether the segment is shared or not,
+ * so turning it on costs nothing extra. The segment describes itself: the
+ * header is followed by each counter's name and kind, then the values, so
+ * pepper_top needs no copy of the list below.
+ *
+ * A clean exit removes the file; a killed game leaves it for pepper_top to
+ * read (it marks the process as gone), and `pepper_top --clean` removes it.
+ *
+ * Segment layout:
+ *   PepperStatsHeader
+ *   PepperStatInfo[stat_count]
+ *   uint64_t values[stat_count], at values_offset
+ *   the hook latency histograms (pepper_latency.c), at latency_offset if
+ *   PEPPER_LATENCY is on
+ *
+ * Environment variables:
+ *   PEPPER_STATS=1                - Shared segment at /dev/shm/pepperopt2.<pid>
+ *   PEPPER_STATS=path             - ...or at this path, %p = process ID
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Segment format (read by tools/pepper_top.c)
+// ============================================================================
+
+#define STATS_MAGIC "PEPSTAT\1"
+
+enum { STAT_COUNTER, STAT_BYTES, STAT_GAUGE, STAT_GAUGE_BYTES };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;         // 1
+    uint32_t stat_count;
+    uint64_t pid;
+    uint64_t start_ns;        // CLOCK_REALTIME when the library loaded
+    uint64_t values_offset;   // from the start of the segment
+    uint64_t latency_offset;  // 0 = no latency histograms
+    uint64_t reserved[2];
+} PepperStatsHeader;
+
+typedef struct {
+    char name[40];            // "module.counter"
+    uint32_t kind;            // STAT_*
+    uint32_t reserved;
+} PepperStatInfo;
+
+static const struct {
+    const char* name;
+    uint32_t kind;
+} g_stat_info[PEPPER_STAT_COUNT] = {
+    [PEPPER_STAT_TEXTURES] = { "textures.uploaded", STAT_COUNTER },
+    [PEPPER_STAT_SCALED] = { "textures.scaled", STAT_COUNTER },
+    [PEPPER_STAT_ORIGINAL_BYTES] = { "textures.original", STAT_BYTES },
+    [PEPPER_STAT_OPTIMIZED_BYTES] = { "textures.uploaded_bytes", STAT_BYTES },
+    [PEPPER_STAT_FREED] = { "textures.buffers_freed", STAT_COUNTER },
+    [PEPPER_STAT_FREED_BYTES] = { "textures.freed_bytes", STAT_BYTES },
+    [PEPPER_STAT_FRAMES] = { "frames", STAT_COUNTER },
+    [PEPPER_STAT_TEXCACHE_HITS] = { "texcache.hits", STAT_COUNTER },
+    [PEPPER_STAT_TEXCACHE_HIT_BYTES] = { "texcache.hit_bytes", STAT_BYTES },
+    [PEPPER_STAT_TEXCACHE_STORED] = { "texcache.stored", STAT_COUNTER },
+    [PEPPER_STAT_TEXCACHE_STORED_BYTES] = { "texcache.stored_bytes", STAT_BYTES },
+    [PEPPER_STAT_ASSET_OPENS] = { "assetio.opens", STAT_COUNTER },
+    [PEPPER_STAT_ASSET_READS] = { "assetio.reads", STAT_COUNTER },
+    [PEPPER_STAT_ASSET_BYTES] = { "assetio.bytes", STAT_BYTES },
+    [PEPPER_STAT_ASSET_SEEKS] = { "assetio.seeks", STAT_COUNTER },
+    [PEPPER_STAT_PREFETCH_ENTRIES] = { "prefetch.entries", STAT_COUNTER },
+    [PEPPER_STAT_PREFETCH_BYTES] = { "prefetch.bytes", STAT_BYTES },
+    [PEPPER_STAT_PREFETCH_CALLS] = { "prefetch.calls", STAT_COUNTER },
+    [PEPPER_STAT_PREFETCH_WAKEUPS] = { "prefetch.wakeups", STAT_COUNTER },
+    [PEPPER_STAT_ZLIB_FAST_CALLS] = { "zlib.fast_inflates", STAT_COUNTER },
+    [PEPPER_STAT_ZLIB_FAST_BYTES] = { "zlib.fast_bytes", STAT_BYTES },
+    [PEPPER_STAT_ZLIB_FALLBACK_CALLS] = { "zlib.fallbacks", STAT_COUNTER },
+    [PEPPER_STAT_ZLIB_POOL_HITS] = { "zlib.pool_hits", STAT_COUNTER },
+    [PEPPER_STAT_ZLIB_POOL_MISSES] = { "zlib.pool_misses", STAT_COUNTER },
+    [PEPPER_STAT_STAGE_DECODED] = { "stage.decoded", STAT_COUNTER },
+    [PEPPER_STAT_STAGE_DECODED_BYTES] = { "stage.decoded_bytes", STAT_BYTES },
+    [PEPPER_STAT_STAGE_FAILED] = { "stage.failed", STAT_COUNTER },
+    [PEPPER_STAT_STAGE_HITS] = { "stage.hits", STAT_COUNTER },
+    [PEPPER_STAT_STAGE_REMAPS] = { "stage.remaps", STAT_COUNTER },
+    [PEPPER_STAT_STAGE_WAITS] = { "stage.waits", STAT_COUNTER },
+    [PEPPER_STAT_STAGE_MISSES] = { "stage.misses", STAT_COUNTER },
+    [PEPPER_STAT_STAGE_EVICTED] = { "stage.evicted", STAT_COUNTER },
+    [PEPPER_STAT_SIDECAR_HITS] = { "sidecar.hits", STAT_COUNTER },
+    [PEPPER_STAT_SIDECAR_BYTES] = { "sidecar.bytes", STAT_BYTES },
+    [PEPPER_STAT_SIDECAR_MISSES] = { "sidecar.misses", STAT_COUNTER },
+    [PEPPER_STAT_RAWCACHE_HITS] = { "rawcache.hits", STAT_COUNTER },
+    [PEPPER_STAT_RAWCACHE_STORED] = { "rawcache.stored", STAT_COUNTER },
+    [PEPPER_STAT_RAWCACHE_STORED_BYTES] = { "rawcache.stored_bytes", STAT_BYTES },
+    [PEPPER_STAT_RAWCACHE_MAPPED_BYTES] = { "rawcache.mapped_bytes", STAT_BYTES },
+    [PEPPER_STAT_RAWCACHE_COPIED_BYTES] = { "rawcache.copied_bytes", STAT_BYTES },
+    [PEPPER_STAT_ARENA_ALLOCS] = { "arena.allocs", STAT_COUNTER },
+    [PEPPER_STAT_ARENA_FALLBACKS] = { "arena.fallbacks", STAT_COUNTER },
+    [PEPPER_STAT_ARENA_LIVE_BYTES] = { "arena.live", STAT_GAUGE_BYTES },
+    [PEPPER_STAT_ARENA_RETURNS] = { "arena.returns", STAT_COUNTER },
+    [PEPPER_STAT_ARENA_RETURNED_BYTES] = { "arena.returned_bytes", STAT_BYTES },
+    [PEPPER_STAT_SLAB_REFILLS] = { "slab.refills", STAT_COUNTER },
+    [PEPPER_STAT_SLAB_FLUSHES] = { "slab.flushes", STAT_COUNTER },
+    [PEPPER_STAT_SLAB_SPANS_LIVE] = { "slab.spans_live", STAT_GAUGE },
+    [PEPPER_STAT_SLAB_SPANS_RETURNED] = { "slab.spans_returned", STAT_COUNTER },
+    [PEPPER_STAT_MALLOC_FREE_BYTES] = { "malloc.free", STAT_GAUGE_BYTES },
+    [PEPPER_STAT_MALLOC_TRIMS] = { "malloc.trims", STAT_COUNTER },
+    [PEPPER_STAT_RSS] = { "memory.rss", STAT_GAUGE_BYTES },
+    [PEPPER_STAT_PSS] = { "memory.pss", STAT_GAUGE_BYTES },
+};
+
+// ============================================================================
+// Segment
+// ============================================================================
+
+static uint64_t g_private[PEPPER_STAT_COUNT];
+uint64_t* g_stats = g_private;
+
+static char g_stats_path[512];
+static void* g_segment = NULL;
+static size_t g_segment_size = 0;
+
+// A forked child counts on its own, in private memory again
+static void after_fork_child(void) {
+    for (int i = 0; i < PEPPER_STAT_COUNT; i++) g_private[i] = pepper_stat_get(i);
+    g_stats = g_private;
+    g_stats_path[0] = '\0';
+}
+
+void pepper_stats_init(void) {
+    const char* spec = pepper_env_str("PEPPER_STATS");
+    if (!spec || strcmp(spec, "0") == 0) return;
+    pepper_expand_path(g_stats_path, sizeof(g_stats_path),
+                       strcmp(spec, "1") == 0 ? "/dev/shm/pepperopt2.%p" : spec);
+
+    size_t values_offset = (sizeof(PepperStatsHeader) +
+                            PEPPER_STAT_COUNT * sizeof(PepperStatInfo) + 63) & ~(size_t)63;
+    size_t latency_offset = (values_offset + PEPPER_STAT_COUNT * sizeof(uint64_t) + 63) &
+                            ~(size_t)63;
+    size_t latency_size = pepper_latency_size();
+    g_segment_size = latency_offset + latency_size;
+    int fd = open(g_stats_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, g_segment_size) != 0) {
+        fprintf(stderr, "[PepperOpt2] Stats: cannot create %s, disabled\n", g_stats_path);
+        if (fd >= 0) close(fd);
+        g_stats_path[0] = '\0';
+        return;
+    }
+    g_segment = mmap(NULL, g_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (g_segment == MAP_FAILED) {
+        fprintf(stderr, "[PepperOpt2] Stats: cannot map %s, disabled\n", g_stats_path);
+        unlink(g_stats_path);
+        g_segment = NULL;
+        g_stats_path[0] = '\0';
+        return;
+    }
+
+    PepperStatsHeader* header = g_segment;
+    PepperStatInfo* info = (PepperStatInfo*)(header + 1);
+    for (int i = 0; i < PEPPER_STAT_COUNT; i++) {
+        snprintf(info[i].name, sizeof(info[i].name), "%s", g_stat_info[i].name);
+        info[i].kind = g_stat_info[i].kind;
+    }
+    uint64_t* values = (uint64_t*)((char*)g_segment + values_offset);
+    for (int i = 0; i < PEPPER_STAT_COUNT; i++) values[i] = g_private[i];
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->version = 1;
+    header->stat_count = PEPPER_STAT_COUNT;
+    header->pid = (uint64_t)getpid();
+    header->start_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    header->values_offset = values_offset;
+    if (latency_size) {
+        pepper_latency_attach((char*)g_segment + latency_offset);
+        header->latency_offset = latency_offset;
+    }
+    // The magic goes last: a viewer that sees it sees a complete header
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, STATS_MAGIC, 8);
+    __atomic_store_n(&g_stats, values, __ATOMIC_RELEASE);
+
+    pthread_atfork(NULL, NULL, after_fork_child);
+    fprintf(stderr, "[PepperOpt2] Stats: ENABLED (%s, %d counters; view with pepper_top)\n",
+            g_stats_path, PEPPER_STAT_COUNT);
+}
+
+// The values stay mapped for the summaries that run after this
+void pepper_stats_summary(void) {
+    if (!g_stats_path[0]) return;
+    unlink(g_stats_path);
+    g_stats_path[0] = '\0';
+}
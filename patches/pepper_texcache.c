@@ -0,0 +1,368 @@
+/*
+ * pepper_texcache.c - Keep downscaled textures on disk across launches
+ *
+ * The glTexImage2D hook downscales the same few thousand textures on every
+ * launch. With PEPPER_TEXCACHE=path, each downscaled result is also
+ * written to a cache file, keyed by a hash of the source pixels and
+ * dimensions. On the next launch the file is mapped read-only and a hit
+ * is uploaded straight from the mapped pages. Only the source hash is
+ * computed; nothing is resampled or copied.
+ *
+ * The header records a hash of the scaling policy (algorithm, PEPPER_SCALE,
+ * PEPPER_MIN_SIZE). If any of those changes, the old contents are ignored
+ * and the file is rebuilt. New results are streamed to <path>.tmp as they
+ * are produced, so they are not kept in memory. At exit the still-useful
+ * old entries are appended and the index is written. The file is then
+ * fsync'd and renamed over <path>. A session that is killed therefore
+ * leaves the previous cache intact. Entries used this session are kept
+ * first; the rest are kept while they fit in PEPPER_TEXCACHE_MB.
+ *
+ * File format (little-endian):
+ *   Header (40 bytes): "PEPTEX\0\1", policy hash, index offset,
+ *                      entry count, reserved, payload bytes
+ *   Payloads
+ *   Index: entry count x {key, offset, size, reserved}, sorted by key
+ *
+ * Environment variables:
+ *   PEPPER_TEXCACHE=path          - Cache file (default: off)
+ *   PEPPER_TEXCACHE_MB=128        - Size limit for the rewritten file
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// File format
+// ============================================================================
+
+#define TEXCACHE_MAGIC "PEPTEX\0\1"
+
+typedef struct {
+    char magic[8];
+    uint64_t policy_hash;
+    uint64_t index_offset;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t payload_bytes;
+} TexCacheHeader;
+
+typedef struct {
+    uint64_t key;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+} TexCacheEntry;
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static const char* g_texcache_path = NULL;
+static char* g_tmp_path = NULL;
+static size_t g_texcache_limit = 128u << 20;
+static uint64_t g_policy_hash = 0;
+
+// Stats
+static int g_texcache_stale = 0;
+
+static pthread_mutex_t g_texcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ============================================================================
+// Cache state
+// ============================================================================
+
+// Previous launch's cache, read-only
+static const uint8_t* g_map = NULL;
+static size_t g_map_size = 0;
+static const TexCacheEntry* g_entries = NULL;
+static uint32_t g_entry_count = 0;
+static uint8_t* g_used = NULL;          // per old entry: hit this session
+static size_t g_used_bytes = 0;         // payload bytes of those entries
+
+// This session's new results, streamed to g_tmp_path
+static int g_tmp_fd = -1;
+static uint64_t g_tmp_cursor = sizeof(TexCacheHeader);
+static TexCacheEntry* g_new = NULL;
+static size_t g_new_count = 0;
+static size_t g_new_cap = 0;
+
+// Keys of g_new by open addressing (0 = empty slot), so a texture uploaded
+// twice in one session is only written once
+static uint64_t* g_stored = NULL;
+static size_t g_stored_cap = 0;         // power of two, at least twice g_new_count
+
+static void* cache_alloc(size_t size) {
+    in_malloc = 1;
+    void* p = calloc(1, size);
+    in_malloc = 0;
+    return p;
+}
+
+static void cache_free(void* p) {
+    in_malloc = 1;
+    free(p);
+    in_malloc = 0;
+}
+
+static void load_cache(void) {
+    int fd = open(g_texcache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TexCacheHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const TexCacheHeader* header = map;
+    size_t size = st.st_size;
+    int valid = memcmp(header->magic, TEXCACHE_MAGIC, sizeof(header->magic)) == 0 &&
+                header->index_offset <= size &&
+                (size - header->index_offset) / sizeof(TexCacheEntry) >= header->count;
+    if (!valid || header->policy_hash != g_policy_hash) {
+        g_texcache_stale = valid;
+        munmap(map, size);
+        return;
+    }
+
+    g_map = map;
+    g_map_size = size;
+    g_entries = (const TexCacheEntry*)(g_map + header->index_offset);
+    g_entry_count = header->count;
+    g_used = cache_alloc(g_entry_count ? g_entry_count : 1);
+}
+
+static const TexCacheEntry* find_entry(uint64_t key) {
+    size_t lo = 0, hi = g_entry_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (g_entries[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < g_entry_count && g_entries[lo].key == key ? &g_entries[lo] : NULL;
+}
+
+// Key 0 marks an empty slot, so it is stored as 1
+static uint64_t* stored_slot(uint64_t key) {
+    key = key ? key : 1;
+    size_t i = key & (g_stored_cap - 1);
+    while (g_stored[i] && g_stored[i] != key) i = (i + 1) & (g_stored_cap - 1);
+    return &g_stored[i];
+}
+
+static void stored_add(uint64_t key) {
+    *stored_slot(key) = key ? key : 1;
+}
+
+static int grow_stored(void) {
+    size_t cap = g_stored_cap ? g_stored_cap * 2 : 512;
+    uint64_t* grown = cache_alloc(cap * sizeof(uint64_t));
+    if (!grown) return -1;
+    cache_free(g_stored);
+    g_stored = grown;
+    g_stored_cap = cap;
+    for (size_t i = 0; i < g_new_count; i++) stored_add(g_new[i].key);
+    return 0;
+}
+
+// ============================================================================
+// Hooks from pepper_optimizer_v2.c
+// ============================================================================
+
+int pepper_texcache_enabled(void) {
+    return g_texcache_path && !g_disabled;
+}
+
+const void* pepper_texcache_find(const void* src, int width, int height, size_t out_size,
+                                 uint64_t* key) {
+    if (!pepper_texcache_enabled()) return NULL;
+
+    *key = pepper_hash64(src, (size_t)width * height * 4) ^
+           pepper_mix64(((uint64_t)(uint32_t)width << 32) | (uint32_t)height);
+
+    pthread_mutex_lock(&g_texcache_mutex);
+    const TexCacheEntry* e = g_map ? find_entry(*key) : NULL;
+    const void* found = NULL;
+    if (e && e->size == out_size && e->offset + e->size <= g_map_size) {
+        found = g_map + e->offset;
+        if (!g_used[e - g_entries]) g_used_bytes += e->size;
+        g_used[e - g_entries] = 1;
+        pepper_stat_add(PEPPER_STAT_TEXCACHE_HITS, 1);
+        pepper_stat_add(PEPPER_STAT_TEXCACHE_HIT_BYTES, out_size);
+    }
+    pthread_mutex_unlock(&g_texcache_mutex);
+    return found;
+}
+
+void pepper_texcache_store(uint64_t key, const void* data, size_t size) {
+    if (!pepper_texcache_enabled()) return;
+
+    // Entries hit this session keep their room, so a full cache does not
+    // push out what is still being used
+    pthread_mutex_lock(&g_texcache_mutex);
+    if (g_tmp_fd < 0 || g_tmp_cursor + g_used_bytes + size > g_texcache_limit ||
+        (g_stored && *stored_slot(key))) {
+        pthread_mutex_unlock(&g_texcache_mutex);
+        return;
+    }
+    if (g_new_count == g_new_cap) {
+        size_t cap = g_new_cap ? g_new_cap * 2 : 256;
+        TexCacheEntry* grown = cache_alloc(cap * sizeof(TexCacheEntry));
+        if (!grown) {
+            pthread_mutex_unlock(&g_texcache_mutex);
+            return;
+        }
+        if (g_new) memcpy(grown, g_new, g_new_count * sizeof(TexCacheEntry));
+        cache_free(g_new);
+        g_new = grown;
+        g_new_cap = cap;
+    }
+    if ((g_new_count + 1) * 2 > g_stored_cap && grow_stored() != 0) {
+        pthread_mutex_unlock(&g_texcache_mutex);
+        return;
+    }
+    if (pwrite(g_tmp_fd, data, size, (off_t)g_tmp_cursor) == (ssize_t)size) {
+        g_new[g_new_count++] = (TexCacheEntry){ key, g_tmp_cursor, (uint32_t)size, 0 };
+        stored_add(key);
+        g_tmp_cursor += size;
+        pepper_stat_add(PEPPER_STAT_TEXCACHE_STORED, 1);
+        pepper_stat_add(PEPPER_STAT_TEXCACHE_STORED_BYTES, size);
+    }
+    pthread_mutex_unlock(&g_texcache_mutex);
+}
+
+// ============================================================================
+// Commit at exit
+// ============================================================================
+
+static int compare_keys(const void* a, const void* b) {
+    uint64_t x = ((const TexCacheEntry*)a)->key;
+    uint64_t y = ((const TexCacheEntry*)b)->key;
+    return x < y ? -1 : (x > y);
+}
+
+// Copy one old entry into the new file; returns 0 on success
+static int carry_over(const TexCacheEntry* e, TexCacheEntry* out) {
+    if (e->offset + e->size > g_map_size) return -1;
+    if (pwrite(g_tmp_fd, g_map + e->offset, e->size, (off_t)g_tmp_cursor) != (ssize_t)e->size) {
+        return -1;
+    }
+    *out = (TexCacheEntry){ e->key, g_tmp_cursor, e->size, 0 };
+    g_tmp_cursor += e->size;
+    return 0;
+}
+
+// Returns the number of entries written, or -1 if the old cache was kept
+static long commit_cache(void) {
+    size_t max = g_new_count + g_entry_count;
+    TexCacheEntry* index = cache_alloc((max ? max : 1) * sizeof(TexCacheEntry));
+    if (!index) return -1;
+    memcpy(index, g_new, g_new_count * sizeof(TexCacheEntry));
+    size_t count = g_new_count;
+
+    // Entries used this session first, then the rest while they fit. A key
+    // stored again this session already has its new copy.
+    qsort(index, count, sizeof(TexCacheEntry), compare_keys);
+    size_t fresh = count;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < g_entry_count; i++) {
+            const TexCacheEntry* e = &g_entries[i];
+            if (g_used[i] != (pass == 0) || g_tmp_cursor + e->size > g_texcache_limit ||
+                bsearch(e, index, fresh, sizeof(TexCacheEntry), compare_keys)) {
+                continue;
+            }
+            if (carry_over(e, &index[count]) == 0) count++;
+        }
+    }
+    qsort(index, count, sizeof(TexCacheEntry), compare_keys);
+
+    TexCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TEXCACHE_MAGIC, sizeof(header.magic));
+    header.policy_hash = g_policy_hash;
+    header.index_offset = g_tmp_cursor;
+    header.count = (uint32_t)count;
+    header.payload_bytes = g_tmp_cursor - sizeof(header);
+
+    size_t index_bytes = count * sizeof(TexCacheEntry);
+    int ok = pwrite(g_tmp_fd, index, index_bytes, (off_t)g_tmp_cursor) == (ssize_t)index_bytes &&
+             pwrite(g_tmp_fd, &header, sizeof(header), 0) == sizeof(header) &&
+             fsync(g_tmp_fd) == 0;
+    cache_free(index);
+    close(g_tmp_fd);
+    g_tmp_fd = -1;
+
+    if (!ok || rename(g_tmp_path, g_texcache_path) != 0) {
+        fprintf(stderr, "[PepperOpt2] Texture cache not updated: %s\n", strerror(errno));
+        unlink(g_tmp_path);
+        return -1;
+    }
+    return (long)count;
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+void pepper_texcache_init(const char* policy) {
+    g_texcache_path = pepper_env_str("PEPPER_TEXCACHE");
+    if (!pepper_texcache_enabled()) return;
+
+    int limit_mb = pepper_env_int("PEPPER_TEXCACHE_MB", 128);
+    if (limit_mb < 1) limit_mb = 1;
+    g_texcache_limit = (size_t)limit_mb << 20;
+    g_policy_hash = pepper_hash64(policy, strlen(policy));
+
+    load_cache();
+
+    g_tmp_path = cache_alloc(strlen(g_texcache_path) + 5);
+    if (g_tmp_path) {
+        sprintf(g_tmp_path, "%s.tmp", g_texcache_path);
+        g_tmp_fd = open(g_tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (g_tmp_fd < 0) {
+        fprintf(stderr, "[PepperOpt2] Texture cache: cannot write %s.tmp, read-only\n",
+                g_texcache_path);
+    }
+
+    fprintf(stderr, "[PepperOpt2] Texture cache: ENABLED (%s, %u entries%s)\n", g_texcache_path,
+            g_entry_count, g_texcache_stale ? ", policy changed: rebuilding" : "");
+}
+
+void pepper_texcache_summary(void) {
+    if (!pepper_texcache_enabled()) return;
+
+    pthread_mutex_lock(&g_texcache_mutex);
+    // Nothing new and nothing to drop: leave the file as it is
+    long written = -1;
+    if (g_tmp_fd >= 0 && (g_new_count > 0 || g_texcache_stale)) {
+        written = commit_cache();
+    } else if (g_tmp_fd >= 0) {
+        close(g_tmp_fd);
+        g_tmp_fd = -1;
+        unlink(g_tmp_path);
+    }
+    fprintf(stderr, "[PepperOpt2]   Texture cache: %zu hits (%.2f MB uploaded from cache), "
+            "%zu stored (%.2f MB)\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_TEXCACHE_HITS),
+            (size_t)pepper_stat_get(PEPPER_STAT_TEXCACHE_HIT_BYTES) / 1024.0 / 1024.0,
+            (size_t)pepper_stat_get(PEPPER_STAT_TEXCACHE_STORED),
+            (size_t)pepper_stat_get(PEPPER_STAT_TEXCACHE_STORED_BYTES) / 1024.0 / 1024.0);
+    if (written >= 0) {
+        fprintf(stderr, "[PepperOpt2]   Texture cache rewritten: %ld entries, %.2f MB\n",
+                written, g_tmp_cursor / 1024.0 / 1024.0);
+    }
+    pthread_mutex_unlock(&g_texcache_mutex);
+}
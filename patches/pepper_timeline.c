@@ -0,0 +1,475 @@
+/*
+ * pepper_timeline.c - Startup timeline in Chrome's trace-event format
+ *
+ * Cold start on the handheld is some mix of reading Assets.dat, inflating
+ * images, running the game's own (emulated) code and uploading textures.
+ * The summaries give totals for each; this module shows them in order.
+ * With PEPPER_TIMELINE=path, the hooks record a span for:
+ *   - every Assets.dat fread, named after the table entry it reads
+ *     ("image 1234", "sound 12") or "metadata tables";
+ *   - every inflate() call, with the bytes in and out;
+ *   - every glTexImage2D, with the downscale and the driver upload nested
+ *     inside it;
+ *   - every frame, from one buffer swap to the next.
+ * When the file is written, the reads are also grouped into phases, shown
+ * as separate rows: the metadata table read, image loads, the sound
+ * preload, fonts and shaders. There are also rows for the time from
+ * process start (box64 and the dynamic loader) to this library, and from
+ * here to the first frame. Gaps on a thread's row, inside a phase, are
+ * the game's own code.
+ *
+ * The file is trace-event JSON, which chrome://tracing, Perfetto
+ * (ui.perfetto.dev) and speedscope open. It is written at exit, on
+ * PEPPER_DUMP_SIGNAL (SIGUSR2 by default), and once
+ * PEPPER_TIMELINE_FRAMES frames have been shown, after which recording
+ * stops. Spans go into a fixed buffer with one atomic add each. Spans
+ * past its end are counted and dropped.
+ *
+ * Environment variables:
+ *   PEPPER_TIMELINE=path          - Write the trace here (%p = PID; default off)
+ *   PEPPER_TIMELINE_FRAMES=60     - Stop and write after N frames
+ *                                   (default 0 = record until exit)
+ *   PEPPER_TIMELINE_EVENTS=1048576 - Buffer size in spans (40 bytes each)
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+int g_timeline = 0;
+static char g_timeline_path[512];
+static unsigned long g_stop_frame = 0;
+static size_t g_capacity = 1u << 20;
+
+// ============================================================================
+// Span buffer
+// ============================================================================
+
+typedef struct {
+    uint64_t start, end;              // ticks
+    uint32_t tid;
+    uint16_t span;                    // PEPPER_SPAN_* + 1; 0 until complete
+    uint16_t reserved;
+    uint64_t arg[2];
+} TimelineSpan;
+
+static TimelineSpan* g_spans = NULL;
+static size_t g_span_count = 0;       // claimed; may pass g_capacity
+static uint64_t g_start_ticks = 0, g_start_ns = 0;
+static uint64_t g_last_swap = 0;
+static uint64_t g_first_frame = 0;
+static int g_written = 0;
+
+#define MAX_THREADS 64
+
+static struct {
+    uint32_t tid;
+    char name[16];
+} g_threads[MAX_THREADS];
+static int g_thread_count = 0;
+static pthread_mutex_t g_timeline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static PEPPER_TLS uint32_t t_tid = 0;
+
+// The thread's name as it is on its first span
+static uint32_t register_thread(void) {
+    uint32_t tid = (uint32_t)syscall(SYS_gettid);
+    pthread_mutex_lock(&g_timeline_mutex);
+    if (g_thread_count < MAX_THREADS) {
+        g_threads[g_thread_count].tid = tid;
+        prctl(PR_GET_NAME, g_threads[g_thread_count].name, 0, 0, 0);
+        g_thread_count++;
+    }
+    pthread_mutex_unlock(&g_timeline_mutex);
+    t_tid = tid;
+    return tid;
+}
+
+void pepper_timeline_add(int span, uint64_t start, uint64_t arg0, uint64_t arg1) {
+    uint64_t end = pepper_ticks();
+    if (!__atomic_load_n(&g_timeline, __ATOMIC_RELAXED)) return;
+    size_t i = __atomic_fetch_add(&g_span_count, 1, __ATOMIC_RELAXED);
+    if (i >= g_capacity) return;
+
+    TimelineSpan* s = &g_spans[i];
+    s->start = start;
+    s->end = end;
+    s->tid = t_tid ? t_tid : register_thread();
+    s->arg[0] = arg0;
+    s->arg[1] = arg1;
+    __atomic_store_n(&s->span, (uint16_t)(span + 1), __ATOMIC_RELEASE);
+}
+
+// ============================================================================
+// Assets.dat entries, for naming reads
+// ============================================================================
+
+static char* g_asset_path = NULL;
+static size_t g_asset_size = 0;
+
+void pepper_timeline_open(const char* path, size_t size) {
+    if (!g_timeline) return;
+    pthread_mutex_lock(&g_timeline_mutex);
+    if (!g_asset_path) {
+        g_asset_path = strdup(path);
+        g_asset_size = size;
+    }
+    pthread_mutex_unlock(&g_timeline_mutex);
+}
+
+enum {
+    PHASE_TABLES,
+    PHASE_IMAGES,
+    PHASE_SOUNDS,
+    PHASE_FONTS,
+    PHASE_SHADERS,
+    PHASE_OTHER,                      // between entries, or no index
+    PHASE_COUNT
+};
+
+static const char* g_phase_names[PHASE_COUNT] = {
+    [PHASE_TABLES] = "metadata tables",
+    [PHASE_IMAGES] = "image loads",
+    [PHASE_SOUNDS] = "sound preload",
+    [PHASE_FONTS] = "font loads",
+    [PHASE_SHADERS] = "shader loads",
+    [PHASE_OTHER] = "other reads",
+};
+
+static const char* g_kind_names[] = { "image", "sound", "font", "shader" };
+
+typedef struct {
+    uint64_t first, last;             // ticks
+    uint64_t spans, bytes;
+} PhaseSpan;
+
+// Phase of a read at `offset`, and the entry it falls in (or NULL)
+static int classify(const PepperAssetIndex* index, uint64_t offset, const PepperEntry** entry) {
+    *entry = NULL;
+    if (offset < PEPPER_TABLES_SIZE) return PHASE_TABLES;
+    if (!index->entries) return PHASE_OTHER;
+    size_t i = pepper_asset_index_find(index, (size_t)offset);
+    if (i >= index->count || index->entries[i].offset > offset) return PHASE_OTHER;
+    *entry = &index->entries[i];
+    return PHASE_IMAGES + (*entry)->kind;
+}
+
+// ============================================================================
+// Clock
+// ============================================================================
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Ticks per microsecond over the whole recording; arm64 states its rate
+static double ticks_per_us(void) {
+#if defined(__aarch64__)
+    uint64_t freq;
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+    if (freq) return freq / 1e6;
+#elif !defined(__x86_64__) && !defined(__i386__)
+    return 1000.0;
+#endif
+    uint64_t ns = monotonic_ns() - g_start_ns;
+    uint64_t ticks = pepper_ticks() - g_start_ticks;
+    return ns ? (double)ticks * 1000.0 / ns : 1000.0;
+}
+
+// Microseconds from process start to this library's constructor: box64's
+// own startup and the dynamic loader
+static double process_start_us(void) {
+    FILE* f = fopen("/proc/self/stat", "r");
+    if (!f) return 0;
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+
+    // Field 22, counted from after the parenthesised command name
+    char* p = strrchr(buf, ')');
+    unsigned long long start_ticks = 0;
+    for (int field = 2; p && field < 22; field++) p = strchr(p + 1, ' ');
+    if (!p || sscanf(p + 1, "%llu", &start_ticks) != 1) return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    double now_us = ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+    double start_us = (double)start_ticks * 1e6 / sysconf(_SC_CLK_TCK);
+    return now_us > start_us ? now_us - start_us : 0;
+}
+
+static double g_preload_us = 0;
+
+// ============================================================================
+// Trace-event JSON
+// ============================================================================
+
+static void write_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        if ((unsigned char)*s >= 0x20) fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void write_async(FILE* f, int pid, int id, const char* name, double begin, double end,
+                        uint64_t spans, uint64_t bytes) {
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"b\",\"id\":%d,\"ts\":%.3f,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"spans\":%lu,\"MB\":%.2f}}", name, id, begin, pid,
+            pid, (unsigned long)spans, bytes / 1024.0 / 1024.0);
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"e\",\"id\":%d,\"ts\":%.3f,"
+            "\"pid\":%d,\"tid\":%d}", name, id, end, pid, pid);
+}
+
+static void write_span(FILE* f, int pid, const TimelineSpan* s, double begin, double dur,
+                       const PepperAssetIndex* index) {
+    int span = s->span - 1;
+    fprintf(f, ",\n{\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,", begin, dur,
+            pid, s->tid);
+    unsigned long a = (unsigned long)s->arg[0], b = (unsigned long)s->arg[1];
+    switch (span) {
+    case PEPPER_SPAN_FREAD: {
+        const PepperEntry* e;
+        int phase = classify(index, s->arg[0], &e);
+        if (e) {
+            fprintf(f, "\"name\":\"%s %u\",", g_kind_names[e->kind], e->index);
+        } else {
+            fprintf(f, "\"name\":\"%s\",", phase == PHASE_TABLES ? "metadata tables" : "fread");
+        }
+        fprintf(f, "\"cat\":\"io\",\"args\":{\"offset\":%lu,\"bytes\":%lu}}", a, b);
+        break;
+    }
+    case PEPPER_SPAN_INFLATE:
+        fprintf(f, "\"name\":\"inflate\",\"cat\":\"inflate\",\"args\":{\"in\":%lu,\"out\":%lu}}",
+                a, b);
+        break;
+    case PEPPER_SPAN_TEXIMAGE:
+    case PEPPER_SPAN_DOWNSCALE:
+    case PEPPER_SPAN_UPLOAD:
+        fprintf(f, "\"name\":\"%s\",\"cat\":\"%s\",\"args\":{\"width\":%lu,\"height\":%lu}}",
+                span == PEPPER_SPAN_TEXIMAGE ? "glTexImage2D" :
+                span == PEPPER_SPAN_DOWNSCALE ? "downscale" : "driver upload",
+                span == PEPPER_SPAN_UPLOAD ? "gl" : "texture", a, b);
+        break;
+    default:
+        fprintf(f, "\"name\":\"frame\",\"cat\":\"frame\",\"args\":{\"frame\":%lu}}", a);
+        break;
+    }
+}
+
+// Reads grouped by phase; also used for the summary
+static void collect_phases(const PepperAssetIndex* index, size_t count, PhaseSpan* phases) {
+    memset(phases, 0, PHASE_COUNT * sizeof(PhaseSpan));
+    for (size_t i = 0; i < count; i++) {
+        const TimelineSpan* s = &g_spans[i];
+        if (__atomic_load_n(&s->span, __ATOMIC_ACQUIRE) != PEPPER_SPAN_FREAD + 1) continue;
+        const PepperEntry* e;
+        PhaseSpan* p = &phases[classify(index, s->arg[0], &e)];
+        if (!p->spans || s->start < p->first) p->first = s->start;
+        if (s->end > p->last) p->last = s->end;
+        p->spans++;
+        p->bytes += s->arg[1];
+    }
+}
+
+static void load_index(PepperAssetIndex* index) {
+    memset(index, 0, sizeof(*index));
+    if (!g_asset_path) return;
+    int fd = open(g_asset_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    pepper_asset_index_load(fd, g_asset_size, index);
+    close(fd);
+}
+
+static size_t span_count(void) {
+    size_t count = __atomic_load_n(&g_span_count, __ATOMIC_RELAXED);
+    return count < g_capacity ? count : g_capacity;
+}
+
+static void write_timeline(void) {
+    int saved_in_malloc = in_malloc;
+    in_malloc = 1;
+    pthread_mutex_lock(&g_timeline_mutex);
+
+    char tmp[540];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_timeline_path);
+    FILE* f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "[PepperOpt2] Timeline: cannot write %s\n", tmp);
+        pthread_mutex_unlock(&g_timeline_mutex);
+        in_malloc = saved_in_malloc;
+        return;
+    }
+
+    PepperAssetIndex index;
+    load_index(&index);
+    size_t count = span_count();
+    double tpu = ticks_per_us();
+    int pid = (int)getpid();
+
+    char comm[32] = "game";
+    FILE* cf = fopen("/proc/self/comm", "r");
+    if (cf) {
+        if (fgets(comm, sizeof(comm), cf)) comm[strcspn(comm, "\n")] = 0;
+        fclose(cf);
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"spans\":%lu,\"dropped\":%lu},\n",
+            (unsigned long)count, (unsigned long)(g_span_count - count));
+    fprintf(f, "\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":", pid);
+    write_string(f, comm);
+    fprintf(f, "}}");
+    for (int t = 0; t < g_thread_count; t++) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                "\"args\":{\"name\":", pid, g_threads[t].tid);
+        write_string(f, g_threads[t].name);
+        fprintf(f, "}}");
+    }
+
+    // Time before the constructor is drawn before 0
+    write_async(f, pid, 0, "process start to preload", -g_preload_us, 0, 0, 0);
+    if (g_first_frame) {
+        double first = (g_first_frame - g_start_ticks) / tpu;
+        write_async(f, pid, 1, "preload to first frame", 0, first, 0, 0);
+        fprintf(f, ",\n{\"name\":\"first frame\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%d}", first, pid, pid);
+    }
+    PhaseSpan phases[PHASE_COUNT];
+    collect_phases(&index, count, phases);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        if (!phases[p].spans) continue;
+        write_async(f, pid, 2 + p, g_phase_names[p], (phases[p].first - g_start_ticks) / tpu,
+                    (phases[p].last - g_start_ticks) / tpu, phases[p].spans, phases[p].bytes);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const TimelineSpan* s = &g_spans[i];
+        if (!__atomic_load_n(&s->span, __ATOMIC_ACQUIRE)) continue;
+        write_span(f, pid, s, (double)(int64_t)(s->start - g_start_ticks) / tpu,
+                   (s->end - s->start) / tpu, &index);
+    }
+    fprintf(f, "\n]}\n");
+
+    int failed = ferror(f) | (fclose(f) != 0);
+    if (failed || rename(tmp, g_timeline_path) != 0) {
+        fprintf(stderr, "[PepperOpt2] Timeline: cannot write %s\n", g_timeline_path);
+        unlink(tmp);
+    } else {
+        g_written = 1;
+        fprintf(stderr, "[PepperOpt2] Timeline: %zu spans written to %s\n", count,
+                g_timeline_path);
+    }
+    pepper_asset_index_free(&index);
+    pthread_mutex_unlock(&g_timeline_mutex);
+    in_malloc = saved_in_malloc;
+}
+
+// ============================================================================
+// Frames
+// ============================================================================
+
+void pepper_timeline_frame(unsigned long frame) {
+    if (!g_timeline) return;
+    uint64_t now = pepper_ticks();
+    if (g_last_swap) pepper_timeline_add(PEPPER_SPAN_FRAME, g_last_swap, frame, 0);
+    if (!g_first_frame) g_first_frame = now;
+    g_last_swap = now;
+
+    if (g_stop_frame && frame >= g_stop_frame) {
+        __atomic_store_n(&g_timeline, 0, __ATOMIC_RELEASE);
+        write_timeline();
+    }
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+static void dump_timeline(void) {
+    write_timeline();
+}
+
+// Only the parent writes the file
+static void after_fork_child(void) {
+    g_timeline = 0;
+}
+
+void pepper_timeline_init(void) {
+    const char* spec = pepper_env_str("PEPPER_TIMELINE");
+    if (!spec || !*spec) return;
+    pepper_expand_path(g_timeline_path, sizeof(g_timeline_path), spec);
+    g_stop_frame = (unsigned long)pepper_env_int("PEPPER_TIMELINE_FRAMES", 0);
+    int capacity = pepper_env_int("PEPPER_TIMELINE_EVENTS", 1 << 20);
+    if (capacity > 0) g_capacity = (size_t)capacity;
+
+    // Pages are only touched as spans arrive
+    void* spans = mmap(NULL, g_capacity * sizeof(TimelineSpan), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (spans == MAP_FAILED) {
+        fprintf(stderr, "[PepperOpt2] Timeline: cannot map %zu spans, disabled\n", g_capacity);
+        return;
+    }
+    g_spans = spans;
+    g_preload_us = process_start_us();
+    g_start_ns = monotonic_ns();
+    g_start_ticks = pepper_ticks();
+    pthread_atfork(NULL, NULL, after_fork_child);
+
+    int dump_signal = pepper_on_dump_signal(dump_timeline);
+    __atomic_store_n(&g_timeline, 1, __ATOMIC_RELEASE);
+    fprintf(stderr, "[PepperOpt2] Timeline: ENABLED (%s", g_timeline_path);
+    if (g_stop_frame) fprintf(stderr, ", until frame %lu", g_stop_frame);
+    if (dump_signal > 0) fprintf(stderr, ", dump with kill -%d %d", dump_signal, (int)getpid());
+    fprintf(stderr, ")\n");
+}
+
+void pepper_timeline_summary(void) {
+    if (!g_spans) return;
+    int recording = g_timeline;
+    __atomic_store_n(&g_timeline, 0, __ATOMIC_RELEASE);
+    if (recording || !g_written) write_timeline();
+
+    size_t count = span_count();
+    fprintf(stderr, "[PepperOpt2]   Timeline: %zu spans", count);
+    if (g_span_count > count) {
+        fprintf(stderr, " (%zu dropped, raise PEPPER_TIMELINE_EVENTS)", g_span_count - count);
+    }
+    fprintf(stderr, ", %.1f ms before preload\n", g_preload_us / 1000.0);
+
+    PepperAssetIndex index;
+    load_index(&index);
+    PhaseSpan phases[PHASE_COUNT];
+    collect_phases(&index, count, phases);
+    pepper_asset_index_free(&index);
+    double tpu = ticks_per_us();
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        if (!phases[p].spans) continue;
+        fprintf(stderr, "[PepperOpt2]     %-16s %8.1f ms to %8.1f ms, %lu reads, %.2f MB\n",
+                g_phase_names[p], (phases[p].first - g_start_ticks) / tpu / 1000.0,
+                (phases[p].last - g_start_ticks) / tpu / 1000.0,
+                (unsigned long)phases[p].spans, phases[p].bytes / 1024.0 / 1024.0);
+    }
+    if (g_first_frame) {
+        fprintf(stderr, "[PepperOpt2]     %-16s %8.1f ms\n", "first frame",
+                (g_first_frame - g_start_ticks) / tpu / 1000.0);
+    }
+}
@@ -0,0 +1,451 @@
+/*
+ * pepper_zlib.c - Fast one-shot inflate for the engine's zlib calls
+ *
+ * Every image in Assets.dat is a zlib stream that the engine inflates at
+ * startup, and under box64 that zlib may itself be running emulated. With
+ * PEPPER_FAST_INFLATE=1 this module interposes uncompress(), inflateInit_(),
+ * inflateInit2_(), inflate(), inflateReset() and inflateEnd():
+ *
+ *   - uncompress(), and the first inflate() call on a stream that already
+ *     has the whole zlib stream in next_in and room for all of the output,
+ *     are decoded in one call by libdeflate (native, SIMD where available).
+ *     The output is identical.
+ *   - Anything else (input arriving in pieces, a too-small output buffer,
+ *     raw/gzip streams, corrupt data) goes to the real zlib from the
+ *     untouched initial state, so error codes and streaming behaviour are
+ *     unchanged.
+ *   - Streams initialised without a custom allocator get a pooled
+ *     zalloc/zfree, so 10k init/end cycles reuse the same inflate state
+ *     and window blocks instead of going through malloc each time.
+ *
+ * Built without -DUSE_LIBDEFLATE, only the allocator pool is active.
+ *
+ * The same hooks also serve images that pepper_stage.c already inflated
+ * ahead of the engine (PEPPER_STAGE) and images found in an LZ4 sidecar
+ * (pepper_sidecar.c, PEPPER_SIDECAR), with or without PEPPER_FAST_INFLATE.
+ * With PEPPER_RAWCACHE, every complete single-call decode (whichever path
+ * produced it) is handed to pepper_rawcache.c, which is also asked first.
+ *
+ * Environment variables:
+ *   PEPPER_FAST_INFLATE=1         - Enable (default 0)
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include "pepper_common.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static int g_fast_inflate = 0;
+static int g_zlib_hooks = 0;       // fast inflate, staging, sidecar or raw cache wants the calls
+
+static pthread_mutex_t g_zlib_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ============================================================================
+// Real function pointers
+// ============================================================================
+
+static int (*real_uncompress)(Bytef* dest, uLongf* destLen,
+                              const Bytef* source, uLong sourceLen) = NULL;
+static int (*real_inflateInit_)(z_streamp strm, const char* version, int stream_size) = NULL;
+static int (*real_inflateInit2_)(z_streamp strm, int windowBits,
+                                 const char* version, int stream_size) = NULL;
+static int (*real_inflate)(z_streamp strm, int flush) = NULL;
+static int (*real_inflateReset)(z_streamp strm) = NULL;
+static int (*real_inflateReset2)(z_streamp strm, int windowBits) = NULL;
+static int (*real_inflateEnd)(z_streamp strm) = NULL;
+
+#define RESOLVE(name) do { if (!real_##name) real_##name = dlsym(RTLD_NEXT, #name); } while (0)
+
+// ============================================================================
+// Pooled zalloc/zfree
+// ============================================================================
+
+// inflate allocates the same two sizes over and over (its state, then the
+// 32 KB window), so a small cache of exact-size blocks covers it.
+#define POOL_SLOTS 16
+
+typedef struct {
+    size_t size;
+    void* block;
+} PoolSlot;
+
+static PoolSlot g_pool[POOL_SLOTS];
+static pthread_mutex_t g_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The block size is kept in front of the block, aligned for any type
+#define POOL_HEADER 16
+
+static voidpf pool_alloc(voidpf opaque, uInt items, uInt size) {
+    (void)opaque;
+    size_t n = (size_t)items * size;
+
+    pthread_mutex_lock(&g_pool_mutex);
+    for (int i = 0; i < POOL_SLOTS; i++) {
+        if (g_pool[i].block && g_pool[i].size == n) {
+            void* block = g_pool[i].block;
+            g_pool[i].block = NULL;
+            pepper_stat_add(PEPPER_STAT_ZLIB_POOL_HITS, 1);
+            pthread_mutex_unlock(&g_pool_mutex);
+            return (uint8_t*)block + POOL_HEADER;
+        }
+    }
+    pepper_stat_add(PEPPER_STAT_ZLIB_POOL_MISSES, 1);
+    pthread_mutex_unlock(&g_pool_mutex);
+
+    in_malloc = 1;
+    uint8_t* block = malloc(n + POOL_HEADER);
+    in_malloc = 0;
+    if (!block) return Z_NULL;
+    memcpy(block, &n, sizeof(n));
+    return block + POOL_HEADER;
+}
+
+static void pool_free(voidpf opaque, voidpf address) {
+    (void)opaque;
+    if (!address) return;
+    uint8_t* block = (uint8_t*)address - POOL_HEADER;
+    size_t n;
+    memcpy(&n, block, sizeof(n));
+
+    pthread_mutex_lock(&g_pool_mutex);
+    for (int i = 0; i < POOL_SLOTS; i++) {
+        if (!g_pool[i].block) {
+            g_pool[i].block = block;
+            g_pool[i].size = n;
+            pthread_mutex_unlock(&g_pool_mutex);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&g_pool_mutex);
+    free(block);
+}
+
+// ============================================================================
+// Streams eligible for the one-shot path
+// ============================================================================
+
+#define MAX_FAST_STREAMS 64
+
+typedef enum {
+    STREAM_PENDING = 1,   // zlib-wrapped, nothing inflated yet
+    STREAM_DONE,          // finished by the one-shot path
+} StreamState;
+
+typedef struct {
+    z_streamp strm;
+    StreamState state;
+} FastStream;
+
+static FastStream g_streams[MAX_FAST_STREAMS];
+
+static FastStream* find_stream(z_streamp strm) {
+    for (int i = 0; i < MAX_FAST_STREAMS; i++) {
+        if (g_streams[i].strm == strm) return &g_streams[i];
+    }
+    return NULL;
+}
+
+static void set_stream(z_streamp strm, StreamState state) {
+    pthread_mutex_lock(&g_zlib_mutex);
+    FastStream* s = find_stream(strm);
+    if (!s) s = find_stream(NULL);
+    if (s) {
+        s->strm = strm;
+        s->state = state;
+    }
+    pthread_mutex_unlock(&g_zlib_mutex);
+}
+
+static StreamState get_stream(z_streamp strm) {
+    pthread_mutex_lock(&g_zlib_mutex);
+    FastStream* s = find_stream(strm);
+    StreamState state = s ? s->state : 0;
+    pthread_mutex_unlock(&g_zlib_mutex);
+    return state;
+}
+
+static void drop_stream(z_streamp strm) {
+    pthread_mutex_lock(&g_zlib_mutex);
+    FastStream* s = find_stream(strm);
+    if (s) {
+        s->strm = NULL;
+        s->state = 0;
+    }
+    pthread_mutex_unlock(&g_zlib_mutex);
+}
+
+// ============================================================================
+// One-shot decode
+// ============================================================================
+
+#ifdef USE_LIBDEFLATE
+// One decompressor per thread, freed when the thread exits
+static pthread_key_t g_decompressor_key;
+static pthread_once_t g_decompressor_once = PTHREAD_ONCE_INIT;
+
+static void free_decompressor(void* d) {
+    libdeflate_free_decompressor(d);
+}
+
+static void create_decompressor_key(void) {
+    pthread_key_create(&g_decompressor_key, free_decompressor);
+}
+
+static struct libdeflate_decompressor* thread_decompressor(void) {
+    pthread_once(&g_decompressor_once, create_decompressor_key);
+    struct libdeflate_decompressor* d = pthread_getspecific(g_decompressor_key);
+    if (!d) {
+        in_malloc = 1;
+        d = libdeflate_alloc_decompressor();
+        in_malloc = 0;
+        if (d) pthread_setspecific(g_decompressor_key, d);
+    }
+    return d;
+}
+#endif
+
+int pepper_zlib_decode(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap,
+                       size_t* in_used, size_t* out_len) {
+#ifdef USE_LIBDEFLATE
+    struct libdeflate_decompressor* d = thread_decompressor();
+    if (!d) return -1;
+    return libdeflate_zlib_decompress_ex(d, in, in_len, out, out_cap, in_used, out_len) ==
+           LIBDEFLATE_SUCCESS ? 0 : -1;
+#else
+    RESOLVE(inflateInit_);
+    RESOLVE(inflate);
+    RESOLVE(inflateEnd);
+    if (!real_inflateInit_ || !real_inflate || !real_inflateEnd) return -1;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (real_inflateInit_(&strm, ZLIB_VERSION, (int)sizeof(strm)) != Z_OK) return -1;
+    strm.next_in = (Bytef*)in;
+    strm.avail_in = (uInt)in_len;
+    strm.next_out = out;
+    strm.avail_out = (uInt)out_cap;
+    int ret = real_inflate(&strm, Z_FINISH);
+    *in_used = strm.total_in;
+    *out_len = strm.total_out;
+    real_inflateEnd(&strm);
+    return ret == Z_STREAM_END ? 0 : -1;
+#endif
+}
+
+// Decode a complete zlib stream. Returns 0 and fills *in_used/*out_len on
+// success; -1 means "let real zlib handle it" (no output is guaranteed).
+static int one_shot(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap,
+                    size_t* in_used, size_t* out_len) {
+    if (pepper_rawcache_take(in, in_len, out, out_cap, in_used, out_len) == 0) return 0;
+    if (pepper_stage_take(in, in_len, out, out_cap, in_used, out_len) == 0 ||
+        pepper_sidecar_take(in, in_len, out, out_cap, in_used, out_len) == 0) {
+        pepper_rawcache_store(in, *in_used, out, *out_len);
+        return 0;
+    }
+
+#ifdef USE_LIBDEFLATE
+    if (!g_fast_inflate) return -1;
+    struct libdeflate_decompressor* d = thread_decompressor();
+    if (!d) return -1;
+    if (libdeflate_zlib_decompress_ex(d, in, in_len, out, out_cap, in_used, out_len) !=
+        LIBDEFLATE_SUCCESS) {
+        return -1;
+    }
+
+    pepper_stat_add(PEPPER_STAT_ZLIB_FAST_CALLS, 1);
+    pepper_stat_add(PEPPER_STAT_ZLIB_FAST_BYTES, *out_len);
+    pepper_rawcache_store(in, *in_used, out, *out_len);
+    return 0;
+#else
+    (void)in; (void)in_len; (void)out; (void)out_cap; (void)in_used; (void)out_len;
+    return -1;
+#endif
+}
+
+static void count_fallback(void) {
+    pepper_stat_add(PEPPER_STAT_ZLIB_FALLBACK_CALLS, 1);
+}
+
+// ============================================================================
+// zlib hooks
+// ============================================================================
+
+int uncompress(Bytef* dest, uLongf* destLen, const Bytef* source, uLong sourceLen) {
+    RESOLVE(uncompress);
+    if (g_zlib_hooks) {
+        size_t in_used, out_len;
+        if (one_shot(source, sourceLen, dest, *destLen, &in_used, &out_len) == 0) {
+            *destLen = (uLongf)out_len;
+            return Z_OK;
+        }
+        count_fallback();
+    }
+    if (!real_uncompress) return Z_STREAM_ERROR;
+    int ret = real_uncompress(dest, destLen, source, sourceLen);
+    if (g_zlib_hooks && ret == Z_OK) pepper_rawcache_store(source, sourceLen, dest, *destLen);
+    return ret;
+}
+
+static void use_pool(z_streamp strm) {
+    if (g_fast_inflate && strm && !strm->zalloc && !strm->zfree) {
+        strm->zalloc = pool_alloc;
+        strm->zfree = pool_free;
+        strm->opaque = Z_NULL;
+    }
+}
+
+int inflateInit_(z_streamp strm, const char* version, int stream_size) {
+    RESOLVE(inflateInit_);
+    if (!real_inflateInit_) return Z_VERSION_ERROR;
+    if (!g_zlib_hooks) return real_inflateInit_(strm, version, stream_size);
+
+    use_pool(strm);
+    int ret = real_inflateInit_(strm, version, stream_size);
+    if (ret == Z_OK) set_stream(strm, STREAM_PENDING);
+    return ret;
+}
+
+int inflateInit2_(z_streamp strm, int windowBits, const char* version, int stream_size) {
+    RESOLVE(inflateInit2_);
+    if (!real_inflateInit2_) return Z_VERSION_ERROR;
+    if (!g_zlib_hooks) {
+        return real_inflateInit2_(strm, windowBits, version, stream_size);
+    }
+
+    use_pool(strm);
+    int ret = real_inflateInit2_(strm, windowBits, version, stream_size);
+    // Only plain zlib-wrapped streams (8..15) can take the one-shot path
+    if (ret == Z_OK && windowBits >= 8 && windowBits <= 15) set_stream(strm, STREAM_PENDING);
+    return ret;
+}
+
+static int inflate_hooked(z_streamp strm, int flush) {
+    if (!g_zlib_hooks || !strm) return real_inflate(strm, flush);
+
+    StreamState state = get_stream(strm);
+    if (state == STREAM_DONE) return Z_STREAM_END;
+
+    if (state == STREAM_PENDING && strm->total_in == 0 && strm->total_out == 0 &&
+        strm->next_in && strm->next_out) {
+        size_t in_used, out_len;
+        if (one_shot(strm->next_in, strm->avail_in, strm->next_out, strm->avail_out,
+                     &in_used, &out_len) == 0) {
+            // adler32 of the output is the stream's big-endian trailer
+            const uint8_t* trailer = strm->next_in + in_used - 4;
+            strm->adler = ((uLong)trailer[0] << 24) | ((uLong)trailer[1] << 16) |
+                          ((uLong)trailer[2] << 8) | trailer[3];
+            strm->next_in += in_used;
+            strm->avail_in -= (uInt)in_used;
+            strm->total_in += in_used;
+            strm->next_out += out_len;
+            strm->avail_out -= (uInt)out_len;
+            strm->total_out += out_len;
+            strm->msg = Z_NULL;
+            set_stream(strm, STREAM_DONE);
+            return Z_STREAM_END;
+        }
+        count_fallback();
+    }
+
+    // Real zlib from here on, starting from its untouched initial state
+    if (state != STREAM_PENDING) return real_inflate(strm, flush);
+    drop_stream(strm);
+    const Bytef* in = strm->next_in;
+    Bytef* out = strm->next_out;
+    int fresh = strm->total_in == 0 && strm->total_out == 0;
+    int ret = real_inflate(strm, flush);
+    // Finished in this one call: the whole image is in `out`
+    if (ret == Z_STREAM_END && fresh) {
+        pepper_rawcache_store(in, strm->total_in, out, strm->total_out);
+    }
+    return ret;
+}
+
+int inflate(z_streamp strm, int flush) {
+    RESOLVE(inflate);
+    if (!real_inflate) return Z_STREAM_ERROR;
+    uint64_t lat = pepper_latency_start();
+    uint64_t span = strm ? pepper_timeline_start() : 0;
+    uLong in = span ? strm->total_in : 0, out = span ? strm->total_out : 0;
+    int ret = inflate_hooked(strm, flush);
+    if (span) {
+        pepper_timeline_add(PEPPER_SPAN_INFLATE, span, strm->total_in - in,
+                            strm->total_out - out);
+    }
+    pepper_latency_record(PEPPER_LAT_INFLATE, lat);
+    return ret;
+}
+
+int inflateReset(z_streamp strm) {
+    RESOLVE(inflateReset);
+    if (!real_inflateReset) return Z_STREAM_ERROR;
+    int ret = real_inflateReset(strm);
+    if (g_zlib_hooks && ret == Z_OK && get_stream(strm)) set_stream(strm, STREAM_PENDING);
+    return ret;
+}
+
+// A new windowBits may switch the stream to gzip or raw deflate, which the
+// one-shot path does not take
+int inflateReset2(z_streamp strm, int windowBits) {
+    RESOLVE(inflateReset2);
+    if (!real_inflateReset2) return Z_STREAM_ERROR;
+    int ret = real_inflateReset2(strm, windowBits);
+    if (g_zlib_hooks && ret == Z_OK && get_stream(strm)) {
+        if (windowBits >= 8 && windowBits <= 15) set_stream(strm, STREAM_PENDING);
+        else drop_stream(strm);
+    }
+    return ret;
+}
+
+int inflateEnd(z_streamp strm) {
+    RESOLVE(inflateEnd);
+    if (!real_inflateEnd) return Z_STREAM_ERROR;
+    if (g_zlib_hooks) drop_stream(strm);
+    return real_inflateEnd(strm);
+}
+
+// ============================================================================
+// Init / summary
+// ============================================================================
+
+void pepper_zlib_init(void) {
+    g_fast_inflate = pepper_env_int("PEPPER_FAST_INFLATE", 0) && !g_disabled;
+    g_zlib_hooks = g_fast_inflate || pepper_stage_enabled() || pepper_sidecar_enabled() ||
+                   pepper_rawcache_enabled();
+    if (!g_fast_inflate) return;
+
+#ifdef USE_LIBDEFLATE
+    fprintf(stderr, "[PepperOpt2] Fast inflate: ENABLED (libdeflate one-shot, pooled state)\n");
+#else
+    fprintf(stderr, "[PepperOpt2] Fast inflate: pooled state only (built without USE_LIBDEFLATE)\n");
+#endif
+}
+
+void pepper_zlib_summary(void) {
+    if (!g_fast_inflate) return;
+
+#ifdef USE_LIBDEFLATE
+    fprintf(stderr, "[PepperOpt2]   One-shot inflates: %zu (%.2f MB out), zlib fallbacks: %zu\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_ZLIB_FAST_CALLS),
+            (size_t)pepper_stat_get(PEPPER_STAT_ZLIB_FAST_BYTES) / 1024.0 / 1024.0,
+            (size_t)pepper_stat_get(PEPPER_STAT_ZLIB_FALLBACK_CALLS));
+#endif
+
+    fprintf(stderr, "[PepperOpt2]   Inflate state pool: %zu reused, %zu allocated\n",
+            (size_t)pepper_stat_get(PEPPER_STAT_ZLIB_POOL_HITS),
+            (size_t)pepper_stat_get(PEPPER_STAT_ZLIB_POOL_MISSES));
+}
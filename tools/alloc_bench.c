@@ -0,0 +1,815 @@
+/*
+ * alloc_bench.c - Compare glibc malloc with libpepperopt2's allocator
+ *
+ * Replays an allocation trace shaped like Chowdren's loading phase:
+ *   - a loader thread that, for every image, allocates a compressed read
+ *     buffer, then a 16 KB - 1 MB pixel buffer, then a burst of small
+ *     objects, and frees the read buffer;
+ *   - most pixel buffers are freed a few images later, as the preload
+ *     library does once they are uploaded (PEPPER_AGGRESSIVE_FREE); the
+ *     rest stay for the whole session;
+ *   - a few of the small objects live for the rest of the session;
+ *   - worker threads that churn through short-lived small objects.
+ * The trace is generated from a fixed seed, so every run and every
+ * allocator sees exactly the same operations.
+ *
+ * With --trace, a capture made with PEPPER_ALLOC_TRACE (see
+ * patches/pepper_alloctrace.c) is replayed instead: every thread of the
+ * game (up to 64) becomes a replay thread with the same calls in the same
+ * order, and a call on a block another thread allocated or reallocated
+ * waits until that call has been replayed. Only the calls are replayed,
+ * not the time between them.
+ *
+ * Each allocator runs in its own child process (LD_PRELOAD is set before
+ * exec), so any malloc replacement (jemalloc, tcmalloc, ...) can be added
+ * with --alloc. The benchmark reports:
+ *   - wall time and ns per operation (page faults included: every page
+ *     handed out is touched once, as the engine writes its pixels),
+ *   - peak RSS during the replay,
+ *   - RSS left at the end against the bytes still live, which shows
+ *     fragmentation, and for captures the peak RSS against the most bytes
+ *     that were live at once.
+ *
+ * Build:
+ *   gcc -O3 -o alloc_bench alloc_bench.c -lpthread -lm
+ *
+ * Usage:
+ *   ./alloc_bench [--lib libpepperopt2.so] [--images N] [--threads N] [--runs N]
+ *   ./alloc_bench --trace alloc.trace [--lib libpepperopt2.so] [--alloc NAME=LIB]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// ============================================================================
+// Trace
+// ============================================================================
+
+enum { OP_MALLOC, OP_CALLOC, OP_REALLOC, OP_FREE };
+#define OP_LAST_CALL OP_FREE  // later ops in a capture are events, not calls
+
+typedef struct {
+    uint32_t slot;
+    uint32_t size;
+    uint32_t seq;           // ops on this slot before this one
+    uint8_t kind;
+} TraceOp;
+
+typedef struct {
+    TraceOp* ops;
+    size_t count;
+    size_t cap;
+    uint64_t live_bytes;    // requested bytes still allocated at the end
+} ThreadTrace;
+
+// Slots are shared by all threads, so one thread can free another's block
+static uint32_t g_slot_count = 0;
+
+// Ops pushed so far for each slot, while the trace is built
+static uint32_t* g_slot_ops = NULL;
+static size_t g_slot_ops_cap = 0;
+
+static uint64_t g_rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t next_random(void) {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+static uint32_t random_range(uint32_t lo, uint32_t hi) {
+    return lo + (uint32_t)(next_random() % (hi - lo + 1));
+}
+
+// Log-uniform size, so small and large buffers are equally common per octave
+static uint32_t random_log_size(uint32_t lo, uint32_t hi) {
+    double f = (next_random() >> 11) * (1.0 / 9007199254740992.0);
+    return (uint32_t)(lo * exp(f * log((double)hi / lo)));
+}
+
+static void push_op(ThreadTrace* t, int kind, uint32_t slot, uint32_t size) {
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 4096;
+        t->ops = realloc(t->ops, t->cap * sizeof(TraceOp));
+        if (!t->ops) {
+            fprintf(stderr, "Error: out of memory for the trace\n");
+            exit(1);
+        }
+    }
+    if (slot >= g_slot_ops_cap) {
+        size_t cap = g_slot_ops_cap ? g_slot_ops_cap : 1 << 16;
+        while (cap <= slot) cap *= 2;
+        g_slot_ops = realloc(g_slot_ops, cap * sizeof(uint32_t));
+        if (!g_slot_ops) {
+            fprintf(stderr, "Error: out of memory for the trace\n");
+            exit(1);
+        }
+        memset(g_slot_ops + g_slot_ops_cap, 0, (cap - g_slot_ops_cap) * sizeof(uint32_t));
+        g_slot_ops_cap = cap;
+    }
+    t->ops[t->count].slot = slot;
+    t->ops[t->count].size = size;
+    t->ops[t->count].seq = g_slot_ops[slot]++;
+    t->ops[t->count].kind = (uint8_t)kind;
+    t->count++;
+}
+
+static uint32_t small_size(void) {
+    return (next_random() % 10) ? random_range(16, 512) : random_range(512, 4096);
+}
+
+// Small objects with short lifetimes; about 1 in `keep_one_in` stays live
+typedef struct {
+    uint32_t slots[256];
+    uint32_t sizes[256];
+    int count;
+} ShortLived;
+
+static void small_burst(ThreadTrace* t, ShortLived* pool, int ops, int keep_one_in) {
+    for (int i = 0; i < ops; i++) {
+        if (pool->count == 256 || (pool->count > 0 && (next_random() & 1))) {
+            int victim = (int)(next_random() % pool->count);
+            push_op(t, OP_FREE, pool->slots[victim], 0);
+            t->live_bytes -= pool->sizes[victim];
+            pool->count--;
+            pool->slots[victim] = pool->slots[pool->count];
+            pool->sizes[victim] = pool->sizes[pool->count];
+            continue;
+        }
+        uint32_t slot = g_slot_count++;
+        uint32_t size = small_size();
+        uint32_t kind = next_random() % 8;
+        push_op(t, kind == 0 ? OP_CALLOC : OP_MALLOC, slot, size);
+        if (kind == 1) {
+            uint32_t grown = size + size / 2;
+            push_op(t, OP_REALLOC, slot, grown);
+            size = grown;
+        }
+        t->live_bytes += size;
+        if (next_random() % keep_one_in == 0) continue;  // lives on
+        pool->slots[pool->count] = slot;
+        pool->sizes[pool->count] = size;
+        pool->count++;
+    }
+}
+
+static void build_trace(ThreadTrace* traces, int threads, int images) {
+    memset(traces, 0, threads * sizeof(ThreadTrace));
+
+    // Loader: one pixel buffer per image; 3 in 4 are freed after "upload",
+    // up to UPLOAD_DELAY images later
+    enum { UPLOAD_DELAY = 4 };
+    ThreadTrace* loader = &traces[0];
+    ShortLived pool = { .count = 0 };
+    uint32_t pending_slot[UPLOAD_DELAY], pending_size[UPLOAD_DELAY];
+    int pending = 0;
+    for (int i = 0; i < images; i++) {
+        uint32_t pixels = random_log_size(16 * 1024, 1024 * 1024);
+        uint32_t read_slot = g_slot_count++;
+        uint32_t pixel_slot = g_slot_count++;
+        push_op(loader, OP_MALLOC, read_slot, pixels / 4 + 64);
+        push_op(loader, OP_MALLOC, pixel_slot, pixels);
+        loader->live_bytes += pixels;
+        small_burst(loader, &pool, (int)random_range(20, 60), 20);
+        push_op(loader, OP_FREE, read_slot, 0);
+
+        if (pending == UPLOAD_DELAY || (pending > 0 && next_random() % 2)) {
+            int done = (int)(next_random() % pending);
+            push_op(loader, OP_FREE, pending_slot[done], 0);
+            loader->live_bytes -= pending_size[done];
+            pending--;
+            pending_slot[done] = pending_slot[pending];
+            pending_size[done] = pending_size[pending];
+        }
+        if (next_random() % 4) {
+            pending_slot[pending] = pixel_slot;
+            pending_size[pending] = pixels;
+            pending++;
+        }
+    }
+
+    // Workers: short-lived small objects, few survivors
+    for (int w = 1; w < threads; w++) {
+        ShortLived worker_pool = { .count = 0 };
+        small_burst(&traces[w], &worker_pool, images * 40, 200);
+    }
+}
+
+// ============================================================================
+// Captured trace (PEPPER_ALLOC_TRACE, see patches/pepper_alloctrace.c)
+// ============================================================================
+
+#define CAPTURE_MAGIC "PEPALC\0\1"
+#define MAX_THREADS 64
+
+// Same layout as patches/pepper_alloctrace.c
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t start_ns;
+} CaptureHeader;
+
+typedef struct {
+    uint64_t time_ns;
+    uint64_t ptr;
+    uint64_t old_ptr;
+    uint32_t size;
+    uint32_t site;
+    uint32_t before_ns;
+    uint16_t thread;
+    uint8_t op;
+    uint8_t reserved;
+} CaptureRecord;
+
+// A record at the point it takes effect. A realloc gives up its old block
+// when it is called and gets the new one when it returns, so it has two.
+typedef struct {
+    uint64_t time_ns;
+    uint32_t record;
+    uint32_t release;         // 1 = a realloc giving up old_ptr
+} CaptureEvent;
+
+static int compare_events(const void* a, const void* b) {
+    const CaptureEvent* x = a;
+    const CaptureEvent* y = b;
+    if (x->time_ns != y->time_ns) return x->time_ns < y->time_ns ? -1 : 1;
+    if (x->record != y->record) return x->record < y->record ? -1 : 1;
+    return (int)y->release - (int)x->release;
+}
+
+// Live pointers -> slots; open addressing with backward-shift deletion
+typedef struct {
+    uint64_t* keys;           // 0 = empty
+    uint32_t* slots;
+    size_t mask;
+    size_t count;
+} PointerMap;
+
+static size_t pointer_hash(uint64_t ptr) {
+    ptr ^= ptr >> 33;
+    ptr *= 0xff51afd7ed558ccdull;
+    ptr ^= ptr >> 33;
+    return (size_t)ptr;
+}
+
+static void map_grow(PointerMap* m);
+
+static void map_put(PointerMap* m, uint64_t ptr, uint32_t slot) {
+    if ((m->count + 1) * 2 > m->mask + 1) map_grow(m);
+    size_t i = pointer_hash(ptr) & m->mask;
+    while (m->keys[i] && m->keys[i] != ptr) i = (i + 1) & m->mask;
+    if (!m->keys[i]) m->count++;
+    m->keys[i] = ptr;
+    m->slots[i] = slot;
+}
+
+static void map_grow(PointerMap* m) {
+    PointerMap old = *m;
+    size_t size = old.keys ? (old.mask + 1) * 2 : 1 << 16;
+    m->keys = calloc(size, sizeof(uint64_t));
+    m->slots = calloc(size, sizeof(uint32_t));
+    if (!m->keys || !m->slots) {
+        fprintf(stderr, "Error: out of memory for the trace\n");
+        exit(1);
+    }
+    m->mask = size - 1;
+    m->count = 0;
+    for (size_t i = 0; old.keys && i <= old.mask; i++) {
+        if (old.keys[i]) map_put(m, old.keys[i], old.slots[i]);
+    }
+    free(old.keys);
+    free(old.slots);
+}
+
+// Removes `ptr` and returns its slot, or UINT32_MAX if it is not live
+static uint32_t map_take(PointerMap* m, uint64_t ptr) {
+    if (!m->keys) return UINT32_MAX;
+    size_t i = pointer_hash(ptr) & m->mask;
+    while (m->keys[i] != ptr) {
+        if (!m->keys[i]) return UINT32_MAX;
+        i = (i + 1) & m->mask;
+    }
+    uint32_t slot = m->slots[i];
+    // Pull later entries of the cluster back so lookups never stop early
+    size_t hole = i;
+    for (size_t j = (i + 1) & m->mask; m->keys[j]; j = (j + 1) & m->mask) {
+        size_t home = pointer_hash(m->keys[j]) & m->mask;
+        if (((j - home) & m->mask) >= ((j - hole) & m->mask)) {
+            m->keys[hole] = m->keys[j];
+            m->slots[hole] = m->slots[j];
+            hole = j;
+        }
+    }
+    m->keys[hole] = 0;
+    m->count--;
+    return slot;
+}
+
+typedef struct {
+    size_t records;
+    size_t unknown_frees;     // blocks allocated before the capture started
+    size_t reused_live;       // address handed out again with no free seen
+    uint64_t peak_live;       // most requested bytes live at once
+    int threads;              // threads in the capture
+} CaptureStats;
+
+// Turn a capture into per-thread op lists over shared slots. Returns the
+// number of replay threads, 0 on error.
+static int load_capture(const char* path, ThreadTrace* traces, CaptureStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    const CaptureHeader* header = NULL;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CaptureHeader)) {
+        header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (header == MAP_FAILED) header = NULL;
+    }
+    if (fd >= 0) close(fd);
+    if (!header || memcmp(header->magic, CAPTURE_MAGIC, 8) != 0 ||
+        header->record_size != sizeof(CaptureRecord)) {
+        fprintf(stderr, "Error: %s is not an allocation trace\n", path);
+        return 0;
+    }
+    // Mapped, so the capture's pages do not count against the replay
+    const CaptureRecord* records = (const CaptureRecord*)(header + 1);
+    size_t count = (st.st_size - sizeof(CaptureHeader)) / sizeof(CaptureRecord);
+    CaptureEvent* events = malloc((count ? count : 1) * 2 * sizeof(CaptureEvent));
+    uint32_t* pending = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!events || !pending) {
+        fprintf(stderr, "Error: out of memory for the trace\n");
+        return 0;
+    }
+
+    // Capture thread IDs -> replay threads, in order of first appearance
+    int thread_of[65536];
+    memset(thread_of, -1, sizeof(thread_of));
+    int threads = 0;
+    size_t event_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        const CaptureRecord* r = &records[i];
+        if (r->op > OP_LAST_CALL) continue;
+        if (thread_of[r->thread] < 0) {
+            if (threads == MAX_THREADS) {
+                fprintf(stderr, "Error: capture has more than %d threads, which cannot be "
+                        "replayed separately\n", MAX_THREADS);
+                return 0;
+            }
+            thread_of[r->thread] = threads++;
+        }
+        events[event_count++] = (CaptureEvent){ r->time_ns, (uint32_t)i, 0 };
+        if (r->op == OP_REALLOC) {
+            uint64_t called = r->time_ns > r->before_ns ? r->time_ns - r->before_ns : 0;
+            events[event_count++] = (CaptureEvent){ called, (uint32_t)i, 1 };
+        }
+    }
+    qsort(events, event_count, sizeof(CaptureEvent), compare_events);
+
+    PointerMap live = { 0 };
+    uint32_t* sizes = NULL;
+    size_t sizes_cap = 0;
+    uint64_t live_bytes = 0;
+    for (size_t e = 0; e < event_count; e++) {
+        const CaptureRecord* r = &records[events[e].record];
+        ThreadTrace* t = &traces[thread_of[r->thread]];
+        uint32_t slot;
+        if (events[e].release) {
+            pending[events[e].record] = r->old_ptr ? map_take(&live, r->old_ptr) : UINT32_MAX;
+            if (r->old_ptr && pending[events[e].record] == UINT32_MAX) stats->unknown_frees++;
+            continue;
+        }
+        if (r->op == OP_FREE) {
+            slot = map_take(&live, r->ptr);
+            if (slot == UINT32_MAX) {
+                stats->unknown_frees++;
+                continue;
+            }
+            push_op(t, OP_FREE, slot, 0);
+            live_bytes -= sizes[slot];
+            continue;
+        }
+
+        slot = r->op == OP_REALLOC ? pending[events[e].record] : UINT32_MAX;
+        if (r->op == OP_REALLOC && !r->ptr) {
+            // realloc(ptr, 0)
+            if (slot != UINT32_MAX) {
+                push_op(t, OP_FREE, slot, 0);
+                live_bytes -= sizes[slot];
+            }
+            continue;
+        }
+        if (slot == UINT32_MAX) {
+            slot = g_slot_count++;
+            if (slot >= sizes_cap) {
+                sizes_cap = sizes_cap ? sizes_cap * 2 : 1 << 16;
+                sizes = realloc(sizes, sizes_cap * sizeof(uint32_t));
+                if (!sizes) {
+                    fprintf(stderr, "Error: out of memory for the trace\n");
+                    exit(1);
+                }
+            }
+            push_op(t, r->op == OP_CALLOC ? OP_CALLOC : OP_MALLOC, slot, r->size);
+        } else {
+            push_op(t, OP_REALLOC, slot, r->size);
+            live_bytes -= sizes[slot];
+        }
+        uint32_t stale = map_take(&live, r->ptr);
+        if (stale != UINT32_MAX) {
+            // Its free was not captured (or not in order); leave it allocated
+            stats->reused_live++;
+        }
+        map_put(&live, r->ptr, slot);
+        sizes[slot] = r->size;
+        live_bytes += r->size;
+        if (live_bytes > stats->peak_live) stats->peak_live = live_bytes;
+    }
+    // Leftover blocks are the ones still live at the end
+    traces[0].live_bytes = live_bytes;
+
+    stats->records = count;
+    stats->threads = threads;
+    munmap((void*)header, st.st_size);
+    free(events);
+    free(pending);
+    free(sizes);
+    free(live.keys);
+    free(live.slots);
+    return threads;
+}
+
+// ============================================================================
+// Replay (child process)
+// ============================================================================
+
+typedef struct {
+    void* ptr;
+    uint32_t done;          // ops replayed on this slot
+} ReplaySlot;
+
+typedef struct {
+    ThreadTrace* trace;
+    ReplaySlot* slots;
+    pthread_barrier_t* start;
+    size_t page_size;
+} ReplayJob;
+
+// The op before this one on the slot may belong to another thread and not
+// have run yet (an allocation, or a realloc that moved the block); wait for
+// exactly that op, so the pointer is never a stale one
+static void* slot_get(ReplaySlot* slots, const TraceOp* op) {
+    while (__atomic_load_n(&slots[op->slot].done, __ATOMIC_ACQUIRE) != op->seq) sched_yield();
+    return slots[op->slot].ptr;
+}
+
+static void slot_set(ReplaySlot* slots, const TraceOp* op, void* p) {
+    slots[op->slot].ptr = p;
+    __atomic_store_n(&slots[op->slot].done, op->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void* replay_thread(void* arg) {
+    ReplayJob* job = arg;
+    ThreadTrace* t = job->trace;
+    ReplaySlot* slots = job->slots;
+    pthread_barrier_wait(job->start);
+
+    for (size_t i = 0; i < t->count; i++) {
+        const TraceOp* op = &t->ops[i];
+        uint8_t* p;
+        switch (op->kind) {
+        case OP_MALLOC:
+            p = malloc(op->size ? op->size : 1);
+            break;
+        case OP_CALLOC:
+            p = calloc(1, op->size ? op->size : 1);
+            break;
+        case OP_REALLOC:
+            p = realloc(slot_get(slots, op), op->size ? op->size : 1);
+            break;
+        default:
+            free(slot_get(slots, op));
+            slot_set(slots, op, NULL);
+            continue;
+        }
+        if (!p) return (void*)1;
+        // Touch every page once, as the engine writes what it allocates
+        for (size_t off = 0; off < op->size; off += job->page_size) p[off] = (uint8_t)i;
+        slot_set(slots, op, p);
+    }
+    // Live objects are kept (and leaked) so the end RSS can be measured
+    return NULL;
+}
+
+static long rss_kb(void) {
+    FILE* f = fopen("/proc/self/statm", "r");
+    long pages = 0, resident = 0;
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Peak RSS since reset_peak_rss(), or 0 if the kernel cannot reset it
+static long peak_rss_kb(void) {
+    FILE* f = fopen("/proc/self/status", "r");
+    char line[256];
+    long peak = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld", &peak) == 1) break;
+    }
+    if (f) fclose(f);
+    return peak;
+}
+
+// Start the peak over, so building the trace does not count
+static int reset_peak_rss(void) {
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if (!f) return -1;
+    int ok = fputs("5", f) >= 0;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Replays the synthetic trace, or the capture at `capture` if set. Prints
+// "<seconds> <ops> <rss_used_kb> <live_kb> <rss_before_kb> <peak_live_kb>
+// <peak_kb>" for the parent; peak_kb is 0 if it could not be measured.
+static int run_child(const char* capture, int images, int threads) {
+    ThreadTrace* traces = calloc(capture ? MAX_THREADS : threads, sizeof(ThreadTrace));
+    if (!traces) return 1;
+    uint64_t peak_live = 0;
+    if (capture) {
+        CaptureStats stats;
+        threads = load_capture(capture, traces, &stats);
+        if (threads == 0) return 1;
+        peak_live = stats.peak_live;
+    } else {
+        build_trace(traces, threads, images);
+    }
+    ReplayJob* jobs = calloc(threads, sizeof(ReplayJob));
+    pthread_t* ids = calloc(threads, sizeof(pthread_t));
+    ReplaySlot* slots = calloc(g_slot_count ? g_slot_count : 1, sizeof(ReplaySlot));
+    if (!jobs || !ids || !slots) return 1;
+    free(g_slot_ops);
+    g_slot_ops = NULL;
+    g_slot_ops_cap = 0;
+    // Fault the slot table in now so it is part of the baseline, not the replay
+    for (size_t i = 0; i < g_slot_count; i += 256) ((volatile ReplaySlot*)slots)[i].done = 0;
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    size_t ops = 0;
+    uint64_t live = 0;
+    for (int t = 0; t < threads; t++) {
+        jobs[t].trace = &traces[t];
+        jobs[t].slots = slots;
+        jobs[t].start = &start;
+        jobs[t].page_size = sysconf(_SC_PAGESIZE);
+        ops += traces[t].count;
+        live += traces[t].live_bytes;
+        if (pthread_create(&ids[t], NULL, replay_thread, &jobs[t]) != 0) return 1;
+    }
+
+    long rss_before = rss_kb();
+    int peak_reset = reset_peak_rss() == 0;
+    pthread_barrier_wait(&start);
+    double begin = now_seconds();
+    int failed = 0;
+    for (int t = 0; t < threads; t++) {
+        void* ret;
+        pthread_join(ids[t], &ret);
+        failed |= ret != NULL;
+    }
+    double elapsed = now_seconds() - begin;
+    if (failed) return 1;
+
+    printf("%.6f %zu %ld %llu %ld %llu %ld\n", elapsed, ops, rss_kb() - rss_before,
+           (unsigned long long)(live / 1024), rss_before, (unsigned long long)(peak_live / 1024),
+           peak_reset ? peak_rss_kb() : 0);
+    fflush(stdout);
+    return 0;
+}
+
+// ============================================================================
+// Benchmark (parent)
+// ============================================================================
+
+#define MAX_ALLOCATORS 8
+
+typedef struct {
+    const char* name;
+    const char* preload;    // NULL = plain glibc
+    const char* slab;       // PEPPER_SLAB (and PEPPER_ARENA) value
+} Allocator;
+
+typedef struct {
+    double seconds;
+    size_t ops;
+    long rss_used_kb;
+    long live_kb;
+    long rss_before_kb;
+    long peak_live_kb;
+    long peak_kb;
+} RunResult;
+
+typedef struct {
+    const char* capture;    // NULL = synthetic trace
+    int images;
+    int threads;
+} Workload;
+
+static int run_once(const Allocator* a, const Workload* w, RunResult* r) {
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (a->preload) setenv("LD_PRELOAD", a->preload, 1);
+        else unsetenv("LD_PRELOAD");
+        setenv("PEPPER_SLAB", a->slab, 1);
+        setenv("PEPPER_ARENA", a->slab, 1);
+        unsetenv("PEPPER_ALLOC_TRACE");
+        if (w->capture) {
+            execl("/proc/self/exe", "alloc_bench", "--child-trace", w->capture, (char*)NULL);
+        } else {
+            char images_arg[16], threads_arg[16];
+            snprintf(images_arg, sizeof(images_arg), "%d", w->images);
+            snprintf(threads_arg, sizeof(threads_arg), "%d", w->threads);
+            execl("/proc/self/exe", "alloc_bench", "--child", images_arg, threads_arg, (char*)NULL);
+        }
+        _exit(127);
+    }
+    close(fds[1]);
+    char line[256] = { 0 };
+    FILE* f = fdopen(fds[0], "r");
+    int got = f && fgets(line, sizeof(line), f) != NULL;
+    if (f) fclose(f);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        !got) {
+        return -1;
+    }
+    unsigned long long live, peak_live;
+    if (sscanf(line, "%lf %zu %ld %llu %ld %llu %ld", &r->seconds, &r->ops, &r->rss_used_kb, &live,
+               &r->rss_before_kb, &peak_live, &r->peak_kb) != 7) {
+        return -1;
+    }
+    r->live_kb = (long)live;
+    r->peak_live_kb = (long)peak_live;
+    if (r->peak_kb == 0) r->peak_kb = usage.ru_maxrss;
+    return 0;
+}
+
+static int run_bench(const Allocator* allocators, int count, const Workload* w, int runs) {
+    printf("\n================================================================================\n");
+    if (w->capture) {
+        printf("ALLOCATOR BENCHMARK (%s, %d runs)\n", w->capture, runs);
+    } else {
+        printf("ALLOCATOR BENCHMARK (%d images, %d threads, %d runs)\n", w->images, w->threads, runs);
+    }
+    printf("================================================================================\n");
+
+    RunResult best[MAX_ALLOCATORS];
+    for (int r = 0; r < runs; r++) {
+        // Alternate allocators so drift hits all of them
+        for (int a = 0; a < count; a++) {
+            RunResult result;
+            if (run_once(&allocators[a], w, &result) != 0) {
+                fprintf(stderr, "Error: %s run failed\n", allocators[a].name);
+                return 1;
+            }
+            if (r == 0 || result.seconds < best[a].seconds) {
+                long peak = r == 0 ? 0 : best[a].peak_kb;
+                best[a] = result;
+                if (peak > best[a].peak_kb) best[a].peak_kb = peak;
+            } else if (result.peak_kb > best[a].peak_kb) {
+                best[a].peak_kb = result.peak_kb;
+            }
+        }
+    }
+
+    printf("  Operations: %zu, live at end: %.1f MB", best[0].ops, best[0].live_kb / 1024.0);
+    if (best[0].peak_live_kb) printf(", peak live: %.1f MB", best[0].peak_live_kb / 1024.0);
+    printf("\n\n");
+    printf("  %-28s %9s %8s %11s %11s %9s %9s\n", "Allocator", "best ms", "ns/op", "peak RSS",
+           "end RSS", "overhead", "peak ovh");
+    for (int a = 0; a < count; a++) {
+        const RunResult* b = &best[a];
+        double overhead = b->live_kb ? 100.0 * (b->rss_used_kb - b->live_kb) / b->live_kb : 0;
+        printf("  %-28s %9.1f %8.1f %8.1f MB %8.1f MB %8.1f%%", allocators[a].name,
+               b->seconds * 1000.0, b->seconds * 1e9 / b->ops, b->peak_kb / 1024.0,
+               b->rss_used_kb / 1024.0, overhead);
+        if (b->peak_live_kb) {
+            long peak_used = b->peak_kb - b->rss_before_kb;
+            printf(" %8.1f%%", 100.0 * (peak_used - b->peak_live_kb) / b->peak_live_kb);
+        } else {
+            printf(" %9s", "-");
+        }
+        printf("\n");
+    }
+    printf("\n  overhead = RSS added by the replay beyond the bytes still live\n");
+    printf("  peak ovh = peak RSS added by the replay beyond the most bytes live at once\n");
+    printf("================================================================================\n\n");
+    return 0;
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+static void usage(void) {
+    printf("Usage:\n");
+    printf("  alloc_bench [--lib libpepperopt2.so] [--alloc NAME=LIB]... [--trace FILE]\n");
+    printf("              [--images N] [--threads N] [--runs N]\n");
+    printf("\nOptions:\n");
+    printf("  --lib PATH        Preload library to compare with glibc (hooks only, and PEPPER_SLAB=1)\n");
+    printf("  --alloc NAME=LIB  Another allocator to preload, e.g. jemalloc=/usr/lib/libjemalloc.so.2\n");
+    printf("  --trace FILE      Replay a PEPPER_ALLOC_TRACE capture instead of the synthetic trace\n");
+    printf("  --images N        Pixel buffers the loader thread allocates (default: 3000)\n");
+    printf("  --threads N       Loader plus worker threads (default: 4)\n");
+    printf("  --runs N          Runs per allocator (default: 3)\n");
+}
+
+// A bare file name in LD_PRELOAD would be looked up in the library path
+static const char* full_path(const char* path) {
+    char* full = realpath(path, NULL);
+    if (!full) fprintf(stderr, "Error: cannot find %s\n", path);
+    return full;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 4 && strcmp(argv[1], "--child") == 0) {
+        int threads = atoi(argv[3]);
+        return run_child(NULL, atoi(argv[2]), threads < 1 ? 1 : threads);
+    }
+    if (argc == 3 && strcmp(argv[1], "--child-trace") == 0) {
+        return run_child(argv[2], 0, 0);
+    }
+
+    Allocator allocators[MAX_ALLOCATORS] = { { "glibc", NULL, "0" } };
+    int count = 1;
+    const char* lib = NULL;
+    Workload w = { NULL, 3000, 4 };
+    int runs = 3;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--lib") == 0 && i + 1 < argc) {
+            lib = argv[++i];
+        } else if (strcmp(argv[i], "--alloc") == 0 && i + 1 < argc && count < MAX_ALLOCATORS - 2) {
+            char* spec = argv[++i];
+            char* eq = strchr(spec, '=');
+            if (!eq || eq == spec) {
+                usage();
+                return 1;
+            }
+            *eq = '\0';
+            if (!(allocators[count].preload = full_path(eq + 1))) return 1;
+            allocators[count].name = spec;
+            allocators[count].slab = "0";
+            count++;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            w.capture = argv[++i];
+        } else if (strcmp(argv[i], "--images") == 0 && i + 1 < argc) {
+            w.images = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            w.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (lib) {
+        if (!(lib = full_path(lib))) return 1;
+        allocators[count++] = (Allocator){ "libpepperopt2 hooks only", lib, "0" };
+        allocators[count++] = (Allocator){ "libpepperopt2 PEPPER_SLAB=1", lib, "1" };
+    }
+    if (w.capture && !(w.capture = full_path(w.capture))) return 1;
+    if (w.images < 1) w.images = 1;
+    if (w.threads < 1) w.threads = 1;
+    if (runs < 1) runs = 1;
+    return run_bench(allocators, count, &w, runs);
+}
@@ -0,0 +1,561 @@
+/*
+ * batch_optimize.c - Whole-archive image transform pipeline
+ *
+ * Native replacement for optimize_smart.py / optimize_assets.py. Reads
+ * Assets.dat directly, runs every selected image through
+ *
+ *   decode -> analyze -> transform (resize / requantize) -> encode -> write
+ *
+ * on a work-stealing scheduler, and writes the new archive straight away
+ * (no extracted .bin or .png files). Results are written in index order
+ * through a small reorder buffer so the payload layout stays sequential.
+ * Decoded pixels and pending results share one memory budget; a worker
+ * waits for room unless it holds the next image the writer needs.
+ *
+ * Build:
+ *   gcc -O3 -march=native -o batch_optimize batch_optimize.c chowdren_image.c \
+ *       chowdren_assets.c parallel.c -lz -lpthread
+ *
+ * Usage:
+ *   ./batch_optimize <input_Assets.dat> <output_Assets.dat> [options]
+ *
+ * Options:
+ *   --images A-B[,C-D...]    Only transform these image indices (default: all)
+ *   --scale S                Resize factor, e.g. 0.5 (default 1.0 = no resize)
+ *   --min-size N             Skip images with width or height <= N (default 16)
+ *   --filter box|nearest     Downscale filter (default box, alpha-weighted)
+ *   --quantize BITS          Requantize every channel to BITS bits (1-7)
+ *   --level N                zlib level for re-encoded streams (default 9)
+ *   --memory-mb N            Budget for in-flight pixels + pending results (default 256)
+ *   --threads N              Worker threads (default: one per CPU)
+ *   --dry-run                Run the pipeline and print stats, write nothing
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chowdren_assets.h"
+#include "chowdren_image.h"
+#include "parallel.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} IndexRange;
+
+#define MAX_RANGES 64
+
+static IndexRange g_ranges[MAX_RANGES];
+static int g_range_count = 0;
+static float g_scale = 1.0f;
+static int g_min_size = 16;
+static int g_filter_nearest = 0;
+static int g_quantize_bits = 0;
+static int g_threads = 0;
+static size_t g_memory_budget = 256u << 20;
+static int g_dry_run = 0;
+static ChowdrenEncodeOptions g_encode = { .level = 9, .strict_size = 0 };
+
+static int is_selected(uint32_t index) {
+    if (g_range_count == 0) return 1;
+    for (int i = 0; i < g_range_count; i++) {
+        if (index >= g_ranges[i].first && index <= g_ranges[i].last) return 1;
+    }
+    return 0;
+}
+
+// ============================================================================
+// Stage counters
+// ============================================================================
+
+typedef enum {
+    STAGE_DECODE = 0,
+    STAGE_ANALYZE,
+    STAGE_TRANSFORM,
+    STAGE_ENCODE,
+    STAGE_WRITE,
+    STAGE_COUNT
+} Stage;
+
+static const char* k_stage_names[STAGE_COUNT] = {
+    "decode", "analyze", "transform", "encode", "write"
+};
+
+typedef struct {
+    atomic_ullong items;
+    atomic_ullong ns;
+    atomic_ullong bytes_in;
+    atomic_ullong bytes_out;
+} StageStats;
+
+static StageStats g_stages[STAGE_COUNT];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void stage_record(Stage s, uint64_t start, uint64_t bytes_in, uint64_t bytes_out) {
+    StageStats* st = &g_stages[s];
+    atomic_fetch_add_explicit(&st->items, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->ns, now_ns() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->bytes_in, bytes_in, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->bytes_out, bytes_out, memory_order_relaxed);
+}
+
+// ============================================================================
+// Pipeline state
+// ============================================================================
+
+typedef struct {
+    const uint8_t* data;   // points into the archive or at `owned`
+    uint8_t* owned;
+    uint32_t size;
+    int ready;
+} Slot;
+
+typedef struct {
+    const ChowdrenArchive* archive;
+    ChowdrenWriter writer;
+    ChowdrenTable tables[CHOWDREN_KIND_COUNT];
+    Slot* slots;
+    int write_failed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next_write;
+    size_t budget_used;
+    size_t peak_budget;
+
+    atomic_uint transformed;
+    atomic_uint skipped_small;
+    atomic_uint failed;
+    atomic_uint transparent;
+    atomic_uint opaque;
+    atomic_ullong pixels_before;
+    atomic_ullong pixels_after;
+    atomic_ullong trimmable_pixels;
+} Pipeline;
+
+// Reserve `bytes` of the memory budget. The worker holding the image the
+// writer is waiting for never blocks, so the pipeline always drains.
+static void budget_acquire(Pipeline* p, size_t index, size_t bytes) {
+    pthread_mutex_lock(&p->lock);
+    while (p->budget_used > 0 && p->budget_used + bytes > g_memory_budget &&
+           index != p->next_write) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    p->budget_used += bytes;
+    if (p->budget_used > p->peak_budget) p->peak_budget = p->budget_used;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Hand a finished image to the writer, release its pixel reservation and
+// flush every contiguous ready slot.
+static void slot_complete(Pipeline* p, size_t index, size_t reserved) {
+    pthread_mutex_lock(&p->lock);
+    Slot* slot = &p->slots[index];
+    slot->ready = 1;
+    p->budget_used -= reserved;
+    if (slot->owned) p->budget_used += slot->size;
+
+    ChowdrenTable* images = &p->tables[CHOWDREN_IMAGES];
+    while (p->next_write < images->count && p->slots[p->next_write].ready) {
+        Slot* s = &p->slots[p->next_write];
+        ChowdrenEntry* e = &images->entries[p->next_write];
+
+        // Empty or out-of-bounds entries keep their original table entry
+        if (s->data && s->size > 0) {
+            uint64_t start = now_ns();
+            if (!g_dry_run && !p->write_failed &&
+                chowdren_writer_append(&p->writer, s->data, s->size, &e->offset) != 0) {
+                p->write_failed = 1;
+            }
+            e->size = s->size;
+            stage_record(STAGE_WRITE, start, s->size, s->size);
+        }
+
+        if (s->owned) {
+            p->budget_used -= s->size;
+            free(s->owned);
+            s->owned = NULL;
+        }
+        s->data = NULL;
+        p->next_write++;
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// ============================================================================
+// Transforms
+// ============================================================================
+
+// Alpha-weighted area average, so transparent pixels do not darken edges.
+static void downscale_box(const uint8_t* src, int sw, int sh, uint8_t* dst, int dw, int dh) {
+    for (int y = 0; y < dh; y++) {
+        int y0 = (int)((int64_t)y * sh / dh);
+        int y1 = (int)((int64_t)(y + 1) * sh / dh);
+        if (y1 <= y0) y1 = y0 + 1;
+        for (int x = 0; x < dw; x++) {
+            int x0 = (int)((int64_t)x * sw / dw);
+            int x1 = (int)((int64_t)(x + 1) * sw / dw);
+            if (x1 <= x0) x1 = x0 + 1;
+
+            uint64_t r = 0, g = 0, b = 0, a = 0;
+            uint32_t n = 0;
+            for (int sy = y0; sy < y1; sy++) {
+                const uint8_t* row = src + ((size_t)sy * sw + x0) * 4;
+                for (int sx = x0; sx < x1; sx++, row += 4) {
+                    r += row[0] * row[3];
+                    g += row[1] * row[3];
+                    b += row[2] * row[3];
+                    a += row[3];
+                    n++;
+                }
+            }
+
+            uint8_t* out = dst + ((size_t)y * dw + x) * 4;
+            if (a > 0) {
+                out[0] = (uint8_t)((r + a / 2) / a);
+                out[1] = (uint8_t)((g + a / 2) / a);
+                out[2] = (uint8_t)((b + a / 2) / a);
+            } else {
+                out[0] = out[1] = out[2] = 0;
+            }
+            out[3] = (uint8_t)((a + n / 2) / n);
+        }
+    }
+}
+
+static void downscale_nearest(const uint8_t* src, int sw, int sh, uint8_t* dst, int dw, int dh) {
+    for (int y = 0; y < dh; y++) {
+        int sy = (int)(((int64_t)y * 2 + 1) * sh / (2 * dh));
+        for (int x = 0; x < dw; x++) {
+            int sx = (int)(((int64_t)x * 2 + 1) * sw / (2 * dw));
+            memcpy(dst + ((size_t)y * dw + x) * 4, src + ((size_t)sy * sw + sx) * 4, 4);
+        }
+    }
+}
+
+static void requantize(uint8_t* px, size_t bytes, int bits) {
+    uint8_t lut[256];
+    int levels = (1 << bits) - 1;
+    for (int v = 0; v < 256; v++) {
+        int q = (v * levels + 127) / 255;
+        lut[v] = (uint8_t)((q * 255 + levels / 2) / levels);
+    }
+    for (size_t i = 0; i < bytes; i++) px[i] = lut[px[i]];
+}
+
+// ============================================================================
+// Worker
+// ============================================================================
+
+static void process_image(void* ctx, size_t index, int worker) {
+    (void)worker;
+    Pipeline* p = ctx;
+    const ChowdrenTable* images = &p->archive->tables[CHOWDREN_IMAGES];
+    const uint8_t* payload = chowdren_archive_payload(p->archive, CHOWDREN_IMAGES, (uint32_t)index);
+    uint32_t payload_size = images->entries[index].size;
+    Slot* slot = &p->slots[index];
+
+    // Default result: copy the original bytes
+    slot->data = payload;
+    slot->size = payload_size;
+
+    ChowdrenImageInfo info;
+    if (!payload || !is_selected((uint32_t)index) ||
+        chowdren_image_parse(payload, payload_size, &info) != 0) {
+        slot_complete(p, index, 0);
+        return;
+    }
+
+    size_t pixel_bytes = chowdren_image_pixel_size(&info);
+    size_t reserved = pixel_bytes * 2;
+    budget_acquire(p, index, reserved);
+
+    // decode
+    uint64_t t = now_ns();
+    uint8_t* rgba = NULL;
+    if (chowdren_image_decode(payload, payload_size, &info, CHOWDREN_ORDER_RGBA, &rgba) != 0) {
+        atomic_fetch_add(&p->failed, 1);
+        slot_complete(p, index, reserved);
+        return;
+    }
+    stage_record(STAGE_DECODE, t, info.stream_size, pixel_bytes);
+
+    // analyze
+    t = now_ns();
+    int w = info.width, h = info.height;
+    int min_x = w, min_y = h, max_x = -1, max_y = -1;
+    int all_opaque = 1;
+    for (int y = 0; y < h; y++) {
+        const uint8_t* row = rgba + (size_t)y * w * 4;
+        for (int x = 0; x < w; x++) {
+            uint8_t a = row[x * 4 + 3];
+            if (a != 255) all_opaque = 0;
+            if (a != 0) {
+                if (x < min_x) min_x = x;
+                if (x > max_x) max_x = x;
+                if (y < min_y) min_y = y;
+                if (y > max_y) max_y = y;
+            }
+        }
+    }
+    if (max_x < 0) {
+        atomic_fetch_add(&p->transparent, 1);
+    } else {
+        uint64_t used = (uint64_t)(max_x - min_x + 1) * (max_y - min_y + 1);
+        atomic_fetch_add(&p->trimmable_pixels, (uint64_t)w * h - used);
+    }
+    if (all_opaque) atomic_fetch_add(&p->opaque, 1);
+    stage_record(STAGE_ANALYZE, t, pixel_bytes, 0);
+
+    // transform
+    t = now_ns();
+    int new_w = w, new_h = h;
+    if (g_scale < 1.0f && w > g_min_size && h > g_min_size) {
+        new_w = (int)(w * g_scale);
+        new_h = (int)(h * g_scale);
+        if (new_w < g_min_size) new_w = g_min_size;
+        if (new_h < g_min_size) new_h = g_min_size;
+        if (new_w > w) new_w = w;
+        if (new_h > h) new_h = h;
+    } else if (g_scale < 1.0f) {
+        atomic_fetch_add(&p->skipped_small, 1);
+    }
+
+    uint8_t* out_px = rgba;
+    if (new_w != w || new_h != h) {
+        out_px = malloc((size_t)new_w * new_h * 4);
+        if (!out_px) {
+            free(rgba);
+            atomic_fetch_add(&p->failed, 1);
+            slot_complete(p, index, reserved);
+            return;
+        }
+        if (g_filter_nearest) downscale_nearest(rgba, w, h, out_px, new_w, new_h);
+        else downscale_box(rgba, w, h, out_px, new_w, new_h);
+    }
+    if (g_quantize_bits > 0) requantize(out_px, (size_t)new_w * new_h * 4, g_quantize_bits);
+    stage_record(STAGE_TRANSFORM, t, pixel_bytes, (uint64_t)new_w * new_h * 4);
+
+    int changed = new_w != w || new_h != h || g_quantize_bits > 0;
+    atomic_fetch_add(&p->pixels_before, (uint64_t)w * h);
+    atomic_fetch_add(&p->pixels_after, (uint64_t)new_w * new_h);
+
+    // encode
+    if (changed) {
+        t = now_ns();
+        uint8_t* entry;
+        size_t entry_len;
+        if (chowdren_image_encode(out_px, (uint16_t)new_w, (uint16_t)new_h, payload, payload_size,
+                                  &g_encode, &entry, &entry_len) == 0) {
+            slot->owned = entry;
+            slot->data = entry;
+            slot->size = (uint32_t)entry_len;
+            atomic_fetch_add(&p->transformed, 1);
+            stage_record(STAGE_ENCODE, t, (uint64_t)new_w * new_h * 4, entry_len);
+        } else {
+            atomic_fetch_add(&p->failed, 1);
+        }
+    }
+
+    if (out_px != rgba) free(out_px);
+    free(rgba);
+    slot_complete(p, index, reserved);
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+static void usage(void) {
+    printf("Usage: batch_optimize <input_Assets.dat> <output_Assets.dat> [options]\n");
+    printf("\nOptions:\n");
+    printf("  --images A-B[,C-D...]    Only transform these image indices (default: all)\n");
+    printf("  --scale S                Resize factor, e.g. 0.5 (default 1.0 = no resize)\n");
+    printf("  --min-size N             Skip images with width or height <= N (default 16)\n");
+    printf("  --filter box|nearest     Downscale filter (default box)\n");
+    printf("  --quantize BITS          Requantize every channel to BITS bits (1-7)\n");
+    printf("  --level N                zlib level for re-encoded streams (default 9)\n");
+    printf("  --memory-mb N            Budget for in-flight pixels + pending results (default 256)\n");
+    printf("  --threads N              Worker threads (default: one per CPU)\n");
+    printf("  --dry-run                Run the pipeline and print stats, write nothing\n");
+}
+
+static int parse_ranges(const char* spec) {
+    char* copy = strdup(spec);
+    char* save = NULL;
+    for (char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (g_range_count >= MAX_RANGES) {
+            fprintf(stderr, "Error: --images takes at most %d ranges\n", MAX_RANGES);
+            free(copy);
+            return -1;
+        }
+        IndexRange* r = &g_ranges[g_range_count];
+        if (sscanf(tok, "%u-%u", &r->first, &r->last) == 2 && r->first <= r->last) {
+            g_range_count++;
+        } else if (sscanf(tok, "%u", &r->first) == 1) {
+            r->last = r->first;
+            g_range_count++;
+        } else {
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+static int copy_other_kinds(Pipeline* p) {
+    for (int k = CHOWDREN_SOUNDS; k < CHOWDREN_KIND_COUNT; k++) {
+        ChowdrenTable* table = &p->tables[k];
+        for (uint32_t i = 0; i < table->count; i++) {
+            ChowdrenEntry* e = &table->entries[i];
+            if (e->size == 0) continue;
+            const uint8_t* data = chowdren_archive_payload(p->archive, k, i);
+            if (!data || chowdren_writer_append(&p->writer, data, e->size, &e->offset) != 0) {
+                fprintf(stderr, "Error: could not copy %s entry %u\n", table->name, i);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+
+    const char* input = argv[1];
+    const char* output = argv[2];
+
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--images") == 0 && i + 1 < argc) {
+            if (parse_ranges(argv[++i]) != 0) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            g_scale = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--min-size") == 0 && i + 1 < argc) {
+            g_min_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            g_filter_nearest = strcmp(argv[++i], "nearest") == 0;
+        } else if (strcmp(argv[i], "--quantize") == 0 && i + 1 < argc) {
+            g_quantize_bits = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+            g_encode.level = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--memory-mb") == 0 && i + 1 < argc) {
+            g_memory_budget = (size_t)atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            g_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            g_dry_run = 1;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (g_scale <= 0.0f || g_scale > 1.0f) g_scale = 1.0f;
+    if (g_min_size < 1) g_min_size = 1;
+    if (g_quantize_bits < 0 || g_quantize_bits > 7) g_quantize_bits = 0;
+    if (g_memory_budget == 0) g_memory_budget = 256u << 20;
+    if (g_threads <= 0) g_threads = parallel_cpu_count();
+
+    Pipeline p;
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    ChowdrenArchive archive;
+    if (chowdren_archive_open(&archive, input) != 0) return 1;
+    p.archive = &archive;
+
+    if (chowdren_tables_clone(&archive, p.tables) != 0) return 1;
+    uint32_t image_count = archive.tables[CHOWDREN_IMAGES].count;
+    p.slots = calloc(image_count, sizeof(Slot));
+    if (!p.slots) return 1;
+
+    if (!g_dry_run && chowdren_writer_open(&p.writer, output) != 0) return 1;
+
+    printf("\n================================================================================\n");
+    printf("BATCH IMAGE PIPELINE%s\n", g_dry_run ? " (dry run)" : "");
+    printf("================================================================================\n");
+    printf("Input:    %s\n", input);
+    printf("Output:   %s\n", g_dry_run ? "(none)" : output);
+    printf("Scale:    %.0f%% (%s), min size %d\n", g_scale * 100,
+           g_filter_nearest ? "nearest" : "box", g_min_size);
+    if (g_quantize_bits) printf("Quantize: %d bits per channel\n", g_quantize_bits);
+    printf("Images:   %s\n", g_range_count ? "selected ranges" : "all");
+    printf("Threads:  %d, memory budget %zu MB\n", g_threads, g_memory_budget >> 20);
+    printf("================================================================================\n\n");
+
+    ParallelStealStats steal_stats;
+    uint64_t start = now_ns();
+    parallel_for_stealing(image_count, g_threads, 16, process_image, &p, &steal_stats);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    int rc = 0;
+    if (!g_dry_run) {
+        if (p.write_failed || copy_other_kinds(&p) != 0) {
+            chowdren_writer_abort(&p.writer);
+            rc = 1;
+        } else {
+            uint64_t final_size = p.writer.cursor;
+            if (chowdren_writer_finish(&p.writer, p.tables) != 0) rc = 1;
+            else printf("Output: %.2f MB (input %.2f MB)\n\n",
+                        final_size / 1024.0 / 1024.0, archive.size / 1024.0 / 1024.0);
+        }
+    }
+
+    printf("================================================================================\n");
+    printf("PIPELINE COMPLETE (%.2f s, %zu chunks claimed, %zu steals, peak budget %.1f MB)\n",
+           elapsed, steal_stats.chunks_claimed, steal_stats.steals,
+           p.peak_budget / 1024.0 / 1024.0);
+    printf("================================================================================\n");
+    printf("  %-10s %8s %10s %12s %12s\n", "stage", "items", "cpu s", "items/s", "MB/s in");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        StageStats* st = &g_stages[s];
+        unsigned long long items = atomic_load(&st->items);
+        double secs = atomic_load(&st->ns) / 1e9;
+        printf("  %-10s %8llu %10.3f %12.0f %12.1f\n", k_stage_names[s], items, secs,
+               secs > 0 ? items / secs : 0.0,
+               secs > 0 ? atomic_load(&st->bytes_in) / 1024.0 / 1024.0 / secs : 0.0);
+    }
+
+    uint64_t before = atomic_load(&p.pixels_before), after = atomic_load(&p.pixels_after);
+    printf("\n  Images transformed:      %u\n", atomic_load(&p.transformed));
+    printf("  Skipped (too small):     %u\n", atomic_load(&p.skipped_small));
+    printf("  Failed (copied as-is):   %u\n", atomic_load(&p.failed));
+    printf("  Fully transparent:       %u\n", atomic_load(&p.transparent));
+    printf("  Fully opaque:            %u\n", atomic_load(&p.opaque));
+    printf("  Trimmable border pixels: %.2f MB of RGBA\n",
+           atomic_load(&p.trimmable_pixels) * 4 / 1024.0 / 1024.0);
+    if (before > 0) {
+        printf("  Decoded RGBA:            %.2f MB -> %.2f MB (%.1f%% less)\n",
+               before * 4 / 1024.0 / 1024.0, after * 4 / 1024.0 / 1024.0,
+               (1.0 - (double)after / before) * 100.0);
+    }
+    printf("================================================================================\n\n");
+
+    free(p.slots);
+    chowdren_tables_free(p.tables);
+    chowdren_archive_close(&archive);
+    return rc;
+}
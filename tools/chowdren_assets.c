@@ -0,0 +1,279 @@
+/*
+ * chowdren_assets.c - Assets.dat (Chowdren 2024 format) reader/writer
+ *
+ * See chowdren_assets.h for the layout.
+ */
+
+#define _GNU_SOURCE
+#include "chowdren_assets.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const struct {
+    const char* name;
+    uint32_t count;
+    uint32_t table_offset;
+} k_layout[CHOWDREN_KIND_COUNT] = {
+    { "images",  CHOWDREN_IMAGE_COUNT,  0 },
+    { "sounds",  CHOWDREN_SOUND_COUNT,  CHOWDREN_IMAGE_COUNT * CHOWDREN_ENTRY_SIZE },
+    { "fonts",   CHOWDREN_FONT_COUNT,   (CHOWDREN_IMAGE_COUNT + CHOWDREN_SOUND_COUNT) *
+                                        CHOWDREN_ENTRY_SIZE },
+    { "shaders", CHOWDREN_SHADER_COUNT, (CHOWDREN_IMAGE_COUNT + CHOWDREN_SOUND_COUNT +
+                                         CHOWDREN_FONT_COUNT) * CHOWDREN_ENTRY_SIZE },
+};
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void write_le32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+// ============================================================================
+// Reader
+// ============================================================================
+
+int chowdren_archive_open(ChowdrenArchive* archive, const char* path) {
+    memset(archive, 0, sizeof(*archive));
+    archive->fd = -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < CHOWDREN_TABLES_SIZE) {
+        fprintf(stderr, "Error: %s is too small to be an Assets.dat\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    archive->fd = fd;
+    archive->data = map;
+    archive->size = (size_t)st.st_size;
+
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        ChowdrenTable* table = &archive->tables[k];
+        table->name = k_layout[k].name;
+        table->count = k_layout[k].count;
+        table->table_offset = k_layout[k].table_offset;
+        table->entries = calloc(table->count, sizeof(ChowdrenEntry));
+        if (!table->entries) {
+            fprintf(stderr, "Error: out of memory reading %s table\n", table->name);
+            chowdren_archive_close(archive);
+            return -1;
+        }
+
+        const uint8_t* p = archive->data + table->table_offset;
+        for (uint32_t i = 0; i < table->count; i++, p += CHOWDREN_ENTRY_SIZE) {
+            table->entries[i].offset = read_le32(p);
+            table->entries[i].size = read_le32(p + 4);
+        }
+    }
+
+    return 0;
+}
+
+void chowdren_archive_close(ChowdrenArchive* archive) {
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        free(archive->tables[k].entries);
+        archive->tables[k].entries = NULL;
+    }
+    if (archive->data) munmap((void*)archive->data, archive->size);
+    if (archive->fd >= 0) close(archive->fd);
+    archive->data = NULL;
+    archive->fd = -1;
+}
+
+const uint8_t* chowdren_archive_payload(const ChowdrenArchive* archive,
+                                        ChowdrenKind kind, uint32_t index) {
+    const ChowdrenTable* table = &archive->tables[kind];
+    if (index >= table->count) return NULL;
+
+    const ChowdrenEntry* e = &table->entries[index];
+    if (e->size == 0 || (uint64_t)e->offset + e->size > archive->size) return NULL;
+    return archive->data + e->offset;
+}
+
+int chowdren_tables_clone(const ChowdrenArchive* archive,
+                          ChowdrenTable out[CHOWDREN_KIND_COUNT]) {
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        out[k] = archive->tables[k];
+        out[k].entries = malloc(out[k].count * sizeof(ChowdrenEntry));
+        if (!out[k].entries) {
+            for (int j = 0; j < k; j++) free(out[j].entries);
+            return -1;
+        }
+        memcpy(out[k].entries, archive->tables[k].entries,
+               out[k].count * sizeof(ChowdrenEntry));
+    }
+    return 0;
+}
+
+void chowdren_tables_free(ChowdrenTable tables[CHOWDREN_KIND_COUNT]) {
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        free(tables[k].entries);
+        tables[k].entries = NULL;
+    }
+}
+
+// ============================================================================
+// Writer
+// ============================================================================
+
+int chowdren_writer_open(ChowdrenWriter* writer, const char* path) {
+    memset(writer, 0, sizeof(*writer));
+
+    writer->path = strdup(path);
+    if (!writer->path || asprintf(&writer->tmp_path, "%s.tmp", path) < 0) {
+        free(writer->path);
+        return -1;
+    }
+
+    writer->file = fopen(writer->tmp_path, "wb");
+    if (!writer->file) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", writer->tmp_path, strerror(errno));
+        free(writer->path);
+        free(writer->tmp_path);
+        return -1;
+    }
+
+    // Reserve the table area; it is filled in by chowdren_writer_finish()
+    static const uint8_t zeros[CHOWDREN_TABLES_SIZE];
+    if (fwrite(zeros, 1, sizeof(zeros), writer->file) != sizeof(zeros)) {
+        chowdren_writer_abort(writer);
+        return -1;
+    }
+    writer->cursor = CHOWDREN_TABLES_SIZE;
+    return 0;
+}
+
+int chowdren_writer_append(ChowdrenWriter* writer, const void* data,
+                           uint32_t size, uint32_t* offset_out) {
+    if (writer->cursor + size > UINT32_MAX) {
+        fprintf(stderr, "Error: archive would exceed the 4 GB offset limit\n");
+        return -1;
+    }
+    if (size > 0 && fwrite(data, 1, size, writer->file) != size) {
+        fprintf(stderr, "Error: write to %s failed: %s\n", writer->tmp_path, strerror(errno));
+        return -1;
+    }
+    *offset_out = (uint32_t)writer->cursor;
+    writer->cursor += size;
+    return 0;
+}
+
+int chowdren_writer_finish(ChowdrenWriter* writer,
+                           const ChowdrenTable tables[CHOWDREN_KIND_COUNT]) {
+    uint8_t* buf = malloc(CHOWDREN_TABLES_SIZE);
+    if (!buf) {
+        chowdren_writer_abort(writer);
+        return -1;
+    }
+
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        uint8_t* p = buf + k_layout[k].table_offset;
+        for (uint32_t i = 0; i < k_layout[k].count; i++, p += CHOWDREN_ENTRY_SIZE) {
+            write_le32(p, tables[k].entries[i].offset);
+            write_le32(p + 4, tables[k].entries[i].size);
+        }
+    }
+
+    int ok = fseek(writer->file, 0, SEEK_SET) == 0 &&
+             fwrite(buf, 1, CHOWDREN_TABLES_SIZE, writer->file) == CHOWDREN_TABLES_SIZE &&
+             fflush(writer->file) == 0 &&
+             fsync(fileno(writer->file)) == 0;
+    free(buf);
+
+    if (fclose(writer->file) != 0) ok = 0;
+    writer->file = NULL;
+
+    if (!ok || rename(writer->tmp_path, writer->path) != 0) {
+        fprintf(stderr, "Error: could not finalize %s: %s\n", writer->path, strerror(errno));
+        unlink(writer->tmp_path);
+        ok = 0;
+    }
+
+    free(writer->path);
+    free(writer->tmp_path);
+    writer->path = writer->tmp_path = NULL;
+    return ok ? 0 : -1;
+}
+
+void chowdren_writer_abort(ChowdrenWriter* writer) {
+    if (writer->file) fclose(writer->file);
+    if (writer->tmp_path) unlink(writer->tmp_path);
+    free(writer->path);
+    free(writer->tmp_path);
+    memset(writer, 0, sizeof(*writer));
+}
+
+// ============================================================================
+// Hash
+// ============================================================================
+
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t chowdren_hash64(const void* data, size_t size) {
+    const uint8_t* p = data;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ (size * 0x100000001b3ull);
+
+    // Eight bytes at a time, then the tail
+    while (size >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = (h ^ mix64(v)) * 0x100000001b3ull;
+        p += 8;
+        size -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, size);
+    return mix64(h ^ mix64(tail ^ size));
+}
+
+// ============================================================================
+// Benchmarks
+// ============================================================================
+
+void chowdren_drop_file_cache(int fd) {
+    int dropped = 0;
+    if (geteuid() == 0) {
+        sync();
+        int proc = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        if (proc >= 0) {
+            dropped = write(proc, "1", 1) == 1;
+            close(proc);
+        }
+    }
+    if (!dropped) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
@@ -0,0 +1,108 @@
+/*
+ * chowdren_assets.h - Assets.dat (Chowdren 2024 format) reader/writer
+ *
+ * The archive starts with four tables of (offset, size) pairs, one per
+ * asset kind, followed by the raw asset payloads:
+ *
+ *   Byte 0:      Image table   (0x14080 bytes)
+ *   Byte 82048:  Sound table   (0x858 bytes, 267 entries)
+ *   Byte 84184:  Font table    (0x98 bytes, 19 entries)
+ *   Byte 84336:  Shader table  (0x18 bytes, 3 entries)
+ *   Byte 84360:  Asset data begins
+ *
+ * The table sizes come straight from the fread() calls in
+ * LoadAssetMetadataTable. 0x14080 / 8 is 10,256 image entries; the
+ * Python scripts read 10,260, whose last four "images" are really the
+ * first four sound entries.
+ *
+ * The reader maps the whole file read-only so tools can hand out payload
+ * pointers without copying. The writer streams payloads to a temporary
+ * file and renames it over the destination once the tables are written,
+ * so an interrupted run never leaves a half-written Assets.dat behind.
+ */
+
+#ifndef CHOWDREN_ASSETS_H
+#define CHOWDREN_ASSETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CHOWDREN_IMAGE_COUNT  10256
+#define CHOWDREN_SOUND_COUNT  267
+#define CHOWDREN_FONT_COUNT   19
+#define CHOWDREN_SHADER_COUNT 3
+
+#define CHOWDREN_ENTRY_SIZE   8
+#define CHOWDREN_TABLES_SIZE  ((CHOWDREN_IMAGE_COUNT + CHOWDREN_SOUND_COUNT + \
+                                CHOWDREN_FONT_COUNT + CHOWDREN_SHADER_COUNT) * \
+                               CHOWDREN_ENTRY_SIZE)
+
+typedef enum {
+    CHOWDREN_IMAGES = 0,
+    CHOWDREN_SOUNDS,
+    CHOWDREN_FONTS,
+    CHOWDREN_SHADERS,
+    CHOWDREN_KIND_COUNT
+} ChowdrenKind;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+} ChowdrenEntry;
+
+typedef struct {
+    const char* name;
+    uint32_t count;
+    uint32_t table_offset;
+    ChowdrenEntry* entries;
+} ChowdrenTable;
+
+typedef struct {
+    int fd;
+    const uint8_t* data;
+    size_t size;
+    ChowdrenTable tables[CHOWDREN_KIND_COUNT];
+} ChowdrenArchive;
+
+typedef struct {
+    FILE* file;
+    char* path;
+    char* tmp_path;
+    uint64_t cursor;
+} ChowdrenWriter;
+
+// Reader. Returns 0 on success, -1 on error (message already printed).
+int chowdren_archive_open(ChowdrenArchive* archive, const char* path);
+void chowdren_archive_close(ChowdrenArchive* archive);
+
+// Payload of an entry, or NULL if the entry is empty or out of bounds.
+const uint8_t* chowdren_archive_payload(const ChowdrenArchive* archive,
+                                        ChowdrenKind kind, uint32_t index);
+
+// Copy of the table set (entries allocated fresh) for tools that rewrite
+// offsets. Free with chowdren_tables_free().
+int chowdren_tables_clone(const ChowdrenArchive* archive,
+                          ChowdrenTable out[CHOWDREN_KIND_COUNT]);
+void chowdren_tables_free(ChowdrenTable tables[CHOWDREN_KIND_COUNT]);
+
+// Writer. Payloads are appended after the reserved table area; the tables
+// are written last by chowdren_writer_finish(), which also renames the
+// temporary file into place.
+int chowdren_writer_open(ChowdrenWriter* writer, const char* path);
+int chowdren_writer_append(ChowdrenWriter* writer, const void* data,
+                           uint32_t size, uint32_t* offset_out);
+int chowdren_writer_finish(ChowdrenWriter* writer,
+                           const ChowdrenTable tables[CHOWDREN_KIND_COUNT]);
+void chowdren_writer_abort(ChowdrenWriter* writer);
+
+// 64-bit content hash for payloads (not cryptographic; collisions are
+// resolved by callers with memcmp).
+uint64_t chowdren_hash64(const void* data, size_t size);
+
+// Evict a file from the page cache before a cold-read benchmark. As root
+// this uses drop_caches; otherwise POSIX_FADV_DONTNEED still drops the
+// file's clean pages.
+void chowdren_drop_file_cache(int fd);
+
+#endif
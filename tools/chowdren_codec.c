@@ -0,0 +1,547 @@
+/*
+ * chowdren_codec.c - Native batch codec for Chowdren .bin images
+ *
+ * Native replacement for decode_images.py / encode_images_fixed.py. Reads
+ * images straight out of Assets.dat (or a single extracted .bin), converts
+ * to PNG or raw pixels in any channel order, encodes edited files back to
+ * .bin entries with the same header rules as encode_images_fixed.py, and
+ * spreads the work over every core.
+ *
+ * Build:
+ *   gcc -O3 -march=native -o chowdren_codec chowdren_codec.c chowdren_image.c \
+ *       chowdren_png.c chowdren_assets.c parallel.c -lpng -lz -lpthread
+ *
+ *   Add -DUSE_LIBDEFLATE ... -ldeflate to encode with libdeflate.
+ *   On the handheld (aarch64) NEON is used automatically.
+ *
+ * Usage:
+ *   ./chowdren_codec info <Assets.dat> [index]
+ *   ./chowdren_codec decode <Assets.dat|image.bin> <out_dir|out_file> [options]
+ *   ./chowdren_codec encode <Assets.dat> <in_dir> <out_dir> [options]
+ *   ./chowdren_codec roundtrip <Assets.dat> [options]
+ *
+ * Options:
+ *   --format png|rgba|bgra|argb|abgr   File format for decode/encode (default png)
+ *   --range A-B                        Only image indices A..B (inclusive)
+ *   --threads N                        Worker threads (default: one per CPU)
+ *   --level N                          zlib level for .bin streams (default 9)
+ *   --png-level N                      zlib level for PNG output (default 1)
+ *   --strict-size                      Refuse images over 65,535 decompressed bytes
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "chowdren_assets.h"
+#include "chowdren_image.h"
+#include "chowdren_png.h"
+#include "parallel.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+typedef enum {
+    FORMAT_PNG = -1,
+    FORMAT_RGBA = CHOWDREN_ORDER_RGBA,
+    FORMAT_BGRA = CHOWDREN_ORDER_BGRA,
+    FORMAT_ARGB = CHOWDREN_ORDER_ARGB,
+    FORMAT_ABGR = CHOWDREN_ORDER_ABGR,
+} FileFormat;
+
+static const char* k_format_ext[] = { "rgba", "bgra", "argb", "abgr" };
+
+static int g_format = FORMAT_PNG;
+static uint32_t g_first = 0;
+static uint32_t g_last = UINT32_MAX;
+static int g_threads = 0;
+static int g_png_level = 1;
+static ChowdrenEncodeOptions g_encode = { .level = 9, .strict_size = 0 };
+
+static const char* format_ext(void) {
+    return g_format == FORMAT_PNG ? "png" : k_format_ext[g_format];
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ============================================================================
+// Shared batch state
+// ============================================================================
+
+typedef struct {
+    const ChowdrenArchive* archive;
+    const char* in_dir;
+    const char* out_dir;
+    atomic_uint ok;
+    atomic_uint skipped;
+    atomic_uint failed;
+    atomic_uint size_wrapped;
+    atomic_ullong pixel_bytes;
+} Batch;
+
+static void report_failure(Batch* batch, uint32_t index, const char* what) {
+    unsigned n = atomic_fetch_add(&batch->failed, 1);
+    if (n < 20) fprintf(stderr, "  ✗ Image %05u: %s\n", index, what);
+}
+
+static int write_file(const char* path, const void* data, size_t size) {
+    FILE* f = fopen(path, "wb");
+    if (!f) return -1;
+    size_t n = fwrite(data, 1, size, f);
+    return (fclose(f) == 0 && n == size) ? 0 : -1;
+}
+
+static uint8_t* read_file(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* data = len > 0 ? malloc(len) : NULL;
+    if (data && fread(data, 1, len, f) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = data ? (size_t)len : 0;
+    return data;
+}
+
+// Write decoded RGBA pixels in the selected file format. Raw formats are
+// swizzled in place.
+static int write_pixels(const char* path, uint8_t* rgba, uint32_t w, uint32_t h) {
+    if (g_format == FORMAT_PNG) return chowdren_png_write(path, rgba, w, h, g_png_level);
+    chowdren_swizzle_from_rgba(rgba, rgba, (size_t)w * h, (ChowdrenPixelOrder)g_format);
+    return write_file(path, rgba, (size_t)w * h * 4);
+}
+
+// ============================================================================
+// info
+// ============================================================================
+
+static void print_info(uint32_t index, const uint8_t* data, uint32_t size) {
+    ChowdrenImageInfo info;
+    if (chowdren_image_parse(data, size, &info) != 0) {
+        printf("Image %05u: %u bytes, no valid header/zlib stream\n", index, size);
+        return;
+    }
+    printf("Image %05u:\n", index);
+    printf("  Dimensions:      %ux%u\n", info.width, info.height);
+    printf("  Hotspot:         (%.1f, %.1f)\n", info.hotspot_x, info.hotspot_y);
+    printf("  Flags:           0x%04x\n", info.flags);
+    printf("  Size field:      %u (%s)\n", info.size_field,
+           !chowdren_image_size_field_ok(&info) ? "MISMATCH" :
+           chowdren_image_pixel_size(&info) > CHOWDREN_IMAGE_MAX_SIZE_FIELD ? "wrapped" : "ok");
+    printf("  zlib stream:     byte %u, %u bytes (%02x %02x)\n", info.stream_offset,
+           info.stream_size, data[info.stream_offset], data[info.stream_offset + 1]);
+    printf("  Pixel data:      %zu bytes\n", chowdren_image_pixel_size(&info));
+    printf("  Bytes 20-45:     ");
+    for (int i = 20; i < 46; i++) printf("%02x", data[i]);
+    printf("\n");
+}
+
+static int cmd_info(const ChowdrenArchive* archive, int argc, char** argv) {
+    const ChowdrenTable* images = &archive->tables[CHOWDREN_IMAGES];
+
+    if (argc > 0) {
+        uint32_t index = (uint32_t)strtoul(argv[0], NULL, 0);
+        const uint8_t* data = chowdren_archive_payload(archive, CHOWDREN_IMAGES, index);
+        if (!data) {
+            fprintf(stderr, "Error: image %u is empty or out of range\n", index);
+            return 1;
+        }
+        print_info(index, data, images->entries[index].size);
+        return 0;
+    }
+
+    unsigned valid = 0, invalid = 0, wrapped = 0, mismatch = 0, offset_50 = 0;
+    uint64_t pixels = 0;
+    for (uint32_t i = 0; i < images->count; i++) {
+        ChowdrenImageInfo info;
+        const uint8_t* data = chowdren_archive_payload(archive, CHOWDREN_IMAGES, i);
+        if (!data || chowdren_image_parse(data, images->entries[i].size, &info) != 0) {
+            invalid++;
+            continue;
+        }
+        valid++;
+        pixels += chowdren_image_pixel_size(&info);
+        if (info.stream_offset == CHOWDREN_IMAGE_HEADER_SIZE) offset_50++;
+        if (!chowdren_image_size_field_ok(&info)) mismatch++;
+        else if (chowdren_image_pixel_size(&info) > CHOWDREN_IMAGE_MAX_SIZE_FIELD) wrapped++;
+    }
+
+    printf("Images:                 %u\n", images->count);
+    printf("  Valid headers:        %u (%u with stream at byte 50)\n", valid, offset_50);
+    printf("  Invalid/empty:        %u\n", invalid);
+    printf("  Size field wrapped:   %u (over 65,535 bytes)\n", wrapped);
+    printf("  Size field mismatch:  %u\n", mismatch);
+    printf("  Decompressed total:   %.2f MB\n", pixels / 1024.0 / 1024.0);
+    return 0;
+}
+
+// ============================================================================
+// decode
+// ============================================================================
+
+static void decode_one(void* ctx, size_t n, int worker) {
+    (void)worker;
+    Batch* batch = ctx;
+    uint32_t index = g_first + (uint32_t)n;
+    const ChowdrenTable* images = &batch->archive->tables[CHOWDREN_IMAGES];
+    const uint8_t* data = chowdren_archive_payload(batch->archive, CHOWDREN_IMAGES, index);
+    if (!data) {
+        atomic_fetch_add(&batch->skipped, 1);
+        return;
+    }
+
+    ChowdrenImageInfo info;
+    uint8_t* rgba;
+    if (chowdren_image_decode(data, images->entries[index].size, &info,
+                              CHOWDREN_ORDER_RGBA, &rgba) != 0) {
+        report_failure(batch, index, "decode failed");
+        return;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/image_%05u.%s", batch->out_dir, index, format_ext());
+    if (write_pixels(path, rgba, info.width, info.height) != 0) {
+        report_failure(batch, index, "write failed");
+    } else {
+        atomic_fetch_add(&batch->ok, 1);
+        atomic_fetch_add(&batch->pixel_bytes, chowdren_image_pixel_size(&info));
+    }
+    free(rgba);
+}
+
+static int decode_single_bin(const char* in_path, const char* out_path) {
+    size_t size;
+    uint8_t* data = read_file(in_path, &size);
+    if (!data) {
+        fprintf(stderr, "Error: cannot read %s\n", in_path);
+        return 1;
+    }
+
+    ChowdrenImageInfo info;
+    uint8_t* rgba;
+    int rc = chowdren_image_decode(data, size, &info, CHOWDREN_ORDER_RGBA, &rgba);
+    free(data);
+    if (rc != 0) {
+        fprintf(stderr, "✗ Error: could not decode %s\n", in_path);
+        return 1;
+    }
+
+    rc = write_pixels(out_path, rgba, info.width, info.height);
+    free(rgba);
+    if (rc != 0) {
+        fprintf(stderr, "✗ Error: could not write %s\n", out_path);
+        return 1;
+    }
+    printf("%ux%u -> %s\n", info.width, info.height, out_path);
+    return 0;
+}
+
+// ============================================================================
+// encode
+// ============================================================================
+
+static void encode_one(void* ctx, size_t n, int worker) {
+    (void)worker;
+    Batch* batch = ctx;
+    uint32_t index = g_first + (uint32_t)n;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/image_%05u.%s", batch->in_dir, index, format_ext());
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        atomic_fetch_add(&batch->skipped, 1);
+        return;
+    }
+
+    const ChowdrenTable* images = &batch->archive->tables[CHOWDREN_IMAGES];
+    const uint8_t* original = chowdren_archive_payload(batch->archive, CHOWDREN_IMAGES, index);
+    uint32_t original_size = original ? images->entries[index].size : 0;
+
+    uint8_t* rgba = NULL;
+    uint32_t w = 0, h = 0;
+    if (g_format == FORMAT_PNG) {
+        if (chowdren_png_read(path, &rgba, &w, &h) != 0) {
+            report_failure(batch, index, "PNG read failed");
+            return;
+        }
+    } else {
+        // Raw files carry no dimensions; they must match the original
+        ChowdrenImageInfo info;
+        size_t size;
+        if (!original || chowdren_image_parse(original, original_size, &info) != 0) {
+            report_failure(batch, index, "raw input needs a valid original header");
+            return;
+        }
+        rgba = read_file(path, &size);
+        if (!rgba || size != chowdren_image_pixel_size(&info)) {
+            free(rgba);
+            report_failure(batch, index, "raw size does not match original dimensions");
+            return;
+        }
+        w = info.width;
+        h = info.height;
+        chowdren_swizzle_to_rgba(rgba, rgba, (size_t)w * h, (ChowdrenPixelOrder)g_format);
+    }
+
+    if (w == 0 || h == 0 || w > UINT16_MAX || h > UINT16_MAX) {
+        free(rgba);
+        report_failure(batch, index, "dimensions do not fit the header");
+        return;
+    }
+
+    uint8_t* entry;
+    size_t entry_len;
+    int rc = chowdren_image_encode(rgba, (uint16_t)w, (uint16_t)h, original, original_size,
+                                   &g_encode, &entry, &entry_len);
+    free(rgba);
+    if (rc == -2) {
+        report_failure(batch, index, "over 65,535 decompressed bytes (--strict-size)");
+        return;
+    }
+    if (rc != 0) {
+        report_failure(batch, index, "encode failed");
+        return;
+    }
+
+    if ((size_t)w * h * 4 > CHOWDREN_IMAGE_MAX_SIZE_FIELD) atomic_fetch_add(&batch->size_wrapped, 1);
+
+    snprintf(path, sizeof(path), "%s/image_%05u.bin", batch->out_dir, index);
+    if (write_file(path, entry, entry_len) != 0) {
+        report_failure(batch, index, "write failed");
+    } else {
+        atomic_fetch_add(&batch->ok, 1);
+        atomic_fetch_add(&batch->pixel_bytes, (size_t)w * h * 4);
+    }
+    free(entry);
+}
+
+// ============================================================================
+// roundtrip
+// ============================================================================
+
+static void roundtrip_one(void* ctx, size_t n, int worker) {
+    (void)worker;
+    Batch* batch = ctx;
+    uint32_t index = g_first + (uint32_t)n;
+    const ChowdrenTable* images = &batch->archive->tables[CHOWDREN_IMAGES];
+    const uint8_t* data = chowdren_archive_payload(batch->archive, CHOWDREN_IMAGES, index);
+    ChowdrenImageInfo info;
+    if (!data || chowdren_image_parse(data, images->entries[index].size, &info) != 0) {
+        atomic_fetch_add(&batch->skipped, 1);
+        return;
+    }
+
+    // decode -> swizzle out -> swizzle back -> encode -> decode -> compare
+    uint8_t* pixels;
+    if (chowdren_image_decode(data, images->entries[index].size, &info,
+                              CHOWDREN_ORDER_RGBA, &pixels) != 0) {
+        report_failure(batch, index, "decode failed");
+        return;
+    }
+
+    size_t count = (size_t)info.width * info.height;
+    uint8_t* reference = malloc(count * 4);
+    if (!reference) {
+        free(pixels);
+        report_failure(batch, index, "out of memory");
+        return;
+    }
+    memcpy(reference, pixels, count * 4);
+
+    ChowdrenPixelOrder order = g_format == FORMAT_PNG ? CHOWDREN_ORDER_BGRA : (ChowdrenPixelOrder)g_format;
+    chowdren_swizzle_from_rgba(pixels, pixels, count, order);
+    chowdren_swizzle_to_rgba(pixels, pixels, count, order);
+
+    uint8_t* entry = NULL;
+    size_t entry_len;
+    uint8_t* again = NULL;
+    ChowdrenImageInfo again_info;
+    int ok = chowdren_image_encode(pixels, info.width, info.height, data,
+                                   images->entries[index].size, &g_encode,
+                                   &entry, &entry_len) == 0 &&
+             chowdren_image_decode(entry, entry_len, &again_info,
+                                   CHOWDREN_ORDER_RGBA, &again) == 0 &&
+             again_info.width == info.width && again_info.height == info.height &&
+             memcmp(again, reference, count * 4) == 0;
+
+    if (ok) {
+        atomic_fetch_add(&batch->ok, 1);
+        atomic_fetch_add(&batch->pixel_bytes, count * 4);
+    } else {
+        report_failure(batch, index, "round-trip mismatch");
+    }
+    free(again);
+    free(entry);
+    free(reference);
+    free(pixels);
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+static void usage(void) {
+    printf("Usage:\n");
+    printf("  chowdren_codec info <Assets.dat> [index]\n");
+    printf("  chowdren_codec decode <Assets.dat|image.bin> <out_dir|out_file> [options]\n");
+    printf("  chowdren_codec encode <Assets.dat> <in_dir> <out_dir> [options]\n");
+    printf("  chowdren_codec roundtrip <Assets.dat> [options]\n");
+    printf("\nOptions:\n");
+    printf("  --format png|rgba|bgra|argb|abgr   File format (default png)\n");
+    printf("  --range A-B                        Only image indices A..B\n");
+    printf("  --threads N                        Worker threads (default: one per CPU)\n");
+    printf("  --level N                          zlib level for .bin streams (default 9)\n");
+    printf("  --png-level N                      zlib level for PNG output (default 1)\n");
+    printf("  --strict-size                      Refuse images over 65,535 decompressed bytes\n");
+}
+
+static int parse_options(int argc, char** argv, char** positional, int max_positional) {
+    int count = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            const char* f = argv[++i];
+            if (strcmp(f, "png") == 0) g_format = FORMAT_PNG;
+            else if (strcmp(f, "rgba") == 0) g_format = FORMAT_RGBA;
+            else if (strcmp(f, "bgra") == 0) g_format = FORMAT_BGRA;
+            else if (strcmp(f, "argb") == 0) g_format = FORMAT_ARGB;
+            else if (strcmp(f, "abgr") == 0) g_format = FORMAT_ABGR;
+            else return -1;
+        } else if (strcmp(argv[i], "--range") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u-%u", &g_first, &g_last) != 2 || g_first > g_last) return -1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            g_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+            g_encode.level = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc) {
+            g_png_level = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--strict-size") == 0) {
+            g_encode.strict_size = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            return -1;
+        } else if (count < max_positional) {
+            positional[count++] = argv[i];
+        } else {
+            return -1;
+        }
+    }
+    return count;
+}
+
+static size_t clamp_range(const ChowdrenArchive* archive) {
+    uint32_t count = archive->tables[CHOWDREN_IMAGES].count;
+    if (g_last >= count) g_last = count - 1;
+    if (g_first > g_last) return 0;
+    return (size_t)g_last - g_first + 1;
+}
+
+static int ends_with(const char* s, const char* suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+
+    const char* cmd = argv[1];
+    char* pos[3] = { NULL };
+    int npos = parse_options(argc - 2, argv + 2, pos, 3);
+    if (npos < 1) {
+        usage();
+        return 1;
+    }
+    if (g_png_level < 0 || g_png_level > 9) g_png_level = 1;
+
+    if (strcmp(cmd, "decode") == 0 && npos == 2 && ends_with(pos[0], ".bin")) {
+        return decode_single_bin(pos[0], pos[1]);
+    }
+
+    ChowdrenArchive archive;
+    if (chowdren_archive_open(&archive, pos[0]) != 0) return 1;
+
+    if (strcmp(cmd, "info") == 0) {
+        int rc = cmd_info(&archive, npos - 1, pos + 1);
+        chowdren_archive_close(&archive);
+        return rc;
+    }
+
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.archive = &archive;
+
+    ParallelFn fn;
+    const char* title;
+    if (strcmp(cmd, "decode") == 0 && npos == 2) {
+        batch.out_dir = pos[1];
+        fn = decode_one;
+        title = "DECODING IMAGES";
+    } else if (strcmp(cmd, "encode") == 0 && npos == 3) {
+        batch.in_dir = pos[1];
+        batch.out_dir = pos[2];
+        fn = encode_one;
+        title = "ENCODING IMAGES";
+    } else if (strcmp(cmd, "roundtrip") == 0 && npos == 1) {
+        fn = roundtrip_one;
+        title = "ROUND-TRIP CHECK";
+    } else {
+        usage();
+        chowdren_archive_close(&archive);
+        return 1;
+    }
+
+    if (batch.out_dir && mkdir(batch.out_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", batch.out_dir, strerror(errno));
+        chowdren_archive_close(&archive);
+        return 1;
+    }
+
+    size_t count = clamp_range(&archive);
+    int threads = g_threads > 0 ? g_threads : parallel_cpu_count();
+
+    printf("\n================================================================================\n");
+    printf("%s\n", title);
+    printf("================================================================================\n");
+    printf("Archive:  %s\n", pos[0]);
+    printf("Images:   %u-%u (%zu)\n", g_first, g_last, count);
+    printf("Format:   %s\n", format_ext());
+    printf("Threads:  %d\n", threads);
+    printf("================================================================================\n\n");
+
+    double start = now_seconds();
+    parallel_for(count, threads, fn, &batch);
+    double elapsed = now_seconds() - start;
+
+    unsigned ok = atomic_load(&batch.ok);
+    printf("\n================================================================================\n");
+    printf("Done in %.2f s (%.0f images/s, %.1f MB/s of pixels)\n", elapsed,
+           elapsed > 0 ? ok / elapsed : 0.0,
+           elapsed > 0 ? atomic_load(&batch.pixel_bytes) / 1024.0 / 1024.0 / elapsed : 0.0);
+    printf("  Succeeded: %u\n", ok);
+    printf("  Skipped:   %u\n", atomic_load(&batch.skipped));
+    printf("  Failed:    %u\n", atomic_load(&batch.failed));
+    if (atomic_load(&batch.size_wrapped)) {
+        printf("  Size field wrapped (>65,535 bytes): %u\n", atomic_load(&batch.size_wrapped));
+    }
+    printf("================================================================================\n\n");
+
+    chowdren_archive_close(&archive);
+    return atomic_load(&batch.failed) ? 1 : 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * chowdren_image.c - Chowdren .bin image codec
+ */
+
+#include "chowdren_image.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static uint16_t read_le16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void write_le16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static float read_lef32(const uint8_t* p) {
+    uint32_t bits = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static void write_lef32(uint8_t* p, float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    p[0] = (uint8_t)bits;
+    p[1] = (uint8_t)(bits >> 8);
+    p[2] = (uint8_t)(bits >> 16);
+    p[3] = (uint8_t)(bits >> 24);
+}
+
+// ============================================================================
+// Header
+// ============================================================================
+
+// A zlib header is CMF FLG with CM=8, a window of at most 32 KB, no preset
+// dictionary, and (CMF*256 + FLG) divisible by 31. Checking all of it
+// instead of just "78 9c" also finds streams packed at other levels
+// (78 01, 78 5e, 78 da).
+static int is_zlib_header(const uint8_t* p) {
+    return (p[0] & 0x0F) == 8 &&
+           (p[0] >> 4) <= 7 &&
+           (p[1] & 0x20) == 0 &&
+           ((p[0] << 8) | p[1]) % 31 == 0;
+}
+
+int chowdren_image_parse(const uint8_t* data, size_t size, ChowdrenImageInfo* info) {
+    memset(info, 0, sizeof(*info));
+    if (!data || size < CHOWDREN_IMAGE_HEADER_SIZE + 2) return -1;
+
+    info->width = read_le16(data + 0);
+    info->height = read_le16(data + 2);
+    info->hotspot_x = read_lef32(data + 16);
+    info->hotspot_y = read_lef32(data + 20);
+    info->flags = read_le16(data + 24);
+    info->size_field = read_le16(data + 46);
+
+    // The stream normally starts right after the header. Fall back to a
+    // short scan for entries whose header is laid out differently.
+    size_t start = CHOWDREN_IMAGE_HEADER_SIZE;
+    if (!is_zlib_header(data + start)) {
+        size_t limit = size - 2 < 128 ? size - 2 : 128;
+        for (start = 4; start < limit; start++) {
+            if (is_zlib_header(data + start)) break;
+        }
+        if (start >= limit) return -1;
+    }
+
+    info->stream_offset = (uint32_t)start;
+    info->stream_size = (uint32_t)(size - start);
+    return 0;
+}
+
+// ============================================================================
+// Decode
+// ============================================================================
+
+int chowdren_image_inflate(const uint8_t* data, size_t size, ChowdrenImageInfo* info,
+                           uint8_t** raw_out, size_t* raw_len) {
+    *raw_out = NULL;
+    *raw_len = 0;
+    if (chowdren_image_parse(data, size, info) != 0) return -1;
+
+    size_t cap = chowdren_image_pixel_size(info);
+    if (cap == 0) cap = (size_t)info->stream_size * 4 + 64;
+    uint8_t* out = malloc(cap);
+    if (!out) return -1;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit(&strm) != Z_OK) {
+        free(out);
+        return -1;
+    }
+
+    strm.next_in = (Bytef*)(data + info->stream_offset);
+    strm.avail_in = info->stream_size;
+
+    // Sized from the header, so this is normally a single call; grow if
+    // the header under-reports.
+    int ret;
+    do {
+        if (strm.total_out == cap) {
+            uint8_t* grown = realloc(out, cap * 2);
+            if (!grown) {
+                ret = Z_MEM_ERROR;
+                break;
+            }
+            out = grown;
+            cap *= 2;
+        }
+        strm.next_out = out + strm.total_out;
+        strm.avail_out = (uInt)(cap - strm.total_out);
+        ret = inflate(&strm, Z_FINISH);
+    } while (ret == Z_BUF_ERROR && strm.avail_out == 0);
+
+    size_t produced = strm.total_out;
+    inflateEnd(&strm);
+
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return -1;
+    }
+
+    *raw_out = out;
+    *raw_len = produced;
+    return 0;
+}
+
+int chowdren_image_decode(const uint8_t* data, size_t size, ChowdrenImageInfo* info,
+                          ChowdrenPixelOrder order, uint8_t** pixels_out) {
+    uint8_t* raw;
+    size_t raw_len;
+    *pixels_out = NULL;
+    if (chowdren_image_inflate(data, size, info, &raw, &raw_len) != 0) return -1;
+
+    size_t pixels = (size_t)info->width * info->height;
+    if (pixels == 0) {
+        free(raw);
+        return -1;
+    }
+
+    if (raw_len == pixels * 3) {
+        // RGB stream: expand to opaque RGBA
+        uint8_t* rgba = malloc(pixels * 4);
+        if (!rgba) {
+            free(raw);
+            return -1;
+        }
+        for (size_t i = 0; i < pixels; i++) {
+            rgba[i * 4 + 0] = raw[i * 3 + 0];
+            rgba[i * 4 + 1] = raw[i * 3 + 1];
+            rgba[i * 4 + 2] = raw[i * 3 + 2];
+            rgba[i * 4 + 3] = 255;
+        }
+        free(raw);
+        raw = rgba;
+    } else if (raw_len != pixels * 4) {
+        free(raw);
+        return -1;
+    }
+
+    if (order != CHOWDREN_ORDER_RGBA) chowdren_swizzle_from_rgba(raw, raw, pixels, order);
+    *pixels_out = raw;
+    return 0;
+}
+
+// ============================================================================
+// Encode
+// ============================================================================
+
+#ifdef USE_LIBDEFLATE
+// libdeflate compressors are expensive to create at high levels; keep one
+// per thread for batch use.
+static __thread struct libdeflate_compressor* tls_compressor = NULL;
+static __thread int tls_compressor_level = 0;
+#endif
+
+static uint8_t* deflate_pixels(const uint8_t* raw, size_t len, int level, size_t* out_len) {
+#ifdef USE_LIBDEFLATE
+    if (level < 1 || level > 12) level = 12;
+    if (!tls_compressor || tls_compressor_level != level) {
+        if (tls_compressor) libdeflate_free_compressor(tls_compressor);
+        tls_compressor = libdeflate_alloc_compressor(level);
+        tls_compressor_level = level;
+        if (!tls_compressor) return NULL;
+    }
+
+    size_t cap = libdeflate_zlib_compress_bound(tls_compressor, len);
+    uint8_t* out = malloc(cap);
+    if (!out) return NULL;
+    *out_len = libdeflate_zlib_compress(tls_compressor, raw, len, out, cap);
+    if (*out_len == 0) {
+        free(out);
+        return NULL;
+    }
+    return out;
+#else
+    if (level < 1 || level > 9) level = 9;
+    uLongf cap = compressBound((uLong)len);
+    uint8_t* out = malloc(cap);
+    if (!out) return NULL;
+    if (compress2(out, &cap, raw, (uLong)len, level) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    *out_len = cap;
+    return out;
+#endif
+}
+
+int chowdren_image_encode(const uint8_t* rgba, uint16_t width, uint16_t height,
+                          const uint8_t* original, size_t original_size,
+                          const ChowdrenEncodeOptions* options,
+                          uint8_t** entry_out, size_t* entry_len) {
+    *entry_out = NULL;
+    *entry_len = 0;
+
+    size_t pixel_size = (size_t)width * height * 4;
+    if (pixel_size == 0) return -1;
+    if (options->strict_size && pixel_size > CHOWDREN_IMAGE_MAX_SIZE_FIELD) return -2;
+
+    uint8_t header[CHOWDREN_IMAGE_HEADER_SIZE];
+
+    if (original && original_size >= CHOWDREN_IMAGE_HEADER_SIZE) {
+        memcpy(header, original, sizeof(header));
+
+        uint16_t orig_w = read_le16(original + 0);
+        uint16_t orig_h = read_le16(original + 2);
+        if (orig_w != width || orig_h != height) {
+            // Keep the hotspot at the same relative position, then zero
+            // the mystery region. This also clears hotspot Y (bytes 20-23),
+            // matching encode_images_fixed.py.
+            if (orig_w > 0) {
+                write_lef32(header + 16, read_lef32(original + 16) / orig_w * width);
+            }
+            memset(header + 20, 0, 26);
+        }
+    } else {
+        memset(header, 0, sizeof(header));
+        write_lef32(header + 16, width / 2.0f);
+        write_lef32(header + 20, height / 2.0f);
+        write_le16(header + 24, 2);
+    }
+
+    write_le16(header + 0, width);
+    write_le16(header + 4, width);
+    write_le16(header + 12, width);
+    write_le16(header + 2, height);
+    write_le16(header + 6, height);
+    write_le16(header + 14, height);
+    write_le16(header + 46, (uint16_t)pixel_size);
+
+    size_t stream_len;
+    uint8_t* stream = deflate_pixels(rgba, pixel_size, options->level, &stream_len);
+    if (!stream) return -1;
+
+    uint8_t* entry = malloc(sizeof(header) + stream_len);
+    if (!entry) {
+        free(stream);
+        return -1;
+    }
+    memcpy(entry, header, sizeof(header));
+    memcpy(entry + sizeof(header), stream, stream_len);
+    free(stream);
+
+    *entry_out = entry;
+    *entry_len = sizeof(header) + stream_len;
+    return 0;
+}
+
+// ============================================================================
+// Swizzle
+// ============================================================================
+
+// dst channel i comes from src channel k_perm[order][i]
+static const uint8_t k_from_rgba[4][4] = {
+    { 0, 1, 2, 3 },   // RGBA
+    { 2, 1, 0, 3 },   // BGRA
+    { 3, 0, 1, 2 },   // ARGB
+    { 3, 2, 1, 0 },   // ABGR
+};
+
+static const uint8_t k_to_rgba[4][4] = {
+    { 0, 1, 2, 3 },
+    { 2, 1, 0, 3 },
+    { 1, 2, 3, 0 },
+    { 3, 2, 1, 0 },
+};
+
+static void swizzle(uint8_t* dst, const uint8_t* src, size_t pixels, const uint8_t perm[4]) {
+    size_t i = 0;
+
+#if defined(__SSSE3__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    uint8_t mask_bytes[16];
+    for (int p = 0; p < 4; p++) {
+        for (int c = 0; c < 4; c++) mask_bytes[p * 4 + c] = (uint8_t)(p * 4 + perm[c]);
+    }
+#if defined(__SSSE3__)
+    __m128i mask = _mm_loadu_si128((const __m128i*)mask_bytes);
+    for (; i + 4 <= pixels; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_shuffle_epi8(v, mask));
+    }
+#else
+    uint8x16_t mask = vld1q_u8(mask_bytes);
+    for (; i + 4 <= pixels; i += 4) {
+        vst1q_u8(dst + i * 4, vqtbl1q_u8(vld1q_u8(src + i * 4), mask));
+    }
+#endif
+#endif
+
+    for (; i < pixels; i++) {
+        uint8_t px[4];
+        memcpy(px, src + i * 4, 4);
+        for (int c = 0; c < 4; c++) dst[i * 4 + c] = px[perm[c]];
+    }
+}
+
+void chowdren_swizzle_from_rgba(uint8_t* dst, const uint8_t* src, size_t pixels,
+                                ChowdrenPixelOrder order) {
+    if (order == CHOWDREN_ORDER_RGBA) {
+        if (dst != src) memcpy(dst, src, pixels * 4);
+        return;
+    }
+    swizzle(dst, src, pixels, k_from_rgba[order]);
+}
+
+void chowdren_swizzle_to_rgba(uint8_t* dst, const uint8_t* src, size_t pixels,
+                              ChowdrenPixelOrder order) {
+    if (order == CHOWDREN_ORDER_RGBA) {
+        if (dst != src) memcpy(dst, src, pixels * 4);
+        return;
+    }
+    swizzle(dst, src, pixels, k_to_rgba[order]);
+}
@@ -0,0 +1,99 @@
+/*
+ * chowdren_image.h - Chowdren .bin image codec
+ *
+ * Header (50 bytes):
+ *   Bytes 0-1:   Width (uint16)
+ *   Bytes 2-3:   Height (uint16)
+ *   Bytes 4-5:   Width copy
+ *   Bytes 6-7:   Height copy
+ *   Bytes 8-11:  Unknown
+ *   Bytes 12-13: Width copy
+ *   Bytes 14-15: Height copy
+ *   Bytes 16-19: Hotspot X (float)
+ *   Bytes 20-23: Hotspot Y (float)
+ *   Bytes 24-25: Flags (uint16)
+ *   Bytes 26-45: Mystery bytes (must be zeroed if dimensions change)
+ *   Bytes 46-47: Decompressed size (uint16, low 16 bits of width*height*4)
+ *   Byte 50+:    zlib compressed RGBA pixel data
+ *
+ * The decompressed-size field only holds 16 bits. Shipped images larger
+ * than 64 KB store the size modulo 65,536, so the codec accepts wrapped
+ * values when decoding and writes them when encoding unless strict mode
+ * asks for the old "refuse anything over 65,535 bytes" behaviour.
+ */
+
+#ifndef CHOWDREN_IMAGE_H
+#define CHOWDREN_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHOWDREN_IMAGE_HEADER_SIZE 50
+#define CHOWDREN_IMAGE_MAX_SIZE_FIELD 65535
+
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    float hotspot_x;
+    float hotspot_y;
+    uint16_t flags;
+    uint16_t size_field;      // as stored; wraps for images over 64 KB
+    uint32_t stream_offset;   // where the zlib stream starts
+    uint32_t stream_size;     // bytes from stream_offset to end of entry
+} ChowdrenImageInfo;
+
+typedef enum {
+    CHOWDREN_ORDER_RGBA = 0,
+    CHOWDREN_ORDER_BGRA,
+    CHOWDREN_ORDER_ARGB,
+    CHOWDREN_ORDER_ABGR,
+} ChowdrenPixelOrder;
+
+typedef struct {
+    int level;                // zlib 1-9 (libdeflate 1-12 with USE_LIBDEFLATE)
+    int strict_size;          // refuse images whose size does not fit in 16 bits
+} ChowdrenEncodeOptions;
+
+// Parse the header and locate the zlib stream. Returns 0 on success,
+// -1 if the entry is too small or no valid zlib header is found.
+int chowdren_image_parse(const uint8_t* data, size_t size, ChowdrenImageInfo* info);
+
+// Decompressed RGBA size implied by the header dimensions.
+static inline size_t chowdren_image_pixel_size(const ChowdrenImageInfo* info) {
+    return (size_t)info->width * info->height * 4;
+}
+
+// True when the stored size field matches the header dimensions (modulo 2^16).
+static inline int chowdren_image_size_field_ok(const ChowdrenImageInfo* info) {
+    return info->size_field == (uint16_t)chowdren_image_pixel_size(info);
+}
+
+// Inflate the entry's pixel stream as-is. *raw_len is whatever the stream
+// held; it is normally width*height*4. Returns 0 on success.
+int chowdren_image_inflate(const uint8_t* data, size_t size, ChowdrenImageInfo* info,
+                           uint8_t** raw_out, size_t* raw_len);
+
+// Decode to tightly packed pixels in the requested channel order. RGB
+// streams are expanded to opaque RGBA. Returns 0 on success.
+int chowdren_image_decode(const uint8_t* data, size_t size, ChowdrenImageInfo* info,
+                          ChowdrenPixelOrder order, uint8_t** pixels_out);
+
+// Encode RGBA pixels to a complete .bin entry. When `original` is given its
+// header is kept (hotspots, flags, unknown fields) with every dimension and
+// size field updated; if the dimensions changed, the hotspot X is rescaled
+// and bytes 20-45 are zeroed like encode_images_fixed.py does. Without an
+// original a default header (centre hotspot, flags 2) is written.
+// Returns 0 on success, -1 on error, -2 if strict_size rejected the image.
+int chowdren_image_encode(const uint8_t* rgba, uint16_t width, uint16_t height,
+                          const uint8_t* original, size_t original_size,
+                          const ChowdrenEncodeOptions* options,
+                          uint8_t** entry_out, size_t* entry_len);
+
+// Reorder 4-byte pixels between RGBA and `order` (SSSE3/NEON when built
+// for them). dst may equal src.
+void chowdren_swizzle_from_rgba(uint8_t* dst, const uint8_t* src, size_t pixels,
+                                ChowdrenPixelOrder order);
+void chowdren_swizzle_to_rgba(uint8_t* dst, const uint8_t* src, size_t pixels,
+                              ChowdrenPixelOrder order);
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * chowdren_png.c - RGBA PNG read/write for the native codec (libpng)
+ */
+
+#include "chowdren_png.h"
+
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int chowdren_png_write(const char* path, const uint8_t* rgba,
+                       uint32_t width, uint32_t height, int level) {
+    FILE* f = fopen(path, "wb");
+    if (!f) return -1;
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!info || setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        fclose(f);
+        return -1;
+    }
+
+    png_init_io(png, f);
+    png_set_compression_level(png, level);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGBA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (uint32_t y = 0; y < height; y++) {
+        png_write_row(png, (png_const_bytep)(rgba + (size_t)y * width * 4));
+    }
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+int chowdren_png_read(const char* path, uint8_t** rgba_out,
+                      uint32_t* width, uint32_t* height) {
+    *rgba_out = NULL;
+    FILE* f = fopen(path, "rb");
+    if (!f) return -1;
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    uint8_t* volatile pixels = NULL;
+    if (!info || setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        free(pixels);
+        fclose(f);
+        return -1;
+    }
+
+    png_init_io(png, f);
+    png_read_info(png, info);
+
+    png_byte color = png_get_color_type(png, info);
+    png_byte depth = png_get_bit_depth(png, info);
+    if (depth == 16) png_set_strip_16(png);
+    if (color == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+    if (color == PNG_COLOR_TYPE_GRAY && depth < 8) png_set_expand_gray_1_2_4_to_8(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
+    if (color == PNG_COLOR_TYPE_GRAY || color == PNG_COLOR_TYPE_GRAY_ALPHA) png_set_gray_to_rgb(png);
+    if (!(color & PNG_COLOR_MASK_ALPHA) && !png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    }
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    uint32_t w = png_get_image_width(png, info);
+    uint32_t h = png_get_image_height(png, info);
+    pixels = malloc((size_t)w * h * 4);
+    if (!pixels) png_error(png, "out of memory");
+
+    for (int pass = 0; pass < passes; pass++) {
+        for (uint32_t y = 0; y < h; y++) {
+            png_read_row(png, pixels + (size_t)y * w * 4, NULL);
+        }
+    }
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(f);
+
+    *rgba_out = pixels;
+    *width = w;
+    *height = h;
+    return 0;
+}
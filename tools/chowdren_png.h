@@ -0,0 +1,18 @@
+/*
+ * chowdren_png.h - RGBA PNG read/write for the native codec (libpng)
+ */
+
+#ifndef CHOWDREN_PNG_H
+#define CHOWDREN_PNG_H
+
+#include <stdint.h>
+
+// Write 8-bit RGBA. `level` is the zlib level for the PNG (1 = fastest).
+int chowdren_png_write(const char* path, const uint8_t* rgba,
+                       uint32_t width, uint32_t height, int level);
+
+// Read any PNG as 8-bit RGBA (palette, grey, RGB and 16-bit are converted).
+int chowdren_png_read(const char* path, uint8_t** rgba_out,
+                      uint32_t* width, uint32_t* height);
+
+#endif
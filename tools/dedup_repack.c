@@ -0,0 +1,288 @@
+/*
+ * dedup_repack.c - Collapse identical Assets.dat entries to one stored copy
+ *
+ * The Assets.dat tables are plain offset+size pairs, so any number of
+ * image or sound indices can point at the same bytes without the engine
+ * noticing. This tool hashes every entry's payload on all cores, confirms
+ * each match byte-for-byte, writes a single copy of each distinct payload
+ * and points every duplicate table entry at it. Indices are unchanged.
+ *
+ * Run it after recompress/batch_optimize, which write every entry
+ * separately, and before layout_assets and build_sidecar (the order in
+ * scripts.md).
+ *
+ * Build:
+ *   gcc -O3 -o dedup_repack dedup_repack.c chowdren_assets.c parallel.c -lpthread
+ *
+ * Usage:
+ *   ./dedup_repack <input_Assets.dat> <output_Assets.dat> [--threads N] [--dry-run] [--list]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "chowdren_assets.h"
+#include "parallel.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static int g_threads = 0;
+static int g_dry_run = 0;
+static int g_list = 0;
+
+// ============================================================================
+// Entry index
+// ============================================================================
+
+// Every table entry flattened into one array, in table order
+typedef struct {
+    uint64_t hash;
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t id;          // position in table order
+    uint32_t index;       // index within its table
+    uint8_t kind;
+} EntryRef;
+
+typedef struct {
+    EntryRef* refs;
+} HashJob;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void hash_entry(void* ctx, size_t i, int worker) {
+    (void)worker;
+    HashJob* job = ctx;
+    EntryRef* r = &job->refs[i];
+    if (r->data) r->hash = chowdren_hash64(r->data, r->size);
+}
+
+// Group by size, then hash, then table order so the first member of each
+// run of identical payloads is the one written first.
+static int compare_refs(const void* a, const void* b) {
+    const EntryRef* x = a;
+    const EntryRef* y = b;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->id < y->id ? -1 : (x->id > y->id);
+}
+
+static int same_payload(const EntryRef* a, const EntryRef* b) {
+    return a->data == b->data || memcmp(a->data, b->data, a->size) == 0;
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+static void usage(void) {
+    printf("Usage: dedup_repack <input_Assets.dat> <output_Assets.dat> [options]\n");
+    printf("\nOptions:\n");
+    printf("  --threads N   Hashing threads (default: one per CPU)\n");
+    printf("  --dry-run     Report duplicates without writing an archive\n");
+    printf("  --list        Print every duplicate and the entry it now shares\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+
+    const char* input = argv[1];
+    const char* output = argv[2];
+
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            g_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            g_dry_run = 1;
+        } else if (strcmp(argv[i], "--list") == 0) {
+            g_list = 1;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (g_threads <= 0) g_threads = parallel_cpu_count();
+
+    ChowdrenArchive archive;
+    if (chowdren_archive_open(&archive, input) != 0) return 1;
+
+    printf("\n================================================================================\n");
+    printf("DEDUPLICATING ASSETS.DAT\n");
+    printf("================================================================================\n");
+    printf("Input:    %s (%.2f MB)\n", input, archive.size / 1024.0 / 1024.0);
+    printf("Output:   %s\n", g_dry_run ? "(dry run)" : output);
+    printf("Threads:  %d\n", g_threads);
+    printf("================================================================================\n\n");
+
+    uint32_t total = 0;
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) total += archive.tables[k].count;
+
+    EntryRef* refs = calloc(total, sizeof(EntryRef));
+    uint32_t* leader = malloc(total * sizeof(uint32_t));
+    uint8_t* own_copy = calloc(total, 1);   // duplicate stored separately in the input
+    if (!refs || !leader || !own_copy) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    uint32_t id = 0;
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        const ChowdrenTable* table = &archive.tables[k];
+        for (uint32_t i = 0; i < table->count; i++, id++) {
+            EntryRef* r = &refs[id];
+            r->id = id;
+            r->index = i;
+            r->kind = (uint8_t)k;
+            r->size = table->entries[i].size;
+            r->data = chowdren_archive_payload(&archive, k, i);
+            if (r->size > 0 && !r->data) {
+                fprintf(stderr, "Error: %s entry %u points past the end of the file\n",
+                        table->name, i);
+                return 1;
+            }
+            leader[id] = id;
+        }
+    }
+
+    double start = now_seconds();
+    HashJob job = { refs };
+    parallel_for(total, g_threads, hash_entry, &job);
+    double hash_time = now_seconds() - start;
+
+    // Sort a copy so `refs` stays addressable by id
+    EntryRef* sorted = malloc(total * sizeof(EntryRef));
+    if (!sorted) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+    memcpy(sorted, refs, total * sizeof(EntryRef));
+    qsort(sorted, total, sizeof(EntryRef), compare_refs);
+
+    // Within each (size, hash) run, match every entry against the distinct
+    // payloads seen so far in that run. Runs are almost always one distinct
+    // payload, so this is a single memcmp per duplicate.
+    uint64_t collisions = 0;
+    for (uint32_t run = 0; run < total;) {
+        uint32_t end = run + 1;
+        while (end < total && sorted[end].size == sorted[run].size &&
+               sorted[end].hash == sorted[run].hash) {
+            end++;
+        }
+
+        if (sorted[run].size > 0) {
+            for (uint32_t i = run + 1; i < end; i++) {
+                for (uint32_t j = run; j < i; j++) {
+                    if (leader[sorted[j].id] != sorted[j].id) continue;
+                    if (same_payload(&sorted[i], &sorted[j])) {
+                        leader[sorted[i].id] = sorted[j].id;
+                        break;
+                    }
+                }
+                if (leader[sorted[i].id] == sorted[i].id) {
+                    collisions++;
+                    continue;
+                }
+                // Entries the input already pointed at one copy save nothing
+                own_copy[sorted[i].id] = 1;
+                for (uint32_t j = run; j < i; j++) {
+                    if (sorted[j].data == sorted[i].data) {
+                        own_copy[sorted[i].id] = 0;
+                        break;
+                    }
+                }
+            }
+        }
+        run = end;
+    }
+    free(sorted);
+
+    // Rewrite in table order; duplicates reuse their leader's new offset
+    ChowdrenTable tables[CHOWDREN_KIND_COUNT];
+    ChowdrenWriter writer;
+    if (chowdren_tables_clone(&archive, tables) != 0) return 1;
+    if (!g_dry_run && chowdren_writer_open(&writer, output) != 0) return 1;
+
+    uint32_t* new_offset = calloc(total, sizeof(uint32_t));
+    uint32_t shared[CHOWDREN_KIND_COUNT] = { 0 };
+    uint32_t cross_kind = 0;
+    uint64_t saved[CHOWDREN_KIND_COUNT] = { 0 };
+    uint64_t cursor = CHOWDREN_TABLES_SIZE;
+    if (!new_offset) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < total; i++) {
+        const EntryRef* r = &refs[i];
+        ChowdrenEntry* e = &tables[r->kind].entries[r->index];
+        if (r->size == 0) continue;
+
+        if (leader[i] != i) {
+            const EntryRef* l = &refs[leader[i]];
+            e->offset = new_offset[leader[i]];
+            shared[r->kind]++;
+            if (own_copy[i]) saved[r->kind] += r->size;
+            if (l->kind != r->kind) cross_kind++;
+            if (g_list) {
+                printf("  %s %u -> %s %u (%u bytes)\n", archive.tables[r->kind].name,
+                       r->index, archive.tables[l->kind].name, l->index, r->size);
+            }
+            continue;
+        }
+
+        if (g_dry_run) {
+            new_offset[i] = (uint32_t)cursor;
+            cursor += r->size;
+        } else {
+            if (chowdren_writer_append(&writer, r->data, r->size, &new_offset[i]) != 0) {
+                chowdren_writer_abort(&writer);
+                return 1;
+            }
+            cursor = writer.cursor;
+        }
+        e->offset = new_offset[i];
+    }
+
+    if (!g_dry_run && chowdren_writer_finish(&writer, tables) != 0) return 1;
+
+    uint64_t saved_total = 0;
+    printf("================================================================================\n");
+    printf("DEDUPLICATION %s (hashing %.2f s)\n", g_dry_run ? "REPORT" : "COMPLETE", hash_time);
+    printf("================================================================================\n");
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        printf("  %-8s %5u of %5u entries shared, %10.2f MB saved\n", tables[k].name,
+               shared[k], tables[k].count, saved[k] / 1024.0 / 1024.0);
+        saved_total += saved[k];
+    }
+    if (cross_kind) printf("\n  Shared across tables: %u\n", cross_kind);
+    if (collisions) printf("  Hash collisions resolved by compare: %llu\n",
+                           (unsigned long long)collisions);
+    printf("\n  Input archive:  %12zu bytes (%.2f MB)\n", archive.size, archive.size / 1024.0 / 1024.0);
+    printf("  Output archive: %12llu bytes (%.2f MB, %+.1f%%)\n",
+           (unsigned long long)cursor, cursor / 1024.0 / 1024.0,
+           archive.size ? ((double)cursor - archive.size) * 100.0 / archive.size : 0.0);
+    printf("  Payload bytes no longer stored twice: %.2f MB\n", saved_total / 1024.0 / 1024.0);
+    printf("================================================================================\n");
+
+    free(new_offset);
+    free(own_copy);
+    free(leader);
+    free(refs);
+    chowdren_tables_free(tables);
+    chowdren_archive_close(&archive);
+    return 0;
+}
@@ -0,0 +1,479 @@
+/*
+ * heap_diff.c - Compare heap snapshots taken with PEPPER_HEAPSNAP
+ *
+ * Each snapshot (see patches/pepper_heapsnap.c) lists every live block
+ * with its size and call site. For each pair of consecutive snapshots the
+ * tool prints:
+ *   - live blocks and bytes before and after, and what was allocated and
+ *     freed in between (a block is the same block when both its address
+ *     and its serial number match);
+ *   - the call sites by net growth, and the same by size class;
+ *   - the pixel buffers the aggressive free was still holding.
+ * With three or more snapshots (e.g. one after each level load) it also
+ * lists the call sites whose live bytes grew at every step, which is what
+ * a leak across level loads looks like.
+ *
+ * Call sites are matched by module and offset, not address, so snapshots
+ * from different runs can be compared by site (blocks never match across
+ * processes, so everything shows as added and freed).
+ *
+ * Build:
+ *   gcc -O2 -o heap_diff heap_diff.c
+ *
+ * Usage:
+ *   ./heap_diff [--top N] before.snap after.snap [later.snap...]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// ============================================================================
+// Snapshot file
+// ============================================================================
+
+#define SNAP_MAGIC "PEPSNP\0\1"
+#define HEAPSNAP_TRACKED 1
+#define MAX_SNAPSHOTS 32
+#define SIZE_CLASSES 24
+
+// Same layout as patches/pepper_heapsnap.c
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t sequence;
+    uint64_t frame;
+    uint64_t time_ns;
+    uint64_t block_count;
+    uint64_t live_bytes;
+} SnapHeader;
+
+typedef struct {
+    uint64_t ptr;
+    uint64_t site;
+    uint32_t size;
+    uint32_t serial;
+    uint32_t flags;
+    uint32_t reserved;
+} SnapRecord;
+
+typedef struct {
+    const char* path;
+    const SnapHeader* header;
+    const SnapRecord* records;
+    size_t count;
+    uint32_t* site_of;        // per record, index into g_site_names
+} Snapshot;
+
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static size_t table_slots(size_t count) {
+    size_t slots = 1024;
+    while (slots < count * 2) slots *= 2;
+    return slots;
+}
+
+// ============================================================================
+// Call sites - one name per module+offset, shared by all snapshots
+// ============================================================================
+
+static char** g_site_names = NULL;
+static size_t g_site_count = 0;
+static size_t g_site_cap = 0;
+static uint32_t* g_name_slots = NULL;     // site index + 1, 0 = empty
+static size_t g_name_mask = 0;
+
+static uint64_t hash_name(const char* name) {
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    while (*name) h = mix64(h ^ (uint8_t)*name++);
+    return h;
+}
+
+static uint32_t intern_site(const char* name) {
+    if ((g_site_count + 1) * 2 > g_name_mask) {
+        size_t slots = g_name_mask ? (g_name_mask + 1) * 2 : 4096;
+        free(g_name_slots);
+        g_name_slots = calloc(slots, sizeof(uint32_t));
+        g_name_mask = slots - 1;
+        for (size_t i = 0; i < g_site_count; i++) {
+            size_t slot = hash_name(g_site_names[i]) & g_name_mask;
+            while (g_name_slots[slot]) slot = (slot + 1) & g_name_mask;
+            g_name_slots[slot] = (uint32_t)i + 1;
+        }
+    }
+    size_t slot = hash_name(name) & g_name_mask;
+    while (g_name_slots[slot]) {
+        if (strcmp(g_site_names[g_name_slots[slot] - 1], name) == 0) return g_name_slots[slot] - 1;
+        slot = (slot + 1) & g_name_mask;
+    }
+    if (g_site_count == g_site_cap) {
+        g_site_cap = g_site_cap ? g_site_cap * 2 : 1024;
+        g_site_names = realloc(g_site_names, g_site_cap * sizeof(char*));
+    }
+    g_site_names[g_site_count] = strdup(name);
+    g_name_slots[slot] = (uint32_t)g_site_count + 1;
+    return (uint32_t)g_site_count++;
+}
+
+// Address -> site index, for one snapshot's site lines
+typedef struct {
+    uint64_t* addrs;
+    uint32_t* sites;
+    size_t mask;
+} AddrMap;
+
+static void addr_put(AddrMap* map, uint64_t addr, uint32_t site) {
+    size_t slot = mix64(addr) & map->mask;
+    while (map->addrs[slot] && map->addrs[slot] != addr) slot = (slot + 1) & map->mask;
+    map->addrs[slot] = addr;
+    map->sites[slot] = site;
+}
+
+static uint32_t addr_site(const AddrMap* map, uint64_t addr) {
+    for (size_t slot = mix64(addr) & map->mask; map->addrs[slot]; slot = (slot + 1) & map->mask) {
+        if (map->addrs[slot] == addr) return map->sites[slot];
+    }
+    char name[32];
+    snprintf(name, sizeof(name), addr ? "0x%llx" : "(unknown)", (unsigned long long)addr);
+    return intern_site(name);
+}
+
+// ============================================================================
+// Loading
+// ============================================================================
+
+static int load_snapshot(const char* path, Snapshot* snap) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    const uint8_t* data = NULL;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SnapHeader)) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) data = NULL;
+    }
+    if (fd >= 0) close(fd);
+    const SnapHeader* header = (const SnapHeader*)data;
+    if (!header || memcmp(header->magic, SNAP_MAGIC, 8) != 0 ||
+        header->record_size != sizeof(SnapRecord) ||
+        header->block_count > (st.st_size - sizeof(SnapHeader)) / sizeof(SnapRecord)) {
+        fprintf(stderr, "Error: %s is not a heap snapshot\n", path);
+        return 0;
+    }
+    snap->path = path;
+    snap->header = header;
+    snap->records = (const SnapRecord*)(header + 1);
+    snap->count = header->block_count;
+
+    // Site lines after the records: 0x<address> <module>+0x<offset> [symbol]
+    AddrMap map;
+    const char* text = (const char*)(snap->records + snap->count);
+    const char* end = (const char*)data + st.st_size;
+    size_t lines = 0;
+    for (const char* p = text; p < end; p++) lines += *p == '\n';
+    map.mask = table_slots(lines) - 1;
+    map.addrs = calloc(map.mask + 1, sizeof(uint64_t));
+    map.sites = calloc(map.mask + 1, sizeof(uint32_t));
+    snap->site_of = malloc((snap->count ? snap->count : 1) * sizeof(uint32_t));
+    if (!map.addrs || !map.sites || !snap->site_of) {
+        fprintf(stderr, "Error: out of memory for %s\n", path);
+        return 0;
+    }
+    char line[1024];
+    while (text < end) {
+        const char* nl = memchr(text, '\n', end - text);
+        size_t len = (nl ? nl : end) - text;
+        if (len >= sizeof(line)) len = sizeof(line) - 1;
+        memcpy(line, text, len);
+        line[len] = '\0';
+        text = nl ? nl + 1 : end;
+
+        char* name = strchr(line, ' ');
+        if (!name) continue;
+        *name++ = '\0';
+        uint64_t addr = strtoull(line, NULL, 16);
+        size_t n = strlen(name);
+        while (n > 0 && name[n - 1] == ' ') name[--n] = '\0';
+        if (strcmp(name, "?") == 0) continue;
+        addr_put(&map, addr, intern_site(name));
+    }
+    for (size_t i = 0; i < snap->count; i++) snap->site_of[i] = addr_site(&map, snap->records[i].site);
+    free(map.addrs);
+    free(map.sites);
+    return 1;
+}
+
+// ============================================================================
+// Block identity - address and serial, so a freed block and a new one at
+// the same address are told apart
+// ============================================================================
+
+typedef struct {
+    uint64_t* ptrs;           // 0 = empty
+    uint32_t* serials;
+    size_t mask;
+} BlockSet;
+
+static uint64_t block_hash(uint64_t ptr, uint32_t serial) {
+    return mix64(ptr ^ ((uint64_t)serial << 40));
+}
+
+static int build_set(BlockSet* set, const Snapshot* snap) {
+    set->mask = table_slots(snap->count) - 1;
+    set->ptrs = calloc(set->mask + 1, sizeof(uint64_t));
+    set->serials = calloc(set->mask + 1, sizeof(uint32_t));
+    if (!set->ptrs || !set->serials) return 0;
+    for (size_t i = 0; i < snap->count; i++) {
+        const SnapRecord* r = &snap->records[i];
+        size_t slot = block_hash(r->ptr, r->serial) & set->mask;
+        while (set->ptrs[slot]) slot = (slot + 1) & set->mask;
+        set->ptrs[slot] = r->ptr;
+        set->serials[slot] = r->serial;
+    }
+    return 1;
+}
+
+static int in_set(const BlockSet* set, const SnapRecord* r) {
+    for (size_t slot = block_hash(r->ptr, r->serial) & set->mask; set->ptrs[slot];
+         slot = (slot + 1) & set->mask) {
+        if (set->ptrs[slot] == r->ptr && set->serials[slot] == r->serial) return 1;
+    }
+    return 0;
+}
+
+static void free_set(BlockSet* set) {
+    free(set->ptrs);
+    free(set->serials);
+}
+
+// ============================================================================
+// Report
+// ============================================================================
+
+typedef struct {
+    uint64_t added, added_bytes;
+    uint64_t freed, freed_bytes;
+} Change;
+
+typedef struct {
+    uint32_t site;
+    int64_t net;
+} Ranked;
+
+static int compare_ranked(const void* a, const void* b) {
+    const Ranked* x = a;
+    const Ranked* y = b;
+    if (x->net != y->net) return x->net > y->net ? -1 : 1;
+    return x->site < y->site ? -1 : x->site > y->site;
+}
+
+static int size_class(uint32_t size) {
+    if (size < 32) return 0;
+    int cls = 63 - __builtin_clzll(size) - 4;
+    return cls < SIZE_CLASSES ? cls : SIZE_CLASSES - 1;
+}
+
+static const char* size_label(char* buf, size_t cap, uint64_t bytes) {
+    if (bytes >= (1ull << 20)) snprintf(buf, cap, "%lluM", (unsigned long long)(bytes >> 20));
+    else if (bytes >= 1024) snprintf(buf, cap, "%lluK", (unsigned long long)(bytes >> 10));
+    else snprintf(buf, cap, "%llu", (unsigned long long)bytes);
+    return buf;
+}
+
+static double mb(uint64_t bytes) {
+    return bytes / 1048576.0;
+}
+
+static void print_change_row(const char* label, const Change* c) {
+    printf("    %+9.2f %9llu %9.2f %9llu %9.2f  %s\n",
+           mb(c->added_bytes) - mb(c->freed_bytes), (unsigned long long)c->added,
+           mb(c->added_bytes), (unsigned long long)c->freed, mb(c->freed_bytes), label);
+}
+
+static void describe(const Snapshot* s) {
+    printf("%s (frame %llu, %.1f s)", s->path, (unsigned long long)s->header->frame,
+           s->header->time_ns / 1e9);
+}
+
+static int diff_pair(const Snapshot* a, const Snapshot* b, int top) {
+    BlockSet in_a, in_b;
+    Change* by_site = calloc(g_site_count ? g_site_count : 1, sizeof(Change));
+    Ranked* ranked = malloc((g_site_count ? g_site_count : 1) * sizeof(Ranked));
+    if (!by_site || !ranked || !build_set(&in_a, a) || !build_set(&in_b, b)) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 0;
+    }
+    Change total = { 0, 0, 0, 0 };
+    Change by_class[SIZE_CLASSES];
+    memset(by_class, 0, sizeof(by_class));
+    uint64_t tracked[2] = { 0, 0 }, tracked_bytes[2] = { 0, 0 };
+
+    for (size_t i = 0; i < b->count; i++) {
+        const SnapRecord* r = &b->records[i];
+        if (r->flags & HEAPSNAP_TRACKED) {
+            tracked[1]++;
+            tracked_bytes[1] += r->size;
+        }
+        if (in_set(&in_a, r)) continue;
+        Change* c[3] = { &total, &by_site[b->site_of[i]], &by_class[size_class(r->size)] };
+        for (int k = 0; k < 3; k++) {
+            c[k]->added++;
+            c[k]->added_bytes += r->size;
+        }
+    }
+    for (size_t i = 0; i < a->count; i++) {
+        const SnapRecord* r = &a->records[i];
+        if (r->flags & HEAPSNAP_TRACKED) {
+            tracked[0]++;
+            tracked_bytes[0] += r->size;
+        }
+        if (in_set(&in_b, r)) continue;
+        Change* c[3] = { &total, &by_site[a->site_of[i]], &by_class[size_class(r->size)] };
+        for (int k = 0; k < 3; k++) {
+            c[k]->freed++;
+            c[k]->freed_bytes += r->size;
+        }
+    }
+
+    printf("\n");
+    describe(a);
+    printf("\n  -> ");
+    describe(b);
+    printf("\n");
+    printf("  Live:    %9llu blocks %9.2f MB -> %9llu blocks %9.2f MB (%+.2f MB)\n",
+           (unsigned long long)a->count, mb(a->header->live_bytes),
+           (unsigned long long)b->count, mb(b->header->live_bytes),
+           mb(b->header->live_bytes) - mb(a->header->live_bytes));
+    printf("  Added:   %9llu blocks %9.2f MB\n", (unsigned long long)total.added,
+           mb(total.added_bytes));
+    printf("  Freed:   %9llu blocks %9.2f MB\n", (unsigned long long)total.freed,
+           mb(total.freed_bytes));
+    printf("  Pixel buffers held by the aggressive free: %llu (%.2f MB) -> %llu (%.2f MB)\n",
+           (unsigned long long)tracked[0], mb(tracked_bytes[0]),
+           (unsigned long long)tracked[1], mb(tracked_bytes[1]));
+
+    printf("\n  By call site:\n");
+    printf("    %9s %9s %9s %9s %9s  %s\n", "net MB", "added", "added MB", "freed", "freed MB",
+           "site");
+    size_t changed = 0;
+    for (uint32_t s = 0; s < g_site_count; s++) {
+        if (!by_site[s].added && !by_site[s].freed) continue;
+        ranked[changed].site = s;
+        ranked[changed].net = (int64_t)by_site[s].added_bytes - (int64_t)by_site[s].freed_bytes;
+        changed++;
+    }
+    qsort(ranked, changed, sizeof(Ranked), compare_ranked);
+    for (size_t i = 0; i < changed && i < (size_t)top; i++) {
+        print_change_row(g_site_names[ranked[i].site], &by_site[ranked[i].site]);
+    }
+    if (changed > (size_t)top) printf("    ... %zu more sites\n", changed - top);
+
+    printf("\n  By size class:\n");
+    printf("    %9s %9s %9s %9s %9s  %s\n", "net MB", "added", "added MB", "freed", "freed MB",
+           "size");
+    for (int c = 0; c < SIZE_CLASSES; c++) {
+        if (!by_class[c].added && !by_class[c].freed) continue;
+        char lo[16], hi[16], range[40];
+        if (c == 0) snprintf(range, sizeof(range), "<32");
+        else if (c == SIZE_CLASSES - 1) snprintf(range, sizeof(range), ">=%s",
+                                                 size_label(lo, sizeof(lo), 16ull << c));
+        else snprintf(range, sizeof(range), "%s-%s", size_label(lo, sizeof(lo), 16ull << c),
+                      size_label(hi, sizeof(hi), 32ull << c));
+        print_change_row(range, &by_class[c]);
+    }
+
+    free_set(&in_a);
+    free_set(&in_b);
+    free(by_site);
+    free(ranked);
+    return 1;
+}
+
+// Sites whose live bytes went up from every snapshot to the next
+static int print_growing(const Snapshot* snaps, int count, int top) {
+    uint64_t* live = calloc((size_t)count * (g_site_count ? g_site_count : 1), sizeof(uint64_t));
+    Ranked* ranked = malloc((g_site_count ? g_site_count : 1) * sizeof(Ranked));
+    if (!live || !ranked) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 0;
+    }
+    for (int n = 0; n < count; n++) {
+        for (size_t i = 0; i < snaps[n].count; i++) {
+            live[(size_t)snaps[n].site_of[i] * count + n] += snaps[n].records[i].size;
+        }
+    }
+    size_t growing = 0;
+    for (uint32_t s = 0; s < g_site_count; s++) {
+        const uint64_t* row = &live[(size_t)s * count];
+        int n = 1;
+        while (n < count && row[n] > row[n - 1]) n++;
+        if (n < count) continue;
+        ranked[growing].site = s;
+        ranked[growing].net = (int64_t)(row[count - 1] - row[0]);
+        growing++;
+    }
+    qsort(ranked, growing, sizeof(Ranked), compare_ranked);
+
+    printf("\nCall sites that grew at every step (%zu):\n", growing);
+    printf("    %9s  %s\n", "growth MB", "live MB per snapshot, site");
+    for (size_t i = 0; i < growing && i < (size_t)top; i++) {
+        const uint64_t* row = &live[(size_t)ranked[i].site * count];
+        printf("    %+9.2f  ", mb((uint64_t)ranked[i].net));
+        for (int n = 0; n < count; n++) printf("%s%.2f", n ? " -> " : "", mb(row[n]));
+        printf("  %s\n", g_site_names[ranked[i].site]);
+    }
+    if (growing > (size_t)top) printf("    ... %zu more sites\n", growing - top);
+    free(live);
+    free(ranked);
+    return 1;
+}
+
+static void usage(void) {
+    printf("Usage:\n");
+    printf("  heap_diff [--top N] before.snap after.snap [later.snap...]\n");
+    printf("\nOptions:\n");
+    printf("  --top N   Call sites to list per table (default: 20)\n");
+    printf("\nSnapshots are written by libpepperopt2 with PEPPER_HEAPSNAP=path.\n");
+}
+
+int main(int argc, char** argv) {
+    Snapshot snaps[MAX_SNAPSHOTS];
+    int count = 0;
+    int top = 20;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+            if (top < 1) top = 1;
+        } else if (argv[i][0] == '-' || count == MAX_SNAPSHOTS) {
+            usage();
+            return 1;
+        } else if (!load_snapshot(argv[i], &snaps[count++])) {
+            return 1;
+        }
+    }
+    if (count < 2) {
+        usage();
+        return 1;
+    }
+
+    printf("================================================================================\n");
+    printf("Heap Diff\n");
+    printf("================================================================================\n");
+    for (int n = 1; n < count; n++) {
+        if (!diff_pair(&snaps[n - 1], &snaps[n], top)) return 1;
+    }
+    if (count > 2 && !print_growing(snaps, count, top)) return 1;
+    printf("================================================================================\n");
+    return 0;
+}
@@ -0,0 +1,487 @@
+/*
+ * layout_assets.c - Store Assets.dat entries in the order the game loads them
+ *
+ * Chowdren reads the tables and then the assets it needs. When the physical
+ * order of the file does not match that order, every load on an SD card
+ * turns into a seek. This tool takes a captured load trace and rewrites
+ * the archive so entries are stored in first-access order. Entries the
+ * trace never touched follow in their original order. Table indices are
+ * unchanged, and entries that share storage (see dedup_repack) keep sharing
+ * one copy.
+ *
+ * Trace format (text, one access per line, '#' starts a comment):
+ *   <offset> <length>     byte range read from Assets.dat (decimal or 0x hex)
+ *   image <N>             entry N of a table (also sound/font/shader)
+ * The preload library writes the first form when PEPPER_ASSET_TRACE is set.
+ * Ranges are resolved against the archive the trace was captured from.
+ *
+ * Benchmark mode replays the trace against two archives with their page
+ * cache pages dropped before every run, and reports the wall time and the
+ * number of seeks each layout needs.
+ *
+ * Build:
+ *   gcc -O2 -o layout_assets layout_assets.c chowdren_assets.c
+ *
+ * Usage:
+ *   ./layout_assets <input_Assets.dat> <trace.txt> <output_Assets.dat>
+ *   ./layout_assets --bench <trace.txt> <original_Assets.dat> <laid_out_Assets.dat> [--runs N]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chowdren_assets.h"
+
+#define NOT_ACCESSED UINT32_MAX
+
+// ============================================================================
+// Extents
+// ============================================================================
+
+// One distinct stored payload. Several table entries can point at it.
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t first_access;    // trace position of the first read, or NOT_ACCESSED
+    uint32_t new_offset;
+} Extent;
+
+typedef struct {
+    ChowdrenArchive archive;
+    Extent* extents;           // sorted by offset
+    uint32_t extent_count;
+    uint32_t* entry_extent[CHOWDREN_KIND_COUNT];   // entry -> extent, or NOT_ACCESSED
+} Layout;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_extents(const void* a, const void* b) {
+    const Extent* x = a;
+    const Extent* y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->size < y->size ? -1 : (x->size > y->size);
+}
+
+static int compare_first_access(const void* a, const void* b) {
+    const Extent* x = *(const Extent* const*)a;
+    const Extent* y = *(const Extent* const*)b;
+    if (x->first_access != y->first_access) return x->first_access < y->first_access ? -1 : 1;
+    return x->offset < y->offset ? -1 : (x->offset > y->offset);
+}
+
+static uint32_t find_extent(const Layout* layout, uint32_t offset, uint32_t size) {
+    uint32_t lo = 0, hi = layout->extent_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const Extent* e = &layout->extents[mid];
+        if (e->offset < offset || (e->offset == offset && e->size < size)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int layout_open(Layout* layout, const char* path) {
+    memset(layout, 0, sizeof(*layout));
+    if (chowdren_archive_open(&layout->archive, path) != 0) return -1;
+
+    uint32_t total = 0;
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) total += layout->archive.tables[k].count;
+
+    layout->extents = malloc(total * sizeof(Extent));
+    if (!layout->extents) return -1;
+
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        const ChowdrenTable* table = &layout->archive.tables[k];
+        for (uint32_t i = 0; i < table->count; i++) {
+            if (!chowdren_archive_payload(&layout->archive, k, i)) continue;
+            Extent* e = &layout->extents[layout->extent_count++];
+            e->offset = table->entries[i].offset;
+            e->size = table->entries[i].size;
+            e->first_access = NOT_ACCESSED;
+            e->new_offset = 0;
+        }
+    }
+
+    // Collapse entries that already share storage into one extent
+    qsort(layout->extents, layout->extent_count, sizeof(Extent), compare_extents);
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < layout->extent_count; i++) {
+        if (unique > 0 && layout->extents[unique - 1].offset == layout->extents[i].offset &&
+            layout->extents[unique - 1].size == layout->extents[i].size) {
+            continue;
+        }
+        layout->extents[unique++] = layout->extents[i];
+    }
+    layout->extent_count = unique;
+
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        const ChowdrenTable* table = &layout->archive.tables[k];
+        layout->entry_extent[k] = malloc(table->count * sizeof(uint32_t));
+        if (!layout->entry_extent[k]) return -1;
+        for (uint32_t i = 0; i < table->count; i++) {
+            layout->entry_extent[k][i] = NOT_ACCESSED;
+            if (!chowdren_archive_payload(&layout->archive, k, i)) continue;
+            layout->entry_extent[k][i] =
+                find_extent(layout, table->entries[i].offset, table->entries[i].size);
+        }
+    }
+    return 0;
+}
+
+static void layout_close(Layout* layout) {
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) free(layout->entry_extent[k]);
+    free(layout->extents);
+    chowdren_archive_close(&layout->archive);
+}
+
+// ============================================================================
+// Trace
+// ============================================================================
+
+// The trace resolved to extents, in access order (repeats kept for replay)
+typedef struct {
+    uint32_t* extents;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t lines;
+    uint32_t unresolved;
+} Trace;
+
+// Consecutive reads of one entry (header, then body) count as one access
+static int trace_push(Trace* trace, uint32_t extent) {
+    if (trace->count > 0 && trace->extents[trace->count - 1] == extent) return 0;
+    if (trace->count == trace->cap) {
+        uint32_t cap = trace->cap ? trace->cap * 2 : 4096;
+        uint32_t* grown = realloc(trace->extents, cap * sizeof(uint32_t));
+        if (!grown) return -1;
+        trace->extents = grown;
+        trace->cap = cap;
+    }
+    trace->extents[trace->count++] = extent;
+    return 0;
+}
+
+static int kind_from_name(const char* name) {
+    static const char* names[CHOWDREN_KIND_COUNT] = { "image", "sound", "font", "shader" };
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        if (strcmp(name, names[k]) == 0) return k;
+    }
+    return -1;
+}
+
+// Push every extent overlapping [offset, offset + length). Reads of the
+// tables or of gaps between entries resolve to nothing.
+static int trace_range(Trace* trace, const Layout* layout, uint64_t offset, uint64_t length) {
+    uint64_t end = offset + (length ? length : 1);
+
+    // First extent that ends after `offset`
+    uint32_t lo = 0, hi = layout->extent_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const Extent* e = &layout->extents[mid];
+        if ((uint64_t)e->offset + e->size <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int found = 0;
+    for (uint32_t i = lo; i < layout->extent_count && layout->extents[i].offset < end; i++) {
+        if (trace_push(trace, i) != 0) return -1;
+        found = 1;
+    }
+    if (!found && offset >= CHOWDREN_TABLES_SIZE) trace->unresolved++;
+    return 0;
+}
+
+static int trace_load(Trace* trace, const Layout* layout, const char* path) {
+    memset(trace, 0, sizeof(*trace));
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open trace %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char word[32];
+        unsigned long long a, b;
+        if (sscanf(line, "%31s", word) != 1) continue;
+        trace->lines++;
+
+        int kind = kind_from_name(word);
+        if (kind >= 0 && sscanf(line, "%*s %llu", &a) == 1) {
+            const ChowdrenTable* table = &layout->archive.tables[kind];
+            if (a < table->count && layout->entry_extent[kind][a] != NOT_ACCESSED) {
+                if (trace_push(trace, layout->entry_extent[kind][a]) != 0) break;
+            } else {
+                trace->unresolved++;
+            }
+        } else if (sscanf(line, "%lli %lli", (long long*)&a, (long long*)&b) == 2) {
+            if (trace_range(trace, layout, a, b) != 0) break;
+        } else {
+            fprintf(stderr, "Warning: ignoring trace line %u: %s", trace->lines, line);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+// Reads that do not start where the previous one ended
+static uint32_t count_seeks(const Trace* trace, const Extent* extents, int use_new) {
+    uint64_t position = CHOWDREN_TABLES_SIZE;
+    uint32_t seeks = 0;
+    for (uint32_t i = 0; i < trace->count; i++) {
+        const Extent* e = &extents[trace->extents[i]];
+        uint64_t offset = use_new ? e->new_offset : e->offset;
+        if (offset != position) seeks++;
+        position = offset + e->size;
+    }
+    return seeks;
+}
+
+// ============================================================================
+// Layout
+// ============================================================================
+
+static int write_layout(const char* input, const char* trace_path, const char* output) {
+    Layout layout;
+    if (layout_open(&layout, input) != 0) return 1;
+
+    Trace trace;
+    if (trace_load(&trace, &layout, trace_path) != 0) return 1;
+
+    uint32_t accessed = 0;
+    uint64_t accessed_bytes = 0;
+    for (uint32_t i = 0; i < trace.count; i++) {
+        Extent* e = &layout.extents[trace.extents[i]];
+        if (e->first_access == NOT_ACCESSED) {
+            e->first_access = accessed++;
+            accessed_bytes += e->size;
+        }
+    }
+
+    Extent** order = malloc(layout.extent_count * sizeof(Extent*));
+    if (!order) return 1;
+    for (uint32_t i = 0; i < layout.extent_count; i++) order[i] = &layout.extents[i];
+    qsort(order, layout.extent_count, sizeof(Extent*), compare_first_access);
+
+    ChowdrenTable tables[CHOWDREN_KIND_COUNT];
+    ChowdrenWriter writer;
+    if (chowdren_tables_clone(&layout.archive, tables) != 0 ||
+        chowdren_writer_open(&writer, output) != 0) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < layout.extent_count; i++) {
+        Extent* e = order[i];
+        if (chowdren_writer_append(&writer, layout.archive.data + e->offset, e->size,
+                                   &e->new_offset) != 0) {
+            chowdren_writer_abort(&writer);
+            return 1;
+        }
+    }
+
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        for (uint32_t i = 0; i < tables[k].count; i++) {
+            uint32_t x = layout.entry_extent[k][i];
+            if (x != NOT_ACCESSED) tables[k].entries[i].offset = layout.extents[x].new_offset;
+        }
+    }
+
+    uint64_t final_size = writer.cursor;
+    if (chowdren_writer_finish(&writer, tables) != 0) return 1;
+
+    printf("\n================================================================================\n");
+    printf("LAYOUT COMPLETE\n");
+    printf("================================================================================\n");
+    printf("  Trace lines:           %u (%u reads of stored entries)\n", trace.lines, trace.count);
+    if (trace.unresolved) printf("  Unresolved accesses:   %u\n", trace.unresolved);
+    printf("  Entries in load order: %u of %u (%.2f MB)\n", accessed, layout.extent_count,
+           accessed_bytes / 1024.0 / 1024.0);
+    printf("  Seeks replaying trace: %u -> %u\n", count_seeks(&trace, layout.extents, 0),
+           count_seeks(&trace, layout.extents, 1));
+    printf("  Output archive:        %llu bytes (%.2f MB)\n",
+           (unsigned long long)final_size, final_size / 1024.0 / 1024.0);
+    printf("================================================================================\n\n");
+
+    free(order);
+    free(trace.extents);
+    chowdren_tables_free(tables);
+    layout_close(&layout);
+    return 0;
+}
+
+// ============================================================================
+// Benchmark
+// ============================================================================
+
+// Replay the trace the way the engine reads: the tables, then one read per
+// entry access. `trace` is already resolved to `target`'s extents.
+static double replay(const char* path, const Layout* target, const Trace* trace,
+                     uint8_t* buffer) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1.0;
+    chowdren_drop_file_cache(fd);
+
+    double start = now_seconds();
+    if (pread(fd, buffer, CHOWDREN_TABLES_SIZE, 0) != CHOWDREN_TABLES_SIZE) {
+        close(fd);
+        return -1.0;
+    }
+    for (uint32_t i = 0; i < trace->count; i++) {
+        const Extent* e = &target->extents[trace->extents[i]];
+        if (pread(fd, buffer, e->size, e->offset) != (ssize_t)e->size) {
+            close(fd);
+            return -1.0;
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    close(fd);
+    return elapsed;
+}
+
+// Map every access to the same table entry in `target`, so the replay
+// reads identical payloads from both layouts.
+static int resolve_in(const Layout* source, const Layout* target, const Trace* trace,
+                      Trace* out) {
+    memset(out, 0, sizeof(*out));
+    uint32_t* map = malloc(source->extent_count * sizeof(uint32_t));
+    if (!map) return -1;
+    for (uint32_t i = 0; i < source->extent_count; i++) map[i] = NOT_ACCESSED;
+
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        uint32_t count = source->archive.tables[k].count;
+        if (target->archive.tables[k].count < count) count = target->archive.tables[k].count;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t s = source->entry_extent[k][i];
+            if (s != NOT_ACCESSED && map[s] == NOT_ACCESSED) map[s] = target->entry_extent[k][i];
+        }
+    }
+
+    for (uint32_t i = 0; i < trace->count; i++) {
+        uint32_t t = map[trace->extents[i]];
+        if (t == NOT_ACCESSED) {
+            out->unresolved++;
+            continue;
+        }
+        if (trace_push(out, t) != 0) {
+            free(map);
+            return -1;
+        }
+    }
+    free(map);
+    return 0;
+}
+
+static int run_bench(const char* trace_path, const char* path_a, const char* path_b, int runs) {
+    Layout a, b;
+    if (layout_open(&a, path_a) != 0 || layout_open(&b, path_b) != 0) return 1;
+
+    Trace trace_a, trace_b;
+    if (trace_load(&trace_a, &a, trace_path) != 0 || resolve_in(&a, &b, &trace_a, &trace_b) != 0) {
+        return 1;
+    }
+    if (trace_b.unresolved) {
+        fprintf(stderr, "Warning: %u accesses have no matching entry in %s\n",
+                trace_b.unresolved, path_b);
+    }
+
+    uint32_t largest = CHOWDREN_TABLES_SIZE;
+    for (uint32_t i = 0; i < a.extent_count; i++) {
+        if (a.extents[i].size > largest) largest = a.extents[i].size;
+    }
+    for (uint32_t i = 0; i < b.extent_count; i++) {
+        if (b.extents[i].size > largest) largest = b.extents[i].size;
+    }
+    uint8_t* buffer = malloc(largest);
+    if (!buffer) return 1;
+
+    printf("\n================================================================================\n");
+    printf("LAYOUT BENCHMARK (%d runs, page cache dropped before each)\n", runs);
+    printf("================================================================================\n");
+    if (geteuid() != 0) {
+        printf("Not root: using POSIX_FADV_DONTNEED instead of drop_caches.\n");
+    }
+
+    // Alternate the two files so drift (thermal, background I/O) hits both
+    double best[2] = { 0, 0 }, sum[2] = { 0, 0 };
+    for (int r = 0; r < runs; r++) {
+        for (int side = 0; side < 2; side++) {
+            double t = side == 0 ? replay(path_a, &a, &trace_a, buffer)
+                                 : replay(path_b, &b, &trace_b, buffer);
+            if (t < 0) {
+                fprintf(stderr, "Error: replay of %s failed\n", side == 0 ? path_a : path_b);
+                return 1;
+            }
+            sum[side] += t;
+            if (r == 0 || t < best[side]) best[side] = t;
+        }
+    }
+
+    // Seeks measured against the offsets actually stored in each file
+    for (uint32_t i = 0; i < a.extent_count; i++) a.extents[i].new_offset = a.extents[i].offset;
+    for (uint32_t i = 0; i < b.extent_count; i++) b.extents[i].new_offset = b.extents[i].offset;
+
+    printf("  %-40s best %8.1f ms  avg %8.1f ms  seeks %u\n", path_a, best[0] * 1000.0,
+           sum[0] / runs * 1000.0, count_seeks(&trace_a, a.extents, 0));
+    printf("  %-40s best %8.1f ms  avg %8.1f ms  seeks %u\n", path_b, best[1] * 1000.0,
+           sum[1] / runs * 1000.0, count_seeks(&trace_b, b.extents, 0));
+    if (best[0] > 0) {
+        printf("\n  Speedup (best): %.2fx\n", best[0] / (best[1] > 0 ? best[1] : 1e-9));
+    }
+    printf("================================================================================\n\n");
+
+    free(buffer);
+    free(trace_a.extents);
+    free(trace_b.extents);
+    layout_close(&a);
+    layout_close(&b);
+    return 0;
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+static void usage(void) {
+    printf("Usage:\n");
+    printf("  layout_assets <input_Assets.dat> <trace.txt> <output_Assets.dat>\n");
+    printf("  layout_assets --bench <trace.txt> <original_Assets.dat> <laid_out_Assets.dat> [--runs N]\n");
+    printf("\nTrace lines are \"<offset> <length>\" or \"image|sound|font|shader <index>\".\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 5 && strcmp(argv[1], "--bench") == 0) {
+        int runs = 3;
+        for (int i = 5; i < argc; i++) {
+            if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+                runs = atoi(argv[++i]);
+            } else {
+                usage();
+                return 1;
+            }
+        }
+        if (runs < 1) runs = 1;
+        return run_bench(argv[2], argv[3], argv[4], runs);
+    }
+
+    if (argc != 4) {
+        usage();
+        return 1;
+    }
+    return write_layout(argv[1], argv[2], argv[3]);
+}
@@ -0,0 +1,346 @@
+/*
+ * mem_timeline.c - Memory time line from an allocation trace
+ *
+ * With PEPPER_MEM_SAMPLE and PEPPER_ALLOC_TRACE both set, libpepperopt2
+ * writes its RSS/PSS samples (patches/pepper_memsample.c) into the trace
+ * next to every glTexImage2D call and, unless PEPPER_ALLOC_TRACE_CALLS=0,
+ * every allocation. This tool puts them on one time line, in steps of
+ * --step ms:
+ *   - RSS, PSS, anonymous RSS and swap at the end of the step;
+ *   - the game's live heap bytes (when calls were recorded);
+ *   - the textures uploaded during the step, and their bytes.
+ * It then lists the steps where RSS grew most, with what was uploaded and
+ * allocated in them, and with --limit, the step where RSS first went over
+ * the limit. That is the load phase to look at.
+ *
+ * Build:
+ *   gcc -O2 -o mem_timeline mem_timeline.c
+ *
+ * Usage:
+ *   ./mem_timeline [--step MS] [--limit MB] [--top N] alloc.trace
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// ============================================================================
+// Trace file
+// ============================================================================
+
+#define TRACE_MAGIC "PEPALC\0\1"
+
+enum { OP_MALLOC, OP_CALLOC, OP_REALLOC, OP_FREE, OP_TEXTURE, OP_MEMORY };
+
+// Same layout as patches/pepper_alloctrace.c
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t start_ns;
+} TraceHeader;
+
+typedef struct {
+    uint64_t time_ns;
+    uint64_t ptr;
+    uint64_t old_ptr;
+    uint32_t size;
+    uint32_t site;
+    uint32_t before_ns;
+    uint16_t thread;
+    uint8_t op;
+    uint8_t reserved;
+} TraceRecord;
+
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static int compare_time(const void* a, const void* b) {
+    const TraceRecord* x = *(const TraceRecord* const*)a;
+    const TraceRecord* y = *(const TraceRecord* const*)b;
+    return x->time_ns < y->time_ns ? -1 : x->time_ns > y->time_ns;
+}
+
+// ============================================================================
+// Live blocks - address -> requested size
+// ============================================================================
+
+typedef struct {
+    uint64_t* keys;
+    uint32_t* sizes;
+    size_t mask;
+    size_t count;
+} SizeMap;
+
+static void map_grow(SizeMap* m);
+
+static void map_put(SizeMap* m, uint64_t ptr, uint32_t size) {
+    if ((m->count + 1) * 2 > m->mask) map_grow(m);
+    size_t i = mix64(ptr) & m->mask;
+    while (m->keys[i] && m->keys[i] != ptr) i = (i + 1) & m->mask;
+    if (!m->keys[i]) m->count++;
+    m->keys[i] = ptr;
+    m->sizes[i] = size;
+}
+
+static void map_grow(SizeMap* m) {
+    SizeMap old = *m;
+    size_t slots = old.mask ? (old.mask + 1) * 2 : 1 << 16;
+    m->keys = calloc(slots, sizeof(uint64_t));
+    m->sizes = calloc(slots, sizeof(uint32_t));
+    if (!m->keys || !m->sizes) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    m->mask = slots - 1;
+    m->count = 0;
+    for (size_t i = 0; old.mask && i <= old.mask; i++) {
+        if (old.keys[i]) map_put(m, old.keys[i], old.sizes[i]);
+    }
+    free(old.keys);
+    free(old.sizes);
+}
+
+// Removes `ptr` and returns its size (0 if it was not live)
+static uint32_t map_take(SizeMap* m, uint64_t ptr) {
+    if (!m->keys) return 0;
+    size_t i = mix64(ptr) & m->mask;
+    while (m->keys[i] != ptr) {
+        if (!m->keys[i]) return 0;
+        i = (i + 1) & m->mask;
+    }
+    uint32_t size = m->sizes[i];
+    // Pull later entries of the cluster back so lookups never stop early
+    size_t hole = i;
+    for (size_t j = (i + 1) & m->mask; m->keys[j]; j = (j + 1) & m->mask) {
+        size_t home = mix64(m->keys[j]) & m->mask;
+        if (((j - home) & m->mask) >= ((j - hole) & m->mask)) {
+            m->keys[hole] = m->keys[j];
+            m->sizes[hole] = m->sizes[j];
+            hole = j;
+        }
+    }
+    m->keys[hole] = 0;
+    m->count--;
+    return size;
+}
+
+// ============================================================================
+// Steps
+// ============================================================================
+
+typedef struct {
+    uint64_t start_ns;
+    int touched;              // any record fell in this step
+    int sampled;              // a memory sample fell in this step
+    uint64_t rss, pss, anon, swap;
+    int64_t heap;             // live heap bytes at the end of the step
+    size_t textures;
+    uint64_t texture_bytes;
+    uint64_t allocated;       // bytes allocated during the step
+    int64_t rss_growth;       // against the previous sampled step
+} Step;
+
+static double mb(double bytes) {
+    return bytes / 1048576.0;
+}
+
+static int compare_growth(const void* a, const void* b) {
+    const Step* x = *(const Step* const*)a;
+    const Step* y = *(const Step* const*)b;
+    return x->rss_growth > y->rss_growth ? -1 : x->rss_growth < y->rss_growth;
+}
+
+static void print_step(const Step* s, int with_heap) {
+    printf("%8.2f %8.1f %8.1f %8.1f %7.1f", s->start_ns / 1e9, mb(s->rss), mb(s->pss),
+           mb(s->anon), mb(s->swap));
+    if (with_heap) printf(" %8.1f %8.1f", mb(s->heap), mb(s->allocated));
+    printf(" %6zu %8.1f\n", s->textures, mb(s->texture_bytes));
+}
+
+static void print_header(int with_heap) {
+    printf("%8s %8s %8s %8s %7s", "time s", "RSS MB", "PSS MB", "anon MB", "swap MB");
+    if (with_heap) printf(" %8s %8s", "heap MB", "alloc MB");
+    printf(" %6s %8s\n", "tex", "tex MB");
+}
+
+int main(int argc, char** argv) {
+    double step_ms = 500;
+    double limit_mb = 0;
+    int top = 10;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--step") == 0 && i + 1 < argc) {
+            step_ms = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            limit_mb = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (!path || step_ms <= 0) {
+        fprintf(stderr, "Usage: %s [--step MS] [--limit MB] [--top N] alloc.trace\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    const TraceHeader* header = NULL;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TraceHeader)) {
+        header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (header == MAP_FAILED) header = NULL;
+    }
+    if (fd >= 0) close(fd);
+    if (!header || memcmp(header->magic, TRACE_MAGIC, 8) != 0 ||
+        header->record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "Error: %s is not an allocation trace\n", path);
+        return 1;
+    }
+    const TraceRecord* records = (const TraceRecord*)(header + 1);
+    size_t count = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+
+    // Threads flush their buffers separately, so put the records in time order
+    const TraceRecord** order = malloc((count ? count : 1) * sizeof(*order));
+    if (!order) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) order[i] = &records[i];
+    qsort(order, count, sizeof(*order), compare_time);
+
+    uint64_t step_ns = (uint64_t)(step_ms * 1e6);
+    size_t step_count = count ? order[count - 1]->time_ns / step_ns + 1 : 0;
+    Step* steps = calloc(step_count ? step_count : 1, sizeof(Step));
+    if (!steps) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    SizeMap live = { 0 };
+    int64_t heap = 0;
+    size_t samples = 0, calls = 0, textures = 0;
+    for (size_t i = 0; i < count; i++) {
+        const TraceRecord* r = order[i];
+        Step* s = &steps[r->time_ns / step_ns];
+        switch (r->op) {
+        case OP_MEMORY:
+            s->sampled = 1;
+            s->rss = r->ptr;
+            s->pss = r->old_ptr;
+            s->swap = (uint64_t)r->size << 10;
+            s->anon = (uint64_t)r->before_ns << 10;
+            samples++;
+            break;
+        case OP_TEXTURE:
+            s->textures++;
+            s->texture_bytes += r->size;
+            textures++;
+            break;
+        case OP_FREE:
+            heap -= map_take(&live, r->ptr);
+            calls++;
+            break;
+        case OP_REALLOC:
+            if (r->old_ptr) heap -= map_take(&live, r->old_ptr);
+            // fall through
+        case OP_MALLOC:
+        case OP_CALLOC:
+            if (r->ptr) {
+                heap -= map_take(&live, r->ptr);
+                map_put(&live, r->ptr, r->size);
+                heap += r->size;
+                s->allocated += r->size;
+            }
+            calls++;
+            break;
+        }
+        s->heap = heap;
+        s->touched = 1;
+    }
+
+    // Carry the last values into steps with nothing in them
+    const Step* prev = NULL;
+    int64_t last_heap = 0;
+    for (size_t i = 0; i < step_count; i++) {
+        Step* s = &steps[i];
+        s->start_ns = i * step_ns;
+        if (!s->sampled && prev) {
+            s->rss = prev->rss;
+            s->pss = prev->pss;
+            s->anon = prev->anon;
+            s->swap = prev->swap;
+        }
+        if (s->sampled) {
+            s->rss_growth = prev ? (int64_t)s->rss - (int64_t)prev->rss : 0;
+            prev = s;
+        }
+        if (!s->touched) s->heap = last_heap;
+        last_heap = s->heap;
+    }
+
+    printf("%s: %zu memory samples, %zu texture uploads, %zu allocation calls\n\n",
+           path, samples, textures, calls);
+    if (!samples) {
+        printf("No memory samples: record with PEPPER_MEM_SAMPLE=<ms> as well.\n");
+    }
+    int with_heap = calls > 0;
+    print_header(with_heap);
+    for (size_t i = 0; i < step_count; i++) {
+        const Step* s = &steps[i];
+        if (s->sampled || s->textures) print_step(s, with_heap);
+    }
+
+    if (limit_mb > 0) {
+        uint64_t limit = (uint64_t)(limit_mb * 1048576.0);
+        size_t i;
+        for (i = 0; i < step_count && !(steps[i].sampled && steps[i].rss >= limit); i++) {
+        }
+        printf("\n");
+        if (i == step_count) {
+            printf("RSS stayed under %g MB\n", limit_mb);
+        } else {
+            printf("RSS went over %g MB at %.2f s:\n", limit_mb, steps[i].start_ns / 1e9);
+            print_header(with_heap);
+            for (size_t j = i >= 4 ? i - 4 : 0; j <= i; j++) print_step(&steps[j], with_heap);
+        }
+    }
+
+    const Step** grown = malloc((step_count ? step_count : 1) * sizeof(*grown));
+    size_t grown_count = 0;
+    for (size_t i = 0; grown && i < step_count; i++) {
+        if (steps[i].rss_growth > 0) grown[grown_count++] = &steps[i];
+    }
+    if (grown_count) {
+        qsort(grown, grown_count, sizeof(*grown), compare_growth);
+        printf("\nSteps where RSS grew most:\n");
+        printf("%11s  ", "growth");
+        print_header(with_heap);
+        for (size_t i = 0; i < grown_count && (int)i < top; i++) {
+            printf("%+8.1f MB  ", mb(grown[i]->rss_growth));
+            print_step(grown[i], with_heap);
+        }
+    }
+
+    free(grown);
+    free(steps);
+    free(order);
+    munmap((void*)header, st.st_size);
+    return 0;
+}
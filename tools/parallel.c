@@ -0,0 +1,226 @@
+/*
+ * parallel.c - Minimal fan-out helper for the native asset tools
+ */
+
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    atomic_size_t next;
+    size_t count;
+    ParallelFn fn;
+    void* ctx;
+} ParallelJob;
+
+typedef struct {
+    ParallelJob* job;
+    int worker;
+} ParallelWorker;
+
+int parallel_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static void* parallel_worker_main(void* arg) {
+    ParallelWorker* w = arg;
+    ParallelJob* job = w->job;
+
+    for (;;) {
+        size_t i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+        if (i >= job->count) break;
+        job->fn(job->ctx, i, w->worker);
+    }
+    return NULL;
+}
+
+void parallel_for(size_t count, int threads, ParallelFn fn, void* ctx) {
+    if (threads <= 0) threads = parallel_cpu_count();
+    if ((size_t)threads > count) threads = count > 0 ? (int)count : 1;
+
+    ParallelJob job = { .count = count, .fn = fn, .ctx = ctx };
+    atomic_init(&job.next, 0);
+
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    ParallelWorker* workers = calloc(threads, sizeof(ParallelWorker));
+    int started = 0;
+
+    // Worker 0 runs on the calling thread
+    if (tids && workers) {
+        for (int t = 1; t < threads; t++) {
+            workers[t].job = &job;
+            workers[t].worker = t;
+            if (pthread_create(&tids[t], NULL, parallel_worker_main, &workers[t]) != 0) break;
+            started = t;
+        }
+    }
+
+    ParallelWorker self = { &job, 0 };
+    parallel_worker_main(&self);
+
+    for (int t = 1; t <= started; t++) pthread_join(tids[t], NULL);
+    free(tids);
+    free(workers);
+}
+
+// ============================================================================
+// Work stealing
+// ============================================================================
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+} StealRange;
+
+typedef struct {
+    atomic_size_t cursor;
+    size_t count;
+    size_t chunk;
+    int threads;
+    StealRange* ranges;
+    ParallelFn fn;
+    void* ctx;
+    atomic_size_t chunks_claimed;
+    atomic_size_t steals;
+} StealJob;
+
+typedef struct {
+    StealJob* job;
+    int worker;
+} StealWorker;
+
+// Pop the next index from the front of our own range.
+static int steal_pop_own(StealRange* r, size_t* index) {
+    int ok = 0;
+    pthread_mutex_lock(&r->lock);
+    if (r->begin < r->end) {
+        *index = r->begin++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return ok;
+}
+
+// Take the back half of the victim with the most work left.
+static int steal_from_others(StealJob* job, int self) {
+    int victim = -1;
+    size_t best = 0;
+    for (int t = 0; t < job->threads; t++) {
+        if (t == self) continue;
+        StealRange* r = &job->ranges[t];
+        pthread_mutex_lock(&r->lock);
+        size_t left = r->end - r->begin;
+        pthread_mutex_unlock(&r->lock);
+        if (left > best) {
+            best = left;
+            victim = t;
+        }
+    }
+    if (victim < 0) return 0;
+
+    StealRange* v = &job->ranges[victim];
+    size_t begin = 0, end = 0;
+    pthread_mutex_lock(&v->lock);
+    size_t left = v->end - v->begin;
+    if (left > 0) {
+        size_t take = (left + 1) / 2;
+        end = v->end;
+        begin = v->end - take;
+        v->end = begin;
+    }
+    pthread_mutex_unlock(&v->lock);
+    if (begin == end) return 0;
+
+    StealRange* own = &job->ranges[self];
+    pthread_mutex_lock(&own->lock);
+    own->begin = begin;
+    own->end = end;
+    pthread_mutex_unlock(&own->lock);
+    atomic_fetch_add_explicit(&job->steals, 1, memory_order_relaxed);
+    return 1;
+}
+
+static int steal_refill(StealJob* job, int self) {
+    size_t start = atomic_fetch_add_explicit(&job->cursor, job->chunk, memory_order_relaxed);
+    if (start < job->count) {
+        size_t end = start + job->chunk < job->count ? start + job->chunk : job->count;
+        StealRange* own = &job->ranges[self];
+        pthread_mutex_lock(&own->lock);
+        own->begin = start;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        atomic_fetch_add_explicit(&job->chunks_claimed, 1, memory_order_relaxed);
+        return 1;
+    }
+    return steal_from_others(job, self);
+}
+
+static void* steal_worker_main(void* arg) {
+    StealWorker* w = arg;
+    StealJob* job = w->job;
+    StealRange* own = &job->ranges[w->worker];
+
+    for (;;) {
+        size_t index;
+        if (steal_pop_own(own, &index)) {
+            job->fn(job->ctx, index, w->worker);
+        } else if (!steal_refill(job, w->worker)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+void parallel_for_stealing(size_t count, int threads, size_t chunk,
+                           ParallelFn fn, void* ctx, ParallelStealStats* stats) {
+    if (threads <= 0) threads = parallel_cpu_count();
+    if ((size_t)threads > count) threads = count > 0 ? (int)count : 1;
+    if (chunk == 0) chunk = 16;
+
+    StealJob job = { .count = count, .chunk = chunk, .threads = threads, .fn = fn, .ctx = ctx };
+    atomic_init(&job.cursor, 0);
+    atomic_init(&job.chunks_claimed, 0);
+    atomic_init(&job.steals, 0);
+
+    job.ranges = calloc(threads, sizeof(StealRange));
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    StealWorker* workers = calloc(threads, sizeof(StealWorker));
+    if (!job.ranges || !tids || !workers) {
+        // Degrade to running everything on the calling thread
+        for (size_t i = 0; i < count; i++) fn(ctx, i, 0);
+        free(job.ranges);
+        free(tids);
+        free(workers);
+        return;
+    }
+
+    for (int t = 0; t < threads; t++) pthread_mutex_init(&job.ranges[t].lock, NULL);
+
+    int started = 0;
+    for (int t = 1; t < threads; t++) {
+        workers[t].job = &job;
+        workers[t].worker = t;
+        if (pthread_create(&tids[t], NULL, steal_worker_main, &workers[t]) != 0) break;
+        started = t;
+    }
+
+    StealWorker self = { &job, 0 };
+    steal_worker_main(&self);
+
+    for (int t = 1; t <= started; t++) pthread_join(tids[t], NULL);
+    for (int t = 0; t < threads; t++) pthread_mutex_destroy(&job.ranges[t].lock);
+
+    if (stats) {
+        stats->chunks_claimed = atomic_load(&job.chunks_claimed);
+        stats->steals = atomic_load(&job.steals);
+    }
+
+    free(job.ranges);
+    free(tids);
+    free(workers);
+}
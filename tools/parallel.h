@@ -0,0 +1,37 @@
+/*
+ * parallel.h - Minimal fan-out helper for the native asset tools
+ *
+ * parallel_for() hands out one index at a time from a shared atomic
+ * counter, so a few huge images do not leave the other cores idle.
+ *
+ * parallel_for_stealing() is for pipelines that want results roughly in
+ * index order: workers claim small chunks from a shared cursor into their
+ * own range, and once the cursor runs out, idle workers steal the back
+ * half of the busiest worker's remaining range.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+typedef void (*ParallelFn)(void* ctx, size_t index, int worker);
+
+// Number of online CPUs (at least 1).
+int parallel_cpu_count(void);
+
+// Run fn(ctx, i, worker) for every i in [0, count) on `threads` workers
+// (0 = one per CPU). Returns once every item has completed.
+void parallel_for(size_t count, int threads, ParallelFn fn, void* ctx);
+
+typedef struct {
+    size_t chunks_claimed;
+    size_t steals;
+} ParallelStealStats;
+
+// Work-stealing variant. `chunk` is the number of indices a worker claims
+// from the shared cursor at a time (0 = 16). `stats` may be NULL.
+void parallel_for_stealing(size_t count, int threads, size_t chunk,
+                           ParallelFn fn, void* ctx, ParallelStealStats* stats);
+
+#endif
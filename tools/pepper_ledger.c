@@ -0,0 +1,482 @@
+/*
+ * pepper_ledger.c - Memory ledger for the whole launch stack
+ *
+ * weston.sh starts seatd, Weston, Xwayland, gptokeyb and the game under
+ * box64. The post-mortem's `free -m` only says that memory ran out, not
+ * who had it. This monitor samples every process under a root PID (the
+ * launch script) and prints one line per sample:
+ *   - MemAvailable, and PSS for the whole tree;
+ *   - PSS per process name: shared pages are split between the processes
+ *     mapping them, so the numbers add up to what the tree costs;
+ *   - for box64 processes, the same PSS split by what the pages are:
+ *       heap     anonymous memory: the game's heap and box64's own data
+ *                (box64 hands the game's malloc to the native one, so
+ *                they cannot be told apart)
+ *       dynarec  anonymous executable memory: translated x86 code
+ *       guest    the game's x86_64 binary and libraries
+ *       box64    the box64 executable
+ *       native   native libraries (gl4es, SDL, libc, ...)
+ *       files    other mapped files (Assets.dat with PEPPER_ASSET_MMAP)
+ *       gpu      /dev mappings (GPU buffers)
+ *   - swap, as PSS of swapped-out pages.
+ * Lines go to --out (default stdout). On SIGTERM/SIGINT, or when the root
+ * process exits, a summary goes to stderr: peak PSS, USS and swap per
+ * process name, what the rest of the stack held when the game started and
+ * at the peak, and the ledger's own CPU time.
+ *
+ * Reading other processes' smaps needs the same user or root, so run it
+ * with $ESUDO like the rest of the stack. The ledger itself, and the sudo
+ * that started it, are left out.
+ *
+ * Build:
+ *   gcc -O2 -o pepper_ledger pepper_ledger.c
+ *
+ * Usage:
+ *   ./pepper_ledger [--root PID] [--also NAME]... [--interval MS] [--out FILE]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// ============================================================================
+// Processes
+// ============================================================================
+
+#define MAX_PROCS 32768
+#define MAX_GROUPS 64
+#define MAX_ALSO 16
+
+enum { CAT_HEAP, CAT_DYNAREC, CAT_GUEST, CAT_BOX64, CAT_NATIVE, CAT_FILES, CAT_GPU, CAT_COUNT };
+static const char* g_cat_names[CAT_COUNT] = {
+    "heap", "dynarec", "guest", "box64", "native", "files", "gpu"
+};
+
+// Totals for one process name, in KB
+typedef struct {
+    char name[32];
+    int box64;
+    int processes;
+    uint64_t pss, uss, swap;
+    uint64_t cat[CAT_COUNT];  // box64 only
+    uint64_t peak_pss, peak_uss, peak_swap;
+    int seen;                 // in the current sample
+} Group;
+
+static Group g_groups[MAX_GROUPS];
+static int g_group_count = 0;
+
+// Parent of each PID, indexed by PID up to the kernel's pid_max
+static int* g_ppid = NULL;
+static int g_pid_max = 0;
+static const char* g_also[MAX_ALSO];
+static int g_also_count = 0;
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+static double mb(uint64_t kb) {
+    return kb / 1024.0;
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// "pid (comm) state ppid ..."; comm may hold spaces and parentheses
+static int read_stat(int pid, char* comm, size_t comm_size, int* ppid) {
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    char* open = strchr(buf, '(');
+    char* close = strrchr(buf, ')');
+    if (!open || !close || close < open) return 0;
+    size_t len = (size_t)(close - open - 1);
+    if (len >= comm_size) len = comm_size - 1;
+    memcpy(comm, open + 1, len);
+    comm[len] = '\0';
+    char state;
+    return sscanf(close + 1, " %c %d", &state, ppid) == 2;
+}
+
+static int is_box64(int pid) {
+    char path[64], exe[512];
+    snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+    ssize_t n = readlink(path, exe, sizeof(exe) - 1);
+    if (n <= 0) return 0;
+    exe[n] = '\0';
+    const char* base = strrchr(exe, '/');
+    return strncmp(base ? base + 1 : exe, "box64", 5) == 0;
+}
+
+static int read_pid_max(void) {
+    int pid_max = 0;
+    FILE* f = fopen("/proc/sys/kernel/pid_max", "r");
+    if (f) {
+        if (fscanf(f, "%d", &pid_max) != 1) pid_max = 0;
+        fclose(f);
+    }
+    return pid_max > 0 ? pid_max : 4194304;   // PID_MAX_LIMIT on 64-bit
+}
+
+static int in_tree(int pid, int root) {
+    for (int depth = 0; pid > 1 && depth < 64; depth++) {
+        if (pid == root) return 1;
+        pid = pid < g_pid_max ? g_ppid[pid] : 0;
+    }
+    return pid == root;
+}
+
+static Group* group_for(const char* name, int box64) {
+    for (int i = 0; i < g_group_count; i++) {
+        if (g_groups[i].box64 == box64 && strcmp(g_groups[i].name, name) == 0) return &g_groups[i];
+    }
+    if (g_group_count == MAX_GROUPS) return NULL;
+    Group* g = &g_groups[g_group_count++];
+    memset(g, 0, sizeof(*g));
+    size_t len = strnlen(name, sizeof(g->name) - 1);
+    memcpy(g->name, name, len);
+    g->name[len] = '\0';
+    g->box64 = box64;
+    return g;
+}
+
+// ============================================================================
+// Memory per process
+// ============================================================================
+
+// Files already classified: x86_64 ELF (the guest) or not
+#define PATH_SLOTS 1024
+static struct { char* path; int guest; } g_paths[PATH_SLOTS];
+
+static int is_guest_file(const char* path) {
+    uint64_t h = 1469598103934665603ull;
+    for (const char* p = path; *p; p++) h = (h ^ (uint8_t)*p) * 1099511628211ull;
+    size_t slot = h & (PATH_SLOTS - 1);
+    for (int probe = 0; probe < PATH_SLOTS; probe++) {
+        if (!g_paths[slot].path) break;
+        if (strcmp(g_paths[slot].path, path) == 0) return g_paths[slot].guest;
+        slot = (slot + 1) & (PATH_SLOTS - 1);
+    }
+
+    int guest = 0;
+    Elf64_Ehdr header;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+            memcmp(header.e_ident, ELFMAG, SELFMAG) == 0) {
+            guest = header.e_machine == EM_X86_64 ? 1 : 2;    // 2 = native ELF
+        }
+        close(fd);
+    }
+    if (!g_paths[slot].path) {
+        g_paths[slot].path = strdup(path);
+        g_paths[slot].guest = guest;
+    }
+    return guest;
+}
+
+static int classify(const char* perms, const char* path) {
+    if (!path[0] || path[0] == '[') {
+        if (strcmp(path, "[vdso]") == 0 || strcmp(path, "[vvar]") == 0) return CAT_NATIVE;
+        return strchr(perms, 'x') ? CAT_DYNAREC : CAT_HEAP;
+    }
+    if (strncmp(path, "/dev/", 5) == 0) return CAT_GPU;
+    const char* base = strrchr(path, '/');
+    if (strncmp(base ? base + 1 : path, "box64", 5) == 0) return CAT_BOX64;
+    if (strncmp(path, "/memfd:", 7) == 0 || strstr(path, "(deleted)")) return CAT_HEAP;
+    switch (is_guest_file(path)) {
+    case 1: return CAT_GUEST;
+    case 2: return CAT_NATIVE;
+    default: return CAT_FILES;
+    }
+}
+
+typedef struct {
+    uint64_t pss, uss, swap;
+    uint64_t cat[CAT_COUNT];
+} ProcMemory;
+
+// smaps_rollup for most processes; full smaps, split by mapping, for box64
+static int read_memory(int pid, int split, ProcMemory* m) {
+    char path[64], line[1024];
+    memset(m, 0, sizeof(*m));
+    snprintf(path, sizeof(path), split ? "/proc/%d/smaps" : "/proc/%d/smaps_rollup", pid);
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+    int cat = CAT_HEAP;
+    int any = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long kb;
+        if (!isupper((unsigned char)line[0])) {
+            // Mapping header: address perms offset dev inode [path]
+            char perms[8] = "", name[512] = "";
+            sscanf(line, "%*s %7s %*s %*s %*s %511[^\n]", perms, name);
+            cat = classify(perms, name);
+        } else if (sscanf(line, "Pss: %llu kB", &kb) == 1) {
+            m->pss += kb;
+            m->cat[cat] += kb;
+            any = 1;
+        } else if (sscanf(line, "Private_Clean: %llu kB", &kb) == 1 ||
+                   sscanf(line, "Private_Dirty: %llu kB", &kb) == 1) {
+            m->uss += kb;
+        } else if (sscanf(line, "SwapPss: %llu kB", &kb) == 1) {
+            m->swap += kb;
+        }
+    }
+    fclose(f);
+    return any;
+}
+
+static void meminfo(uint64_t* total, uint64_t* available) {
+    char line[256];
+    unsigned long long kb;
+    *total = *available = 0;
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemTotal: %llu kB", &kb) == 1) *total = kb;
+        else if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) *available = kb;
+    }
+    fclose(f);
+}
+
+// ============================================================================
+// Sampling
+// ============================================================================
+
+typedef struct {
+    uint64_t time_ms;
+    uint64_t pss;             // whole tree
+    uint64_t game_pss;        // box64 processes
+    uint64_t available;
+} Totals;
+
+// One pass over /proc. Returns 0 once the root process is gone.
+static int sample(int root, Totals* t) {
+    // Not the ledger, nor the sudo that started it
+    int self = getpid(), parent = getppid() != root ? getppid() : -1;
+    DIR* dir = opendir("/proc");
+    if (!dir) return 0;
+    static int pids[MAX_PROCS];
+    static char comms[MAX_PROCS][32];
+    int count = 0;
+    struct dirent* e;
+    while ((e = readdir(dir))) {
+        int pid = atoi(e->d_name);
+        if (pid <= 0 || pid >= g_pid_max || count == MAX_PROCS) continue;
+        int ppid;
+        if (!read_stat(pid, comms[count], sizeof(comms[count]), &ppid)) continue;
+        g_ppid[pid] = ppid;
+        pids[count++] = pid;
+    }
+    closedir(dir);
+    if (kill(root, 0) != 0 && errno == ESRCH) return 0;
+
+    for (int i = 0; i < g_group_count; i++) {
+        Group* g = &g_groups[i];
+        g->processes = 0;
+        g->pss = g->uss = g->swap = 0;
+        memset(g->cat, 0, sizeof(g->cat));
+        g->seen = 0;
+    }
+    memset(t, 0, sizeof(*t));
+    for (int i = 0; i < count; i++) {
+        int pid = pids[i];
+        if (pid == self || pid == parent) continue;
+        int wanted = in_tree(pid, root);
+        for (int a = 0; !wanted && a < g_also_count; a++) wanted = strcmp(comms[i], g_also[a]) == 0;
+        if (!wanted) continue;
+
+        int box64 = is_box64(pid);
+        ProcMemory m;
+        if (!read_memory(pid, box64, &m)) continue;   // kernel thread or gone
+        Group* g = group_for(comms[i], box64);
+        if (!g) continue;
+        g->processes++;
+        g->seen = 1;
+        g->pss += m.pss;
+        g->uss += m.uss;
+        g->swap += m.swap;
+        for (int c = 0; c < CAT_COUNT; c++) g->cat[c] += m.cat[c];
+        t->pss += m.pss;
+        if (box64) t->game_pss += m.pss;
+    }
+    for (int i = 0; i < g_group_count; i++) {
+        Group* g = &g_groups[i];
+        if (g->pss > g->peak_pss) g->peak_pss = g->pss;
+        if (g->uss > g->peak_uss) g->peak_uss = g->uss;
+        if (g->swap > g->peak_swap) g->peak_swap = g->swap;
+    }
+    uint64_t total;
+    meminfo(&total, &t->available);
+    return 1;
+}
+
+// ============================================================================
+// Output
+// ============================================================================
+
+static void print_line(FILE* out, const Totals* t) {
+    fprintf(out, "%8.1f s  avail %6.1f  pss %6.1f |", t->time_ms / 1000.0, mb(t->available),
+            mb(t->pss));
+    uint64_t swap = 0;
+    for (int i = 0; i < g_group_count; i++) {
+        const Group* g = &g_groups[i];
+        if (!g->seen) continue;
+        swap += g->swap;
+        if (g->processes > 1) {
+            fprintf(out, " %s(%d) %.1f", g->name, g->processes, mb(g->pss));
+        } else {
+            fprintf(out, " %s %.1f", g->name, mb(g->pss));
+        }
+        if (!g->box64) continue;
+        fprintf(out, " [");
+        for (int c = 0; c < CAT_COUNT; c++) {
+            fprintf(out, "%s%s %.1f", c ? " " : "", g_cat_names[c], mb(g->cat[c]));
+        }
+        fprintf(out, "]");
+    }
+    fprintf(out, " | swap %.1f\n", mb(swap));
+    fflush(out);
+}
+
+// The rest of the stack (everything but box64) in a saved sample
+static void print_stack(const char* label, const Group* groups, int count, const Totals* t) {
+    fprintf(stderr, "%s (%.1f s): %.1f MB PSS for the stack, %.1f MB for the game, "
+            "%.1f MB available\n", label, t->time_ms / 1000.0, mb(t->pss - t->game_pss),
+            mb(t->game_pss), mb(t->available));
+    for (int i = 0; i < count; i++) {
+        const Group* g = &groups[i];
+        if (!g->seen) continue;
+        if (!g->box64) {
+            fprintf(stderr, "  %-20s %8.1f MB\n", g->name, mb(g->pss));
+            continue;
+        }
+        fprintf(stderr, "  %-20s %8.1f MB (box64):", g->name, mb(g->pss));
+        for (int c = 0; c < CAT_COUNT; c++) fprintf(stderr, " %s %.1f", g_cat_names[c], mb(g->cat[c]));
+        fprintf(stderr, "\n");
+    }
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+int main(int argc, char** argv) {
+    int root = getppid();
+    int interval_ms = 1000;
+    const char* out_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--root") == 0 && i + 1 < argc) {
+            root = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--also") == 0 && i + 1 < argc && g_also_count < MAX_ALSO) {
+            g_also[g_also_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--root PID] [--also NAME]... [--interval MS] "
+                    "[--out FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (root <= 0 || interval_ms <= 0) {
+        fprintf(stderr, "Error: bad --root or --interval\n");
+        return 1;
+    }
+    // pid_max can be raised while running, but not past 4M on 64-bit
+    g_pid_max = read_pid_max();
+    g_ppid = calloc(g_pid_max, sizeof(int));
+    if (!g_ppid) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+    FILE* out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error: cannot write %s\n", out_path);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    uint64_t mem_total, available;
+    meminfo(&mem_total, &available);
+    fprintf(out, "# pepper_ledger: tree of PID %d every %d ms, MB of PSS (MemTotal %.1f MB)\n",
+            root, interval_ms, mb(mem_total));
+    fflush(out);
+
+    static Group at_start[MAX_GROUPS], at_peak[MAX_GROUPS];
+    int start_count = 0, peak_count = 0;
+    Totals start = { 0 }, peak = { 0 }, t;
+    uint64_t low_available = UINT64_MAX;
+    size_t samples = 0;
+    uint64_t began = monotonic_ms();
+    while (!g_stop && sample(root, &t)) {
+        t.time_ms = monotonic_ms() - began;
+        samples++;
+        print_line(out, &t);
+        if (t.available < low_available) low_available = t.available;
+        if (t.game_pss && !start.game_pss) {
+            start = t;
+            start_count = g_group_count;
+            memcpy(at_start, g_groups, sizeof(Group) * g_group_count);
+        }
+        if (t.pss > peak.pss) {
+            peak = t;
+            peak_count = g_group_count;
+            memcpy(at_peak, g_groups, sizeof(Group) * g_group_count);
+        }
+        struct timespec delay = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+        nanosleep(&delay, NULL);
+    }
+    if (out != stdout) fclose(out);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_ms = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3 +
+                    usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+    fprintf(stderr, "\n===== MEMORY LEDGER =====\n");
+    fprintf(stderr, "%zu samples over %.1f s (ledger CPU %.0f ms), MemTotal %.1f MB, "
+            "lowest MemAvailable %.1f MB\n", samples, (monotonic_ms() - began) / 1000.0, cpu_ms,
+            mb(mem_total), samples ? mb(low_available) : 0.0);
+    if (!samples) return 0;
+    fprintf(stderr, "%-20s %5s %10s %10s %10s\n", "process", "box64", "peak PSS", "peak USS",
+            "peak swap");
+    for (int i = 0; i < g_group_count; i++) {
+        const Group* g = &g_groups[i];
+        fprintf(stderr, "%-20s %5s %7.1f MB %7.1f MB %7.1f MB\n", g->name, g->box64 ? "yes" : "",
+                mb(g->peak_pss), mb(g->peak_uss), mb(g->peak_swap));
+    }
+    if (start.game_pss) print_stack("When the game started", at_start, start_count, &start);
+    print_stack("At the peak", at_peak, peak_count, &peak);
+    fprintf(stderr, "=========================\n");
+    return 0;
+}
@@ -0,0 +1,491 @@
+/*
+ * pepper_top.c - Live view of libpepperopt2's counters
+ *
+ * With PEPPER_STATS=1, libpepperopt2 keeps every module's counters in
+ * /dev/shm/pepperopt2.<pid> (patches/pepper_stats.c). This tool maps that
+ * file read-only and redraws them every --interval ms: each counter's value
+ * and its rate over the last interval, bytes in MB, plus the GPU memory the
+ * downscaler has saved so far. With PEPPER_LATENCY=1 as well, it also
+ * merges the per-thread hook latency histograms (patches/pepper_latency.c)
+ * into a table: calls per second, the share of each second spent in the
+ * hook, and percentiles since the start. Run it over SSH next to the game;
+ * it takes no locks and the game never waits for it.
+ *
+ * A game killed before its exit handlers ran leaves its file behind. The
+ * tool shows those too, marked as gone, with the values at the moment of
+ * the kill; --clean removes them.
+ *
+ * Build:
+ *   gcc -O2 -o pepper_top pepper_top.c
+ *
+ * Usage:
+ *   ./pepper_top [--interval MS] [--once] [--all] [PID | FILE]
+ *   ./pepper_top --list
+ *   ./pepper_top --clean
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// ============================================================================
+// Segment
+// ============================================================================
+
+#define STATS_DIR "/dev/shm"
+#define STATS_PREFIX "pepperopt2."
+#define STATS_MAGIC "PEPSTAT\1"
+#define LATENCY_MAGIC "PEPLAT\0\1"
+
+enum { STAT_COUNTER, STAT_BYTES, STAT_GAUGE, STAT_GAUGE_BYTES };
+
+// Same layout as patches/pepper_stats.c
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t stat_count;
+    uint64_t pid;
+    uint64_t start_ns;
+    uint64_t values_offset;
+    uint64_t latency_offset;
+    uint64_t reserved[2];
+} StatsHeader;
+
+typedef struct {
+    char name[40];
+    uint32_t kind;
+    uint32_t reserved;
+} StatInfo;
+
+// Same layout as patches/pepper_latency.c. Each slot is 64 bytes of owner
+// and padding, then per probe: count, total ticks, max ticks, buckets.
+typedef struct {
+    char magic[8];
+    uint32_t probe_count;
+    uint32_t bucket_count;
+    uint32_t sub_buckets;
+    uint32_t slot_count;
+    uint64_t ticks_per_sec;
+    uint64_t slots_offset;
+    char timer[16];
+    char names[16][24];
+} LatencyHeader;
+
+#define SLOT_HEADER 64
+#define MAX_BUCKETS 256
+
+typedef struct {
+    void* map;
+    size_t size;
+    const StatsHeader* header;
+    const StatInfo* info;
+    const volatile uint64_t* values;
+    uint32_t count;
+    const LatencyHeader* latency;     // NULL without PEPPER_LATENCY
+} Segment;
+
+static int open_segment(const char* path, Segment* seg) {
+    memset(seg, 0, sizeof(*seg));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StatsHeader)) {
+        close(fd);
+        return 0;
+    }
+    seg->size = (size_t)st.st_size;
+    seg->map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg->map == MAP_FAILED) return 0;
+
+    const StatsHeader* h = seg->map;
+    size_t info_end = sizeof(StatsHeader) + (size_t)h->stat_count * sizeof(StatInfo);
+    if (memcmp(h->magic, STATS_MAGIC, 8) != 0 || h->version != 1 ||
+        info_end > h->values_offset ||
+        h->values_offset + (size_t)h->stat_count * sizeof(uint64_t) > seg->size) {
+        munmap(seg->map, seg->size);
+        return 0;
+    }
+    seg->header = h;
+    seg->info = (const StatInfo*)(h + 1);
+    seg->values = (const volatile uint64_t*)((const char*)seg->map + h->values_offset);
+    seg->count = h->stat_count;
+
+    const LatencyHeader* lh = (const LatencyHeader*)((const char*)seg->map + h->latency_offset);
+    if (h->latency_offset && h->latency_offset + sizeof(LatencyHeader) <= seg->size &&
+        memcmp(lh->magic, LATENCY_MAGIC, 8) == 0 && lh->probe_count <= 16 &&
+        lh->bucket_count <= MAX_BUCKETS &&
+        lh->sub_buckets >= 2 && (lh->sub_buckets & (lh->sub_buckets - 1)) == 0 &&
+        h->latency_offset + lh->slots_offset + (size_t)lh->slot_count *
+            (SLOT_HEADER + (size_t)lh->probe_count * (3 + lh->bucket_count) * 8) <= seg->size) {
+        seg->latency = lh;
+    }
+    return 1;
+}
+
+static void close_segment(Segment* seg) {
+    if (seg->map) munmap(seg->map, seg->size);
+    memset(seg, 0, sizeof(*seg));
+}
+
+// A killed game stays a zombie until its parent reaps it
+static int process_alive(uint64_t pid) {
+    if (kill((pid_t)pid, 0) != 0 && errno != EPERM) return 0;
+    char path[64], buf[256];
+    snprintf(path, sizeof(path), "/proc/%lu/stat", (unsigned long)pid);
+    FILE* f = fopen(path, "r");
+    if (!f) return 1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    const char* paren = strrchr(buf, ')');
+    return !(paren && paren[1] == ' ' && paren[2] == 'Z');
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Calls fn for every segment in /dev/shm; stops when it returns nonzero
+static void each_segment(int (*fn)(const char* path, const Segment* seg, void* arg), void* arg) {
+    DIR* dir = opendir(STATS_DIR);
+    if (!dir) return;
+    struct dirent* d;
+    while ((d = readdir(dir)) != NULL) {
+        if (strncmp(d->d_name, STATS_PREFIX, strlen(STATS_PREFIX)) != 0) continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", STATS_DIR, d->d_name);
+        Segment seg;
+        if (!open_segment(path, &seg)) continue;
+        int stop = fn(path, &seg, arg);
+        close_segment(&seg);
+        if (stop) break;
+    }
+    closedir(dir);
+}
+
+// ============================================================================
+// --list, --clean, and picking a segment
+// ============================================================================
+
+static int list_one(const char* path, const Segment* seg, void* arg) {
+    (void)arg;
+    double age = (realtime_ns() - seg->header->start_ns) / 1e9;
+    printf("%8lu  %-6s  started %8.0f s ago  %s\n", (unsigned long)seg->header->pid,
+           process_alive(seg->header->pid) ? "alive" : "gone", age, path);
+    return 0;
+}
+
+static int clean_one(const char* path, const Segment* seg, void* arg) {
+    if (process_alive(seg->header->pid)) return 0;
+    if (unlink(path) == 0) {
+        printf("Removed %s (pid %lu)\n", path, (unsigned long)seg->header->pid);
+        (*(int*)arg)++;
+    } else {
+        fprintf(stderr, "Error: cannot remove %s\n", path);
+    }
+    return 0;
+}
+
+typedef struct {
+    char path[512];
+    uint64_t start_ns;
+    int alive;
+} Newest;
+
+// The most recently started game, preferring one that is still running
+static int newest_one(const char* path, const Segment* seg, void* arg) {
+    Newest* best = arg;
+    int alive = process_alive(seg->header->pid);
+    if (!best->path[0] || alive > best->alive ||
+        (alive == best->alive && seg->header->start_ns > best->start_ns)) {
+        snprintf(best->path, sizeof(best->path), "%s", path);
+        best->start_ns = seg->header->start_ns;
+        best->alive = alive;
+    }
+    return 0;
+}
+
+// ============================================================================
+// Display
+// ============================================================================
+
+static double mb(double bytes) {
+    return bytes / 1048576.0;
+}
+
+static int is_bytes(uint32_t kind) {
+    return kind == STAT_BYTES || kind == STAT_GAUGE_BYTES;
+}
+
+static int is_gauge(uint32_t kind) {
+    return kind == STAT_GAUGE || kind == STAT_GAUGE_BYTES;
+}
+
+static uint64_t value_of(const Segment* seg, const uint64_t* values, const char* name) {
+    for (uint32_t i = 0; i < seg->count; i++) {
+        if (strncmp(seg->info[i].name, name, sizeof(seg->info[i].name)) == 0) return values[i];
+    }
+    return 0;
+}
+
+static void draw(const Segment* seg, const uint64_t* now, const uint64_t* prev,
+                 double seconds, int alive, int show_all) {
+    const StatsHeader* h = seg->header;
+    double uptime = (realtime_ns() - h->start_ns) / 1e9;
+    printf("pepper_top - pid %lu, %s, %.0f s since start\n\n", (unsigned long)h->pid,
+           alive ? "running" : "GONE (last values before it exited or was killed)", uptime);
+
+    uint64_t original = value_of(seg, now, "textures.original");
+    uint64_t uploaded = value_of(seg, now, "textures.uploaded_bytes");
+    uint64_t frames = value_of(seg, now, "frames");
+    printf("GPU memory saved: %.1f MB of %.1f MB", mb(original > uploaded ? original - uploaded : 0),
+           mb(original));
+    if (prev && seconds > 0) {
+        printf(", %.1f fps", (frames - value_of(seg, prev, "frames")) / seconds);
+    }
+    printf("\n\n%-28s %14s %14s\n", "counter", "value", prev ? "per second" : "");
+
+    char module[40] = "";
+    for (uint32_t i = 0; i < seg->count; i++) {
+        const StatInfo* info = &seg->info[i];
+        if (!now[i] && !show_all) continue;
+        char name[41];
+        memcpy(name, info->name, sizeof(info->name));
+        name[40] = '\0';
+
+        // A blank line between modules
+        const char* dot = strchr(name, '.');
+        size_t len = dot ? (size_t)(dot - name) : strlen(name);
+        if (module[0] && (strlen(module) != len || strncmp(module, name, len) != 0)) printf("\n");
+        snprintf(module, sizeof(module), "%.*s", (int)len, name);
+
+        if (is_bytes(info->kind)) {
+            printf("%-28s %11.1f MB", name, mb(now[i]));
+        } else {
+            printf("%-28s %14lu", name, (unsigned long)now[i]);
+        }
+        if (prev && seconds > 0 && !is_gauge(info->kind)) {
+            double rate = (double)(now[i] - prev[i]) / seconds;
+            if (is_bytes(info->kind)) {
+                printf(" %9.2f MB/s", mb(rate));
+            } else {
+                printf(" %14.1f", rate);
+            }
+        } else if (prev && seconds > 0 && now[i] != prev[i]) {
+            double delta = (double)now[i] - (double)prev[i];
+            if (is_bytes(info->kind)) {
+                printf(" %+11.1f MB", mb(delta));
+            } else {
+                printf(" %+14.0f", delta);
+            }
+        }
+        printf("\n");
+    }
+}
+
+// ============================================================================
+// Hook latency
+// ============================================================================
+
+typedef struct {
+    uint64_t count, total, max;
+    uint64_t buckets[MAX_BUCKETS];
+} LatencyTotals;
+
+static void merge_probe(const Segment* seg, uint32_t probe, LatencyTotals* out) {
+    const LatencyHeader* lh = seg->latency;
+    size_t hist_size = (3 + (size_t)lh->bucket_count) * sizeof(uint64_t);
+    size_t slot_size = SLOT_HEADER + lh->probe_count * hist_size;
+    memset(out, 0, sizeof(*out));
+    for (uint32_t s = 0; s < lh->slot_count; s++) {
+        const volatile uint64_t* h = (const volatile uint64_t*)((const char*)lh +
+            lh->slots_offset + s * slot_size + SLOT_HEADER + probe * hist_size);
+        out->count += h[0];
+        out->total += h[1];
+        if (h[2] > out->max) out->max = h[2];
+        for (uint32_t b = 0; b < lh->bucket_count; b++) out->buckets[b] += h[3 + b];
+    }
+}
+
+// Smallest tick count in a bucket; sub_buckets per power of two
+static uint64_t bucket_low(const LatencyHeader* lh, uint32_t bucket) {
+    uint32_t sub = lh->sub_buckets;
+    if (bucket < sub) return bucket;
+    int bits = __builtin_ctz(sub);
+    int msb = (int)(bucket / sub) + bits - 1;
+    return (uint64_t)(sub + bucket % sub) << (msb - bits);
+}
+
+static uint64_t quantile(const LatencyHeader* lh, const LatencyTotals* t, double q) {
+    uint64_t rank = (uint64_t)(q * t->count + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    for (uint32_t b = 0; b < lh->bucket_count; b++) {
+        seen += t->buckets[b];
+        if (seen >= rank) {
+            uint64_t edge = b + 1 < lh->bucket_count ? bucket_low(lh, b + 1) - 1 : t->max;
+            return edge < t->max ? edge : t->max;
+        }
+    }
+    return t->max;
+}
+
+// Calls and time since the last draw come from the previous totals
+static void draw_latency(const Segment* seg, double seconds, int have_prev) {
+    static uint64_t prev_count[16], prev_total[16];
+    const LatencyHeader* lh = seg->latency;
+    double us = 1e6 / (lh->ticks_per_sec ? lh->ticks_per_sec : 1000000000ull);
+    char timer[17];
+    memcpy(timer, lh->timer, 16);
+    timer[16] = '\0';
+
+    printf("\n%-20s %10s %9s %7s %9s %9s %9s %9s\n", "latency, us", "calls",
+           have_prev ? "calls/s" : "", have_prev ? "busy" : "", "mean", "p50", "p99", "max");
+    static LatencyTotals t;
+    for (uint32_t p = 0; p < lh->probe_count; p++) {
+        merge_probe(seg, p, &t);
+        if (t.count) {
+            char name[25];
+            memcpy(name, lh->names[p], 24);
+            name[24] = '\0';
+            printf("%-20s %10lu", name, (unsigned long)t.count);
+            if (have_prev && seconds > 0) {
+                printf(" %9.0f %6.1f%%", (t.count - prev_count[p]) / seconds,
+                       (t.total - prev_total[p]) * us / 1e4 / seconds);
+            } else {
+                printf(" %9s %7s", "", "");
+            }
+            printf(" %9.1f %9.1f %9.1f %9.1f\n", (double)t.total / t.count * us,
+                   quantile(lh, &t, 0.5) * us, quantile(lh, &t, 0.99) * us, t.max * us);
+        }
+        prev_count[p] = t.count;
+        prev_total[p] = t.total;
+    }
+    printf("(%s at %.1f MHz; busy = share of each second spent in the call)\n", timer,
+           lh->ticks_per_sec / 1e6);
+}
+
+static void snapshot(const Segment* seg, uint64_t* out) {
+    for (uint32_t i = 0; i < seg->count; i++) out[i] = seg->values[i];
+}
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+int main(int argc, char** argv) {
+    int interval_ms = 1000;
+    int once = 0, show_all = 0;
+    const char* target = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--once") == 0) {
+            once = 1;
+        } else if (strcmp(argv[i], "--all") == 0) {
+            show_all = 1;
+        } else if (strcmp(argv[i], "--list") == 0) {
+            each_segment(list_one, NULL);
+            return 0;
+        } else if (strcmp(argv[i], "--clean") == 0) {
+            int removed = 0;
+            each_segment(clean_one, &removed);
+            printf("%d stale segment%s removed\n", removed, removed == 1 ? "" : "s");
+            return 0;
+        } else if (argv[i][0] != '-' && !target) {
+            target = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--interval MS] [--once] [--all] [PID | FILE]\n"
+                    "       %s --list | --clean\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if (interval_ms <= 0) {
+        fprintf(stderr, "Error: bad --interval\n");
+        return 1;
+    }
+
+    char path[512];
+    if (!target) {
+        Newest newest = { "", 0, 0 };
+        each_segment(newest_one, &newest);
+        if (!newest.path[0]) {
+            fprintf(stderr, "Error: no %s/%s* found (is the game running with PEPPER_STATS=1?)\n",
+                    STATS_DIR, STATS_PREFIX);
+            return 1;
+        }
+        snprintf(path, sizeof(path), "%s", newest.path);
+    } else if (strspn(target, "0123456789") == strlen(target)) {
+        snprintf(path, sizeof(path), "%s/%s%s", STATS_DIR, STATS_PREFIX, target);
+    } else {
+        snprintf(path, sizeof(path), "%s", target);
+    }
+
+    Segment seg;
+    if (!open_segment(path, &seg)) {
+        fprintf(stderr, "Error: cannot read stats from %s\n", path);
+        return 1;
+    }
+    uint64_t* now = calloc(seg.count, sizeof(uint64_t));
+    uint64_t* prev = calloc(seg.count, sizeof(uint64_t));
+    if (!now || !prev) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    int have_prev = 0;
+    uint64_t prev_ns = 0;
+    while (!g_stop) {
+        uint64_t now_ns = monotonic_ns();
+        snapshot(&seg, now);
+        int alive = process_alive(seg.header->pid);
+        // A clean exit unlinks the file; the mapping still has the last values
+        if (access(path, F_OK) != 0) alive = 0;
+
+        if (!once) printf("\033[H\033[J");
+        draw(&seg, now, have_prev ? prev : NULL, (now_ns - prev_ns) / 1e9, alive, show_all);
+        if (seg.latency) draw_latency(&seg, (now_ns - prev_ns) / 1e9, have_prev);
+        fflush(stdout);
+        if (once || !alive) break;
+
+        uint64_t* swap = prev;
+        prev = now;
+        now = swap;
+        prev_ns = now_ns;
+        have_prev = 1;
+        struct timespec delay = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+        nanosleep(&delay, NULL);
+    }
+
+    free(now);
+    free(prev);
+    close_segment(&seg);
+    return 0;
+}
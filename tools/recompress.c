@@ -0,0 +1,413 @@
+/*
+ * recompress.c - Parallel high-ratio recompression of Assets.dat images
+ *
+ * Re-encoding images with Python's zlib.compress(data, 9) grows Assets.dat
+ * from 160 MB to ~305 MB. This tool re-deflates every image stream on all
+ * cores with a stronger encoder, keeps whichever stream is smaller (the
+ * original or the new one), and writes a new archive. Output streams are
+ * plain zlib (78 xx header + adler32), so Chowdren's loader reads them
+ * unchanged.
+ *
+ * Build (libdeflate level 12, recommended):
+ *   gcc -O3 -DUSE_LIBDEFLATE -o recompress recompress.c chowdren_assets.c \
+ *       chowdren_image.c parallel.c -lz -ldeflate -lpthread
+ *
+ * Build (zlib only, tries several strategies at level 9):
+ *   gcc -O3 -o recompress recompress.c chowdren_assets.c chowdren_image.c \
+ *       parallel.c -lz -lpthread
+ *
+ * Usage:
+ *   ./recompress <input_Assets.dat> <output_Assets.dat> [--threads N] [--level N] [--verify]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include "chowdren_assets.h"
+#include "chowdren_image.h"
+#include "parallel.h"
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+#ifdef USE_LIBDEFLATE
+#define DEFAULT_LEVEL 12
+#define MAX_LEVEL 12
+#else
+#define DEFAULT_LEVEL 9
+#define MAX_LEVEL 9
+#endif
+
+static int g_threads = 0;
+static int g_level = DEFAULT_LEVEL;
+static int g_verify = 0;
+
+// ============================================================================
+// Per-image results
+// ============================================================================
+
+typedef struct {
+    uint8_t* data;       // replacement entry, or NULL to copy the original
+    uint32_t size;
+    int failed;          // could not decode; original copied as-is
+} ImageResult;
+
+typedef struct {
+    const ChowdrenArchive* archive;
+    ImageResult* results;
+#ifdef USE_LIBDEFLATE
+    struct libdeflate_compressor** compressors;
+#endif
+    pthread_mutex_t progress_mutex;
+    size_t done;
+} RecompressJob;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ============================================================================
+// zlib helpers
+// ============================================================================
+
+// Inflate a whole zlib stream. `hint` is the expected output size; the
+// buffer grows if the header lied.
+static uint8_t* inflate_stream(const uint8_t* src, size_t src_len, size_t hint, size_t* out_len) {
+    size_t cap = hint > 0 ? hint : src_len * 4 + 64;
+    uint8_t* out = malloc(cap);
+    if (!out) return NULL;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit(&strm) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+
+    strm.next_in = (Bytef*)src;
+    strm.avail_in = (uInt)src_len;
+
+    int ret;
+    do {
+        if (strm.total_out == cap) {
+            size_t new_cap = cap * 2;
+            uint8_t* grown = realloc(out, new_cap);
+            if (!grown) {
+                ret = Z_MEM_ERROR;
+                break;
+            }
+            out = grown;
+            cap = new_cap;
+        }
+        strm.next_out = out + strm.total_out;
+        strm.avail_out = (uInt)(cap - strm.total_out);
+        ret = inflate(&strm, Z_FINISH);
+    } while (ret == Z_BUF_ERROR && strm.avail_out == 0);
+
+    *out_len = strm.total_out;
+    inflateEnd(&strm);
+
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+#ifndef USE_LIBDEFLATE
+static uint8_t* deflate_with(const uint8_t* src, size_t len, int level, int strategy,
+                             size_t* out_len) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15, 9, strategy) != Z_OK) return NULL;
+
+    size_t cap = deflateBound(&strm, len);
+    uint8_t* out = malloc(cap);
+    if (!out) {
+        deflateEnd(&strm);
+        return NULL;
+    }
+
+    strm.next_in = (Bytef*)src;
+    strm.avail_in = (uInt)len;
+    strm.next_out = out;
+    strm.avail_out = (uInt)cap;
+    int ret = deflate(&strm, Z_FINISH);
+    *out_len = strm.total_out;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+// Smallest zlib stream we can produce for `raw`.
+static uint8_t* compress_best(RecompressJob* job, int worker,
+                              const uint8_t* raw, size_t raw_len, size_t* out_len) {
+#ifdef USE_LIBDEFLATE
+    struct libdeflate_compressor* c = job->compressors[worker];
+    size_t cap = libdeflate_zlib_compress_bound(c, raw_len);
+    uint8_t* out = malloc(cap);
+    if (!out) return NULL;
+
+    *out_len = libdeflate_zlib_compress(c, raw, raw_len, out, cap);
+    if (*out_len == 0) {
+        free(out);
+        return NULL;
+    }
+    return out;
+#else
+    (void)job;
+    (void)worker;
+    static const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+    uint8_t* best = NULL;
+    size_t best_len = 0;
+
+    for (size_t s = 0; s < sizeof(strategies) / sizeof(strategies[0]); s++) {
+        size_t len;
+        uint8_t* candidate = deflate_with(raw, raw_len, g_level, strategies[s], &len);
+        if (!candidate) continue;
+        if (!best || len < best_len) {
+            free(best);
+            best = candidate;
+            best_len = len;
+        } else {
+            free(candidate);
+        }
+    }
+    *out_len = best_len;
+    return best;
+#endif
+}
+
+// ============================================================================
+// Worker
+// ============================================================================
+
+static void recompress_image(void* ctx, size_t index, int worker) {
+    RecompressJob* job = ctx;
+    ImageResult* result = &job->results[index];
+    const ChowdrenEntry* entry = &job->archive->tables[CHOWDREN_IMAGES].entries[index];
+    const uint8_t* payload = chowdren_archive_payload(job->archive, CHOWDREN_IMAGES, (uint32_t)index);
+
+    ChowdrenImageInfo info;
+    if (!payload || chowdren_image_parse(payload, entry->size, &info) != 0) {
+        result->failed = 1;
+        goto progress;
+    }
+
+    const uint8_t* stream = payload + info.stream_offset;
+    size_t raw_len;
+    uint8_t* raw = inflate_stream(stream, info.stream_size, chowdren_image_pixel_size(&info), &raw_len);
+    if (!raw) {
+        result->failed = 1;
+        goto progress;
+    }
+
+    size_t packed_len;
+    uint8_t* packed = compress_best(job, worker, raw, raw_len, &packed_len);
+
+    if (packed && g_verify) {
+        size_t check_len;
+        uint8_t* check = inflate_stream(packed, packed_len, raw_len, &check_len);
+        if (!check || check_len != raw_len || memcmp(check, raw, raw_len) != 0) {
+            fprintf(stderr, "Error: image %zu failed round-trip verification, keeping original\n",
+                    index);
+            free(packed);
+            packed = NULL;
+        }
+        free(check);
+    }
+
+    // Only replace the stream when it actually got smaller. Any trailing
+    // bytes after the original stream are dropped along with it.
+    if (packed && packed_len < info.stream_size) {
+        result->size = (uint32_t)(info.stream_offset + packed_len);
+        result->data = malloc(result->size);
+        if (result->data) {
+            memcpy(result->data, payload, info.stream_offset);
+            memcpy(result->data + info.stream_offset, packed, packed_len);
+        }
+    }
+
+    free(packed);
+    free(raw);
+
+progress:
+    pthread_mutex_lock(&job->progress_mutex);
+    job->done++;
+    if (job->done % 1000 == 0) {
+        fprintf(stderr, "  Processed %zu/%u images...\n", job->done,
+                job->archive->tables[CHOWDREN_IMAGES].count);
+    }
+    pthread_mutex_unlock(&job->progress_mutex);
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+static void usage(void) {
+    printf("Usage: recompress <input_Assets.dat> <output_Assets.dat> [options]\n");
+    printf("\nOptions:\n");
+    printf("  --threads N   Worker threads (default: one per CPU)\n");
+    printf("  --level N     Compression level (default/max: %d)\n", MAX_LEVEL);
+    printf("  --verify      Inflate every new stream and compare with the original pixels\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+
+    const char* input = argv[1];
+    const char* output = argv[2];
+
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            g_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+            g_level = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            g_verify = 1;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (g_level < 1 || g_level > MAX_LEVEL) g_level = DEFAULT_LEVEL;
+    if (g_threads <= 0) g_threads = parallel_cpu_count();
+
+    ChowdrenArchive archive;
+    if (chowdren_archive_open(&archive, input) != 0) return 1;
+
+    const ChowdrenTable* images = &archive.tables[CHOWDREN_IMAGES];
+
+    printf("\n================================================================================\n");
+    printf("RECOMPRESSING ASSETS.DAT\n");
+    printf("================================================================================\n");
+    printf("Input:    %s (%.2f MB)\n", input, archive.size / 1024.0 / 1024.0);
+    printf("Output:   %s\n", output);
+#ifdef USE_LIBDEFLATE
+    printf("Encoder:  libdeflate level %d\n", g_level);
+#else
+    printf("Encoder:  zlib level %d (default/filtered/rle, smallest wins)\n", g_level);
+#endif
+    printf("Threads:  %d\n", g_threads);
+    printf("================================================================================\n\n");
+
+    RecompressJob job;
+    memset(&job, 0, sizeof(job));
+    job.archive = &archive;
+    job.results = calloc(images->count, sizeof(ImageResult));
+    pthread_mutex_init(&job.progress_mutex, NULL);
+
+#ifdef USE_LIBDEFLATE
+    job.compressors = calloc(g_threads, sizeof(*job.compressors));
+    for (int t = 0; t < g_threads; t++) {
+        job.compressors[t] = libdeflate_alloc_compressor(g_level);
+        if (!job.compressors[t]) {
+            fprintf(stderr, "Error: libdeflate_alloc_compressor(%d) failed\n", g_level);
+            return 1;
+        }
+    }
+#endif
+
+    double start = now_seconds();
+    parallel_for(images->count, g_threads, recompress_image, &job);
+    double elapsed = now_seconds() - start;
+
+    // Write the new archive in the original table order
+    ChowdrenTable tables[CHOWDREN_KIND_COUNT];
+    ChowdrenWriter writer;
+    if (chowdren_tables_clone(&archive, tables) != 0 ||
+        chowdren_writer_open(&writer, output) != 0) {
+        return 1;
+    }
+
+    uint64_t kind_before[CHOWDREN_KIND_COUNT] = { 0 };
+    uint64_t kind_after[CHOWDREN_KIND_COUNT] = { 0 };
+    int improved = 0, failed = 0;
+
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        for (uint32_t i = 0; i < tables[k].count; i++) {
+            ChowdrenEntry* e = &tables[k].entries[i];
+            if (e->size == 0) continue;
+
+            const uint8_t* data = chowdren_archive_payload(&archive, k, i);
+            if (!data) {
+                fprintf(stderr, "Error: %s entry %u points past the end of the file\n",
+                        tables[k].name, i);
+                chowdren_writer_abort(&writer);
+                return 1;
+            }
+
+            uint32_t size = e->size;
+            kind_before[k] += size;
+
+            if (k == CHOWDREN_IMAGES) {
+                ImageResult* r = &job.results[i];
+                if (r->failed) failed++;
+                if (r->data) {
+                    data = r->data;
+                    size = r->size;
+                    improved++;
+                }
+            }
+
+            if (chowdren_writer_append(&writer, data, size, &e->offset) != 0) {
+                chowdren_writer_abort(&writer);
+                return 1;
+            }
+            e->size = size;
+            kind_after[k] += size;
+        }
+    }
+
+    uint64_t final_size = writer.cursor;
+    if (chowdren_writer_finish(&writer, tables) != 0) return 1;
+
+    printf("\n================================================================================\n");
+    printf("RECOMPRESSION COMPLETE (%.1f s)\n", elapsed);
+    printf("================================================================================\n");
+    for (int k = 0; k < CHOWDREN_KIND_COUNT; k++) {
+        printf("  %-8s %10.2f MB -> %10.2f MB\n", tables[k].name,
+               kind_before[k] / 1024.0 / 1024.0, kind_after[k] / 1024.0 / 1024.0);
+    }
+    printf("\n  Images recompressed: %d\n", improved);
+    printf("  Images kept as-is:   %u\n", images->count - improved);
+    if (failed) printf("  Images not decodable (copied): %d\n", failed);
+    printf("\n  Input archive:  %12zu bytes (%.2f MB)\n", archive.size, archive.size / 1024.0 / 1024.0);
+    printf("  Output archive: %12llu bytes (%.2f MB, %+.1f%%)\n",
+           (unsigned long long)final_size, final_size / 1024.0 / 1024.0,
+           archive.size ? ((double)final_size / archive.size - 1.0) * 100.0 : 0.0);
+    printf("================================================================================\n\n");
+
+    for (uint32_t i = 0; i < images->count; i++) free(job.results[i].data);
+    free(job.results);
+#ifdef USE_LIBDEFLATE
+    for (int t = 0; t < g_threads; t++) libdeflate_free_compressor(job.compressors[t]);
+    free(job.compressors);
+#endif
+    chowdren_tables_free(tables);
+    chowdren_archive_close(&archive);
+    return 0;
+}
@@ -82,6 +82,16 @@ export BOX64_DYNAREC=1
 # Start game 
 pushd $DATADIR/
 
+# Memory ledger of the whole stack (tools/pepper_ledger.c, built for the device
+# and copied to $GAMEDIR): PSS per process every second into ledger.txt, and a
+# summary in log.txt when the game exits
+LEDGER_PID=
+if [ -x "$GAMEDIR/pepper_ledger" ]; then
+  $ESUDO "$GAMEDIR/pepper_ledger" --root $$ --also seatd --interval 1000 \
+    --out "$GAMEDIR/ledger.txt" &
+  LEDGER_PID=$!
+fi
+
 $GPTOKEYB "$BINARY" -k &
 
 # Start Westonpack
@@ -97,6 +107,11 @@ GAME_RC=$?
 
 popd
 
+if [ -n "$LEDGER_PID" ]; then
+  $ESUDO kill $LEDGER_PID 2>/dev/null
+  wait $LEDGER_PID 2>/dev/null
+fi
+
 # Clean up after ourselves
 $ESUDO $weston_dir/westonwrap.sh cleanup
 if [[ "$PM_CAN_MOUNT" != "N" ]]; then